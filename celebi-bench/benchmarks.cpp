@@ -0,0 +1,327 @@
+#include "benchmarks.h"
+#include "celebi.h"
+#include "extensions/extdatabase.h"
+
+#include <atomic>
+#include <filesystem>
+#include <random>
+
+namespace celebibench {
+
+namespace fs = std::filesystem;
+
+using namespace celebi;
+using namespace celebiext;
+
+namespace {
+
+const std::string scratchDir = ".celebi-bench";
+
+// Keys a scan walks, and members of a bucket a query reads, per iteration
+constexpr std::size_t scanLength = 100;
+constexpr std::size_t bucketCount = 100;
+
+std::atomic<std::uint64_t> scratchCount{0};
+
+// The stores are rebuilt for every benchmark, so one never runs on another's leftovers
+struct StoreFixture {
+    StoreFixture(const StoreKind &kind, const DataSet &data)
+        : m_scratch(kind.m_name + "-" + std::to_string(scratchCount++)), m_data(data),
+          m_store(kind.m_make(m_scratch.m_path))
+    {
+        for (std::size_t i = 0; i < m_data.size(); i++)
+            m_store->setKeyValue(DataSet::makeKey("k", i, m_data.key(0).size()), m_data.value());
+    }
+
+    Scratch m_scratch;
+    DataSet m_data;
+    std::unique_ptr<KeyValueStore> m_store;
+};
+
+struct DatabaseFixture {
+    explicit DatabaseFixture(const DataSet &data)
+        : m_data(data), m_database("celebi-bench-" + std::to_string(scratchCount++)),
+          m_db(m_database.m_db)
+    {
+        for (std::size_t i = 0; i < m_data.size(); i++) {
+            const std::string key = DataSet::makeKey("k", i, m_data.key(0).size());
+            m_db->setKeyValue(key, m_data.value(), "bucket" + std::to_string(i % bucketCount));
+        }
+    }
+
+    DataSet m_data;
+    ScratchDatabase m_database;
+    std::unique_ptr<IDatabase> &m_db;
+};
+
+using StoreOperation = std::function<void(StoreFixture &fixture, State &state)>;
+using DatabaseOperation = std::function<void(DatabaseFixture &fixture, State &state)>;
+
+const std::vector<std::pair<std::string, StoreOperation>> &storeOperations()
+{
+    static const std::vector<std::pair<std::string, StoreOperation>> operations = {
+        { "set", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                f.m_store->setKeyValue(f.m_data.key(i++), f.m_data.value());
+            state.setBytesProcessed(state.iterations() * (f.m_data.key(0).size() + f.m_data.value().size()));
+        } },
+        { "get", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                doNotOptimize(f.m_store->getKeyValue(f.m_data.key(i++)));
+            state.setBytesProcessed(state.iterations() * f.m_data.value().size());
+        } },
+        { "get_miss", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                doNotOptimize(f.m_store->getKeyValue(f.m_data.missing(i++)));
+        } },
+        { "try_get", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            std::string value;
+            double misses = 0;
+            while (state.keepRunning())
+                misses += f.m_store->tryGetKeyValue(f.m_data.key(i++), value) ? 0 : 1;
+            state.counters()["misses"] = misses;
+        } },
+        { "merge_add", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                f.m_store->mergeKeyValue(f.m_data.key(i++), "1", MergeOperator::ADD);
+        } },
+        { "scan", [](StoreFixture &f, State &state) {
+            std::uint64_t i = 0;
+            double keys = 0;
+            while (state.keepRunning()) {
+                std::size_t left = scanLength;
+                f.m_store->scanKeys(f.m_data.key(i++), "", false, [&left](const std::string &) {
+                    return 0 != --left;
+                });
+                keys += scanLength - left;
+            }
+            state.counters()["keys"] = keys;
+        } },
+    };
+
+    return operations;
+}
+
+const std::vector<std::pair<std::string, DatabaseOperation>> &databaseOperations()
+{
+    static const std::vector<std::pair<std::string, DatabaseOperation>> operations = {
+        { "set", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                f.m_db->setKeyValue(f.m_data.key(i++), f.m_data.value());
+        } },
+        { "set_bucket", [](DatabaseFixture &f, State &state) {
+            static const std::string bucket("bucket0");
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                f.m_db->setKeyValue(f.m_data.key(i++), f.m_data.value(), bucket);
+        } },
+        { "get", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                doNotOptimize(f.m_db->getKeyValue(f.m_data.key(i++)));
+        } },
+        { "get_miss", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                doNotOptimize(f.m_db->getKeyValue(f.m_data.missing(i++)));
+        } },
+        { "try_get", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            std::string value;
+            while (state.keepRunning())
+                doNotOptimize(f.m_db->tryGetKeyValue(f.m_data.key(i++), value));
+        } },
+        { "increment", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                f.m_db->incrementKeyValue(f.m_data.key(i++));
+        } },
+        { "compare_and_set", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning())
+                doNotOptimize(f.m_db->compareAndSet(f.m_data.key(i++), f.m_data.value(), f.m_data.value()));
+        } },
+        { "query_bucket", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning()) {
+                BucketQuery query("bucket" + std::to_string(i++ % bucketCount));
+                doNotOptimize(f.m_db->query(query)->recordKeys()->size());
+            }
+        } },
+        { "range_query", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            while (state.keepRunning()) {
+                RangeQuery query(f.m_data.key(i++), "", false, scanLength);
+                doNotOptimize(f.m_db->query(query)->orderedRecordKeys()->size());
+            }
+        } },
+        { "transaction", [](DatabaseFixture &f, State &state) {
+            std::uint64_t i = 0;
+            double conflicts = 0;
+            while (state.keepRunning()) {
+                std::unique_ptr<ITransaction> txn = f.m_db->begin();
+                const std::string &key = f.m_data.key(i++);
+                txn->setKeyValue(key, txn->getKeyValue(key));
+                conflicts += txn->commit() ? 0 : 1;
+            }
+            state.counters()["conflicts"] = conflicts;
+        } },
+    };
+
+    return operations;
+}
+
+}
+
+std::vector<std::vector<std::pair<std::string, std::int64_t>>> sizeArgs(const Sizes &sizes)
+{
+    std::vector<std::vector<std::pair<std::string, std::int64_t>>> args;
+    for (std::int64_t keys : sizes.m_keyCounts)
+        for (std::int64_t keySize : sizes.m_keySizes)
+            for (std::int64_t valueSize : sizes.m_valueSizes)
+                args.push_back({ { "key", keySize }, { "value", valueSize }, { "keys", keys } });
+
+    return args;
+}
+
+DataSet::DataSet(std::size_t keySize, std::size_t valueSize, std::size_t keys)
+    : m_keys(), m_missing(), m_order(orderMask + 1), m_value()
+{
+    std::mt19937_64 random(42);
+
+    for (std::size_t i = 0; i < keys; i++)
+        m_keys.push_back(makeKey("k", i, keySize));
+    for (std::size_t i = 0; i < 1024; i++)
+        m_missing.push_back(makeKey("m", i, keySize));
+
+    std::uniform_int_distribution<std::uint32_t> index(0, static_cast<std::uint32_t>(std::max<std::size_t>(keys, 1) - 1));
+    for (auto &i : m_order)
+        i = index(random);
+
+    std::uniform_int_distribution<int> letter('a', 'z');
+    for (std::size_t i = 0; i < valueSize; i++)
+        m_value.push_back(static_cast<char>(letter(random)));
+}
+
+// The prefix, the index zero padded and filler up to the size, so keys sort by index
+std::string DataSet::makeKey(const std::string &prefix, std::uint64_t index, std::size_t size)
+{
+    std::string digits = std::to_string(index);
+    std::string key = prefix + std::string(digits.size() < 10 ? 10 - digits.size() : 0, '0') + digits;
+    if (key.size() < size)
+        key.append(size - key.size(), 'x');
+
+    return key;
+}
+
+Scratch::Scratch(const std::string &name)
+    : m_path(scratchDir + "/" + name)
+{
+    fs::remove_all(m_path);
+    fs::create_directories(m_path);
+}
+
+Scratch::~Scratch()
+{
+    std::error_code error;
+    fs::remove_all(m_path, error);
+}
+
+// The B+tree syncs nothing here, so it is timed on its structure like the others;
+// what syncing costs is for the durability benchmarks
+ScratchDatabase::ScratchDatabase(const std::string &name, std::unique_ptr<KeyValueStore> store)
+    : m_db(store ? Celebi::createEmptyDB(name, store) : Celebi::createEmptyDB(name))
+{
+
+}
+
+// Destroying clears the store but not the index, and the lock file outlives the
+// database, both go once the lock is let go
+ScratchDatabase::~ScratchDatabase()
+{
+    const std::string directory = m_db->getDirectory();
+    m_db->destroy();
+    m_db.reset();
+
+    std::error_code error;
+    fs::remove_all(directory, error);
+    fs::remove(directory + ".lock", error);
+}
+
+std::vector<StoreKind> storeKinds()
+{
+    return {
+        { "memory", [](const std::string &) {
+            return std::make_unique<MemoryKeyValueStore>(Concurrency::NONE);
+        }, false },
+        { "memory_sharded", [](const std::string &) {
+            return std::make_unique<MemoryKeyValueStore>(Concurrency::SHARDED);
+        } },
+        { "memory_lock_free", [](const std::string &) {
+            return std::make_unique<MemoryKeyValueStore>(Concurrency::LOCK_FREE_READ);
+        } },
+        { "file", [](const std::string &directory) {
+            return std::make_unique<FileKeyValueStore>(directory);
+        } },
+        { "shared", [](const std::string &directory) {
+            std::unique_ptr<KeyValueStore> files = std::make_unique<FileKeyValueStore>(directory + "/files", 0);
+            return std::make_unique<SharedKeyValueStore>(files, directory + "/keydir", true);
+        } },
+        { "lsm", [](const std::string &directory) {
+            return std::make_unique<LsmKeyValueStore>(directory);
+        } },
+        { "btree", [](const std::string &directory) {
+            BTreeOptions options;
+            options.sync = false;
+            return std::make_unique<BTreeKeyValueStore>(directory, options);
+        } },
+    };
+}
+
+std::vector<Benchmark> storeBenchmarks(const Sizes &sizes)
+{
+    std::vector<Benchmark> benchmarks;
+    for (const StoreKind &kind : storeKinds()) {
+        for (auto &operation : storeOperations()) {
+            for (auto &args : sizeArgs(sizes)) {
+                benchmarks.push_back({ kind.m_name + "/" + operation.first, args, [kind, operation, args]() {
+                    auto fixture = std::make_shared<StoreFixture>(kind, DataSet(args[0].second, args[1].second,
+                                                                                args[2].second));
+                    StoreOperation run = operation.second;
+                    return std::function<void(State &)>([fixture, run](State &state) {
+                        run(*fixture, state);
+                    });
+                } });
+            }
+        }
+    }
+
+    return benchmarks;
+}
+
+std::vector<Benchmark> databaseBenchmarks(const Sizes &sizes)
+{
+    std::vector<Benchmark> benchmarks;
+    for (auto &operation : databaseOperations()) {
+        for (auto &args : sizeArgs(sizes)) {
+            benchmarks.push_back({ "database/" + operation.first, args, [operation, args]() {
+                auto fixture = std::make_shared<DatabaseFixture>(DataSet(args[0].second, args[1].second,
+                                                                         args[2].second));
+                DatabaseOperation run = operation.second;
+                return std::function<void(State &)>([fixture, run](State &state) {
+                    run(*fixture, state);
+                });
+            } });
+        }
+    }
+
+    return benchmarks;
+}
+
+}
@@ -0,0 +1,114 @@
+#ifndef __CELEBI_BENCH_BENCHMARKS_H__
+#define __CELEBI_BENCH_BENCHMARKS_H__
+
+#include "harness.h"
+#include "database.h"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace celebibench {
+
+/**
+ * @brief The Sizes struct is what the benchmarks are run over, each combination once
+ */
+struct Sizes {
+    std::vector<std::int64_t> m_keySizes{ 16 };
+    std::vector<std::int64_t> m_valueSizes{ 100 };
+    std::vector<std::int64_t> m_keyCounts{ 10000 };
+};
+
+// Arguments of every combination of the sizes, as key, value and keys
+std::vector<std::vector<std::pair<std::string, std::int64_t>>> sizeArgs(const Sizes &sizes);
+
+/**
+ * @brief The StoreKind struct names a way to make a key-value store in a scratch directory
+ */
+struct StoreKind {
+    std::string m_name;
+    std::function<std::unique_ptr<celebi::KeyValueStore>(const std::string &directory)> m_make;
+    bool m_threadSafe = true;
+};
+
+// Every KeyValueStore implementation, the memory store in each concurrency mode
+std::vector<StoreKind> storeKinds();
+
+/**
+ * @brief The DataSet class is the keys and value a benchmark works on, keys are drawn
+ *        in a fixed random order so no generator runs inside the timed loop
+ */
+class DataSet {
+public:
+    DataSet(std::size_t keySize, std::size_t valueSize, std::size_t keys);
+
+    const std::string &key(std::uint64_t i) const
+    {
+        return m_keys[m_order[i & orderMask]];
+    }
+
+    // Keys of the same size which are not in the set
+    const std::string &missing(std::uint64_t i) const
+    {
+        return m_missing[i & (m_missing.size() - 1)];
+    }
+
+    const std::string &value() const
+    {
+        return m_value;
+    }
+
+    std::size_t size() const
+    {
+        return m_keys.size();
+    }
+
+    static std::string makeKey(const std::string &prefix, std::uint64_t index, std::size_t size);
+
+private:
+    static constexpr std::size_t orderMask = (1 << 16) - 1;
+
+    std::vector<std::string> m_keys;
+    std::vector<std::string> m_missing;
+    std::vector<std::uint32_t> m_order;
+    std::string m_value;
+};
+
+/**
+ * @brief The Scratch struct is a directory removed with everything in it when it goes
+ */
+struct Scratch {
+    explicit Scratch(const std::string &name);
+    ~Scratch();
+
+    Scratch(const Scratch &) = delete;
+    Scratch &operator=(const Scratch &) = delete;
+
+    const std::string m_path;
+};
+
+/**
+ * @brief The ScratchDatabase struct is a database destroyed when it goes, in the given
+ *        store or else the default ones
+ */
+struct ScratchDatabase {
+    explicit ScratchDatabase(const std::string &name,
+                             std::unique_ptr<celebi::KeyValueStore> store = nullptr);
+    ~ScratchDatabase();
+
+    ScratchDatabase(const ScratchDatabase &) = delete;
+    ScratchDatabase &operator=(const ScratchDatabase &) = delete;
+
+    std::unique_ptr<celebi::IDatabase> m_db;
+};
+
+std::vector<Benchmark> storeBenchmarks(const Sizes &sizes);
+std::vector<Benchmark> databaseBenchmarks(const Sizes &sizes);
+// Reads with nothing cached and writes synced to the device, of the stores kept in files
+std::vector<Benchmark> durabilityBenchmarks(const Sizes &sizes);
+
+}
+
+#endif // __CELEBI_BENCH_BENCHMARKS_H__
@@ -0,0 +1,324 @@
+#include "cxxopts.hpp"
+#include "statistics.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <regex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+cxxopts::Options options("celebi-bench-compare",
+                         "Compare two celebi-bench JSON runs, exits 1 if the second one regressed");
+
+// Regressions exit with 1, so a broken input must exit with something else
+constexpr int regressedExit = 1;
+constexpr int failedExit = 2;
+
+static inline void printUsage(const std::string &info = "", int exitCode = 0)
+{
+    if (info.length())
+        std::cout << info << std::endl << std::endl;
+
+    std::cout << options.help() << std::endl;
+
+    ::exit(exitCode);
+}
+
+namespace {
+
+/**
+ * @brief The Json struct is a parsed JSON value, enough of JSON for celebi-bench's output
+ */
+struct Json {
+    enum class Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+    Type m_type = Type::NUL;
+    double m_number = 0;
+    std::string m_string;
+    std::vector<Json> m_array;
+    std::map<std::string, Json> m_object;
+
+    // Null if this is no object or has no such member
+    const Json *find(const std::string &key) const
+    {
+        auto member = m_object.find(key);
+
+        return m_object.end() == member ? nullptr : &member->second;
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(const std::string &text)
+        : m_text(text), m_at(0)
+    {
+
+    }
+
+    Json parse()
+    {
+        Json value = parseValue();
+        skipSpace();
+        if (m_at != m_text.size())
+            fail("trailing characters");
+
+        return value;
+    }
+
+private:
+    Json parseValue()
+    {
+        skipSpace();
+        if (m_at >= m_text.size())
+            fail("unexpected end");
+
+        Json value;
+        const char c = m_text[m_at];
+        if ('{' == c) {
+            value.m_type = Json::Type::OBJECT;
+            m_at++;
+            if (!consume('}')) {
+                do {
+                    skipSpace();
+                    std::string key = parseString();
+                    expect(':');
+                    value.m_object[key] = parseValue();
+                } while (consume(','));
+                expect('}');
+            }
+        } else if ('[' == c) {
+            value.m_type = Json::Type::ARRAY;
+            m_at++;
+            if (!consume(']')) {
+                do {
+                    value.m_array.push_back(parseValue());
+                } while (consume(','));
+                expect(']');
+            }
+        } else if ('"' == c) {
+            value.m_type = Json::Type::STRING;
+            value.m_string = parseString();
+        } else if (0 == m_text.compare(m_at, 4, "true") || 0 == m_text.compare(m_at, 5, "false")) {
+            value.m_type = Json::Type::BOOLEAN;
+            value.m_number = 't' == c ? 1 : 0;
+            m_at += 't' == c ? 4 : 5;
+        } else if (0 == m_text.compare(m_at, 4, "null")) {
+            m_at += 4;
+        } else {
+            value.m_type = Json::Type::NUMBER;
+            std::size_t used = 0;
+            try {
+                value.m_number = std::stod(m_text.substr(m_at, 32), &used);
+            } catch (const std::exception &) {
+                fail("bad value");
+            }
+            m_at += used;
+        }
+
+        return value;
+    }
+
+    std::string parseString()
+    {
+        if (!consume('"'))
+            fail("expected a string");
+
+        std::string out;
+        while (m_at < m_text.size() && '"' != m_text[m_at]) {
+            char c = m_text[m_at++];
+            if ('\\' == c && m_at < m_text.size()) {
+                c = m_text[m_at++];
+                if ('n' == c)
+                    c = '\n';
+                else if ('t' == c)
+                    c = '\t';
+            }
+            out += c;
+        }
+        expect('"');
+
+        return out;
+    }
+
+    void skipSpace()
+    {
+        while (m_at < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_at])))
+            m_at++;
+    }
+
+    bool consume(char c)
+    {
+        skipSpace();
+        if (m_at < m_text.size() && c == m_text[m_at]) {
+            m_at++;
+            return true;
+        }
+
+        return false;
+    }
+
+    void expect(char c)
+    {
+        if (!consume(c))
+            fail(std::string("expected '") + c + "'");
+    }
+
+    [[noreturn]] void fail(const std::string &what) const
+    {
+        throw std::runtime_error("bad JSON at " + std::to_string(m_at) + ": " + what);
+    }
+
+    const std::string &m_text;
+    std::size_t m_at;
+};
+
+struct Run {
+    std::vector<double> m_samples;
+    std::string m_skipped;
+};
+
+// The benchmarks of a celebi-bench --json file by name, with the samples of the metric
+std::map<std::string, Run> loadRuns(const std::string &path, const std::string &metric)
+{
+    std::ifstream is(path);
+    if (!is)
+        throw std::runtime_error("could not read " + path);
+    std::stringstream text;
+    text << is.rdbuf();
+
+    const Json json = JsonParser(text.str()).parse();
+    const Json *benchmarks = json.find("benchmarks");
+    if (!benchmarks || Json::Type::ARRAY != benchmarks->m_type)
+        throw std::runtime_error(path + " is not celebi-bench output, it has no benchmarks");
+
+    std::map<std::string, Run> runs;
+    for (const Json &benchmark : benchmarks->m_array) {
+        const Json *name = benchmark.find("name");
+        if (!name)
+            continue;
+
+        Run &run = runs[name->m_string];
+        if (const Json *skipped = benchmark.find("skipped"))
+            run.m_skipped = skipped->m_string;
+        if (const Json *samples = benchmark.find(metric + "_samples")) {
+            for (const Json &sample : samples->m_array)
+                run.m_samples.push_back(sample.m_number);
+        }
+    }
+
+    return runs;
+}
+
+}
+
+// Each benchmark in both runs is compared on its samples: a regression is a change of
+// the median by more than the threshold which the Mann-Whitney test finds significant
+int main(int argc, char *argv[])
+try {
+    options.add_options()
+          ("baseline", "JSON of the run compared against", cxxopts::value<std::string>())
+          ("contender", "JSON of the run checked for regressions", cxxopts::value<std::string>())
+          ("t,threshold", "Percent a median may slow down by before it counts",
+           cxxopts::value<double>()->default_value("5"))
+          ("a,alpha", "Significance level of the test, and of the confidence interval",
+           cxxopts::value<double>()->default_value("0.05"))
+          ("b,bootstrap", "Resamples of the confidence interval of the median ratio",
+           cxxopts::value<std::size_t>()->default_value("2000"))
+          ("m,metric", "Times compared: real or cpu", cxxopts::value<std::string>()->default_value("real"))
+          ("f,filter", "Compare only the benchmarks whose name matches this regular expression",
+           cxxopts::value<std::string>()->default_value(".*"))
+          ("h,help", "Print Usage")
+        ;
+    options.parse_positional({ "baseline", "contender" });
+    options.positional_help("<baseline.json> <contender.json>");
+
+    auto result = options.parse(argc, argv);
+
+    if (result.count("h"))
+        printUsage();
+    if (!result.count("baseline") || !result.count("contender"))
+        printUsage("You must give the baseline and the contender JSON", failedExit);
+
+    const std::string metric = result["m"].as<std::string>();
+    if ("real" != metric && "cpu" != metric)
+        printUsage("The metric is real or cpu", failedExit);
+    const std::string samples = "real" == metric ? "real_time" : "cpu_time";
+    const double threshold = result["t"].as<double>() / 100;
+    const double alpha = result["a"].as<double>();
+    const std::size_t resamples = result["b"].as<std::size_t>();
+    const std::regex filter(result["f"].as<std::string>());
+
+    const std::map<std::string, Run> baseline = loadRuns(result["baseline"].as<std::string>(), samples);
+    const std::map<std::string, Run> contender = loadRuns(result["contender"].as<std::string>(), samples);
+
+    char line[512];
+    std::snprintf(line, sizeof(line), "%-56s %12s %12s %8s %9s %19s  %s",
+                  "benchmark", "base ns", "new ns", "change", "p", "ci", "verdict");
+    std::cout << line << std::endl;
+
+    std::size_t regressions = 0, improvements = 0, compared = 0;
+    for (auto &base : baseline) {
+        if (!std::regex_search(base.first, filter))
+            continue;
+
+        auto other = contender.find(base.first);
+        if (contender.end() == other) {
+            std::cout << base.first << "  only in the baseline" << std::endl;
+            continue;
+        }
+        if (!base.second.m_skipped.empty() || !other->second.m_skipped.empty()) {
+            std::cout << base.first << "  skipped" << std::endl;
+            continue;
+        }
+        if (base.second.m_samples.empty() || other->second.m_samples.empty()) {
+            std::cout << base.first << "  no samples" << std::endl;
+            continue;
+        }
+
+        const std::vector<double> &a = base.second.m_samples, &b = other->second.m_samples;
+        const double before = celebibench::median(a), after = celebibench::median(b);
+        const double ratio = before > 0 ? after / before : 1;
+        const celebibench::MannWhitney test = celebibench::MannWhitney::test(a, b);
+        const celebibench::Interval interval = celebibench::bootstrapMedianRatio(a, b, alpha, resamples);
+
+        const char *verdict = "same";
+        if (test.m_p < alpha && ratio - 1 > threshold) {
+            verdict = "REGRESSION";
+            regressions++;
+        } else if (test.m_p < alpha && 1 - ratio > threshold) {
+            verdict = "improvement";
+            improvements++;
+        } else if (test.m_p < alpha) {
+            verdict = "within threshold";
+        }
+        compared++;
+
+        char ci[64];
+        std::snprintf(ci, sizeof(ci), "[%+.1f%%, %+.1f%%]",
+                      100 * (interval.m_low - 1), 100 * (interval.m_high - 1));
+        std::snprintf(line, sizeof(line), "%-56s %12.1f %12.1f %+7.1f%% %9.4f %19s  %s",
+                      base.first.c_str(), before, after, 100 * (ratio - 1), test.m_p, ci, verdict);
+        std::cout << line << std::endl;
+    }
+    for (auto &other : contender) {
+        if (std::regex_search(other.first, filter) && !baseline.count(other.first))
+            std::cout << other.first << "  only in the contender" << std::endl;
+    }
+
+    std::cout << compared << " compared, " << regressions << " regressed, "
+              << improvements << " improved" << std::endl;
+
+    return regressions ? regressedExit : 0;
+}
+catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return failedExit;
+}
@@ -0,0 +1,255 @@
+#include "benchmarks.h"
+#include "extensions/extdatabase.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace celebibench {
+
+namespace fs = std::filesystem;
+
+using namespace celebi;
+using namespace celebiext;
+
+namespace {
+
+std::atomic<std::uint64_t> diskCount{0};
+
+/**
+ * @brief The DiskKind struct makes a store which keeps its data in files, syncing every
+ *        write or not. Stores with no sync of their own are synced after each write.
+ */
+struct DiskKind {
+    std::string m_name;
+    std::function<std::unique_ptr<KeyValueStore>(const std::string &directory, bool sync)> m_make;
+    std::function<void(KeyValueStore &store, const std::string &key, bool first)> m_sync;
+};
+
+void syncPath(const std::string &path, bool directory)
+{
+    const int fd = ::open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+    if (fd < 0 || 0 != (directory ? ::fsync(fd) : ::fdatasync(fd))) {
+        const int error = errno;
+        if (fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("could not sync " + path + ": " + std::strerror(error));
+    }
+    ::close(fd);
+}
+
+// The file store syncs nothing itself. The key's file is synced after every write,
+// its directory after the first one, which may have made the file.
+void syncKeyFile(KeyValueStore &store, const std::string &key, bool first)
+{
+    const std::string path = static_cast<FileKeyValueStore &>(store).filePath(key);
+    syncPath(path, false);
+    if (first)
+        syncPath(fs::path(path).parent_path().string(), true);
+}
+
+const std::vector<DiskKind> &diskKinds()
+{
+    static const std::vector<DiskKind> kinds = {
+        { "file", [](const std::string &directory, bool) {
+            return std::make_unique<FileKeyValueStore>(directory);
+        }, syncKeyFile },
+        { "lsm", [](const std::string &directory, bool sync) {
+            LsmOptions options;
+            options.sync = sync;
+            return std::make_unique<LsmKeyValueStore>(directory, options);
+        }, nullptr },
+        { "btree", [](const std::string &directory, bool sync) {
+            BTreeOptions options;
+            options.sync = sync;
+            return std::make_unique<BTreeKeyValueStore>(directory, options);
+        }, nullptr },
+    };
+
+    return kinds;
+}
+
+// Pages of the file still in the page cache
+std::size_t residentPages(const std::string &path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    const std::size_t size = fs::file_size(path);
+    const std::size_t page = ::sysconf(_SC_PAGESIZE);
+    void *map = size ? ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (MAP_FAILED == map)
+        return 0;
+
+    std::vector<unsigned char> pages((size + page - 1) / page);
+    std::size_t resident = 0;
+    if (0 == ::mincore(map, size, pages.data())) {
+        for (unsigned char p : pages)
+            resident += p & 1;
+    }
+    ::munmap(map, size);
+
+    return resident;
+}
+
+/**
+ * @brief The DiskFixture struct is a store loaded through one which does not sync, then
+ *        opened again syncing or not. Evicting opens it again so nothing of it stays in
+ *        memory, then writes back and drops its files' pages.
+ */
+struct DiskFixture {
+    DiskFixture(const DiskKind &kind, const DataSet &data, bool sync)
+        : m_kind(kind), m_scratch("disk-" + kind.m_name + "-" + std::to_string(diskCount++)),
+          m_data(data), m_sync(sync), m_store(kind.m_make(m_scratch.m_path, false))
+    {
+        for (std::size_t i = 0; i < m_data.size(); i++)
+            m_store->setKeyValue(DataSet::makeKey("k", i, m_data.key(0).size()), m_data.value());
+        if (auto lsm = dynamic_cast<LsmKeyValueStore *>(m_store.get()))
+            lsm->compact();
+
+        m_store.reset();
+        m_store = m_kind.m_make(m_scratch.m_path, m_sync);
+    }
+
+    // Returns false with the reason if pages stay cached, e.g. the store maps them or
+    // the file system keeps them anyway. The store is opened before its pages are
+    // dropped, opening it may read them.
+    bool evict(std::string &reason)
+    {
+        m_store.reset();
+        m_store = m_kind.m_make(m_scratch.m_path, m_sync);
+
+        std::string largest;
+        std::uintmax_t largestSize = 0;
+        for (auto &entry : fs::recursive_directory_iterator(m_scratch.m_path)) {
+            if (!entry.is_regular_file())
+                continue;
+
+            const int fd = ::open(entry.path().c_str(), O_RDONLY);
+            if (fd < 0)
+                continue;
+            ::fdatasync(fd);
+            const int error = ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            ::close(fd);
+            if (0 != error) {
+                reason = std::string("posix_fadvise: ") + std::strerror(error);
+                return false;
+            }
+
+            if (entry.file_size() > largestSize) {
+                largestSize = entry.file_size();
+                largest = entry.path().string();
+            }
+        }
+
+        if (!largest.empty() && residentPages(largest) > 0) {
+            reason = "pages of " + fs::path(largest).filename().string() + " stay cached after POSIX_FADV_DONTNEED";
+            return false;
+        }
+
+        return true;
+    }
+
+    const DiskKind &m_kind;
+    Scratch m_scratch;
+    DataSet m_data;
+    const bool m_sync;
+    std::unique_ptr<KeyValueStore> m_store;
+    std::unordered_set<std::string> m_written;  // keys written since loading
+};
+
+using DiskOperation = std::function<void(DiskFixture &fixture, State &state)>;
+
+struct DiskBenchmark {
+    std::string m_name;
+    bool m_sync;
+    DiskOperation m_run;
+};
+
+// A stride coprime to the keys walks all of them once before any comes again
+std::size_t strideOver(std::size_t keys)
+{
+    std::size_t stride = 7919;
+    while (keys > 1 && 1 != std::gcd(stride, keys))
+        stride += 2;
+
+    return stride;
+}
+
+const std::vector<DiskBenchmark> &diskBenchmarks()
+{
+    static const std::vector<DiskBenchmark> benchmarks = {
+        // Each pass over the keys starts with none of them cached
+        { "cold_get", false, [](DiskFixture &f, State &state) {
+            state.measureIo();
+            const std::size_t keys = std::max<std::size_t>(f.m_data.size(), 1);
+            const std::size_t keySize = f.m_data.key(0).size();
+            const std::size_t stride = strideOver(keys);
+            double evictions = 0;
+            std::uint64_t i = 0;
+            while (state.keepRunning()) {
+                if (0 == i % keys) {
+                    state.pauseTiming();
+                    std::string reason;
+                    if (!f.evict(reason)) {
+                        state.skip(reason);
+                        break;
+                    }
+                    evictions++;
+                    state.resumeTiming();
+                }
+                doNotOptimize(f.m_store->getKeyValue(DataSet::makeKey("k", (i++ * stride) % keys, keySize)));
+            }
+            state.setBytesProcessed(state.iterations() * f.m_data.value().size());
+            state.counters()["evictions"] = evictions;
+        } },
+        // A write returns once it is on the device
+        { "sync_set", true, [](DiskFixture &f, State &state) {
+            state.measureIo();
+            std::uint64_t i = 0;
+            while (state.keepRunning()) {
+                const std::string &key = f.m_data.key(i++);
+                f.m_store->setKeyValue(key, f.m_data.value());
+                if (f.m_kind.m_sync)
+                    f.m_kind.m_sync(*f.m_store, key, f.m_written.insert(key).second);
+            }
+            state.setBytesProcessed(state.iterations() * (f.m_data.key(0).size() + f.m_data.value().size()));
+        } },
+    };
+
+    return benchmarks;
+}
+
+}
+
+std::vector<Benchmark> durabilityBenchmarks(const Sizes &sizes)
+{
+    std::vector<Benchmark> benchmarks;
+    for (const DiskKind &kind : diskKinds()) {
+        for (const DiskBenchmark &benchmark : diskBenchmarks()) {
+            for (auto &args : sizeArgs(sizes)) {
+                benchmarks.push_back({ kind.m_name + "/" + benchmark.m_name, args, [&kind, benchmark, args]() {
+                    auto fixture = std::make_shared<DiskFixture>(kind, DataSet(args[0].second, args[1].second,
+                                                                               args[2].second), benchmark.m_sync);
+                    DiskOperation run = benchmark.m_run;
+                    return std::function<void(State &)>([fixture, run](State &state) {
+                        run(*fixture, state);
+                    });
+                } });
+            }
+        }
+    }
+
+    return benchmarks;
+}
+
+}
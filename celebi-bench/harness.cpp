@@ -0,0 +1,439 @@
+#include "harness.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace celebibench {
+
+// Fields of /proc/self/io, see proc(5)
+bool IoStats::read(IoStats &stats)
+{
+    std::ifstream is("/proc/self/io");
+    if (!is)
+        return false;
+
+    const std::map<std::string, std::uint64_t IoStats::*> fields = {
+        { "syscr:", &IoStats::m_readSyscalls }, { "syscw:", &IoStats::m_writeSyscalls },
+        { "read_bytes:", &IoStats::m_readBytes }, { "write_bytes:", &IoStats::m_writeBytes },
+    };
+    std::size_t found = 0;
+    std::string name;
+    for (std::uint64_t value; is >> name >> value; ) {
+        auto field = fields.find(name);
+        if (fields.end() != field) {
+            stats.*field->second = value;
+            found++;
+        }
+    }
+
+    return fields.size() == found;
+}
+
+namespace {
+
+struct PerfEvent {
+    const char *m_name;
+    std::uint32_t m_type;
+    std::uint64_t m_config;
+};
+
+const PerfEvent perfEvents[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { "dtlb_misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+};
+
+}
+
+// Each counter is opened on its own, a group would fail as a whole if one is missing
+PerfCounters::PerfCounters()
+{
+    for (const PerfEvent &event : perfEvents) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = event.m_type;
+        attr.config = event.m_config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        const int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fd < 0) {
+            if (m_unavailable.empty())
+                m_unavailable = std::string(event.m_name) + ": " + std::strerror(errno);
+            continue;
+        }
+
+        m_counters.push_back({ event.m_name, fd });
+    }
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (const Counter &counter : m_counters)
+        ::close(counter.m_fd);
+}
+
+std::vector<std::string> PerfCounters::names() const
+{
+    std::vector<std::string> names;
+    for (const Counter &counter : m_counters)
+        names.push_back(counter.m_name);
+
+    return names;
+}
+
+const std::string &PerfCounters::unavailable() const
+{
+    return m_unavailable;
+}
+
+std::vector<double> PerfCounters::read() const
+{
+    std::vector<double> values;
+    for (const Counter &counter : m_counters) {
+        std::uint64_t value[3] = { 0, 0, 0 };     // count, time enabled, time running
+        double count = 0;
+        if (sizeof(value) == ::read(counter.m_fd, value, sizeof(value)) && value[2] > 0)
+            count = static_cast<double>(value[0]) * value[1] / value[2];
+        values.push_back(count);
+    }
+
+    return values;
+}
+
+State::State(std::uint64_t iterations, const PerfCounters *perf)
+    : m_iterations(iterations), m_remaining(iterations), m_running(false),
+      m_realStart(), m_cpuStart(0), m_real(0), m_cpu(0), m_bytes(0), m_counters(), m_skipped(),
+      m_measureIo(false), m_ioStart(), m_perf(perf && !perf->names().empty() ? perf : nullptr),
+      m_perfStart()
+{
+    if (m_perf) {
+        for (auto &name : m_perf->names())
+            m_counters.emplace(name, 0);
+    }
+}
+
+void State::pauseTiming()
+{
+    stop();
+}
+
+void State::resumeTiming()
+{
+    start();
+}
+
+void State::skip(const std::string &reason)
+{
+    m_skipped = reason;
+    m_remaining = 0;
+}
+
+bool State::measureIo()
+{
+    m_measureIo = IoStats::read(m_ioStart);
+    if (!m_measureIo)
+        return false;
+
+    for (const char *counter : { "read_syscalls", "write_syscalls", "read_bytes", "written_bytes" })
+        m_counters.emplace(counter, 0);
+
+    return true;
+}
+
+double State::realNanos() const
+{
+    return static_cast<double>(m_real.count());
+}
+
+double State::cpuNanos() const
+{
+    return static_cast<double>(m_cpu);
+}
+
+void State::start()
+{
+    if (m_running)
+        return;
+
+    m_running = true;
+    if (m_measureIo)
+        IoStats::read(m_ioStart);
+    if (m_perf)
+        m_perfStart = m_perf->read();
+    m_cpuStart = cpuNow();
+    m_realStart = std::chrono::steady_clock::now();
+}
+
+void State::stop()
+{
+    if (!m_running)
+        return;
+
+    m_real += std::chrono::steady_clock::now() - m_realStart;
+    m_cpu += cpuNow() - m_cpuStart;
+    m_running = false;
+
+    if (m_perf) {
+        const std::vector<double> now = m_perf->read();
+        const std::vector<std::string> names = m_perf->names();
+        for (std::size_t i = 0; i < names.size(); i++)
+            m_counters[names[i]] += now[i] - m_perfStart[i];
+    }
+
+    IoStats now;
+    if (m_measureIo && IoStats::read(now)) {
+        m_counters["read_syscalls"] += now.m_readSyscalls - m_ioStart.m_readSyscalls;
+        m_counters["write_syscalls"] += now.m_writeSyscalls - m_ioStart.m_writeSyscalls;
+        m_counters["read_bytes"] += now.m_readBytes - m_ioStart.m_readBytes;
+        m_counters["written_bytes"] += now.m_writeBytes - m_ioStart.m_writeBytes;
+    }
+}
+
+// Of the calling thread, benchmarks which start threads report wall time only
+std::int64_t State::cpuNow()
+{
+    timespec now;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+std::string Benchmark::fullName() const
+{
+    std::string name = m_name;
+    for (auto &arg : m_args)
+        name += "/" + arg.first + ":" + std::to_string(arg.second);
+
+    return name;
+}
+
+Summary Summary::of(std::vector<double> samples)
+{
+    Summary summary;
+    if (samples.empty())
+        return summary;
+
+    std::sort(samples.begin(), samples.end());
+    const std::size_t n = samples.size();
+    summary.m_min = samples.front();
+    summary.m_max = samples.back();
+    summary.m_median = n % 2 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+
+    double sum = 0;
+    for (double sample : samples)
+        sum += sample;
+    summary.m_mean = sum / n;
+
+    double squares = 0;
+    for (double sample : samples)
+        squares += (sample - summary.m_mean) * (sample - summary.m_mean);
+    summary.m_stddev = n > 1 ? std::sqrt(squares / (n - 1)) : 0;
+
+    return summary;
+}
+
+Runner::Runner(const RunOptions &options)
+    : m_options(options), m_perf(options.m_perf ? std::make_unique<PerfCounters>() : nullptr)
+{
+
+}
+
+// Batches grow until one takes the minimum time, by ten times at most like Google Benchmark
+Result Runner::run(const Benchmark &benchmark) const
+{
+    Result result;
+    result.m_name = benchmark.fullName();
+    result.m_args = benchmark.m_args;
+
+    std::function<void(State &state)> body = benchmark.m_setup();
+
+    auto batch = [this, &body](std::uint64_t iterations) {
+        State state(iterations, m_perf.get());
+        body(state);
+        return state;
+    };
+
+    const double minNanos = m_options.m_minTime * 1e9;
+    std::uint64_t iterations = 1;
+    for (double warmed = 0; ; ) {
+        State state = batch(iterations);
+        if (!state.skipped().empty()) {
+            result.m_skipped = state.skipped();
+            return result;
+        }
+
+        warmed += state.realNanos();
+        if (warmed >= m_options.m_warmupTime * 1e9 && state.realNanos() >= minNanos)
+            break;
+
+        double factor = state.realNanos() > 0 ? minNanos * 1.4 / state.realNanos() : 10;
+        factor = std::min(10.0, std::max(2.0, factor));
+        if (state.realNanos() >= minNanos)
+            factor = 1;
+        iterations = static_cast<std::uint64_t>(std::ceil(iterations * factor));
+    }
+    result.m_iterations = iterations;
+
+    std::map<std::string, double> counters;
+    double bytes = 0, realTotal = 0;
+    for (int repetition = 0; repetition < std::max(m_options.m_repetitions, 1); repetition++) {
+        State state = batch(iterations);
+        result.m_realSamples.push_back(state.realNanos() / iterations);
+        result.m_cpuSamples.push_back(state.cpuNanos() / iterations);
+        bytes += state.bytes();
+        realTotal += state.realNanos();
+        for (auto &counter : state.counters())
+            counters[counter.first] += counter.second / iterations;
+    }
+
+    result.m_real = Summary::of(result.m_realSamples);
+    result.m_cpu = Summary::of(result.m_cpuSamples);
+    if (realTotal > 0)
+        result.m_bytesPerSecond = bytes * 1e9 / realTotal;
+    for (auto &counter : counters)
+        result.m_counters.emplace(counter.first, counter.second / result.m_realSamples.size());
+
+    // Instructions per cycle, of all the iterations rather than per iteration
+    auto cycles = result.m_counters.find("cycles");
+    auto instructions = result.m_counters.find("instructions");
+    if (result.m_counters.end() != cycles && result.m_counters.end() != instructions && cycles->second > 0)
+        result.m_counters["ipc"] = instructions->second / cycles->second;
+
+    return result;
+}
+
+bool Runner::pin(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return 0 == ::sched_setaffinity(0, sizeof(set), &set);
+}
+
+std::string quoted(const std::string &text)
+{
+    std::string out = "\"";
+    for (char c : text) {
+        if ('"' == c || '\\' == c)
+            out += '\\';
+        out += c;
+    }
+
+    return out + "\"";
+}
+
+namespace {
+
+void summaryJson(std::ostream &out, const Summary &summary)
+{
+    out << "{\"mean\": " << summary.m_mean << ", \"median\": " << summary.m_median
+        << ", \"stddev\": " << summary.m_stddev << ", \"min\": " << summary.m_min
+        << ", \"max\": " << summary.m_max << "}";
+}
+
+void samplesJson(std::ostream &out, const std::vector<double> &samples)
+{
+    out << "[";
+    for (std::size_t i = 0; i < samples.size(); i++)
+        out << (i ? ", " : "") << samples[i];
+    out << "]";
+}
+
+}
+
+std::string toJson(const std::vector<Result> &results, const RunOptions &options,
+                   const PerfCounters *perf)
+{
+    std::ostringstream out;
+    out << std::setprecision(10);
+
+    char host[256] = "";
+    ::gethostname(host, sizeof(host) - 1);
+    char date[64] = "";
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": " << quoted(date) << ",\n"
+        << "    \"host_name\": " << quoted(host) << ",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"cpu\": " << options.m_cpu << ",\n"
+        << "    \"repetitions\": " << options.m_repetitions << ",\n"
+        << "    \"min_time\": " << options.m_minTime << ",\n"
+        << "    \"perf_counters\": [";
+    const std::vector<std::string> counters = perf ? perf->names() : std::vector<std::string>();
+    for (std::size_t i = 0; i < counters.size(); i++)
+        out << (i ? ", " : "") << quoted(counters[i]);
+    out << "],\n"
+#ifdef NDEBUG
+        << "    \"library_build_type\": \"release\"\n"
+#else
+        << "    \"library_build_type\": \"debug\"\n"
+#endif
+        << "  },\n  \"benchmarks\": [";
+
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        out << (i ? ",\n" : "\n") << "    {\"name\": " << quoted(result.m_name) << ", \"args\": {";
+        for (std::size_t a = 0; a < result.m_args.size(); a++)
+            out << (a ? ", " : "") << quoted(result.m_args[a].first) << ": " << result.m_args[a].second;
+        out << "}";
+        if (!result.m_skipped.empty()) {
+            out << ", \"skipped\": " << quoted(result.m_skipped) << "}";
+            continue;
+        }
+
+        out << ", \"iterations\": " << result.m_iterations << ", \"time_unit\": \"ns\",\n"
+            << "     \"real_time\": ";
+        summaryJson(out, result.m_real);
+        out << ",\n     \"cpu_time\": ";
+        summaryJson(out, result.m_cpu);
+        out << ",\n     \"real_time_samples\": ";
+        samplesJson(out, result.m_realSamples);
+        out << ",\n     \"cpu_time_samples\": ";
+        samplesJson(out, result.m_cpuSamples);
+        out << ",\n     \"bytes_per_second\": " << result.m_bytesPerSecond << ", \"counters\": {";
+        bool first = true;
+        for (auto &counter : result.m_counters) {
+            out << (first ? "" : ", ") << quoted(counter.first) << ": " << counter.second;
+            first = false;
+        }
+        out << "}}";
+    }
+    out << "\n  ]\n}\n";
+
+    return out.str();
+}
+
+void writeJson(const std::string &path, const std::vector<Result> &results, const RunOptions &options,
+               const PerfCounters *perf)
+{
+    std::ofstream out(path, std::ios::trunc);
+    out << toJson(results, options, perf);
+    if (!out.flush())
+        throw std::runtime_error("could not write benchmark results to " + path);
+}
+
+}
@@ -0,0 +1,237 @@
+#ifndef __CELEBI_BENCH_HARNESS_H__
+#define __CELEBI_BENCH_HARNESS_H__
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+namespace celebibench {
+
+// Keeps the compiler from dropping a result nothing reads
+template <typename T>
+inline void doNotOptimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * @brief The IoStats struct is what /proc/self/io counted for the whole process,
+ *        storage bytes are what reached or came from the device, not the page cache
+ */
+struct IoStats {
+    std::uint64_t m_readSyscalls = 0;
+    std::uint64_t m_writeSyscalls = 0;
+    std::uint64_t m_readBytes = 0;
+    std::uint64_t m_writeBytes = 0;
+
+    // Returns false if the kernel does not count I/O per process
+    static bool read(IoStats &stats);
+};
+
+/**
+ * @brief The PerfCounters class is hardware counters of the calling thread, in user
+ *        space only, from perf_event_open. Those the kernel or the machine do not
+ *        offer are left out, e.g. in most virtual machines all of them are.
+ */
+class PerfCounters {
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+
+    // Names of the counters which opened, in the order read() returns them
+    std::vector<std::string> names() const;
+    // Why the first counter which did not open failed, empty if all opened
+    const std::string &unavailable() const;
+
+    // Counts so far, scaled up to the whole time if the kernel multiplexed them
+    std::vector<double> read() const;
+
+private:
+    struct Counter {
+        std::string m_name;
+        int m_fd;
+    };
+
+    std::vector<Counter> m_counters;
+    std::string m_unavailable;
+};
+
+/**
+ * @brief The State class runs one batch of a benchmark's iterations, the clocks run
+ *        from the first keepRunning() to the last one except while paused
+ */
+class State {
+public:
+    // Counters given are added up over the timed iterations
+    explicit State(std::uint64_t iterations, const PerfCounters *perf = nullptr);
+
+    bool keepRunning()
+    {
+        if (m_remaining == m_iterations && !m_running)
+            start();
+        if (0 == m_remaining) {
+            stop();
+            return false;
+        }
+
+        m_remaining--;
+        return true;
+    }
+
+    // Set up work between iterations is left out of the times
+    void pauseTiming();
+    void resumeTiming();
+
+    std::uint64_t iterations() const
+    {
+        return m_iterations;
+    }
+
+    // Bytes the iterations moved, reported per second
+    void setBytesProcessed(std::uint64_t bytes)
+    {
+        m_bytes = bytes;
+    }
+
+    // Totals over the batch, reported per iteration
+    std::map<std::string, double> &counters()
+    {
+        return m_counters;
+    }
+
+    // Ends the benchmark without results, e.g. if the system does not allow what it needs
+    void skip(const std::string &reason);
+
+    // Counts the syscalls and storage bytes of the timed iterations, returns false if
+    // they can't be counted here
+    bool measureIo();
+
+    double realNanos() const;
+    double cpuNanos() const;
+    std::uint64_t bytes() const
+    {
+        return m_bytes;
+    }
+    const std::string &skipped() const
+    {
+        return m_skipped;
+    }
+
+private:
+    void start();
+    void stop();
+    static std::int64_t cpuNow();
+
+    const std::uint64_t m_iterations;
+    std::uint64_t m_remaining;
+    bool m_running;
+    std::chrono::steady_clock::time_point m_realStart;
+    std::int64_t m_cpuStart;
+    std::chrono::nanoseconds m_real;
+    std::int64_t m_cpu;
+    std::uint64_t m_bytes;
+    std::map<std::string, double> m_counters;
+    std::string m_skipped;
+    bool m_measureIo;
+    IoStats m_ioStart;
+    const PerfCounters *m_perf;
+    std::vector<double> m_perfStart;
+};
+
+/**
+ * @brief The Benchmark struct is a named, parameterized benchmark. Setting up builds
+ *        the data set once and returns what runs the batches, which tears it down when
+ *        it goes.
+ */
+struct Benchmark {
+    std::string m_name;
+    std::vector<std::pair<std::string, std::int64_t>> m_args;
+    std::function<std::function<void(State &state)>()> m_setup;
+
+    // Name with its arguments, e.g. memory/get/key:16/value:100/keys:10000
+    std::string fullName() const;
+};
+
+/**
+ * @brief The Summary struct is the spread of one measure over the repetitions
+ */
+struct Summary {
+    double m_mean = 0;
+    double m_median = 0;
+    double m_stddev = 0;
+    double m_min = 0;
+    double m_max = 0;
+
+    static Summary of(std::vector<double> samples);
+};
+
+/**
+ * @brief The Result struct is what the repetitions of a benchmark measured, times are
+ *        nanoseconds per iteration
+ */
+struct Result {
+    std::string m_name;
+    std::vector<std::pair<std::string, std::int64_t>> m_args;
+    std::uint64_t m_iterations = 0;
+    std::vector<double> m_realSamples;
+    std::vector<double> m_cpuSamples;
+    Summary m_real;
+    Summary m_cpu;
+    double m_bytesPerSecond = 0;
+    std::map<std::string, double> m_counters;   // per iteration, mean over the repetitions
+    std::string m_skipped;
+};
+
+struct RunOptions {
+    double m_minTime = 0.1;         // seconds a repetition runs at least
+    double m_warmupTime = 0.05;     // seconds run first and thrown away
+    int m_repetitions = 5;
+    int m_cpu = -1;                 // core the benchmarks are pinned to, -1 leaves it to the system
+    bool m_perf = true;             // count cycles, instructions and misses where the machine can
+};
+
+/**
+ * @brief The Runner class runs benchmarks: a warm-up, then a batch size which takes
+ *        the minimum time, then the repetitions at that size
+ */
+class Runner {
+public:
+    explicit Runner(const RunOptions &options);
+
+    Result run(const Benchmark &benchmark) const;
+
+    // Null if counting was not asked for
+    const PerfCounters *perf() const
+    {
+        return m_perf.get();
+    }
+
+    // Pins the calling thread, returns false if the core can't be had
+    static bool pin(int cpu);
+
+private:
+    RunOptions m_options;
+    std::unique_ptr<PerfCounters> m_perf;
+};
+
+// A JSON string of the text
+std::string quoted(const std::string &text);
+
+// Google Benchmark like JSON, with each repetition's time so runs can be compared
+std::string toJson(const std::vector<Result> &results, const RunOptions &options,
+                   const PerfCounters *perf = nullptr);
+void writeJson(const std::string &path, const std::vector<Result> &results, const RunOptions &options,
+               const PerfCounters *perf = nullptr);
+
+}
+
+#endif // __CELEBI_BENCH_HARNESS_H__
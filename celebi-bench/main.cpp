@@ -0,0 +1,215 @@
+#include "cxxopts.hpp"
+#include "benchmarks.h"
+#include "workload.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <string>
+
+
+cxxopts::Options options("celebi-bench", "Microbenchmarks for celebi's stores and database");
+
+static inline void printUsage(const std::string &info = "", int exitCode = 0)
+{
+    if (info.length())
+        std::cout << info << std::endl << std::endl;
+
+    std::cout << options.help() << std::endl;
+
+    ::exit(exitCode);
+}
+
+// Median times of the repetitions, the spread as a coefficient of variation
+static void printResult(const celebibench::Result &result)
+{
+    char line[512];
+    if (!result.m_skipped.empty()) {
+        std::snprintf(line, sizeof(line), "%-56s skipped: %s", result.m_name.c_str(), result.m_skipped.c_str());
+    } else {
+        const double cv = result.m_real.m_mean > 0 ? 100 * result.m_real.m_stddev / result.m_real.m_mean : 0;
+        std::snprintf(line, sizeof(line), "%-56s %12.1f ns %12.1f ns %6.2f%% %12llu",
+                      result.m_name.c_str(), result.m_real.m_median, result.m_cpu.m_median, cv,
+                      static_cast<unsigned long long>(result.m_iterations));
+    }
+    std::cout << line;
+    if (result.m_bytesPerSecond > 0)
+        std::cout << "  " << result.m_bytesPerSecond / (1 << 20) << " MiB/s";
+    for (auto &counter : result.m_counters)
+        std::cout << "  " << counter.first << "=" << counter.second;
+    std::cout << std::endl;
+}
+
+static void printWorkload(const celebibench::WorkloadReport &report)
+{
+    std::cout << "workload " << report.m_workload << " on " << report.m_engine << ", "
+              << report.m_threads << " threads, loaded in " << report.m_loadSeconds << " s" << std::endl
+              << report.m_operations << " operations in " << report.m_runSeconds << " s, "
+              << report.throughput() << " ops/s" << std::endl;
+
+    char line[256];
+    std::snprintf(line, sizeof(line), "%-8s %12s %10s %10s %10s %10s %10s %8s %8s",
+                  "op", "count", "mean us", "p50 us", "p99 us", "p999 us", "max us", "missing", "errors");
+    std::cout << line << std::endl;
+    for (std::size_t i = 0; i < celebibench::operationCount; i++) {
+        const celebibench::OperationReport &op = report.m_reports[i];
+        if (0 == op.m_latency.m_count)
+            continue;
+
+        std::snprintf(line, sizeof(line), "%-8s %12llu %10.1f %10.1f %10.1f %10.1f %10.1f %8llu %8llu",
+                      celebibench::operationName(static_cast<celebibench::Operation>(i)).c_str(),
+                      static_cast<unsigned long long>(op.m_latency.m_count), op.m_latency.mean() / 1000,
+                      op.m_latency.percentile(0.5) / 1000.0, op.m_latency.percentile(0.99) / 1000.0,
+                      op.m_latency.percentile(0.999) / 1000.0, op.m_latency.max() / 1000.0,
+                      static_cast<unsigned long long>(op.m_notFound),
+                      static_cast<unsigned long long>(op.m_errors));
+        std::cout << line << std::endl;
+    }
+}
+
+// Loads the records, runs the mix of operations, and reports per operation latencies
+static int runWorkload(const cxxopts::ParseResult &result)
+{
+    celebibench::Workload workload = result.count("workload")
+            ? celebibench::Workload::core(result["workload"].as<std::string>()) : celebibench::Workload();
+    if (result.count("mix"))
+        workload.setMix(result["mix"].as<std::string>());
+    if (result.count("distribution"))
+        workload.m_distribution = celebibench::Workload::distribution(result["distribution"].as<std::string>());
+    workload.m_records = result["records"].as<std::uint64_t>();
+    workload.m_operations = result["operations"].as<std::uint64_t>();
+    workload.m_maxScanLength = result["scan-length"].as<std::size_t>();
+    workload.m_buckets = result["buckets"].as<std::size_t>();
+    if (result.count("k"))
+        workload.m_keySize = result["k"].as<std::vector<std::int64_t>>().front();
+    workload.m_valueSize = result["v"].as<std::vector<std::int64_t>>().front();
+
+    celebibench::DriverOptions driver;
+    driver.m_threads = result["threads"].as<std::size_t>();
+    driver.m_targetThroughput = result["target"].as<double>();
+    driver.m_seed = result["seed"].as<std::uint64_t>();
+
+    const std::string engine = result["engine"].as<std::string>();
+    std::unique_ptr<celebibench::Target> target = celebibench::makeTarget(engine);
+    celebibench::WorkloadReport report = celebibench::Driver(workload, driver).run(*target, engine);
+    printWorkload(report);
+
+    if (result.count("j")) {
+        std::ofstream out(result["j"].as<std::string>(), std::ios::trunc);
+        out << celebibench::toJson(report);
+        if (!out.flush())
+            throw std::runtime_error("could not write workload results to " + result["j"].as<std::string>());
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+try {
+    options.add_options()
+          ("f,filter", "Run only the benchmarks whose full name matches this regular expression",
+           cxxopts::value<std::string>()->default_value(".*"))
+          ("l,list", "List the benchmarks without running them")
+          ("j,json", "Write the results as JSON to this file", cxxopts::value<std::string>())
+          ("r,repetitions", "Times each benchmark is measured",
+           cxxopts::value<int>()->default_value("5"))
+          ("t,min-time", "Seconds each repetition runs at least",
+           cxxopts::value<double>()->default_value("0.1"))
+          ("w,warmup", "Seconds each benchmark runs before it is measured",
+           cxxopts::value<double>()->default_value("0.05"))
+          ("c,cpu", "Core to pin the benchmarks to", cxxopts::value<int>())
+          ("p,perf", "Count cycles, instructions, cache, branch and dTLB misses per operation",
+           cxxopts::value<bool>()->default_value("true"))
+          ("k,key-sizes", "Key sizes in bytes, comma separated",
+           cxxopts::value<std::vector<std::int64_t>>()->default_value("16"))
+          ("v,value-sizes", "Value sizes in bytes, comma separated",
+           cxxopts::value<std::vector<std::int64_t>>()->default_value("100"))
+          ("n,keys", "Keys loaded before each benchmark, comma separated",
+           cxxopts::value<std::vector<std::int64_t>>()->default_value("10000"))
+          ("workload", "Run a YCSB core workload, A to F, instead of the microbenchmarks",
+           cxxopts::value<std::string>())
+          ("mix", "Run a workload of this mix, e.g. read=0.8,update=0.1,query=0.1 "
+           "(read, update, insert, scan, rmw, query)", cxxopts::value<std::string>())
+          ("engine", "What a workload runs on: memory, memory_sharded, memory_lock_free, file, shared, "
+           "lsm, btree, database or database:<store>", cxxopts::value<std::string>()->default_value("database"))
+          ("distribution", "How a workload draws keys: uniform, zipfian or latest", cxxopts::value<std::string>())
+          ("records", "Records loaded before a workload runs",
+           cxxopts::value<std::uint64_t>()->default_value("100000"))
+          ("operations", "Operations a workload runs", cxxopts::value<std::uint64_t>()->default_value("1000000"))
+          ("threads", "Client threads of a workload", cxxopts::value<std::size_t>()->default_value("1"))
+          ("target", "Operations per second a workload is paced to, 0 runs flat out",
+           cxxopts::value<double>()->default_value("0"))
+          ("scan-length", "Most keys a workload's scan reads", cxxopts::value<std::size_t>()->default_value("100"))
+          ("buckets", "Buckets a workload's records are spread over", cxxopts::value<std::size_t>()->default_value("100"))
+          ("seed", "Seed of a workload's key choices", cxxopts::value<std::uint64_t>()->default_value("1"))
+          ("h,help", "Print Usage")
+        ;
+
+    auto result = options.parse(argc, argv);
+
+    if (result.count("h"))
+        printUsage();
+
+    if (result.count("workload") || result.count("mix"))
+        return runWorkload(result);
+
+    celebibench::Sizes sizes;
+    sizes.m_keySizes = result["k"].as<std::vector<std::int64_t>>();
+    sizes.m_valueSizes = result["v"].as<std::vector<std::int64_t>>();
+    sizes.m_keyCounts = result["n"].as<std::vector<std::int64_t>>();
+
+    celebibench::RunOptions run;
+    run.m_repetitions = result["r"].as<int>();
+    run.m_minTime = result["t"].as<double>();
+    run.m_warmupTime = result["w"].as<double>();
+    run.m_perf = result["p"].as<bool>();
+    if (result.count("c")) {
+        run.m_cpu = result["c"].as<int>();
+        if (!celebibench::Runner::pin(run.m_cpu))
+            printUsage("Can not pin to core " + std::to_string(run.m_cpu), 1);
+    }
+
+    std::vector<celebibench::Benchmark> benchmarks = celebibench::storeBenchmarks(sizes);
+    for (auto &benchmark : celebibench::databaseBenchmarks(sizes))
+        benchmarks.push_back(std::move(benchmark));
+    for (auto &benchmark : celebibench::durabilityBenchmarks(sizes))
+        benchmarks.push_back(std::move(benchmark));
+
+    const std::regex filter(result["f"].as<std::string>());
+    std::vector<celebibench::Benchmark> selected;
+    for (auto &benchmark : benchmarks) {
+        if (std::regex_search(benchmark.fullName(), filter))
+            selected.push_back(benchmark);
+    }
+
+    if (result.count("l")) {
+        for (auto &benchmark : selected)
+            std::cout << benchmark.fullName() << std::endl;
+        return 0;
+    }
+
+    celebibench::Runner runner(run);
+    if (runner.perf() && !runner.perf()->unavailable().empty())
+        std::cerr << "hardware counters left out, " << runner.perf()->unavailable() << std::endl;
+
+    char header[256];
+    std::snprintf(header, sizeof(header), "%-56s %15s %15s %7s %12s",
+                  "benchmark", "time/op", "cpu/op", "cv", "iterations");
+    std::cout << header << std::endl;
+
+    std::vector<celebibench::Result> results;
+    for (auto &benchmark : selected) {
+        results.push_back(runner.run(benchmark));
+        printResult(results.back());
+    }
+
+    if (result.count("j"))
+        celebibench::writeJson(result["j"].as<std::string>(), results, run, runner.perf());
+
+    return 0;
+}
+catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,143 @@
+#include "statistics.h"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace celebibench {
+
+namespace {
+
+// Samples of up to this size each are tested exactly, the table has n1 * n2 + 1 counts
+constexpr std::size_t exactSize = 20;
+
+// Ways n1 and n2 samples interleave with U at most u, over all ways
+double exactCdf(std::size_t n1, std::size_t n2, double u)
+{
+    const std::size_t maxU = n1 * n2;
+    // counts[i][j][k], ways i and j samples give U = k, built up one sample at a time
+    std::vector<std::vector<std::vector<double>>> counts(
+            n1 + 1, std::vector<std::vector<double>>(n2 + 1, std::vector<double>(maxU + 1, 0)));
+    for (std::size_t i = 0; i <= n1; i++) {
+        for (std::size_t j = 0; j <= n2; j++) {
+            if (0 == i || 0 == j) {
+                counts[i][j][0] = 1;
+                continue;
+            }
+            // the largest value is either the first sample's, above all j of the second, or not
+            for (std::size_t k = 0; k <= i * j; k++)
+                counts[i][j][k] = counts[i][j - 1][k] + (k >= j ? counts[i - 1][j][k - j] : 0);
+        }
+    }
+
+    double below = 0, total = 0;
+    for (std::size_t k = 0; k <= maxU; k++) {
+        total += counts[n1][n2][k];
+        if (k <= u)
+            below += counts[n1][n2][k];
+    }
+
+    return below / total;
+}
+
+}
+
+MannWhitney MannWhitney::test(const std::vector<double> &a, const std::vector<double> &b)
+{
+    MannWhitney result;
+    const std::size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if (0 == n1 || 0 == n2)
+        return result;
+
+    // Ranks from 1, tied values share the mean of their ranks
+    std::vector<std::pair<double, bool>> all;
+    for (double x : a)
+        all.emplace_back(x, true);
+    for (double x : b)
+        all.emplace_back(x, false);
+    std::sort(all.begin(), all.end(), [](const auto &l, const auto &r) { return l.first < r.first; });
+
+    double rankSumA = 0, ties = 0;
+    for (std::size_t i = 0; i < n; ) {
+        std::size_t j = i;
+        while (j < n && all[j].first == all[i].first)
+            j++;
+        const double rank = (i + 1 + j) / 2.0;
+        for (std::size_t k = i; k < j; k++) {
+            if (all[k].second)
+                rankSumA += rank;
+        }
+        const double t = static_cast<double>(j - i);
+        ties += t * t * t - t;
+        i = j;
+    }
+
+    result.m_u = rankSumA - n1 * (n1 + 1) / 2.0;
+    const double u = std::min(result.m_u, n1 * n2 - result.m_u);
+
+    if (0 == ties && n1 <= exactSize && n2 <= exactSize) {
+        result.m_exact = true;
+        result.m_p = std::min(1.0, 2 * exactCdf(n1, n2, u));
+        return result;
+    }
+
+    const double mean = n1 * n2 / 2.0;
+    const double variance = n1 * n2 / 12.0 * ((n + 1) - ties / (static_cast<double>(n) * (n - 1)));
+    if (variance <= 0)
+        return result;
+
+    const double z = std::max(0.0, std::fabs(result.m_u - mean) - 0.5) / std::sqrt(variance);
+    result.m_p = std::min(1.0, std::erfc(z / std::sqrt(2.0)));
+
+    return result;
+}
+
+double median(std::vector<double> samples)
+{
+    if (samples.empty())
+        return 0;
+
+    const std::size_t n = samples.size();
+    std::nth_element(samples.begin(), samples.begin() + n / 2, samples.end());
+    const double upper = samples[n / 2];
+    if (n % 2)
+        return upper;
+
+    return (*std::max_element(samples.begin(), samples.begin() + n / 2) + upper) / 2;
+}
+
+Interval bootstrapMedianRatio(const std::vector<double> &a, const std::vector<double> &b,
+                              double alpha, std::size_t resamples, std::uint64_t seed)
+{
+    Interval interval;
+    if (a.empty() || b.empty() || 0 == resamples)
+        return interval;
+
+    std::mt19937_64 random(seed);
+    std::uniform_int_distribution<std::size_t> pickA(0, a.size() - 1), pickB(0, b.size() - 1);
+    std::vector<double> ratios, sampleA(a.size()), sampleB(b.size());
+    for (std::size_t r = 0; r < resamples; r++) {
+        for (double &x : sampleA)
+            x = a[pickA(random)];
+        for (double &x : sampleB)
+            x = b[pickB(random)];
+
+        const double base = median(sampleA);
+        if (base > 0)
+            ratios.push_back(median(sampleB) / base);
+    }
+    if (ratios.empty())
+        return interval;
+
+    std::sort(ratios.begin(), ratios.end());
+    auto at = [&ratios](double q) {
+        const auto i = static_cast<std::size_t>(q * (ratios.size() - 1));
+        return ratios[std::min(i, ratios.size() - 1)];
+    };
+    interval.m_low = at(alpha / 2);
+    interval.m_high = at(1 - alpha / 2);
+
+    return interval;
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef __CELEBI_BENCH_STATISTICS_H__
+#define __CELEBI_BENCH_STATISTICS_H__
+
+#include <cstdint>
+#include <vector>
+
+namespace celebibench {
+
+/**
+ * @brief The MannWhitney struct is the Mann-Whitney U test of two samples, two sided.
+ *        Small samples without ties get the exact p-value, others the normal
+ *        approximation with the tie correction.
+ */
+struct MannWhitney {
+    double m_u = 0;         // U of the first sample
+    double m_p = 1;
+    bool m_exact = false;
+
+    static MannWhitney test(const std::vector<double> &a, const std::vector<double> &b);
+};
+
+/**
+ * @brief The Interval struct is a bootstrap percentile confidence interval
+ */
+struct Interval {
+    double m_low = 0;
+    double m_high = 0;
+};
+
+double median(std::vector<double> samples);
+
+// Of the ratio of b's median to a's, resampling both, at 1 - alpha
+Interval bootstrapMedianRatio(const std::vector<double> &a, const std::vector<double> &b,
+                              double alpha, std::size_t resamples, std::uint64_t seed = 1);
+
+}
+
+#endif // __CELEBI_BENCH_STATISTICS_H__
@@ -0,0 +1,521 @@
+#include "workload.h"
+#include "query.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace celebibench {
+
+using namespace celebi;
+
+namespace {
+
+const std::array<std::string, operationCount> operationNames = {
+    "read", "update", "insert", "scan", "rmw", "query"
+};
+
+// FNV-1a over the record's bytes, as YCSB spreads its keys
+std::uint64_t fnv64(std::uint64_t value)
+{
+    std::uint64_t hash = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < 8; i++) {
+        hash ^= value & 0xff;
+        hash *= 0x100000001b3ULL;
+        value >>= 8;
+    }
+
+    return hash;
+}
+
+double zeta(std::uint64_t from, std::uint64_t to, double theta)
+{
+    double sum = 0;
+    for (std::uint64_t i = from; i < to; i++)
+        sum += 1 / std::pow(static_cast<double>(i + 1), theta);
+
+    return sum;
+}
+
+class StoreTarget : public Target {
+public:
+    explicit StoreTarget(const StoreKind &kind)
+        : m_scratch("workload-" + kind.m_name), m_store(kind.m_make(m_scratch.m_path)),
+          m_threadSafe(kind.m_threadSafe)
+    {
+
+    }
+
+    virtual bool read(const std::string &key) override
+    {
+        return !m_store->getKeyValue(key).empty();
+    }
+
+    virtual void update(const std::string &key, const std::string &value) override
+    {
+        m_store->setKeyValue(key, value);
+    }
+
+    virtual void insert(const std::string &key, const std::string &value, const std::string &) override
+    {
+        m_store->setKeyValue(key, value);
+    }
+
+    virtual std::size_t scan(const std::string &from, std::size_t length) override
+    {
+        std::size_t left = length;
+        m_store->scanKeys(from, "", false, [&left](const std::string &) {
+            return 0 != --left;
+        });
+
+        return length - left;
+    }
+
+    virtual std::size_t bucketQuery(const std::string &) override
+    {
+        throw std::runtime_error("bucket queries need a database");
+    }
+
+    virtual bool threadSafe() const override
+    {
+        return m_threadSafe;
+    }
+
+    virtual bool hasBuckets() const override
+    {
+        return false;
+    }
+
+private:
+    Scratch m_scratch;
+    std::unique_ptr<KeyValueStore> m_store;
+    const bool m_threadSafe;
+};
+
+class DatabaseTarget : public Target {
+public:
+    // Without a kind the database keeps its default stores
+    explicit DatabaseTarget(const StoreKind *kind)
+        : m_scratch(kind ? std::make_unique<Scratch>("workload-database-" + kind->m_name) : nullptr),
+          m_database("celebi-workload", kind ? kind->m_make(m_scratch->m_path) : nullptr),
+          m_threadSafe(!kind || kind->m_threadSafe)
+    {
+
+    }
+
+    virtual bool read(const std::string &key) override
+    {
+        return !m_database.m_db->getKeyValue(key).empty();
+    }
+
+    virtual void update(const std::string &key, const std::string &value) override
+    {
+        m_database.m_db->setKeyValue(key, value);
+    }
+
+    virtual void insert(const std::string &key, const std::string &value, const std::string &bucket) override
+    {
+        m_database.m_db->setKeyValue(key, value, bucket);
+    }
+
+    virtual std::size_t scan(const std::string &from, std::size_t length) override
+    {
+        RangeQuery query(from, "", false, length);
+
+        return m_database.m_db->query(query)->orderedRecordKeys()->size();
+    }
+
+    virtual std::size_t bucketQuery(const std::string &bucket) override
+    {
+        BucketQuery query(bucket);
+
+        return m_database.m_db->query(query)->recordKeys()->size();
+    }
+
+    virtual bool threadSafe() const override
+    {
+        return m_threadSafe;
+    }
+
+    virtual bool hasBuckets() const override
+    {
+        return true;
+    }
+
+private:
+    std::unique_ptr<Scratch> m_scratch;
+    ScratchDatabase m_database;
+    const bool m_threadSafe;
+};
+
+const StoreKind &storeKind(const std::string &name)
+{
+    static const std::vector<StoreKind> kinds = storeKinds();
+    for (const StoreKind &kind : kinds) {
+        if (kind.m_name == name)
+            return kind;
+    }
+
+    throw std::runtime_error("unknown engine " + name);
+}
+
+void operationJson(std::ostream &out, const OperationReport &report)
+{
+    const Histogram &latency = report.m_latency;
+    out << "{\"count\": " << latency.m_count << ", \"not_found\": " << report.m_notFound
+        << ", \"errors\": " << report.m_errors << ", \"mean_us\": " << latency.mean() / 1000
+        << ", \"p50_us\": " << latency.percentile(0.5) / 1000.0
+        << ", \"p99_us\": " << latency.percentile(0.99) / 1000.0
+        << ", \"p999_us\": " << latency.percentile(0.999) / 1000.0
+        << ", \"max_us\": " << latency.max() / 1000.0 << "}";
+}
+
+}
+
+const std::string &operationName(Operation operation)
+{
+    return operationNames[static_cast<std::size_t>(operation)];
+}
+
+// The proportions and distributions of YCSB's workloads/workload[a-f]
+Workload Workload::core(const std::string &letter)
+{
+    Workload workload;
+    workload.m_name = letter;
+    auto &mix = workload.m_mix;
+    if ("A" == letter || "a" == letter) {
+        mix[static_cast<std::size_t>(Operation::READ)] = 0.5;
+        mix[static_cast<std::size_t>(Operation::UPDATE)] = 0.5;
+    } else if ("B" == letter || "b" == letter) {
+        mix[static_cast<std::size_t>(Operation::READ)] = 0.95;
+        mix[static_cast<std::size_t>(Operation::UPDATE)] = 0.05;
+    } else if ("C" == letter || "c" == letter) {
+        mix[static_cast<std::size_t>(Operation::READ)] = 1;
+    } else if ("D" == letter || "d" == letter) {
+        mix[static_cast<std::size_t>(Operation::READ)] = 0.95;
+        mix[static_cast<std::size_t>(Operation::INSERT)] = 0.05;
+        workload.m_distribution = Distribution::LATEST;
+    } else if ("E" == letter || "e" == letter) {
+        mix[static_cast<std::size_t>(Operation::SCAN)] = 0.95;
+        mix[static_cast<std::size_t>(Operation::INSERT)] = 0.05;
+    } else if ("F" == letter || "f" == letter) {
+        mix[static_cast<std::size_t>(Operation::READ)] = 0.5;
+        mix[static_cast<std::size_t>(Operation::READ_MODIFY_WRITE)] = 0.5;
+    } else {
+        throw std::runtime_error("unknown workload " + letter + ", the core workloads are A to F");
+    }
+
+    return workload;
+}
+
+void Workload::setMix(const std::string &mix)
+{
+    m_mix.fill(0);
+
+    std::istringstream parts(mix);
+    for (std::string part; std::getline(parts, part, ','); ) {
+        const std::size_t equals = part.find('=');
+        auto name = std::find(operationNames.begin(), operationNames.end(), part.substr(0, equals));
+        if (std::string::npos == equals || operationNames.end() == name)
+            throw std::runtime_error("bad mix " + part + ", expected one of read, update, insert, "
+                                     "scan, rmw or query = a proportion");
+
+        m_mix[name - operationNames.begin()] = std::stod(part.substr(equals + 1));
+    }
+}
+
+Distribution Workload::distribution(const std::string &name)
+{
+    if ("uniform" == name)
+        return Distribution::UNIFORM;
+    if ("zipfian" == name)
+        return Distribution::ZIPFIAN;
+    if ("latest" == name)
+        return Distribution::LATEST;
+
+    throw std::runtime_error("unknown distribution " + name + ", expected uniform, zipfian or latest");
+}
+
+std::string Workload::key(std::uint64_t record) const
+{
+    return DataSet::makeKey("user", fnv64(record), m_keySize);
+}
+
+std::string Workload::bucket(std::uint64_t record) const
+{
+    return "bucket" + std::to_string(record % std::max<std::size_t>(m_buckets, 1));
+}
+
+Zipfian::Zipfian(std::uint64_t items, double theta)
+    : m_theta(theta), m_items(0), m_zetan(0), m_zeta2(zeta(0, 2, theta)),
+      m_alpha(1 / (1 - theta)), m_eta(0)
+{
+    grow(std::max<std::uint64_t>(items, 2));
+}
+
+// Records inserted since extend the sum instead of starting it over
+void Zipfian::grow(std::uint64_t items)
+{
+    m_zetan += zeta(m_items, items, m_theta);
+    m_items = items;
+    m_eta = (1 - std::pow(2.0 / m_items, 1 - m_theta)) / (1 - m_zeta2 / m_zetan);
+}
+
+std::uint64_t Zipfian::next(std::mt19937_64 &random, std::uint64_t items)
+{
+    if (items < 2)
+        return 0;
+    if (items > m_items)
+        grow(items);
+
+    const double u = std::uniform_real_distribution<double>(0, 1)(random);
+    const double uz = u * m_zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + std::pow(0.5, m_theta))
+        return 1;
+
+    const auto rank = static_cast<std::uint64_t>(items * std::pow(m_eta * u - m_eta + 1, m_alpha));
+
+    return std::min(rank, items - 1);
+}
+
+std::unique_ptr<Target> makeTarget(const std::string &engine)
+{
+    if ("database" == engine)
+        return std::make_unique<DatabaseTarget>(nullptr);
+
+    const std::string database = "database:";
+    if (0 == engine.compare(0, database.size(), database))
+        return std::make_unique<DatabaseTarget>(&storeKind(engine.substr(database.size())));
+
+    return std::make_unique<StoreTarget>(storeKind(engine));
+}
+
+void OperationReport::record(std::uint64_t nanos)
+{
+    m_latency.m_counts[Histogram::bucketOf(nanos)]++;
+    m_latency.m_count++;
+    m_latency.m_sum += nanos;
+}
+
+void OperationReport::merge(const OperationReport &other)
+{
+    m_latency.merge(other.m_latency);
+    m_notFound += other.m_notFound;
+    m_errors += other.m_errors;
+}
+
+double WorkloadReport::throughput() const
+{
+    return m_runSeconds > 0 ? m_operations / m_runSeconds : 0;
+}
+
+Driver::Driver(const Workload &workload, const DriverOptions &options)
+    : m_workload(workload), m_options(options), m_cumulative(),
+      m_zipfian(workload.m_records), m_inserting(workload.m_records), m_inserted(workload.m_records)
+{
+    double total = 0;
+    for (double proportion : m_workload.m_mix)
+        total += std::max(proportion, 0.0);
+    if (total <= 0)
+        throw std::runtime_error("the workload's mix has no operations");
+
+    double sum = 0;
+    for (std::size_t i = 0; i < operationCount; i++) {
+        sum += std::max(m_workload.m_mix[i], 0.0) / total;
+        m_cumulative[i] = sum;
+    }
+}
+
+WorkloadReport Driver::run(Target &target, const std::string &engine)
+{
+    const std::size_t threads = std::max<std::size_t>(m_options.m_threads, 1);
+    if (threads > 1 && !target.threadSafe())
+        throw std::runtime_error(engine + " is for one thread only");
+    if (m_workload.m_mix[static_cast<std::size_t>(Operation::BUCKET_QUERY)] > 0 && !target.hasBuckets())
+        throw std::runtime_error("bucket queries need a database, " + engine + " is a store");
+
+    WorkloadReport report;
+    report.m_workload = m_workload.m_name;
+    report.m_engine = engine;
+    report.m_threads = threads;
+    report.m_targetThroughput = m_options.m_targetThroughput;
+
+    auto started = std::chrono::steady_clock::now();
+    load(target);
+    report.m_loadSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::vector<std::array<OperationReport, operationCount>> reports(threads);
+    std::vector<std::thread> clients;
+    started = std::chrono::steady_clock::now();
+    for (std::size_t thread = 0; thread < threads; thread++) {
+        const std::uint64_t operations = m_workload.m_operations / threads +
+                (thread < m_workload.m_operations % threads ? 1 : 0);
+        clients.emplace_back(&Driver::client, this, std::ref(target), thread, operations,
+                             reports[thread].data());
+    }
+    for (auto &client : clients)
+        client.join();
+    report.m_runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    for (auto &threadReports : reports) {
+        for (std::size_t i = 0; i < operationCount; i++) {
+            report.m_reports[i].merge(threadReports[i]);
+            report.m_operations += threadReports[i].m_latency.m_count;
+        }
+    }
+
+    return report;
+}
+
+// Each thread inserts every threads-th record
+void Driver::load(Target &target)
+{
+    const std::size_t threads = std::max<std::size_t>(m_options.m_threads, 1);
+    const std::string value(m_workload.m_valueSize, 'v');
+
+    std::vector<std::thread> loaders;
+    for (std::size_t thread = 0; thread < threads; thread++) {
+        loaders.emplace_back([this, &target, &value, thread, threads]() {
+            for (std::uint64_t record = thread; record < m_workload.m_records; record += threads)
+                target.insert(m_workload.key(record), value, m_workload.bucket(record));
+        });
+    }
+    for (auto &loader : loaders)
+        loader.join();
+}
+
+void Driver::client(Target &target, std::size_t thread, std::uint64_t operations, OperationReport *reports)
+{
+    std::mt19937_64 random(m_options.m_seed * 1000003 + thread);
+    std::uniform_real_distribution<double> unit(0, 1);
+    Zipfian zipfian(m_zipfian);
+
+    std::uniform_int_distribution<int> letter('a', 'z');
+    std::string value;
+    for (std::size_t i = 0; i < m_workload.m_valueSize; i++)
+        value.push_back(static_cast<char>(letter(random)));
+
+    const bool paced = m_options.m_targetThroughput > 0;
+    const std::chrono::nanoseconds interval(paced ? static_cast<std::int64_t>(
+            1e9 * std::max<std::size_t>(m_options.m_threads, 1) / m_options.m_targetThroughput) : 0);
+    auto due = std::chrono::steady_clock::now();
+
+    for (std::uint64_t i = 0; i < operations; i++) {
+        std::chrono::steady_clock::time_point start;
+        if (paced) {
+            std::this_thread::sleep_until(due);
+            start = due;
+            due += interval;
+        } else {
+            start = std::chrono::steady_clock::now();
+        }
+
+        const double pick = unit(random);
+        std::size_t operation = 0;
+        while (operation + 1 < operationCount && pick >= m_cumulative[operation])
+            operation++;
+        OperationReport &report = reports[operation];
+
+        try {
+            switch (static_cast<Operation>(operation)) {
+            case Operation::READ:
+                if (!target.read(m_workload.key(choose(random, zipfian))))
+                    report.m_notFound++;
+                break;
+            case Operation::UPDATE:
+                target.update(m_workload.key(choose(random, zipfian)), value);
+                break;
+            case Operation::INSERT: {
+                const std::uint64_t record = m_inserting.fetch_add(1);
+                target.insert(m_workload.key(record), value, m_workload.bucket(record));
+                inserted(record);
+                break;
+            }
+            case Operation::SCAN: {
+                std::uniform_int_distribution<std::size_t> length(1, std::max<std::size_t>(m_workload.m_maxScanLength, 1));
+                target.scan(m_workload.key(choose(random, zipfian)), length(random));
+                break;
+            }
+            case Operation::READ_MODIFY_WRITE: {
+                const std::string key = m_workload.key(choose(random, zipfian));
+                if (!target.read(key))
+                    report.m_notFound++;
+                target.update(key, value);
+                break;
+            }
+            case Operation::BUCKET_QUERY:
+                target.bucketQuery(m_workload.bucket(choose(random, zipfian)));
+                break;
+            }
+        } catch (const std::exception &) {
+            report.m_errors++;
+        }
+
+        report.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+std::uint64_t Driver::choose(std::mt19937_64 &random, Zipfian &zipfian)
+{
+    const std::uint64_t records = std::max<std::uint64_t>(m_inserted.load(std::memory_order_relaxed), 1);
+
+    switch (m_workload.m_distribution) {
+    case Distribution::UNIFORM:
+        return std::uniform_int_distribution<std::uint64_t>(0, records - 1)(random);
+    case Distribution::ZIPFIAN:
+        return zipfian.next(random, records);
+    case Distribution::LATEST:
+        return records - 1 - zipfian.next(random, records);
+    }
+
+    return 0;
+}
+
+// Inserts finish out of order, the records chosen from only grow past one once all
+// before it are in, as YCSB acknowledges them
+void Driver::inserted(std::uint64_t record)
+{
+    std::lock_guard<std::mutex> lock(m_insertedLock);
+    m_insertedAhead.insert(record);
+    std::uint64_t next = m_inserted.load(std::memory_order_relaxed);
+    while (!m_insertedAhead.empty() && *m_insertedAhead.begin() == next) {
+        m_insertedAhead.erase(m_insertedAhead.begin());
+        next++;
+    }
+    m_inserted.store(next, std::memory_order_relaxed);
+}
+
+std::string toJson(const WorkloadReport &report)
+{
+    std::ostringstream out;
+    out << "{\n  \"workload\": " << quoted(report.m_workload) << ",\n"
+        << "  \"engine\": " << quoted(report.m_engine) << ",\n"
+        << "  \"threads\": " << report.m_threads << ",\n"
+        << "  \"target_throughput\": " << report.m_targetThroughput << ",\n"
+        << "  \"load_seconds\": " << report.m_loadSeconds << ",\n"
+        << "  \"run_seconds\": " << report.m_runSeconds << ",\n"
+        << "  \"operations\": " << report.m_operations << ",\n"
+        << "  \"throughput\": " << report.throughput() << ",\n"
+        << "  \"latencies\": {";
+
+    bool first = true;
+    for (std::size_t i = 0; i < operationCount; i++) {
+        if (0 == report.m_reports[i].m_latency.m_count)
+            continue;
+
+        out << (first ? "\n    " : ",\n    ") << quoted(operationNames[i]) << ": ";
+        operationJson(out, report.m_reports[i]);
+        first = false;
+    }
+    out << "\n  }\n}\n";
+
+    return out.str();
+}
+
+}
@@ -0,0 +1,171 @@
+#ifndef __CELEBI_BENCH_WORKLOAD_H__
+#define __CELEBI_BENCH_WORKLOAD_H__
+
+#include "benchmarks.h"
+#include "stats.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace celebibench {
+
+enum class Distribution {
+    UNIFORM,    // every record as likely as the others
+    ZIPFIAN,    // a few records are hot, the oldest ones
+    LATEST,     // zipfian over the records inserted last
+};
+
+enum class Operation {
+    READ,
+    UPDATE,
+    INSERT,
+    SCAN,
+    READ_MODIFY_WRITE,
+    BUCKET_QUERY,
+};
+
+constexpr std::size_t operationCount = 6;
+
+const std::string &operationName(Operation operation);
+
+/**
+ * @brief The Workload struct is a YCSB style workload: the records loaded first, then the
+ *        mix of operations run over them and how their keys are drawn
+ */
+struct Workload {
+    std::string m_name = "custom";
+    std::array<double, operationCount> m_mix{};    // proportions, by Operation
+    Distribution m_distribution = Distribution::ZIPFIAN;
+    std::uint64_t m_records = 100000;
+    std::uint64_t m_operations = 1000000;
+    std::size_t m_keySize = 24;
+    std::size_t m_valueSize = 100;
+    std::size_t m_maxScanLength = 100;      // scans take 1 to this many keys
+    std::size_t m_buckets = 100;            // records of a database are spread over these
+
+    // YCSB core workloads A to F, throws std::runtime_error for any other letter
+    static Workload core(const std::string &letter);
+
+    // Proportions as e.g. read=0.9,query=0.1, operations left out are not run
+    void setMix(const std::string &mix);
+    static Distribution distribution(const std::string &name);
+
+    // Key of the n-th record, hashed so records inserted one after the other are far apart
+    std::string key(std::uint64_t record) const;
+    std::string bucket(std::uint64_t record) const;
+};
+
+/**
+ * @brief The Zipfian class draws ranks in [0, n) with the probability of rank i going as
+ *        1 / (i + 1)^theta, as Gray et al. do, n may grow as records are inserted
+ */
+class Zipfian {
+public:
+    explicit Zipfian(std::uint64_t items, double theta = 0.99);
+
+    std::uint64_t next(std::mt19937_64 &random, std::uint64_t items);
+
+private:
+    void grow(std::uint64_t items);
+
+    const double m_theta;
+    std::uint64_t m_items;
+    double m_zetan;
+    double m_zeta2;
+    double m_alpha;
+    double m_eta;
+};
+
+/**
+ * @brief The Target class is what a workload runs against, a key-value store or a database
+ */
+class Target {
+public:
+    virtual ~Target() = default;
+
+    // Return false if the record was not there
+    virtual bool read(const std::string &key) = 0;
+    virtual void update(const std::string &key, const std::string &value) = 0;
+    virtual void insert(const std::string &key, const std::string &value, const std::string &bucket) = 0;
+    virtual std::size_t scan(const std::string &from, std::size_t length) = 0;
+    virtual std::size_t bucketQuery(const std::string &bucket) = 0;
+
+    // Whether the target may be used by more than one client thread
+    virtual bool threadSafe() const = 0;
+    virtual bool hasBuckets() const = 0;
+};
+
+// A store kind, "database" for the default database, or "database:<kind>" for a database
+// kept in that store
+std::unique_ptr<Target> makeTarget(const std::string &engine);
+
+struct DriverOptions {
+    std::size_t m_threads = 1;
+    double m_targetThroughput = 0;      // operations per second over all threads, 0 runs flat out
+    std::uint64_t m_seed = 1;
+};
+
+/**
+ * @brief The OperationReport struct is what the clients saw of one kind of operation
+ */
+struct OperationReport {
+    celebi::Histogram m_latency;
+    std::uint64_t m_notFound = 0;
+    std::uint64_t m_errors = 0;
+
+    void record(std::uint64_t nanos);
+    void merge(const OperationReport &other);
+};
+
+struct WorkloadReport {
+    std::string m_workload;
+    std::string m_engine;
+    std::size_t m_threads = 0;
+    double m_targetThroughput = 0;
+    double m_loadSeconds = 0;
+    double m_runSeconds = 0;
+    std::uint64_t m_operations = 0;
+    std::array<OperationReport, operationCount> m_reports;
+
+    double throughput() const;
+};
+
+/**
+ * @brief The Driver class loads a workload's records into a target with the client
+ *        threads, then runs its operations and measures them. Paced runs measure from
+ *        when an operation was due, so a stall is charged to all it held up.
+ */
+class Driver {
+public:
+    Driver(const Workload &workload, const DriverOptions &options);
+
+    WorkloadReport run(Target &target, const std::string &engine);
+
+private:
+    void load(Target &target);
+    void client(Target &target, std::size_t thread, std::uint64_t operations, OperationReport *reports);
+    std::uint64_t choose(std::mt19937_64 &random, Zipfian &zipfian);
+    void inserted(std::uint64_t record);
+
+    const Workload m_workload;
+    const DriverOptions m_options;
+    std::array<double, operationCount> m_cumulative;
+    const Zipfian m_zipfian;
+    std::atomic<std::uint64_t> m_inserting;
+    std::atomic<std::uint64_t> m_inserted;     // records before this one are all in
+    std::mutex m_insertedLock;
+    std::set<std::uint64_t> m_insertedAhead;
+};
+
+std::string toJson(const WorkloadReport &report);
+
+}
+
+#endif // __CELEBI_BENCH_WORKLOAD_H__
@@ -1,6 +1,7 @@
 #include "cxxopts.hpp"
 #include "celebi.h"
 
+#include <chrono>
 #include <cstdlib>
 #include <iostream>
 #include <string>
@@ -18,19 +19,61 @@ static inline void printUsage(const std::string &info = "", int exitCode = 0)
     ::exit(exitCode);
 }
 
+// Reports the calls slower than --slow to stderr once the command is done, the
+// database must outlive it
+class SlowReport {
+public:
+    SlowReport(celebi::IDatabase &db, const cxxopts::ParseResult &result)
+        : m_db(result.count("w") ? &db : nullptr)
+    {
+        if (m_db)
+            m_db->setSlowThreshold(std::chrono::microseconds(result["w"].as<long long>()));
+    }
+
+    ~SlowReport()
+    {
+        if (!m_db)
+            return;
+
+        for (auto &operation : m_db->slowOperations()) {
+            std::cerr << "slow " << operation.m_operation << " took "
+                      << operation.m_duration.count() / 1000 << "us, key "
+                      << operation.m_keySize << " bytes, value " << operation.m_valueSize << " bytes";
+            if (!operation.m_bucket.empty())
+                std::cerr << ", bucket " << operation.m_bucket;
+            for (auto &layer : operation.m_layers)
+                std::cerr << ", " << layer.first << " " << layer.second.count() / 1000 << "us";
+            std::cerr << std::endl;
+        }
+    }
+
+private:
+    celebi::IDatabase *m_db;
+};
+
 // Incorporating https://github.com/jarro2783/cxxopts as a header only library for options parsing
 int main(int argc, char *argv[])
-{
+try {
     options.add_options()
           ("c,create", "Create a DB")
           ("d,destroy", "Destroy a DB")
           ("s,set", "Set a key in a DB")
           ("g,get", "Get a key from a DB")
-          ("q,query", "Query the DB (must also specify a query term. E.g. b for bucket)")
+          ("x,delete", "Delete a key from a DB, or only from the bucket given with -b")
+          ("q,query", "Query the DB (must also specify a query term. E.g. b for bucket, p for prefix)")
+          ("u,memory", "Show the memory the DB holds, and each bucket's share of the index")
           ("n,name","Database name (required)", cxxopts::value<std::string>())
           ("k,key","Key to set/get", cxxopts::value<std::string>())
           ("v,value","Value to set", cxxopts::value<std::string>())
           ("b,bucket","Bucket stored in", cxxopts::value<std::string>())
+          ("t,ttl","Milliseconds until a set key expires", cxxopts::value<long long>())
+          ("p,prefix","Key prefix to query, keys are listed in order", cxxopts::value<std::string>())
+          ("l,limit","Most keys a prefix query lists", cxxopts::value<std::size_t>()->default_value("0"))
+          ("r,reverse","List keys of a prefix query in reverse order")
+          ("w,slow","Report calls which take this many microseconds or longer",
+           cxxopts::value<long long>())
+          ("m,mode","Access mode when processes share the DB: exclusive (default), writer or reader",
+           cxxopts::value<std::string>()->default_value("exclusive"))
           ("h,help", "Print Usage")
         ;
 
@@ -39,6 +82,15 @@ int main(int argc, char *argv[])
     if (result.count("h"))
         printUsage();
 
+    celebi::AccessMode mode = celebi::AccessMode::EXCLUSIVE;
+    std::string modeName = result["m"].as<std::string>();
+    if ("writer" == modeName)
+        mode = celebi::AccessMode::SHARED_WRITER;
+    else if ("reader" == modeName)
+        mode = celebi::AccessMode::SHARED_READER;
+    else if ("exclusive" != modeName)
+        printUsage("Unknown access mode " + modeName, 1);
+
     if (result.count("c")) {
         if (!result.count("n")) {
             printUsage("You must specify a database naem with -n <name>", 1);
@@ -52,7 +104,7 @@ int main(int argc, char *argv[])
         }
         // Destroy database
         std::string dbName = result["n"].as<std::string>();
-        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName));
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
         db->destroy();
     } else if (result.count("s")) {
         if (!result.count("n"))
@@ -68,9 +120,16 @@ int main(int argc, char *argv[])
         std::string key = result["k"].as<std::string>();
         std::string value = result["v"].as<std::string>();
         std::string dbName = result["n"].as<std::string>();
-        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName));
-
-        if (result.count("b")) {
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
+        SlowReport report(*db, result);
+
+        if (result.count("t")) {
+            std::chrono::milliseconds ttl(result["t"].as<long long>());
+            if (result.count("b"))
+                db->setKeyValue(key, value, result["b"].as<std::string>(), ttl);
+            else
+                db->setKeyValue(key, value, ttl);
+        } else if (result.count("b")) {
             std::string bucket(result["b"].as<std::string>());
             db->setKeyValue(key, value, bucket);
         } else {
@@ -86,17 +145,47 @@ int main(int argc, char *argv[])
         // Get key-value from database
         std::string key = result["k"].as<std::string>();
         std::string dbName = result["n"].as<std::string>();
-        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName));
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
+        SlowReport report(*db, result);
         std::cout << db->getKeyValue(key) << std::endl;
+    } else if (result.count("x")) {
+        if (!result.count("n"))
+            printUsage("You must specify a database naem with -n <name>", 1);
+
+        if (!result.count("k"))
+            printUsage("You must specify a key to delete with -k <key>", 1);
+
+        std::string key = result["k"].as<std::string>();
+        std::string dbName = result["n"].as<std::string>();
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
+        SlowReport report(*db, result);
+
+        if (result.count("b"))
+            db->removeFromBucket(key, result["b"].as<std::string>());
+        else
+            db->deleteKey(key);
     } else if (result.count("q")) {
         if (!result.count("n"))
             printUsage("You must specify a database naem with -n <name>", 1);
 
-        if (!result.count("b"))
-            printUsage("You must specify a key to set with -b <bucket>", 1);
+        if (!result.count("b") && !result.count("p"))
+            printUsage("You must specify a query term with -b <bucket> or -p <prefix>", 1);
 
         std::string dbName = result["n"].as<std::string>();
-        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName));
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
+        SlowReport report(*db, result);
+
+        if (result.count("p")) {
+            celebi::PrefixQuery prefixQuery(result["p"].as<std::string>(), result.count("r") > 0,
+                                            result["l"].as<std::size_t>());
+            std::unique_ptr<std::vector<std::string>> keys =
+                    db->query(prefixQuery)->orderedRecordKeys();
+            for (auto &key : *keys)
+                std::cout << key << std::endl;
+
+            return 0;
+        }
+
         std::string bucket(result["b"].as<std::string>());
 
         celebi::BucketQuery buckerQuery(bucket);
@@ -106,9 +195,33 @@ int main(int argc, char *argv[])
         //std::cout << recordKeys.get()->size() << std::endl;
         for (auto it = recordKeys.get()->begin(); it != recordKeys.get()->end(); it++)
             std::cout << *it << std::endl;
+    } else if (result.count("u")) {
+        if (!result.count("n"))
+            printUsage("You must specify a database naem with -n <name>", 1);
+
+        std::string dbName = result["n"].as<std::string>();
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbName, mode));
+
+        celebi::MemoryUsage usage = db->memoryUsage();
+        std::cout << "keys      " << usage.m_keys << std::endl
+                  << "values    " << usage.m_values << std::endl
+                  << "members   " << usage.m_members << std::endl
+                  << "postings  " << usage.m_postings << std::endl
+                  << "overhead  " << usage.m_overhead << std::endl
+                  << "mapped    " << usage.m_mapped << std::endl
+                  << "slack     " << usage.m_slack << std::endl
+                  << "total     " << usage.total() << std::endl;
+
+        for (auto &bucket : db->bucketMemoryUsage())
+            std::cout << "bucket " << bucket.first << " " << bucket.second.total() << std::endl;
     } else {
         printUsage("No command specified !");
     }
 
     return 0;
 }
+catch (const std::exception &e) {
+    // e.g. the database is locked by another process
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
@@ -0,0 +1,96 @@
+#ifndef __CELEBI_ASYNCDATABASE_H__
+#define __CELEBI_ASYNCDATABASE_H__
+
+#include "database.h"
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <string>
+
+namespace celebiext {
+
+using namespace celebi;
+
+/**
+ * @brief The Executor type posts a job to the caller's executor, the job does
+ *        the blocking load and then resumes the awaiting coroutine
+ */
+using Executor = std::function<void(std::function<void()>)>;
+
+/**
+ * @brief The LookupAwaitable class completes without suspension on a memory tier hit,
+ *        otherwise it suspends and finishes the lookup on the executor
+ */
+template <typename T>
+class LookupAwaitable {
+public:
+    LookupAwaitable(std::function<bool(T &)> probe, std::function<T()> load,
+                    const Executor &executor)
+        : m_probe(std::move(probe)), m_load(std::move(load)), m_executor(executor),
+          m_result(), m_exception()
+    {
+
+    }
+
+    bool await_ready()
+    {
+        return m_probe(m_result);
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        // the coroutine may be resumed on another thread before this returns,
+        // so nothing is touched after the job has been posted
+        m_executor([this, handle]() {
+            try {
+                m_result = m_load();
+            } catch (...) {
+                m_exception = std::current_exception();
+            }
+
+            handle.resume();
+        });
+    }
+
+    T await_resume()
+    {
+        if (m_exception)
+            std::rethrow_exception(m_exception);
+
+        return std::move(m_result);
+    }
+
+private:
+    std::function<bool(T &)> m_probe;
+    std::function<T()> m_load;
+    const Executor &m_executor;
+    T m_result;
+    std::exception_ptr m_exception;
+};
+
+/**
+ * @brief The AsyncDatabase class is coroutine API over a database,
+ *        the database and the executor must outlive every pending awaitable
+ */
+class AsyncDatabase {
+public:
+    AsyncDatabase(IDatabase &db, Executor executor);
+    ~AsyncDatabase() = default;
+
+    // Get methods
+    LookupAwaitable<std::string> get(const std::string &key);
+    LookupAwaitable<std::unique_ptr<std::unordered_set<std::string>>>
+                    getSet(const std::string &key);
+
+    // Query records methods, the query must outlive the awaitable
+    LookupAwaitable<std::unique_ptr<IQueryResult>> query(BucketQuery &q);
+
+private:
+    IDatabase &m_db;
+    Executor m_executor;
+};
+
+}
+
+#endif // __CELEBI_ASYNCDATABASE_H__
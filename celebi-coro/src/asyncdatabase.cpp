@@ -0,0 +1,42 @@
+#include "asyncdatabase.h"
+
+namespace celebiext {
+
+AsyncDatabase::AsyncDatabase(IDatabase &db, Executor executor)
+    : m_db(db), m_executor(std::move(executor))
+{
+
+}
+
+// Get methods
+LookupAwaitable<std::string> AsyncDatabase::get(const std::string &key)
+{
+    return LookupAwaitable<std::string>(
+        [this, key](std::string &value) { return m_db.tryGetKeyValue(key, value); },
+        [this, key]() { return m_db.getKeyValue(key); },
+        m_executor);
+}
+
+LookupAwaitable<std::unique_ptr<std::unordered_set<std::string>>>
+AsyncDatabase::getSet(const std::string &key)
+{
+    using ValueSet = std::unique_ptr<std::unordered_set<std::string>>;
+
+    return LookupAwaitable<ValueSet>(
+        [this, key](ValueSet &value) { return m_db.tryGetKeyValueSet(key, value); },
+        [this, key]() { return m_db.getKeyValueSet(key); },
+        m_executor);
+}
+
+// Query records methods
+LookupAwaitable<std::unique_ptr<IQueryResult>> AsyncDatabase::query(BucketQuery &q)
+{
+    using Result = std::unique_ptr<IQueryResult>;
+
+    return LookupAwaitable<Result>(
+        [this, &q](Result &result) { return m_db.tryQuery(q, result); },
+        [this, &q]() { return m_db.query(q); },
+        m_executor);
+}
+
+}
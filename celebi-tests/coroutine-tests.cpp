@@ -0,0 +1,115 @@
+#include "tests.h"
+
+#include "celebi.h"
+#include "asyncdatabase.h"
+
+#include <coroutine>
+#include <deque>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Fire-and-forget coroutine, enough to drive the awaitables from a test
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+static Detached getValue(celebiext::AsyncDatabase &db, const std::string key,
+                         std::string &value, bool &done)
+{
+    value = co_await db.get(key);
+    done = true;
+}
+
+static Detached queryBucket(celebiext::AsyncDatabase &db, celebi::BucketQuery &q,
+                            std::size_t &size, bool &done)
+{
+    auto res = co_await db.query(q);
+    size = res->recordKeys()->size();
+    done = true;
+}
+
+TEST_CASE("coroutine get and query", "[AsyncDatabase]") {
+    // Story:-
+    //   [Who]   As a coroutine based server developer
+    //   [What]  I need to await values and queries without blocking my executor
+    //   [Value] So cold reads don't stall other requests
+    std::deque<std::function<void()>> jobs;
+    celebiext::Executor executor = [&jobs](std::function<void()> job) {
+        jobs.push_back(std::move(job));
+    };
+
+    SECTION("Memory tier hit completes without suspension") {
+        std::string dbName("my-coro-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbName));
+        celebiext::AsyncDatabase asyncDb(*db, executor);
+
+        db->setKeyValue("key", "value", "bucket");
+
+        std::string value;
+        bool done = false;
+        getValue(asyncDb, "key", value, done);
+        REQUIRE(done);
+        REQUIRE(jobs.empty());
+        REQUIRE(value == "value");
+
+        celebi::BucketQuery bq("bucket");
+        std::size_t size = 0;
+        done = false;
+        queryBucket(asyncDb, bq, size, done);
+        REQUIRE(done);
+        REQUIRE(jobs.empty());
+        REQUIRE(size == 1);
+
+        db->destroy();
+        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+    }
+
+    SECTION("Cold read suspends and resumes on the executor") {
+        std::string dbName("my-coro-db");
+        std::unique_ptr<celebi::IDatabase> db1(celebi::Celebi::createEmptyDB(dbName));
+        db1->setKeyValue("key", "value", "bucket");
+
+        std::unique_ptr<celebi::IDatabase> db2(celebi::Celebi::loadDB(dbName));
+        celebiext::AsyncDatabase asyncDb(*db2, executor);
+
+        std::string value;
+        bool done = false;
+        getValue(asyncDb, "key", value, done);
+        REQUIRE(!done);
+        REQUIRE(jobs.size() == 1);
+
+        jobs.front()();
+        jobs.pop_front();
+        REQUIRE(done);
+        REQUIRE(value == "value");
+
+        // the value is in memory now
+        done = false;
+        getValue(asyncDb, "key", value, done);
+        REQUIRE(done);
+        REQUIRE(jobs.empty());
+
+        celebi::BucketQuery bq("bucket");
+        std::size_t size = 0;
+        done = false;
+        queryBucket(asyncDb, bq, size, done);
+        REQUIRE(!done);
+        REQUIRE(jobs.size() == 1);
+
+        jobs.front()();
+        jobs.pop_front();
+        REQUIRE(done);
+        REQUIRE(size == 1);
+
+        db2->destroy();
+        REQUIRE(!fs::exists(fs::status(db2->getDirectory())));
+    }
+}
@@ -1,12 +1,30 @@
 #include "tests.h"
 
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
 #include <string>
 
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include "celebi.h"
 
 namespace fs = std::filesystem;
 
+// Files of the database left in .celebi, its folder and the lock files and keydirs beside it
+static std::size_t leftovers(const std::string &dbName)
+{
+    std::size_t count = 0;
+    for (auto &entry : fs::directory_iterator(".celebi")) {
+        if (0 == entry.path().filename().string().rfind(dbName, 0))
+            count++;
+    }
+
+    return count;
+}
+
 TEST_CASE("db-create", "[createEmptyDB]") {
     // Story:-
     //   [Who]   As a database administrator
@@ -36,6 +54,7 @@ TEST_CASE("db-create", "[createEmptyDB]") {
        // 4. Destroy the database
        db->destroy();
        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+       REQUIRE(0 == leftovers(dbName));
     }
 }
 
@@ -71,3 +90,287 @@ TEST_CASE("db-load", "[loadDB]") {
         REQUIRE(!fs::exists(fs::status(db2->getDirectory())));
     }
 }
+
+TEST_CASE("db-shared", "[loadDB]") {
+    // Story:-
+    //   [Who]   As a database user running several worker processes
+    //   [What]  I need the workers to share one database, one writing and the others reading
+    //   [Value] So readers see new values without reloading and nobody clobbers the files
+
+    SECTION("Writer and reader") {
+        std::string dbName("my-shared-db");
+        std::unique_ptr<celebi::IDatabase> writer(
+                    celebi::Celebi::loadDB(dbName, celebi::AccessMode::SHARED_WRITER));
+        std::unique_ptr<celebi::IDatabase> reader(
+                    celebi::Celebi::loadDB(dbName, celebi::AccessMode::SHARED_READER));
+
+        // 1. Readers see every commit of the writer without reloading
+        writer->setKeyValue("key", "value1", "bucket");
+        REQUIRE(reader->getKeyValue("key") == "value1");
+        writer->setKeyValue("key", "value2");
+        REQUIRE(reader->getKeyValue("key") == "value2");
+
+        celebi::BucketQuery bq("bucket");
+        REQUIRE(reader->query(bq)->recordKeys()->size() == 1);
+
+        // 2. Readers can't write
+        REQUIRE_THROWS_AS(reader->setKeyValue("key", "value3"), std::runtime_error);
+
+        // 3. The keydir grows without readers losing track
+        for (int i = 0; i < 3000; i++)
+            writer->setKeyValue(std::to_string(i), std::to_string(i));
+        writer->setKeyValue("key", "value4");
+        REQUIRE(reader->getKeyValue("2999") == "2999");
+        REQUIRE(reader->getKeyValue("key") == "value4");
+
+        // 4. Readers honor the writer's deadlines before the writer removes the key
+        writer->setKeyValue("later", "value", std::chrono::hours(1));
+        writer->setKeyValue("gone", "value", std::chrono::milliseconds(0));
+        REQUIRE(reader->getKeyValue("later") == "value");
+        REQUIRE(reader->getKeyValue("gone") == "");
+
+        reader.reset();
+        writer->destroy();
+        REQUIRE(!fs::exists(fs::status(writer->getDirectory())));
+        REQUIRE(0 == leftovers(dbName));
+    }
+
+    SECTION("Other processes") {
+        std::string dbName("my-shared-db");
+        std::unique_ptr<celebi::IDatabase> writer(
+                    celebi::Celebi::loadDB(dbName, celebi::AccessMode::SHARED_WRITER));
+        writer->setKeyValue("key", "value");
+
+        pid_t pid = ::fork();
+        REQUIRE(pid >= 0);
+        if (0 == pid) {
+            int failures = 0;
+
+            // a second writer or an exclusive user is turned away
+            try {
+                celebi::Celebi::loadDB(dbName, celebi::AccessMode::SHARED_WRITER);
+                failures++;
+            } catch (const std::runtime_error &) {}
+            try {
+                celebi::Celebi::loadDB(dbName);
+                failures++;
+            } catch (const std::runtime_error &) {}
+
+            // but readers are welcome
+            auto reader = celebi::Celebi::loadDB(dbName, celebi::AccessMode::SHARED_READER);
+            if (reader->getKeyValue("key") != "value")
+                failures++;
+
+            ::_exit(failures);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(0 == WEXITSTATUS(status));
+
+        writer->destroy();
+        REQUIRE(!fs::exists(fs::status(writer->getDirectory())));
+        REQUIRE(0 == leftovers(dbName));
+    }
+}
+
+TEST_CASE("db-stats", "[stats]") {
+    // Story:-
+    //   [Who]   As a database administrator
+    //   [What]  I need latencies and counters of every operation and every layer
+    //   [Value] So I can tell where time goes and feed it to my monitoring
+
+    SECTION("Histogram buckets") {
+        // 1. Every value falls in a bucket no wider than a sixteenth of it
+        for (std::uint64_t nanos : { 0ull, 1ull, 31ull, 32ull, 33ull, 1000ull, 123456789ull,
+                                     (1ull << 40) + 12345 }) {
+            std::size_t bucket = celebi::Histogram::bucketOf(nanos);
+            REQUIRE(celebi::Histogram::upperBound(bucket) >= nanos);
+            REQUIRE(celebi::Histogram::upperBound(bucket) - nanos <= nanos / 16);
+        }
+        for (std::size_t bucket = 0; bucket < celebi::Histogram::buckets; bucket++)
+            REQUIRE(celebi::Histogram::bucketOf(celebi::Histogram::upperBound(bucket)) == bucket);
+        REQUIRE(celebi::Histogram::bucketOf(~0ull) == celebi::Histogram::buckets - 1);
+    }
+
+    SECTION("Operations and layers") {
+        std::string dbName("my-stats-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbName));
+
+        // 0. Nothing is timed until stats are enabled
+        db->setKeyValue("untimed", "value");
+        REQUIRE(db->stats().latency("database", "set").m_count == 0);
+        db->enableStats(true);
+
+        for (int i = 0; i < 100; i++) {
+            db->setKeyValue("key" + std::to_string(i), "value");
+            db->setKeyValue("bucketed" + std::to_string(i), "value", "bucket");
+            REQUIRE(db->getKeyValue("key" + std::to_string(i)) == "value");
+        }
+        celebi::BucketQuery bq("bucket");
+        REQUIRE(db->query(bq)->recordKeys()->size() == 100);
+
+        // 1. Every call into the database is counted once
+        celebi::Stats stats = db->stats();
+        REQUIRE(stats.latency("database", "set").m_count == 100);
+        REQUIRE(stats.latency("database", "set_bucket").m_count == 100);
+        REQUIRE(stats.latency("database", "get").m_count == 100);
+        REQUIRE(stats.latency("database", "query").m_count == 1);
+
+        // 2. And so are the calls into each store below it
+        REQUIRE(stats.latency("memory", "set").m_count == 200);
+        REQUIRE(stats.latency("file", "set").m_count == 200);
+        REQUIRE(stats.latency("index", "merge").m_count == 200);
+        REQUIRE(stats.m_counters.count({ "file", "filter_negatives" }));
+
+        // 3. Percentiles are ordered and nothing is faster than what it calls
+        const celebi::Histogram &sets = stats.latency("database", "set");
+        REQUIRE(sets.percentile(0.5) <= sets.percentile(0.99));
+        REQUIRE(sets.percentile(0.99) <= sets.max());
+        REQUIRE(sets.mean() > 0);
+        REQUIRE(stats.latency("memory", "set").m_sum >= stats.latency("file", "set").m_sum);
+
+        // 4. Switched off, nothing is timed
+        db->enableStats(false);
+        db->setKeyValue("key", "value");
+        REQUIRE(db->stats().latency("database", "set").m_count == 100);
+        db->enableStats(true);
+
+        // 5. Stats can be scraped as a Prometheus text file
+        const std::string path = db->getDirectory() + ".prom";
+        stats.writePrometheus(path);
+        std::ifstream in(path);
+        std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        REQUIRE(text.find("# TYPE celebi_latency_seconds histogram") != std::string::npos);
+        REQUIRE(text.find("celebi_latency_seconds_count{layer=\"database\",operation=\"get\"} 100\n")
+                != std::string::npos);
+        REQUIRE(text.find("celebi_latency_seconds_bucket{layer=\"database\",operation=\"get\",le=\"+Inf\"} 100\n")
+                != std::string::npos);
+        REQUIRE(text.find("celebi_latency_seconds_bucket{layer=\"database\",operation=\"get\",le=\"10\"} 100\n")
+                != std::string::npos);
+
+        // 6. Every series has the same bounds whatever it counted
+        auto buckets = [&text](const std::string &operation) {
+            const std::string series = "celebi_latency_seconds_bucket{layer=\"database\",operation=\"" + operation + "\",";
+            std::size_t count = 0;
+            for (std::size_t at = text.find(series); std::string::npos != at; at = text.find(series, at + 1))
+                count++;
+            return count;
+        };
+        REQUIRE(23 == buckets("query"));
+        REQUIRE(23 == buckets("get"));
+        fs::remove(path);
+
+        db->destroy();
+    }
+}
+
+TEST_CASE("db-slow-log", "[stats]") {
+    // Story:-
+    //   [Who]   As a database administrator
+    //   [What]  I need the calls which took too long, with the key and where the time went
+    //   [Value] So I can find the few slow requests the percentiles hide
+
+    std::string dbName("my-slow-db");
+    std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbName));
+
+    // 1. The log is off until given a threshold
+    db->setKeyValue("key", "value");
+    REQUIRE(db->slowOperations().empty());
+
+    // 2. Calls at or over the threshold are kept with their sizes and layer times
+    db->setSlowThreshold(std::chrono::nanoseconds(1), 4);
+    const std::string longKey(100, 'k');
+    db->setKeyValue(longKey, "value", "bucket");
+    std::vector<celebi::SlowOperation> slow = db->slowOperations();
+    REQUIRE(slow.size() == 1);
+    REQUIRE(slow[0].m_operation == "set_bucket");
+    REQUIRE(slow[0].m_key == longKey.substr(0, celebi::SlowOperation::maxKeySize));
+    REQUIRE(slow[0].m_keySize == 100);
+    REQUIRE(slow[0].m_valueSize == 5);
+    REQUIRE(slow[0].m_bucket == "bucket");
+    REQUIRE(slow[0].m_layers.count("memory"));
+    REQUIRE(slow[0].m_layers.count("index"));
+    REQUIRE(slow[0].m_layers.at("memory") <= slow[0].m_duration);
+
+    // 3. Reads know the size of what they found
+    REQUIRE(db->getKeyValue(longKey) == "value");
+    slow = db->slowOperations();
+    REQUIRE(slow.back().m_operation == "get");
+    REQUIRE(slow.back().m_valueSize == 5);
+
+    // 4. Only the newest calls are kept
+    for (int i = 0; i < 10; i++)
+        db->setKeyValue("key" + std::to_string(i), "value");
+    slow = db->slowOperations();
+    REQUIRE(slow.size() == 4);
+    REQUIRE(slow.back().m_key == "key9");
+
+    // 5. A call made of another is logged once
+    db->setSlowThreshold(std::chrono::nanoseconds(1), 8);
+    REQUIRE(db->setIfAbsent("absent", "value"));
+    slow = db->slowOperations();
+    REQUIRE(slow.back().m_operation == "conditional");
+    REQUIRE(slow.size() == 5);
+
+    // 6. A zero threshold turns it off again
+    db->setSlowThreshold(std::chrono::nanoseconds(0));
+    db->setKeyValue("key", "value");
+    REQUIRE(db->slowOperations().size() == 5);
+
+    db->destroy();
+}
+
+TEST_CASE("db-memory", "[memory]") {
+    // Story:-
+    //   [Who]   As a database administrator
+    //   [What]  I need to know what the database holds in memory and what for
+    //   [Value] So I can plan capacity and size caches by it
+
+    std::string dbName("my-memory-db");
+    std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbName));
+
+    // 1. An empty database holds tables but no data
+    celebi::MemoryUsage empty = db->memoryUsage();
+    REQUIRE(empty.m_keys == 0);
+    REQUIRE(empty.m_values == 0);
+    REQUIRE(empty.m_overhead > 0);
+
+    // 2. Keys, values and set members count byte for byte, long values with slack
+    std::size_t keyBytes = 0;
+    for (int i = 0; i < 100; i++) {
+        std::string key = "key" + std::to_string(i);
+        db->setKeyValue(key, std::string(100, 'v'));
+        keyBytes += key.size();
+    }
+    db->setKeyValue("set", std::unordered_set<std::string>{ "a", "bb" });
+    celebi::MemoryUsage usage = db->memoryUsage();
+    REQUIRE(usage.m_keys == keyBytes + 3);
+    REQUIRE(usage.m_values == 100 * 100);
+    REQUIRE(usage.m_members == 3);
+    REQUIRE(usage.m_slack > 0);
+    REQUIRE(usage.total() > empty.total() + usage.m_values);
+
+    // 3. The index is counted as postings, by bucket too
+    std::size_t largeBytes = 0;
+    for (int i = 0; i < 50; i++) {
+        std::string key = "key" + std::to_string(i);
+        db->setKeyValue(key, "value", "large");
+        largeBytes += key.size();
+    }
+    db->setKeyValue("key0", "value", "small");
+    std::map<std::string, celebi::MemoryUsage> buckets = db->bucketMemoryUsage();
+    REQUIRE(buckets.size() == 2);
+    REQUIRE(buckets["large"].m_postings == std::string("bucket::large").size() + largeBytes);
+    REQUIRE(buckets["small"].m_postings == std::string("bucket::small").size() + 4);
+    REQUIRE(buckets["large"].total() > buckets["small"].total());
+    REQUIRE(db->memoryUsage().m_postings > buckets["large"].m_postings + buckets["small"].m_postings);
+
+    // 4. Deleted keys give their memory back
+    for (int i = 50; i < 100; i++)
+        db->deleteKey("key" + std::to_string(i));
+    REQUIRE(db->memoryUsage().m_values < usage.m_values);
+
+    db->destroy();
+}
@@ -1,7 +1,25 @@
 #include "catch.hpp"
 #include "celebi.h"
+#include "extensions/extdatabase.h"
+#include "extensions/art.h"
+#include "extensions/epoch.h"
+#include "extensions/timingwheel.h"
+#include "extensions/trace.h"
 
+#include <algorithm>
+#include <atomic>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <numeric>
+#include <random>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
@@ -102,3 +120,1486 @@ TEST_CASE("Store and retrive a list value",
         REQUIRE(!fs::exists(fs::status(db->getDirectory())));
     }
 }
+
+// Implements the set and get methods alone, as stores written before the others did
+class PlainKeyValueStore : public celebi::KeyValueStore {
+public:
+    virtual void loadKeysInto(std::function<void(std::string key, std::string vlaue)> cb) override
+    {
+        for (auto &it : m_strings)
+            cb(it.first, it.second);
+        for (auto &it : m_sets)
+            cb(it.first, "");
+    }
+
+    virtual void clear() override
+    {
+        m_strings.clear();
+        m_sets.clear();
+    }
+
+    virtual void setKeyValue(const std::string &key, const std::string &value) override
+    {
+        m_strings[key] = value;
+    }
+
+    virtual void setKeyValue(const std::string &key, const std::unordered_set<std::string> &value) override
+    {
+        m_sets[key] = value;
+    }
+
+    virtual void appendKeyValue(const std::string &key, const std::string &value) override
+    {
+        m_sets[key].insert(value);
+    }
+
+    virtual std::string getKeyValue(const std::string &key) override
+    {
+        auto found = m_strings.find(key);
+
+        return found == m_strings.end() ? "" : found->second;
+    }
+
+    virtual std::unique_ptr<std::unordered_set<std::string>> getKeyValueSet(const std::string &key) override
+    {
+        auto found = m_sets.find(key);
+
+        return std::make_unique<std::unordered_set<std::string>>(
+                    found == m_sets.end() ? std::unordered_set<std::string>() : found->second);
+    }
+
+private:
+    std::map<std::string, std::string> m_strings;
+    std::map<std::string, std::unordered_set<std::string>> m_sets;
+};
+
+class PlainQueryResult : public celebi::IQueryResult {
+public:
+    virtual const std::unique_ptr<std::unordered_set<std::string>> recordKeys() override
+    {
+        return std::make_unique<std::unordered_set<std::string>>(
+                    std::unordered_set<std::string>{ "c", "a", "b" });
+    }
+};
+
+TEST_CASE("Keep stores written against the set and get methods working", "[mergeKeyValue, scanKeys]") {
+    // Story:-
+    //   [Who]   As a developer with a key-value store of my own
+    //   [What]  I need it to keep compiling and working as the interface grows
+    //   [Value] So upgrading celebi doesn't make me write every new method first
+
+    SECTION("Store defaults") {
+        PlainKeyValueStore store;
+        store.mergeKeyValue("counter", "5", celebi::MergeOperator::ADD);
+        store.mergeKeyValue("counter", "-2", celebi::MergeOperator::ADD);
+        REQUIRE("3" == store.getKeyValue("counter"));
+        REQUIRE(!store.compareAndSetKeyValue("counter", "4", "5"));
+        REQUIRE(store.compareAndSetKeyValue("counter", "3", "5"));
+        REQUIRE("5" == store.getKeyValue("counter"));
+
+        store.mergeKeyValue("set", std::unordered_set<std::string>{ "a", "b" });
+        store.removeKeyValue("set", "a");
+        REQUIRE(std::unordered_set<std::string>{ "b" } == *store.getKeyValueSet("set"));
+
+        std::string value;
+        REQUIRE(store.tryGetKeyValue("counter", value));
+        REQUIRE("5" == value);
+
+        store.setKeyValue("key1", "1");
+        store.setKeyValue("key2", "2");
+        std::vector<std::string> scanned;
+        store.scanKeys("key", "set", true, [&scanned](const std::string &key) {
+            scanned.push_back(key);
+            return true;
+        });
+        REQUIRE(std::vector<std::string>{ "key2", "key1" } == scanned);
+
+        REQUIRE_THROWS_AS(store.snapshot(), std::runtime_error);
+        REQUIRE_THROWS_AS(store.deleteKeyValue("counter"), std::runtime_error);
+        REQUIRE(0 == store.memoryUsage().total());
+    }
+
+    SECTION("Database on a plain store") {
+        std::unique_ptr<celebi::KeyValueStore> kvStore = std::make_unique<PlainKeyValueStore>();
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB("my-plain-db", kvStore));
+
+        db->setKeyValue("key", "value", "bucket");
+        db->incrementKeyValue("counter", 2);
+        REQUIRE("2" == db->getKeyValue("counter"));
+        REQUIRE(db->setIfAbsent("new", "value"));
+        REQUIRE(!db->setIfAbsent("new", "other"));
+
+        std::string value;
+        REQUIRE(db->tryGetKeyValue("key", value));
+        REQUIRE("value" == value);
+
+        celebi::BucketQuery bq("bucket");
+        std::unique_ptr<celebi::IQueryResult> result;
+        REQUIRE(db->tryQuery(bq, result));
+        REQUIRE(std::vector<std::string>{ "key" } == *result->orderedRecordKeys());
+
+        db->destroy();
+    }
+
+    SECTION("Query result default") {
+        PlainQueryResult result;
+        REQUIRE(std::vector<std::string>{ "a", "b", "c" } == *result.orderedRecordKeys());
+    }
+}
+
+TEST_CASE("Store and retrieve from many threads", "[setKeyValue, getKeyValue, appendKeyValue]") {
+    // Story:-
+    //   [Who]   As a multi-threaded server developer
+    //   [What]  I need to share one memory store between my worker threads
+    //   [Value] So I can scale past one core without a global lock
+    auto concurrency = GENERATE(celebiext::Concurrency::SHARDED,
+                                celebiext::Concurrency::LOCK_FREE_READ);
+
+    SECTION("Concurrent memory store") {
+        celebiext::MemoryKeyValueStore store(concurrency);
+        const int threads = 8, perThread = 1000;
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&store, t]() {
+                for (int i = 0; i < perThread; i++) {
+                    std::string key = std::to_string(t) + ":" + std::to_string(i);
+                    store.setKeyValue(key, key);
+                    store.appendKeyValue("members", key);
+                }
+            });
+        }
+        // readers racing the writers only ever see complete values
+        std::atomic<bool> torn(false);
+        workers.emplace_back([&store, &torn]() {
+            for (int i = 0; i < perThread; i++) {
+                std::string key = "0:" + std::to_string(i);
+                std::string value = store.getKeyValue(key);
+                if (!value.empty() && value != key)
+                    torn = true;
+            }
+        });
+        // and scans racing them only ever see keys in order
+        std::atomic<bool> unordered(false);
+        workers.emplace_back([&store, &unordered]() {
+            for (int i = 0; i < 100; i++) {
+                std::string last;
+                store.scanKeys("1:", "2:", false, [&last, &unordered](const std::string &key) {
+                    if (key <= last)
+                        unordered = true;
+                    last = key;
+                    return true;
+                });
+            }
+        });
+        for (auto &worker : workers)
+            worker.join();
+        REQUIRE(!torn);
+        REQUIRE(!unordered);
+
+        for (int t = 0; t < threads; t++) {
+            for (int i = 0; i < perThread; i++) {
+                std::string key = std::to_string(t) + ":" + std::to_string(i);
+                REQUIRE(key == store.getKeyValue(key));
+            }
+        }
+        REQUIRE(threads * perThread == store.getKeyValueSet("members")->size());
+    }
+}
+
+TEST_CASE("Keep keys in order", "[scanKeys]") {
+    // Story:-
+    //   [Who]   As a database developer
+    //   [What]  I need the ordered index to agree with a sorted set whatever keys it holds
+    //   [Value] So range and prefix queries never miss or invent a key
+    SECTION("Radix tree against std::set") {
+        celebiext::AdaptiveRadixTree tree;
+        std::set<std::string> expected;
+
+        // keys sharing long prefixes, keys that are prefixes of others, and all byte values
+        std::minstd_rand rand(42);
+        for (int i = 0; i < 20000; i++) {
+            std::string key = "tenant" + std::to_string(rand() % 50) + ":object" +
+                    std::to_string(rand() % 100);
+            if (rand() % 2)
+                key += ":field" + std::to_string(rand() % 10);
+            REQUIRE(tree.insert(key) == expected.insert(key).second);
+        }
+        for (int c = 0; c < 256; c++) {
+            std::string key(1, static_cast<char>(c));
+            REQUIRE(tree.insert(key) == expected.insert(key).second);
+            REQUIRE(tree.insert(key + key) == expected.insert(key + key).second);
+        }
+        REQUIRE(tree.insert("") == expected.insert("").second);
+        REQUIRE(tree.size() == expected.size());
+
+        for (auto &key : expected)
+            REQUIRE(tree.contains(key));
+        REQUIRE(!tree.contains("tenant1:object"));
+        REQUIRE(!tree.contains("tenant1:object1:field10"));
+
+        std::vector<std::string> all;
+        tree.scan("", "", false, [&all](const std::string &key) { all.push_back(key); return true; });
+        REQUIRE(all == std::vector<std::string>(expected.begin(), expected.end()));
+
+        const std::vector<std::pair<std::string, std::string>> ranges = {
+            {"tenant1:", "tenant1;"}, {"tenant17:object3", "tenant2"}, {"", "tenant"},
+            {"tenant49:object99:field9", ""}, {"a", "a"}, {"tenant3", "tenant30:object5:"},
+        };
+        for (auto &range : ranges) {
+            auto begin = range.first.empty() ? expected.begin() : expected.lower_bound(range.first);
+            auto end = range.second.empty() ? expected.end() : expected.lower_bound(range.second);
+            std::vector<std::string> forward(begin, end);
+
+            std::vector<std::string> scanned;
+            tree.scan(range.first, range.second, false, [&scanned](const std::string &key) {
+                scanned.push_back(key);
+                return true;
+            });
+            REQUIRE(scanned == forward);
+
+            scanned.clear();
+            tree.scan(range.first, range.second, true, [&scanned](const std::string &key) {
+                scanned.push_back(key);
+                return scanned.size() < 3;
+            });
+            std::vector<std::string> reverse(forward.rbegin(), forward.rend());
+            reverse.resize(std::min<std::size_t>(reverse.size(), 3));
+            REQUIRE(scanned == reverse);
+        }
+
+        // erasing empties nodes of every size, and keys inserted again find their way back
+        for (int i = 0; i < 20000; i++) {
+            auto it = expected.begin();
+            std::advance(it, rand() % expected.size());
+            std::string key = *it;
+            REQUIRE(tree.erase(key) == (expected.erase(key) > 0));
+            REQUIRE(!tree.erase(key));
+            if (0 == i % 3)
+                REQUIRE(tree.insert(key + "x") == expected.insert(key + "x").second);
+            if (expected.empty())
+                break;
+        }
+        REQUIRE(tree.size() == expected.size());
+        all.clear();
+        tree.scan("", "", false, [&all](const std::string &key) { all.push_back(key); return true; });
+        REQUIRE(all == std::vector<std::string>(expected.begin(), expected.end()));
+    }
+}
+
+TEST_CASE("Store and retrieve with an LSM tree", "[setKeyValue, getKeyValue, appendKeyValue, scanKeys]") {
+    // Story:-
+    //   [Who]   As a database user with more data than memory
+    //   [What]  I need a store which writes sequentially and keeps only recent writes in memory
+    //   [Value] So I can ingest fast and still read everything back after a restart
+    celebiext::LsmOptions options;
+    options.writeBufferSize = 16 << 10;
+    options.blockSize = 1 << 10;
+    options.targetFileSize = 32 << 10;
+    options.levelBaseBytes = 64 << 10;
+
+    SECTION("Flush, compact and reload") {
+        const std::string path = ".celebi/my-lsm-store";
+        const int keys = 5000;
+        {
+            celebiext::LsmKeyValueStore store(path, options);
+            for (int i = 0; i < keys; i++) {
+                std::string key = "key" + std::to_string(i);
+                store.setKeyValue(key, "old" + std::to_string(i));
+                store.appendKeyValue("set" + std::to_string(i % 10), key);
+            }
+            for (int i = 0; i < keys; i += 2)
+                store.setKeyValue("key" + std::to_string(i), "new" + std::to_string(i));
+            store.setKeyValue("set0", std::unordered_set<std::string>{ "reset" });
+            store.appendKeyValue("set0", "after");
+
+            store.compact();
+            auto levels = store.tablesPerLevel();
+            REQUIRE(levels[0] < static_cast<std::size_t>(options.level0CompactionTrigger));
+            REQUIRE(0 < levels[1]);
+            REQUIRE(1 < std::accumulate(levels.begin(), levels.end(), std::size_t(0)));
+
+            // the last writes stay in the log only
+            store.setKeyValue("key1", "latest");
+        }
+
+        celebiext::LsmKeyValueStore store(path, options);
+        REQUIRE("latest" == store.getKeyValue("key1"));
+        for (int i = 2; i < keys; i++) {
+            std::string value = (i % 2 ? "old" : "new") + std::to_string(i);
+            REQUIRE(value == store.getKeyValue("key" + std::to_string(i)));
+        }
+        REQUIRE("" == store.getKeyValue("missing"));
+        for (int i = 0; i < 1000; i++)
+            REQUIRE("" == store.getKeyValue("key" + std::to_string(i) + "x"));
+        REQUIRE(0 < store.filterStats().m_negatives);
+        REQUIRE(store.filterStats().falsePositiveRate() < 0.05);
+        REQUIRE(std::unordered_set<std::string>{ "reset", "after" } == *store.getKeyValueSet("set0"));
+        REQUIRE(keys / 10 == store.getKeyValueSet("set7")->size());
+
+        std::vector<std::string> scanned;
+        store.scanKeys("key10", "key11", false, [&scanned](const std::string &key) {
+            scanned.push_back(key);
+            return true;
+        });
+        REQUIRE(111 == scanned.size());
+        REQUIRE(std::is_sorted(scanned.begin(), scanned.end()));
+
+        std::vector<std::string> reversed;
+        store.scanKeys("key10", "key11", true, [&reversed](const std::string &key) {
+            reversed.push_back(key);
+            return true;
+        });
+        REQUIRE(std::equal(scanned.rbegin(), scanned.rend(), reversed.begin(), reversed.end()));
+
+        store.clear();
+        REQUIRE(!fs::exists(path));
+        store.setKeyValue("key1", "again");
+        REQUIRE("again" == store.getKeyValue("key1"));
+        store.clear();
+    }
+
+    SECTION("Reopen with a log already flushed") {
+        const std::string path = ".celebi/my-replayed-lsm-store";
+        {
+            celebiext::LsmKeyValueStore store(path, options);
+            for (int i = 0; i < 5; i++)
+                store.mergeKeyValue("counter", "1", celebi::MergeOperator::ADD);
+        }
+
+        // opening flushes the log into a table, a crash before the log is removed leaves both
+        std::vector<fs::path> logs;
+        for (auto &entry : fs::directory_iterator(path))
+            if (".log" == entry.path().extension())
+                logs.push_back(entry.path());
+        REQUIRE(1 == logs.size());
+        fs::copy_file(logs.front(), path + "/kept");
+        {
+            celebiext::LsmKeyValueStore store(path, options);
+            REQUIRE("5" == store.getKeyValue("counter"));
+        }
+        fs::rename(path + "/kept", logs.front());
+
+        celebiext::LsmKeyValueStore store(path, options);
+        REQUIRE("5" == store.getKeyValue("counter"));
+        REQUIRE(!fs::exists(logs.front()));
+        store.clear();
+    }
+
+    SECTION("Compact a level holding one oversized table") {
+        // each flushed table is over the level size alone, so it moves down and leaves its level empty
+        celebiext::LsmOptions small;
+        small.writeBufferSize = 4 << 10;
+        small.levelBaseBytes = 1 << 10;
+
+        const std::string path = ".celebi/my-oversized-lsm-store";
+        const std::string value(100, 'v');
+        celebiext::LsmKeyValueStore store(path, small);
+        for (int i = 0; i < 2000; i++)
+            store.setKeyValue("key" + std::to_string(i), value);
+
+        store.compact();
+        auto levels = store.tablesPerLevel();
+        REQUIRE(0 < std::accumulate(levels.begin() + 1, levels.end(), std::size_t(0)));
+        for (int i = 0; i < 2000; i++)
+            REQUIRE(value == store.getKeyValue("key" + std::to_string(i)));
+
+        store.clear();
+        REQUIRE(!fs::exists(path));
+    }
+
+    SECTION("Database on an LSM store") {
+        std::string dbname("my-lsm-db");
+        std::unique_ptr<celebiext::KeyValueStore> kvStore =
+                std::make_unique<celebiext::LsmKeyValueStore>(".celebi/" + dbname, options);
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname, kvStore));
+
+        std::string key = "simple string";
+        std::string value = "some highly valuable values";
+        db->setKeyValue(key, value);
+        REQUIRE(value == db->getKeyValue(key));
+
+        db->destroy();
+        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+    }
+}
+
+// Fails or dies while storing a key, as a full disk or a killed writer would
+class FailingFileStore : public celebiext::FileKeyValueStore {
+public:
+    FailingFileStore(const std::string &fullpath, bool die)
+        : celebiext::FileKeyValueStore(fullpath, 0), m_die(die)
+    {
+
+    }
+
+    using celebiext::FileKeyValueStore::setKeyValue;
+    virtual void setKeyValue(const std::string &key, const std::string &value) override
+    {
+        if ("poison" != key)
+            return celebiext::FileKeyValueStore::setKeyValue(key, value);
+        if (m_die)
+            ::_exit(0);
+
+        throw std::runtime_error("no space left on device");
+    }
+
+private:
+    const bool m_die;
+};
+
+TEST_CASE("Share a store with a failing writer", "[setKeyValue, getKeyValue]") {
+    // Story:-
+    //   [Who]   As a database user running reader processes beside a writer
+    //   [What]  I need a write which fails halfway to hold no reader up
+    //   [Value] So one bad commit can't hang every process sharing the store
+    const std::string path = ".celebi/my-failing-shared-store";
+    const std::string keydir = path + ".keydir";
+
+    SECTION("A write throws") {
+        std::unique_ptr<celebiext::KeyValueStore> failing = std::make_unique<FailingFileStore>(path, false);
+        celebiext::SharedKeyValueStore writer(failing, keydir, true);
+        std::unique_ptr<celebiext::KeyValueStore> files = std::make_unique<celebiext::FileKeyValueStore>(path, 0);
+        celebiext::SharedKeyValueStore reader(files, keydir, false);
+
+        writer.setKeyValue("key", "value");
+        REQUIRE_THROWS_AS(writer.setKeyValue("poison", "value"), std::runtime_error);
+        REQUIRE("" == reader.getKeyValue("poison"));
+        REQUIRE("value" == reader.getKeyValue("key"));
+
+        writer.setKeyValue("key", "again");
+        REQUIRE("again" == reader.getKeyValue("key"));
+        writer.clear();
+    }
+
+    SECTION("The writer dies mid commit") {
+        pid_t pid = ::fork();
+        REQUIRE(pid >= 0);
+        if (0 == pid) {
+            std::unique_ptr<celebiext::KeyValueStore> dying = std::make_unique<FailingFileStore>(path, true);
+            celebiext::SharedKeyValueStore writer(dying, keydir, true);
+            writer.setKeyValue("poison", "value");
+            ::_exit(1);
+        }
+
+        int status = 0;
+        ::waitpid(pid, &status, 0);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(0 == WEXITSTATUS(status));
+
+        // the next writer evens out what the dead one left odd
+        std::unique_ptr<celebiext::KeyValueStore> files = std::make_unique<celebiext::FileKeyValueStore>(path, 0);
+        celebiext::SharedKeyValueStore writer(files, keydir, true);
+        std::unique_ptr<celebiext::KeyValueStore> readerFiles = std::make_unique<celebiext::FileKeyValueStore>(path, 0);
+        celebiext::SharedKeyValueStore reader(readerFiles, keydir, false);
+        REQUIRE("" == reader.getKeyValue("poison"));
+
+        writer.setKeyValue("poison", "cured");
+        REQUIRE("cured" == reader.getKeyValue("poison"));
+        writer.clear();
+    }
+
+    SECTION("A corrupted keydir leaks no file") {
+        {
+            std::ofstream file(keydir, std::ios::trunc);
+            file << std::string(8192, 'x');
+        }
+        auto openFiles = []() {
+            return std::distance(fs::directory_iterator("/proc/self/fd"), fs::directory_iterator());
+        };
+
+        auto before = openFiles();
+        for (int i = 0; i < 10; i++) {
+            std::unique_ptr<celebiext::KeyValueStore> files = std::make_unique<celebiext::FileKeyValueStore>(path, 0);
+            REQUIRE_THROWS_AS(celebiext::SharedKeyValueStore(files, keydir, false), std::runtime_error);
+        }
+        REQUIRE(before == openFiles());
+        fs::remove_all(path);
+    }
+
+    fs::remove(keydir);
+}
+
+TEST_CASE("Answer misses without disk", "[getKeyValue, getKeyValueSet]") {
+    // Story:-
+    //   [Who]   As a database user probing for keys which are mostly not there
+    //   [What]  I need a miss to cost no file system call
+    //   [Value] So existence checks stay cheap however many keys are on disk
+    SECTION("File store bloom filter") {
+        const std::string path = ".celebi/my-filtered-store";
+        const int keys = 3000;
+        {
+            celebiext::FileKeyValueStore store(path, 10);
+            for (int i = 0; i < keys; i++) {
+                store.setKeyValue("key" + std::to_string(i), std::to_string(i));
+                if (0 == i % 100)
+                    store.appendKeyValue("set" + std::to_string(i), std::to_string(i));
+            }
+
+            auto before = store.filterStats();
+            for (int i = 0; i < 10000; i++)
+                REQUIRE("" == store.getKeyValue("missing" + std::to_string(i)));
+            REQUIRE(store.getKeyValueSet("missing")->empty());
+
+            auto stats = store.filterStats();
+            REQUIRE(10 == stats.m_bitsPerKey);
+            REQUIRE(keys <= stats.m_keys);
+            REQUIRE(10001 == stats.m_negatives + stats.m_falsePositives -
+                    before.m_negatives - before.m_falsePositives);
+            REQUIRE(stats.falsePositiveRate() < 0.05);
+            REQUIRE(stats.m_expectedFalsePositiveRate < 0.05);
+        }
+
+        // the filter is saved on close and taken back on open
+        REQUIRE(fs::exists(path + "/filter.bloom"));
+        celebiext::FileKeyValueStore store(path, 10);
+        REQUIRE(!fs::exists(path + "/filter.bloom"));
+        for (int i = 0; i < keys; i++)
+            REQUIRE(std::to_string(i) == store.getKeyValue("key" + std::to_string(i)));
+        REQUIRE(1 == store.getKeyValueSet("set100")->size());
+        REQUIRE(0 == store.filterStats().m_negatives);
+
+        store.clear();
+        REQUIRE(!fs::exists(path));
+    }
+
+    SECTION("File store without a filter") {
+        const std::string path = ".celebi/my-unfiltered-store";
+        celebiext::FileKeyValueStore store(path, 0);
+        store.setKeyValue("key", "value");
+        REQUIRE("value" == store.getKeyValue("key"));
+        REQUIRE("" == store.getKeyValue("missing"));
+        REQUIRE(0 == store.filterStats().m_bits);
+        REQUIRE(0 == store.filterStats().m_negatives);
+
+        store.clear();
+        REQUIRE(!fs::exists(path));
+    }
+}
+
+TEST_CASE("Store and retrieve with a copy-on-write B+tree", "[setKeyValue, getKeyValue, appendKeyValue, scanKeys]") {
+    // Story:-
+    //   [Who]   As a developer of a read-mostly service
+    //   [What]  I need reads straight from a mapped file which never wait for the writer
+    //   [Value] So lookups cost no copies and no locks, and a crash needs no recovery
+    celebiext::BTreeOptions options;
+    options.mapSize = 1 << 20;
+    options.sync = false;
+
+    SECTION("Split, reuse pages and reopen") {
+        const std::string path = ".celebi/my-btree-store";
+        const int keys = 5000;
+        std::set<std::string> expected;
+        {
+            celebiext::BTreeKeyValueStore store(path, options);
+            for (int i = 0; i < keys; i++) {
+                std::string key = "key" + std::to_string(i);
+                store.setKeyValue(key, "old" + std::to_string(i));
+                store.appendKeyValue("set" + std::to_string(i % 10), key);
+                expected.insert(key);
+            }
+            for (int i = 0; i < keys; i += 2)
+                store.setKeyValue("key" + std::to_string(i), "new" + std::to_string(i));
+            for (int i = 0; i < 10; i++)
+                expected.insert("set" + std::to_string(i));
+
+            // large values go to overflow pages, keys may hold any byte
+            store.setKeyValue("big", std::string(100000, 'b'));
+            store.setKeyValue(std::string("zero\0key", 8), "zero");
+            store.setKeyValue("set0", std::unordered_set<std::string>{ "reset" });
+            store.setKeyValue("empty", std::unordered_set<std::string>());
+            expected.insert({ "big", std::string("zero\0key", 8), "empty" });
+
+            // freed pages are reused once no reader can see them
+            std::uint64_t size = store.fileSize();
+            for (int round = 0; round < 20; round++) {
+                store.setKeyValue("big", std::string(100000, 'a' + round));
+                celebiext::Epoch::collect();
+                celebiext::Epoch::collect();
+            }
+            REQUIRE(store.fileSize() < size + 4 * 100000);
+        }
+
+        celebiext::BTreeKeyValueStore store(path, options);
+        for (int i = 0; i < keys; i++) {
+            std::string value = (i % 2 ? "old" : "new") + std::to_string(i);
+            REQUIRE(value == store.getKeyValue("key" + std::to_string(i)));
+        }
+        REQUIRE(std::string(100000, 'a' + 19) == store.getKeyValue("big"));
+        REQUIRE("zero" == store.getKeyValue(std::string("zero\0key", 8)));
+        REQUIRE("" == store.getKeyValue("missing"));
+        REQUIRE(std::unordered_set<std::string>{ "reset" } == *store.getKeyValueSet("set0"));
+        REQUIRE(keys / 10 == store.getKeyValueSet("set7")->size());
+        REQUIRE(store.getKeyValueSet("empty")->empty());
+
+        std::vector<std::string> scanned;
+        store.scanKeys("", "", false, [&scanned](const std::string &key) {
+            scanned.push_back(key);
+            return true;
+        });
+        REQUIRE(scanned == std::vector<std::string>(expected.begin(), expected.end()));
+
+        std::vector<std::string> reversed;
+        store.scanKeys("key10", "key11", true, [&reversed](const std::string &key) {
+            reversed.push_back(key);
+            return true;
+        });
+        std::vector<std::string> range(expected.lower_bound("key10"), expected.lower_bound("key11"));
+        REQUIRE(std::equal(range.rbegin(), range.rend(), reversed.begin(), reversed.end()));
+
+        store.clear();
+        REQUIRE(!fs::exists(path));
+        store.setKeyValue("key1", "again");
+        REQUIRE("again" == store.getKeyValue("key1"));
+        store.clear();
+    }
+
+    SECTION("Torn commit falls back to the previous version") {
+        const std::string path = ".celebi/my-torn-btree-store";
+        {
+            celebiext::BTreeKeyValueStore store(path, options);
+            store.setKeyValue("key", "first");
+            store.setKeyValue("key", "second");
+        }
+        {
+            // the second commit wrote meta page 1 of the file
+            std::fstream file(path + "/data.btree", std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(4096 + 20);
+            file.put('\x7f');
+        }
+
+        celebiext::BTreeKeyValueStore store(path, options);
+        REQUIRE("first" == store.getKeyValue("key"));
+        store.clear();
+    }
+
+    SECTION("Free pages are saved and reused after a reopen") {
+        const std::string path = ".celebi/my-free-btree-store";
+        std::uint64_t size = 0;
+        {
+            celebiext::BTreeKeyValueStore store(path, options);
+            for (int i = 0; i < 100; i++)
+                store.setKeyValue("key" + std::to_string(i), std::string(1000, 'k'));
+            store.setKeyValue("big", std::string(100000, 'a'));
+            store.setKeyValue("big", "small");
+            size = store.fileSize();
+        }
+
+        // every reopen hands out the pages the old value left, the file doesn't grow
+        for (int round = 0; round < 5; round++) {
+            celebiext::BTreeKeyValueStore store(path, options);
+            REQUIRE("small" == store.getKeyValue("big"));
+            store.setKeyValue("big", std::string(100000, 'b' + round));
+            store.setKeyValue("big", "small");
+            REQUIRE(size == store.fileSize());
+        }
+
+        celebiext::BTreeKeyValueStore store(path, options);
+        for (int i = 0; i < 100; i++)
+            REQUIRE(std::string(1000, 'k') == store.getKeyValue("key" + std::to_string(i)));
+        store.clear();
+    }
+
+    SECTION("Readers never wait for the writer") {
+        const std::string path = ".celebi/my-concurrent-btree-store";
+        celebiext::BTreeKeyValueStore store(path, options);
+        const int keys = 2000;
+        for (int i = 0; i < keys; i++)
+            store.setKeyValue("key" + std::to_string(i), "0");
+
+        std::atomic<bool> done(false), torn(false), unordered(false);
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; t++) {
+            readers.emplace_back([&]() {
+                while (!done) {
+                    for (int i = 0; i < keys; i += 97)
+                        if (store.getKeyValue("key" + std::to_string(i)).empty())
+                            torn = true;
+                    std::string last;
+                    store.scanKeys("key1", "key2", false, [&last, &unordered](const std::string &key) {
+                        if (key <= last)
+                            unordered = true;
+                        last = key;
+                        return true;
+                    });
+                }
+            });
+        }
+        for (int round = 1; round <= 3; round++)
+            for (int i = 0; i < keys; i++)
+                store.setKeyValue("key" + std::to_string(i), std::to_string(round));
+        done = true;
+        for (auto &reader : readers)
+            reader.join();
+
+        REQUIRE(!torn);
+        REQUIRE(!unordered);
+        REQUIRE("3" == store.getKeyValue("key1999"));
+        store.clear();
+    }
+
+    SECTION("Database on a B+tree store") {
+        std::string dbname("my-btree-db");
+        std::unique_ptr<celebiext::KeyValueStore> kvStore =
+                std::make_unique<celebiext::BTreeKeyValueStore>(".celebi/" + dbname, options);
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname, kvStore));
+
+        std::string key = "simple string";
+        std::string value = "some highly valuable values";
+        db->setKeyValue(key, value, "bucket1");
+        REQUIRE(value == db->getKeyValue(key));
+
+        db->destroy();
+        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+    }
+}
+
+TEST_CASE("Read a snapshot while writers carry on", "[snapshot]") {
+    // Story:-
+    //   [Who]   As an analytics developer reading many keys in one report
+    //   [What]  I need every read of the report to see the store at the same moment
+    //   [Value] So totals add up while the service keeps writing, without copying the store
+    auto readAll = [](celebi::KeyValueSnapshot &snapshot, const std::string &from, const std::string &to) {
+        std::vector<std::string> keys;
+        snapshot.scanKeys(from, to, false, [&keys](const std::string &key) {
+            keys.push_back(key);
+            return true;
+        });
+        return keys;
+    };
+
+    SECTION("Memory store versions") {
+        for (auto concurrency : { celebiext::Concurrency::NONE, celebiext::Concurrency::SHARDED,
+                                  celebiext::Concurrency::LOCK_FREE_READ }) {
+            celebiext::MemoryKeyValueStore store(concurrency);
+            store.setKeyValue("a", "1");
+            store.setKeyValue("b", std::unordered_set<std::string>{ "x" });
+
+            auto first = store.snapshot();
+            store.setKeyValue("a", "2");
+            store.appendKeyValue("b", "y");
+            store.setKeyValue("c", "new");
+            auto second = store.snapshot();
+            store.setKeyValue("a", "3");
+            REQUIRE(first->sequence() < second->sequence());
+
+            REQUIRE("1" == first->getKeyValue("a"));
+            REQUIRE("2" == second->getKeyValue("a"));
+            REQUIRE("3" == store.getKeyValue("a"));
+            REQUIRE(std::unordered_set<std::string>{ "x" } == *first->getKeyValueSet("b"));
+            REQUIRE(std::unordered_set<std::string>{ "x", "y" } == *second->getKeyValueSet("b"));
+            REQUIRE("" == first->getKeyValue("c"));
+            REQUIRE((std::vector<std::string>{ "a", "b" }) == readAll(*first, "", ""));
+            REQUIRE((std::vector<std::string>{ "a", "b", "c" }) == readAll(*second, "", ""));
+            REQUIRE(0 < store.oldVersions());
+
+            // versions only the first snapshot saw go with it, the rest wait for the second
+            first.reset();
+            REQUIRE("2" == second->getKeyValue("a"));
+            REQUIRE(0 < store.oldVersions());
+            second.reset();
+            REQUIRE(0 == store.oldVersions());
+            store.setKeyValue("a", "4");
+            REQUIRE(0 == store.oldVersions());
+        }
+    }
+
+    SECTION("Writers never disturb a snapshot") {
+        celebiext::MemoryKeyValueStore store(celebiext::Concurrency::LOCK_FREE_READ);
+        const int keys = 100;
+        for (int i = 0; i < keys; i++)
+            store.setKeyValue("key" + std::to_string(i), "0");
+
+        std::atomic<bool> done(false);
+        std::thread writer([&store, &done]() {
+            for (int round = 1; !done; round++)
+                for (int i = 0; i < keys; i++)
+                    store.setKeyValue("key" + std::to_string(i), std::to_string(round));
+        });
+
+        // every key of a snapshot is in the same round, or one round behind the key before it
+        bool consistent = true;
+        for (int n = 0; n < 50; n++) {
+            auto snapshot = store.snapshot();
+            int previous = std::stoi(snapshot->getKeyValue("key0"));
+            for (int i = 1; i < keys; i++) {
+                int round = std::stoi(snapshot->getKeyValue("key" + std::to_string(i)));
+                consistent = consistent && (round == previous || round + 1 == previous);
+                previous = round;
+            }
+            consistent = consistent && snapshot->getKeyValue("key7") == snapshot->getKeyValue("key7");
+        }
+        done = true;
+        writer.join();
+        REQUIRE(consistent);
+        REQUIRE(0 == store.oldVersions());
+    }
+
+    SECTION("Cold keys of a cached file store") {
+        const std::string path = ".celebi/my-snapshot-store";
+        {
+            celebiext::FileKeyValueStore files(path);
+            files.setKeyValue("cold", "on disk");
+            files.setKeyValue("cold set", std::unordered_set<std::string>{ "m" });
+            REQUIRE_THROWS_AS(files.snapshot(), std::runtime_error);
+        }
+
+        std::unique_ptr<celebiext::KeyValueStore> files = std::make_unique<celebiext::FileKeyValueStore>(path);
+        celebiext::MemoryKeyValueStore store(files, celebiext::Concurrency::SHARDED);
+        auto snapshot = store.snapshot();
+        store.setKeyValue("cold", "rewritten");
+        store.appendKeyValue("cold set", "n");
+
+        REQUIRE("on disk" == snapshot->getKeyValue("cold"));
+        REQUIRE(std::unordered_set<std::string>{ "m" } == *snapshot->getKeyValueSet("cold set"));
+        REQUIRE("rewritten" == store.getKeyValue("cold"));
+        REQUIRE((std::vector<std::string>{ "cold", "cold set" }) == readAll(*snapshot, "", ""));
+        snapshot.reset();
+        store.clear();
+    }
+
+    SECTION("LSM tree and B+tree") {
+        celebiext::LsmOptions lsmOptions;
+        lsmOptions.writeBufferSize = 16 << 10;
+        celebiext::BTreeOptions btreeOptions;
+        btreeOptions.mapSize = 1 << 20;
+        btreeOptions.sync = false;
+
+        std::vector<std::unique_ptr<celebiext::KeyValueStore>> stores;
+        stores.push_back(std::make_unique<celebiext::LsmKeyValueStore>(".celebi/my-lsm-snapshot", lsmOptions));
+        stores.push_back(std::make_unique<celebiext::BTreeKeyValueStore>(".celebi/my-btree-snapshot", btreeOptions));
+        for (auto &store : stores) {
+            const int keys = 2000;
+            for (int i = 0; i < keys; i++)
+                store->setKeyValue("key" + std::to_string(i), "old");
+            store->appendKeyValue("set", "a");
+
+            auto snapshot = store->snapshot();
+            // enough rewrites to flush and compact the LSM tree and reuse B+tree pages
+            for (int round = 0; round < 3; round++)
+                for (int i = 0; i < keys; i++)
+                    store->setKeyValue("key" + std::to_string(i), "new" + std::to_string(round));
+            store->appendKeyValue("set", "b");
+            store->setKeyValue("later", "x");
+            if (auto *lsm = dynamic_cast<celebiext::LsmKeyValueStore *>(store.get()))
+                lsm->compact();
+
+            for (int i = 0; i < keys; i++)
+                REQUIRE("old" == snapshot->getKeyValue("key" + std::to_string(i)));
+            REQUIRE(std::unordered_set<std::string>{ "a" } == *snapshot->getKeyValueSet("set"));
+            REQUIRE("" == snapshot->getKeyValue("later"));
+            REQUIRE(keys + 1 == readAll(*snapshot, "", "").size());
+            REQUIRE("new2" == store->getKeyValue("key0"));
+            REQUIRE(std::unordered_set<std::string>{ "a", "b" } == *store->getKeyValueSet("set"));
+
+            snapshot.reset();
+            store->clear();
+        }
+    }
+}
+
+TEST_CASE("Read-modify-write in transactions", "[transaction]") {
+    // Story:-
+    //   [Who]   As a developer keeping balances and their bucket memberships together
+    //   [What]  I need several reads and writes to apply as one, or not at all
+    //   [Value] So concurrent updates never lose each other or leave keys half moved
+    std::string dbname("my-transaction-db");
+    std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+
+    SECTION("Own writes and conflicts") {
+        db->setKeyValue("alice", "10");
+        db->setKeyValue("bob", "5");
+
+        auto txn = db->begin();
+        int alice = std::stoi(txn->getKeyValue("alice"));
+        int bob = std::stoi(txn->getKeyValue("bob"));
+        txn->setKeyValue("alice", std::to_string(alice - 3), "accounts");
+        txn->setKeyValue("bob", std::to_string(bob + 3), "accounts");
+        REQUIRE("7" == txn->getKeyValue("alice"));
+        celebi::BucketQuery accounts("accounts");
+        REQUIRE(2 == txn->query(accounts)->recordKeys()->size());
+        REQUIRE(0 == db->query(accounts)->recordKeys()->size());
+        REQUIRE(txn->commit());
+        REQUIRE("7" == db->getKeyValue("alice"));
+        REQUIRE("8" == db->getKeyValue("bob"));
+        REQUIRE(2 == db->query(accounts)->recordKeys()->size());
+        REQUIRE_THROWS_AS(txn->commit(), std::runtime_error);
+
+        // a write between the read and the commit fails the commit, which writes nothing
+        auto stale = db->begin();
+        stale->getKeyValue("alice");
+        stale->setKeyValue("bob", "0");
+        db->setKeyValue("alice", "100");
+        REQUIRE(!stale->commit());
+        REQUIRE("8" == db->getKeyValue("bob"));
+
+        // each reads what the other writes, only the first to commit wins
+        auto first = db->begin();
+        auto second = db->begin();
+        first->setKeyValue("bob", first->getKeyValue("alice"));
+        second->setKeyValue("alice", second->getKeyValue("bob"));
+        REQUIRE(first->commit());
+        REQUIRE(!second->commit());
+        REQUIRE("100" == db->getKeyValue("bob"));
+        REQUIRE("100" == db->getKeyValue("alice"));
+    }
+
+    SECTION("Counters from many threads") {
+        const int threads = 8, perThread = 100;
+        std::atomic<int> failed(0);
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&db, &failed, t]() {
+                for (int i = 0; i < perThread; i++) {
+                    bool committed = db->transact([t](celebi::ITransaction &txn) {
+                        std::string total = txn.getKeyValue("total");
+                        txn.setKeyValue("total", std::to_string(total.empty() ? 1 : std::stoi(total) + 1));
+                        std::string own = "counter" + std::to_string(t);
+                        std::string count = txn.getKeyValue(own);
+                        txn.setKeyValue(own, std::to_string(count.empty() ? 1 : std::stoi(count) + 1),
+                                        "counters");
+                    }, 1000);
+                    if (!committed)
+                        failed++;
+                }
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+
+        REQUIRE(0 == failed);
+        REQUIRE(std::to_string(threads * perThread) == db->getKeyValue("total"));
+        for (int t = 0; t < threads; t++)
+            REQUIRE(std::to_string(perThread) == db->getKeyValue("counter" + std::to_string(t)));
+        celebi::BucketQuery counters("counters");
+        REQUIRE(threads == db->query(counters)->recordKeys()->size());
+    }
+
+    db->destroy();
+}
+
+TEST_CASE("Delete keys and bucket memberships", "[deleteKey, removeFromBucket]") {
+    // Story:-
+    //   [Who]   As a database user whose records expire or move between buckets
+    //   [What]  I need to delete keys and take them out of buckets without rewriting the store
+    //   [Value] So deleted records never show up in reads, scans or bucket queries again
+    auto scanAll = [](celebiext::KeyValueStore &store) {
+        std::vector<std::string> keys;
+        store.scanKeys("", "", false, [&keys](const std::string &key) {
+            keys.push_back(key);
+            return true;
+        });
+        return keys;
+    };
+
+    SECTION("Every store forgets deleted keys") {
+        celebiext::LsmOptions lsmOptions;
+        lsmOptions.writeBufferSize = 16 << 10;
+        celebiext::BTreeOptions btreeOptions;
+        btreeOptions.mapSize = 1 << 20;
+        btreeOptions.sync = false;
+
+        std::unique_ptr<celebiext::KeyValueStore> files =
+                std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-delete-cached");
+        std::vector<std::unique_ptr<celebiext::KeyValueStore>> stores;
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>());
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>(files, celebiext::Concurrency::LOCK_FREE_READ));
+        stores.push_back(std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-delete-files"));
+        stores.push_back(std::make_unique<celebiext::LsmKeyValueStore>(".celebi/my-delete-lsm", lsmOptions));
+        stores.push_back(std::make_unique<celebiext::BTreeKeyValueStore>(".celebi/my-delete-btree", btreeOptions));
+        for (auto &store : stores) {
+            store->setKeyValue("a", "1");
+            store->setKeyValue("b", std::unordered_set<std::string>{ "x", "y" });
+            store->setKeyValue("c", "3");
+            store->appendKeyValue("c", "member");
+
+            store->deleteKeyValue("a");
+            store->deleteKeyValue("c");
+            store->removeKeyValue("b", "x");
+            store->removeKeyValue("b", "missing");
+            REQUIRE("" == store->getKeyValue("a"));
+            REQUIRE("" == store->getKeyValue("c"));
+            REQUIRE(store->getKeyValueSet("c")->empty());
+            REQUIRE(std::unordered_set<std::string>{ "y" } == *store->getKeyValueSet("b"));
+            REQUIRE((std::vector<std::string>{ "b" }) == scanAll(*store));
+
+            store->setKeyValue("a", "again");
+            REQUIRE("again" == store->getKeyValue("a"));
+            REQUIRE((std::vector<std::string>{ "a", "b" }) == scanAll(*store));
+            store->clear();
+        }
+    }
+
+    SECTION("LSM tombstones survive flushes and compactions") {
+        celebiext::LsmOptions options;
+        options.writeBufferSize = 16 << 10;
+        options.targetFileSize = 32 << 10;
+        options.levelBaseBytes = 64 << 10;
+        const std::string path = ".celebi/my-delete-lsm";
+        const int keys = 3000;
+        {
+            celebiext::LsmKeyValueStore store(path, options);
+            for (int i = 0; i < keys; i++) {
+                store.setKeyValue("key" + std::to_string(i), "value");
+                store.appendKeyValue("set", std::to_string(i));
+            }
+            store.compact();
+            for (int i = 0; i < keys; i += 2) {
+                store.deleteKeyValue("key" + std::to_string(i));
+                store.removeKeyValue("set", std::to_string(i));
+            }
+            store.compact();
+        }
+
+        celebiext::LsmKeyValueStore store(path, options);
+        for (int i = 0; i < keys; i++)
+            REQUIRE((i % 2 ? "value" : "") == store.getKeyValue("key" + std::to_string(i)));
+        REQUIRE(keys / 2 == store.getKeyValueSet("set")->size());
+        REQUIRE(!store.getKeyValueSet("set")->count("0"));
+        REQUIRE(keys / 2 + 1 == scanAll(store).size());
+        store.clear();
+    }
+
+    SECTION("Snapshots still see deleted keys") {
+        for (auto concurrency : { celebiext::Concurrency::NONE, celebiext::Concurrency::SHARDED,
+                                  celebiext::Concurrency::LOCK_FREE_READ }) {
+            std::unique_ptr<celebiext::KeyValueStore> files =
+                    std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-delete-snapshot");
+            files->setKeyValue("cold", "on disk");
+            celebiext::MemoryKeyValueStore store(files, concurrency);
+            store.setKeyValue("a", "1");
+            store.setKeyValue("b", std::unordered_set<std::string>{ "x", "y" });
+
+            auto snapshot = store.snapshot();
+            store.deleteKeyValue("a");
+            store.deleteKeyValue("cold");
+            store.removeKeyValue("b", "x");
+            REQUIRE("" == store.getKeyValue("a"));
+            REQUIRE("" == store.getKeyValue("cold"));
+            REQUIRE((std::vector<std::string>{ "b" }) == scanAll(store));
+            REQUIRE("1" == snapshot->getKeyValue("a"));
+            REQUIRE("on disk" == snapshot->getKeyValue("cold"));
+            REQUIRE(std::unordered_set<std::string>{ "x", "y" } == *snapshot->getKeyValueSet("b"));
+
+            std::vector<std::string> seen;
+            snapshot->scanKeys("", "", false, [&seen](const std::string &key) {
+                seen.push_back(key);
+                return true;
+            });
+            REQUIRE((std::vector<std::string>{ "a", "b", "cold" }) == seen);
+            seen.clear();
+            snapshot->scanKeys("", "", true, [&seen](const std::string &key) {
+                seen.push_back(key);
+                return true;
+            });
+            REQUIRE((std::vector<std::string>{ "cold", "b", "a" }) == seen);
+
+            store.setKeyValue("a", "2");
+            REQUIRE("1" == snapshot->getKeyValue("a"));
+            REQUIRE("2" == store.getKeyValue("a"));
+
+            // tombstones go with the last snapshot which needed them
+            snapshot.reset();
+            REQUIRE(0 == store.oldVersions());
+            REQUIRE((std::vector<std::string>{ "a", "b" }) == scanAll(store));
+            store.clear();
+        }
+    }
+
+    SECTION("Deleting a key leaves every bucket") {
+        std::string dbname("my-delete-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        db->setKeyValue("alice", "1", "users");
+        db->setKeyValue("alice", "1", "admins");
+        db->setKeyValue("bob", "2", "users");
+        celebi::BucketQuery users("users");
+        celebi::BucketQuery admins("admins");
+
+        db->deleteKey("alice");
+        REQUIRE("" == db->getKeyValue("alice"));
+        REQUIRE(std::unordered_set<std::string>{ "bob" } == *db->query(users)->recordKeys());
+        REQUIRE(db->query(admins)->recordKeys()->empty());
+
+        // a key taken out of a bucket keeps its value
+        db->removeFromBucket("bob", "users");
+        REQUIRE(db->query(users)->recordKeys()->empty());
+        REQUIRE("2" == db->getKeyValue("bob"));
+        db->deleteKey("bob");
+        REQUIRE("" == db->getKeyValue("bob"));
+
+        db->destroy();
+    }
+}
+
+TEST_CASE("Expire keys after their time to live", "[setKeyValue, expiredKeys]") {
+    // Story:-
+    //   [Who]   As a database user caching sessions and other short-lived records
+    //   [What]  I need keys to go away by themselves once their time to live has passed
+    //   [Value] So stale records never need a sweep of my own and never show up in buckets
+    auto waitForExpired = [](celebi::IDatabase &db, std::uint64_t expired) {
+        for (int i = 0; i < 500 && db.expiredKeys() < expired; i++)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return db.expiredKeys();
+    };
+
+    SECTION("Timing wheel cascades far deadlines") {
+        celebiext::TimingWheel wheel(0, 10);
+        const std::vector<std::uint64_t> deadlines{ 5, 2000, 2560, 700000, 100000000, 95 };
+        for (std::size_t i = 0; i < deadlines.size(); i++)
+            wheel.schedule(std::to_string(i), deadlines[i]);
+        REQUIRE(deadlines.size() == wheel.size());
+
+        std::vector<std::uint64_t> fired;
+        for (std::uint64_t now = 0; now <= 100000010; now += 5) {
+            wheel.advance(now, [&fired, now](const std::string &key, std::uint64_t deadline) {
+                REQUIRE(deadline <= now);
+                REQUIRE(now < deadline + 10);
+                fired.push_back(std::stoull(key));
+            });
+            if (now == 800000)
+                now = 99990000;     // nothing is due in between
+        }
+        REQUIRE((std::vector<std::uint64_t>{ 0, 5, 1, 2, 3, 4 }) == fired);
+        REQUIRE(0 == wheel.size());
+    }
+
+    SECTION("Lazy and active expiry") {
+        std::string dbname("my-ttl-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        celebi::BucketQuery sessions("sessions");
+
+        // 1. A read past the deadline finds the key unset and removes it
+        db->setKeyValue("lazy", "1", "sessions", std::chrono::milliseconds(0));
+        REQUIRE("" == db->getKeyValue("lazy"));
+        REQUIRE(1 == db->expiredKeys());
+
+        // 2. Keys nobody reads go by themselves, out of their buckets too
+        db->setKeyValue("active", std::unordered_set<std::string>{ "x" }, "sessions",
+                        std::chrono::milliseconds(30));
+        db->setKeyValue("kept", "3", "sessions", std::chrono::hours(1));
+        db->setKeyValue("renewed", "4", std::chrono::milliseconds(30));
+        db->setKeyValue("renewed", "4");
+        REQUIRE(2 == waitForExpired(*db, 2));
+        REQUIRE(std::unordered_set<std::string>{ "kept" } == *db->query(sessions)->recordKeys());
+        REQUIRE(db->getKeyValueSet("active")->empty());
+        REQUIRE("4" == db->getKeyValue("renewed"));
+
+        // 3. Deleting a key drops its deadline
+        db->deleteKey("kept");
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        REQUIRE(2 == db->expiredKeys());
+
+        db->destroy();
+    }
+
+    SECTION("Deadlines survive a reopen") {
+        std::string dbname("my-ttl-reopen-db");
+        {
+            std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+            db->setKeyValue("soon", "1", std::chrono::milliseconds(100));
+            db->setKeyValue("later", "2", std::chrono::hours(1));
+        }
+
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::loadDB(dbname));
+        REQUIRE(1 == waitForExpired(*db, 1));
+        REQUIRE("" == db->getKeyValue("soon"));
+        REQUIRE("2" == db->getKeyValue("later"));
+
+        db->destroy();
+    }
+}
+
+TEST_CASE("Merge values without reading them", "[incrementKeyValue, appendToKeyValue, mergeKeyValueSet]") {
+    // Story:-
+    //   [Who]   As a database user keeping counters, logs and tag sets
+    //   [What]  I need to add to a value in one atomic step instead of reading and writing it
+    //   [Value] So concurrent writers never lose each other's updates and pay one round-trip
+    SECTION("Every store folds merges") {
+        celebiext::LsmOptions lsmOptions;
+        lsmOptions.writeBufferSize = 16 << 10;
+        celebiext::BTreeOptions btreeOptions;
+        btreeOptions.mapSize = 1 << 20;
+        btreeOptions.sync = false;
+
+        std::unique_ptr<celebiext::KeyValueStore> files =
+                std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-merge-cached");
+        std::vector<std::unique_ptr<celebiext::KeyValueStore>> stores;
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>());
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>(files, celebiext::Concurrency::SHARDED));
+        stores.push_back(std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-merge-files"));
+        stores.push_back(std::make_unique<celebiext::LsmKeyValueStore>(".celebi/my-merge-lsm", lsmOptions));
+        stores.push_back(std::make_unique<celebiext::BTreeKeyValueStore>(".celebi/my-merge-btree", btreeOptions));
+        for (auto &store : stores) {
+            store->mergeKeyValue("counter", "5", celebi::MergeOperator::ADD);
+            store->mergeKeyValue("counter", "-7", celebi::MergeOperator::ADD);
+            store->setKeyValue("log", "a");
+            store->mergeKeyValue("log", "b", celebi::MergeOperator::APPEND);
+            store->mergeKeyValue("log", "c", celebi::MergeOperator::APPEND);
+            store->setKeyValue("word", "not a number");
+            store->mergeKeyValue("word", "3", celebi::MergeOperator::ADD);
+            store->appendKeyValue("tags", "x");
+            store->mergeKeyValue("tags", std::unordered_set<std::string>{ "x", "y", "z" });
+
+            REQUIRE("-2" == store->getKeyValue("counter"));
+            REQUIRE("abc" == store->getKeyValue("log"));
+            REQUIRE("3" == store->getKeyValue("word"));
+            REQUIRE(std::unordered_set<std::string>{ "x", "y", "z" } == *store->getKeyValueSet("tags"));
+
+            // a delete leaves nothing for later merges to add to
+            store->deleteKeyValue("counter");
+            store->mergeKeyValue("counter", "1", celebi::MergeOperator::ADD);
+            REQUIRE("1" == store->getKeyValue("counter"));
+            store->clear();
+        }
+    }
+
+    SECTION("LSM folds merges in flushes and compactions") {
+        celebiext::LsmOptions options;
+        options.writeBufferSize = 16 << 10;
+        options.targetFileSize = 32 << 10;
+        options.levelBaseBytes = 64 << 10;
+        const std::string path = ".celebi/my-merge-lsm";
+        const int rounds = 2000;
+        {
+            celebiext::LsmKeyValueStore store(path, options);
+            store.setKeyValue("log", ">");
+            for (int i = 0; i < rounds; i++) {
+                store.mergeKeyValue("counter" + std::to_string(i % 10), "1", celebi::MergeOperator::ADD);
+                store.mergeKeyValue("log", i % 2 ? "b" : "a", celebi::MergeOperator::APPEND);
+                store.setKeyValue("filler" + std::to_string(i), std::string(64, 'f'));
+                if (500 == i)
+                    store.compact();
+            }
+            REQUIRE(std::to_string(rounds / 10) == store.getKeyValue("counter3"));
+        }
+
+        celebiext::LsmKeyValueStore store(path, options);
+        store.compact();
+        std::string log = ">";
+        for (int i = 0; i < rounds; i++)
+            log += i % 2 ? "b" : "a";
+        REQUIRE(log == store.getKeyValue("log"));
+        for (int i = 0; i < 10; i++)
+            REQUIRE(std::to_string(rounds / 10) == store.getKeyValue("counter" + std::to_string(i)));
+        store.clear();
+    }
+
+    SECTION("Counters from many threads") {
+        std::string dbname("my-merge-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        const int threads = 8;
+        const int increments = 500;
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&db, t]() {
+                for (int i = 0; i < increments; i++) {
+                    db->incrementKeyValue("hits");
+                    db->decrementKeyValue("stock", 2);
+                    db->mergeKeyValueSet("workers", { std::to_string(t) });
+                }
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+
+        REQUIRE(std::to_string(threads * increments) == db->getKeyValue("hits"));
+        REQUIRE(std::to_string(-2 * threads * increments) == db->getKeyValue("stock"));
+        REQUIRE(threads == db->getKeyValueSet("workers")->size());
+        db->appendToKeyValue("hits", "!");
+        REQUIRE(std::to_string(threads * increments) + "!" == db->getKeyValue("hits"));
+
+        db->destroy();
+    }
+}
+
+TEST_CASE("Write only if nothing changed", "[compareAndSet, setIfAbsent, setKeyValueIfVersion]") {
+    // Story:-
+    //   [Who]   As a database user electing leaders and applying updates exactly once
+    //   [What]  I need writes which only happen if the value is still the one I expect
+    //   [Value] So I need no lock service and no read before every contended write
+    SECTION("Every store compares and sets") {
+        celebiext::LsmOptions lsmOptions;
+        lsmOptions.writeBufferSize = 16 << 10;
+        celebiext::BTreeOptions btreeOptions;
+        btreeOptions.mapSize = 1 << 20;
+        btreeOptions.sync = false;
+
+        std::unique_ptr<celebiext::KeyValueStore> files =
+                std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-cas-cached");
+        files->setKeyValue("cold", "on disk");
+        std::vector<std::unique_ptr<celebiext::KeyValueStore>> stores;
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>());
+        stores.push_back(std::make_unique<celebiext::MemoryKeyValueStore>(files, celebiext::Concurrency::SHARDED));
+        stores.push_back(std::make_unique<celebiext::FileKeyValueStore>(".celebi/my-cas-files"));
+        stores.push_back(std::make_unique<celebiext::LsmKeyValueStore>(".celebi/my-cas-lsm", lsmOptions));
+        stores.push_back(std::make_unique<celebiext::BTreeKeyValueStore>(".celebi/my-cas-btree", btreeOptions));
+        // the cached store finds it on disk only
+        for (std::size_t i = 0; i < stores.size(); i++)
+            if (1 != i)
+                stores[i]->setKeyValue("cold", "on disk");
+
+        for (auto &store : stores) {
+            REQUIRE(store->compareAndSetKeyValue("leader", "", "a"));
+            REQUIRE_FALSE(store->compareAndSetKeyValue("leader", "", "b"));
+            REQUIRE_FALSE(store->compareAndSetKeyValue("leader", "b", "c"));
+            REQUIRE(store->compareAndSetKeyValue("leader", "a", "d"));
+            REQUIRE("d" == store->getKeyValue("leader"));
+
+            REQUIRE(store->compareAndSetKeyValue("cold", "on disk", "warm"));
+            REQUIRE("warm" == store->getKeyValue("cold"));
+            store->clear();
+        }
+    }
+
+    SECTION("One leader among many threads") {
+        std::string dbname("my-cas-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        const int threads = 8;
+        const int increments = 200;
+        std::atomic<int> leaders{0};
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&db, &leaders, t]() {
+                if (db->setIfAbsent("leader", std::to_string(t)))
+                    leaders++;
+
+                // read-modify-write loops, with values and with versions
+                for (int i = 0; i < increments; i++) {
+                    for (;;) {
+                        std::string seen = db->getKeyValue("cas");
+                        std::string next = std::to_string(seen.empty() ? 1 : std::stoi(seen) + 1);
+                        if (db->compareAndSet("cas", seen, next))
+                            break;
+                    }
+                    for (;;) {
+                        std::uint64_t version;
+                        std::string seen = db->getKeyValue("versioned", version);
+                        std::string next = std::to_string(seen.empty() ? 1 : std::stoi(seen) + 1);
+                        if (db->setKeyValueIfVersion("versioned", next, version))
+                            break;
+                    }
+                }
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+
+        REQUIRE(1 == leaders);
+        REQUIRE(std::to_string(threads * increments) == db->getKeyValue("cas"));
+        REQUIRE(std::to_string(threads * increments) == db->getKeyValue("versioned"));
+
+        // a version is gone with the next write to the key
+        std::uint64_t version;
+        db->getKeyValue("versioned", version);
+        db->setKeyValue("versioned", "changed");
+        REQUIRE_FALSE(db->setKeyValueIfVersion("versioned", "stale", version));
+        REQUIRE("changed" == db->getKeyValue("versioned"));
+
+        db->destroy();
+    }
+}
+
+TEST_CASE("Trace where the time of a call goes", "[Tracer]") {
+    // Story:-
+    //   [Who]   As a database administrator chasing a slow get in production
+    //   [What]  I need spans of each layer a call went through, with key hashes and sizes
+    //   [Value] So I can see whether hashing, the memory map or file I/O took the time
+    celebiext::Tracer::enable(true);
+    celebiext::Tracer::clear();
+
+    auto spansNamed = [](const std::string &name) {
+        std::vector<celebiext::TraceEvent> found;
+        for (auto &event : celebiext::Tracer::events())
+            if (name == event.m_name)
+                found.push_back(event);
+        return found;
+    };
+
+    SECTION("Spans and rings") {
+        // 1. A span records its key hash and byte count
+        {
+            celebiext::TraceSpan span("test.span", "key", 5);
+        }
+        auto spans = spansNamed("test.span");
+        REQUIRE(1 == spans.size());
+        REQUIRE(std::hash<std::string>()("key") == spans[0].m_keyHash);
+        REQUIRE(5 == spans[0].m_bytes);
+
+        // 2. A full ring keeps the newest spans while another thread dumps it
+        std::atomic<bool> done{false};
+        std::thread dumper([&done]() {
+            while (!done)
+                celebiext::Tracer::chromeTrace();
+        });
+        std::thread writer([]() {
+            for (std::size_t i = 0; i < celebiext::Tracer::ringSize + 100; i++)
+                celebiext::TraceSpan span("test.wrap", std::to_string(i), i);
+        });
+        writer.join();
+        done = true;
+        dumper.join();
+        auto wrapped = spansNamed("test.wrap");
+        REQUIRE(celebiext::Tracer::ringSize == wrapped.size());
+        REQUIRE(100 == wrapped.front().m_bytes);
+
+        // 3. Nothing is recorded while tracing is off, and a clear drops what was
+        celebiext::Tracer::enable(false);
+        {
+            celebiext::TraceSpan span("test.off", "key");
+        }
+        REQUIRE(spansNamed("test.off").empty());
+        celebiext::Tracer::enable(true);
+        celebiext::Tracer::clear();
+        REQUIRE(spansNamed("test.span").empty());
+
+        // 4. The dump is Chrome trace event JSON
+        {
+            celebiext::TraceSpan span("test.json", "key", 7);
+        }
+        const std::string path = "my-trace.json";
+        celebiext::Tracer::writeChromeTrace(path);
+        std::ifstream in(path);
+        std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        REQUIRE(0 == json.find("{\"traceEvents\":["));
+        REQUIRE(json.find("\"name\":\"test.json\",\"cat\":\"celebi\",\"ph\":\"X\"") != std::string::npos);
+        REQUIRE(json.find("\"bytes\":7}") != std::string::npos);
+        fs::remove(path);
+    }
+
+#ifdef CELEBI_TRACING
+    SECTION("Trace points in the storage stack") {
+        std::string dbname("my-traced-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        db->setKeyValue("traced", "value");
+        REQUIRE("value" == db->getKeyValue("traced"));
+        db.reset();
+
+        // a cold get goes through every layer down to the file
+        std::unique_ptr<celebi::IDatabase> loaded(celebi::Celebi::loadDB(dbname));
+        celebiext::Tracer::clear();
+        REQUIRE("value" == loaded->getKeyValue("traced"));
+
+        const std::uint64_t hash = std::hash<std::string>()("traced");
+        for (const char *name : { "database.get", "memory.get", "memory.hash", "memory.lookup",
+                                  "memory.fallback", "file.get", "file.read", "memory.fill" }) {
+            auto spans = spansNamed(name);
+            REQUIRE(1 == spans.size());
+            REQUIRE(hash == spans[0].m_keyHash);
+        }
+        REQUIRE(5 == spansNamed("file.read")[0].m_bytes);
+
+        // spans nest in time as the calls do
+        auto outer = spansNamed("database.get")[0];
+        auto inner = spansNamed("file.read")[0];
+        REQUIRE(outer.m_start <= inner.m_start);
+        REQUIRE(inner.m_start + inner.m_duration <= outer.m_start + outer.m_duration);
+
+        loaded->destroy();
+    }
+#endif
+
+    celebiext::Tracer::enable(false);
+}
@@ -1,16 +1,39 @@
 #include "catch.hpp"
 #include "celebi.h"
 #include "extensions/extdatabase.h"
+#include "extensions/art.h"
 
+#include <algorithm>
+#include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <iostream>
+#include <iomanip>
 #include <filesystem>
+#include <random>
+#include <thread>
+#include <vector>
 
 namespace fs = std::filesystem;
 
+static void printLatencies(const celebi::Stats &stats)
+{
+    std::cout << "=========== LATENCY (ns) ===========" << std::endl;
+    for (auto &series : stats.m_latencies)
+        std::cout << "  " << std::left << std::setw(22)
+                  << series.first.first + " " + series.first.second << std::right
+                  << " p50 " << std::setw(8) << series.second.percentile(0.5)
+                  << " p99 " << std::setw(8) << series.second.percentile(0.99)
+                  << " p99.9 " << std::setw(9) << series.second.percentile(0.999)
+                  << " max " << std::setw(10) << series.second.max() << std::endl;
+}
+
 static void testPerformance(std::unique_ptr<celebi::IDatabase> db)
 {
     std::cout << "------------------------------------------" << std::endl;
+    // the percentiles printed at the end need the stats, which are off by default
+    db->enableStats(true);
+
     // 1. Prepare the 100k key-value pairs
     long total = 100000;
     std::unordered_map<std::string, std::string> keyValues;
@@ -42,6 +65,9 @@ static void testPerformance(std::unique_ptr<celebi::IDatabase> db)
     std::cout << "  " << keyValues.size() * 1000.0 * 1000.0 / (std::chrono::duration_cast<std::chrono::microseconds>(end - begin)).count()
               << " requests per second" << std::endl;
 
+    // 4. Latency percentiles of each layer
+    printLatencies(db->stats());
+
     db->destroy();
     std::cout << "------------------------------------------" << std::endl << std::endl;
 }
@@ -149,3 +175,174 @@ TEST_CASE("Measure basic performance", "[setKeyValue, getKeyValue]") {
         std::cout << "------------------------------------------" << std::endl << std::endl;
     }
 }
+
+static double testConcurrentPerformance(celebi::KeyValueStore &store, long keys,
+                                        int threads, int readPercent, long totalOps)
+{
+    std::vector<std::thread> workers;
+    long perThread = totalOps / threads;
+
+    auto begin = std::chrono::steady_clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&store, keys, readPercent, perThread, t]() {
+            std::minstd_rand rand(t + 1);
+            std::string res;
+            for (long i = 0; i < perThread; i++) {
+                std::string key = std::to_string(rand() % keys);
+                if (static_cast<int>(rand() % 100) < readPercent)
+                    res = store.getKeyValue(key);
+                else
+                    store.setKeyValue(key, key);
+            }
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    auto end = std::chrono::steady_clock::now();
+
+    return perThread * threads * 1000.0 * 1000.0 /
+            (std::chrono::duration_cast<std::chrono::microseconds>(end - begin)).count();
+}
+
+static void testConcurrentScaling(celebi::KeyValueStore &store,
+                                  std::initializer_list<int> threadCounts,
+                                  std::initializer_list<int> readPercents)
+{
+    long keys = 100000, totalOps = 400000;
+    for (long i = 0; i < keys; i++)
+        store.setKeyValue(std::to_string(i), std::to_string(i));
+
+    std::cout << std::setw(8) << "threads";
+    for (int readPercent : readPercents)
+        std::cout << std::setw(12) << (std::to_string(readPercent) + "% read");
+    std::cout << std::endl;
+
+    for (int threads : threadCounts) {
+        std::cout << std::setw(8) << threads;
+        for (int readPercent : readPercents) {
+            double rps = testConcurrentPerformance(store, keys, threads, readPercent, totalOps);
+            std::cout << std::setw(12) << static_cast<long>(rps);
+        }
+        std::cout << std::endl;
+    }
+    std::cout << "------------------------------------------" << std::endl << std::endl;
+}
+
+TEST_CASE("Measure multi-threaded performance", "[.][performance][setKeyValue, getKeyValue]") {
+    // Story:-
+    //   [Who]   As a multi-threaded server developer
+    //   [What]  I need to know how the memory store scales with threads and read/write mixes
+    //   [Value] So I can size my worker pools and pick the store concurrency
+    SECTION("Sharded memory store, 1-64 threads") {
+        std::cout << "Sharded memory key-value store: requests per second" << std::endl;
+        celebiext::MemoryKeyValueStore store(celebiext::Concurrency::SHARDED, 64);
+
+        testConcurrentScaling(store, { 1, 2, 4, 8, 16, 32, 64 }, { 100, 95, 50 });
+    }
+}
+
+TEST_CASE("Measure lock-free read scaling", "[.][performance][getKeyValue]") {
+    // Story:-
+    //   [Who]   As a developer of a read-heavy server
+    //   [What]  I need to know how far lock-free reads scale past sharded locks
+    //   [Value] So I can pick the store concurrency for up to 128 reader threads
+    SECTION("Read scaling, lock-free reads vs sharded locks") {
+        std::cout << "Sharded lock memory key-value store: requests per second" << std::endl;
+        celebiext::MemoryKeyValueStore lockedStore(celebiext::Concurrency::SHARDED, 64);
+        testConcurrentScaling(lockedStore, { 1, 32, 64, 128 }, { 100, 95 });
+
+        std::cout << "Lock-free read memory key-value store: requests per second" << std::endl;
+        celebiext::MemoryKeyValueStore lockFreeStore(celebiext::Concurrency::LOCK_FREE_READ, 64);
+        testConcurrentScaling(lockFreeStore, { 1, 32, 64, 128 }, { 100, 95 });
+    }
+}
+
+template <typename F>
+static double timeMicroseconds(F f)
+{
+    auto begin = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+
+    return (std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)).count() / 1000.0;
+}
+
+static void printIndexResult(const std::string &name, double insert, double lookup,
+                             double scan, long keys, long scans)
+{
+    std::cout << std::setw(16) << name
+              << std::setw(16) << static_cast<long>(keys * 1000.0 * 1000.0 / insert)
+              << std::setw(16) << static_cast<long>(keys * 1000.0 * 1000.0 / lookup)
+              << std::setw(16) << scan / scans << std::endl;
+}
+
+TEST_CASE("Measure ordered index performance", "[scanKeys]") {
+    // Story:-
+    //   [Who]   As a multi-tenant service developer
+    //   [What]  I need to know what the radix tree costs next to a tree map and a hash table
+    //   [Value] So I can trust prefix scans over keys with long shared prefixes
+    SECTION("Radix tree vs std::map vs hash table, 200k tenant:object:field keys") {
+        const long total = 200000, tenants = 100;
+        std::vector<std::string> keys;
+        std::size_t keyBytes = 0;
+        for (long i = 0; i < total; i++) {
+            keys.push_back("tenant" + std::to_string(i % tenants) + ":object" +
+                           std::to_string(i / tenants % 1000) + ":field" + std::to_string(i / tenants / 1000));
+            keyBytes += keys.back().size();
+        }
+        std::shuffle(keys.begin(), keys.end(), std::minstd_rand(7));
+
+        std::vector<std::string> prefixes;
+        for (long t = 0; t < tenants; t++)
+            prefixes.push_back("tenant" + std::to_string(t) + ":object1");
+
+        std::cout << std::setw(16) << "index" << std::setw(16) << "inserts/s"
+                  << std::setw(16) << "lookups/s" << std::setw(16) << "us/prefix scan" << std::endl;
+
+        long found = 0, scanned = 0;
+
+        celebiext::AdaptiveRadixTree tree(false);
+        double insert = timeMicroseconds([&]() { for (auto &key : keys) tree.insert(key); });
+        double lookup = timeMicroseconds([&]() { for (auto &key : keys) found += tree.contains(key); });
+        double scan = timeMicroseconds([&]() {
+            for (auto &prefix : prefixes) {
+                std::string to = prefix;
+                to.back()++;
+                tree.scan(prefix, to, false, [&scanned](const std::string &) { scanned++; return true; });
+            }
+        });
+        printIndexResult("radix tree", insert, lookup, scan, total, tenants);
+
+        std::map<std::string, bool> map;
+        insert = timeMicroseconds([&]() { for (auto &key : keys) map.emplace(key, true); });
+        lookup = timeMicroseconds([&]() { for (auto &key : keys) found += map.count(key); });
+        scan = timeMicroseconds([&]() {
+            for (auto &prefix : prefixes) {
+                for (auto it = map.lower_bound(prefix);
+                     it != map.end() && 0 == it->first.compare(0, prefix.size(), prefix); it++)
+                    scanned++;
+            }
+        });
+        printIndexResult("std::map", insert, lookup, scan, total, tenants);
+
+        // a hash table has no order, every prefix scan looks at every key
+        std::unordered_set<std::string> hashTable;
+        insert = timeMicroseconds([&]() { for (auto &key : keys) hashTable.insert(key); });
+        lookup = timeMicroseconds([&]() { for (auto &key : keys) found += hashTable.count(key); });
+        scan = timeMicroseconds([&]() {
+            for (auto &prefix : prefixes) {
+                for (auto &key : hashTable)
+                    scanned += 0 == key.compare(0, prefix.size(), prefix);
+            }
+        });
+        printIndexResult("hash table", insert, lookup, scan, total, tenants);
+
+        std::cout << "radix tree holds " << tree.memoryUsage() << " bytes for "
+                  << keyBytes << " bytes of keys" << std::endl;
+        std::cout << "------------------------------------------" << std::endl << std::endl;
+
+        // a prefix holds object1, object10-19 and object100-199 of its tenant, each with field0 and field1
+        REQUIRE(found == 3 * total);
+        REQUIRE(scanned == 3 * tenants * 2 * (1 + 10 + 100));
+    }
+}
@@ -2,7 +2,11 @@
 #include "celebi.h"
 
 #include <iostream>
+#include <algorithm>
 #include <filesystem>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -52,3 +56,152 @@ TEST_CASE("query tests", "[query]") {
     }
 }
 
+TEST_CASE("concurrent query tests", "[query]") {
+    // Story:-
+    //   [Who]   As a multi-threaded server developer
+    //   [What]  I need to add keys to buckets from many threads at once
+    //   [Value] So no bucket membership is lost under concurrent writers
+    SECTION("Bucket set from many threads") {
+        std::string dbname("my-concurrent-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        const int threads = 8, perThread = 200;
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&db, t]() {
+                for (int i = 0; i < perThread; i++) {
+                    std::string key = std::to_string(t) + ":" + std::to_string(i);
+                    db->setKeyValue(key, key, "hot bucket");
+                    db->setKeyValue(key + ":own", key, "bucket " + std::to_string(t));
+                }
+            });
+        }
+        for (auto &worker : workers)
+            worker.join();
+
+        celebi::BucketQuery hot("hot bucket");
+        REQUIRE(db->query(hot)->recordKeys()->size() == threads * perThread);
+        for (int t = 0; t < threads; t++) {
+            celebi::BucketQuery own("bucket " + std::to_string(t));
+            REQUIRE(db->query(own)->recordKeys()->size() == perThread);
+        }
+
+        // every membership made it to disk too
+        std::unique_ptr<celebi::IDatabase> loaded(celebi::Celebi::loadDB(dbname));
+        REQUIRE(loaded->query(hot)->recordKeys()->size() == threads * perThread);
+
+        db->destroy();
+        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+    }
+}
+
+TEST_CASE("range query tests", "[query]") {
+    // Story:-
+    //   [Who]   As a multi-tenant service developer
+    //   [What]  I need to list the keys under a tenant prefix or in a key range, in order
+    //   [Value] So I can page through one tenant's records without loading every key
+    std::string dbname("my-range-db");
+    std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+
+    const std::vector<std::string> tenantA = {"tenantA:001", "tenantA:002", "tenantA:010", "tenantA:100"};
+    for (auto &key : tenantA)
+        db->setKeyValue(key, "value of " + key);
+    db->setKeyValue("tenantB:001", "value of tenantB:001");
+    db->setKeyValue("tenant", "not in any tenant");
+    db->setKeyValue("tenantA:set", std::unordered_set<std::string>{"a", "b"});
+
+    SECTION("Prefix scan forward and reverse") {
+        celebi::PrefixQuery forward("tenantA:");
+        auto forwardKeys = db->query(forward)->orderedRecordKeys();
+        std::vector<std::string> expected(tenantA);
+        expected.push_back("tenantA:set");
+        REQUIRE(*forwardKeys == expected);
+
+        celebi::PrefixQuery reverse("tenantA:", true);
+        auto reverseKeys = db->query(reverse)->orderedRecordKeys();
+        std::reverse(expected.begin(), expected.end());
+        REQUIRE(*reverseKeys == expected);
+    }
+
+    SECTION("Range scan with limits") {
+        celebi::RangeQuery range("tenantA:002", "tenantA:100", false, 0);
+        auto rangeKeys = db->query(range)->orderedRecordKeys();
+        REQUIRE(*rangeKeys == std::vector<std::string>{"tenantA:002", "tenantA:010"});
+
+        celebi::RangeQuery firstTwo("tenantA:", "", false, 2);
+        auto firstKeys = db->query(firstTwo)->orderedRecordKeys();
+        REQUIRE(*firstKeys == std::vector<std::string>{"tenantA:001", "tenantA:002"});
+
+        celebi::RangeQuery lastTwo("", "tenantB:", true, 2);
+        auto lastKeys = db->query(lastTwo)->orderedRecordKeys();
+        REQUIRE(*lastKeys == std::vector<std::string>{"tenantA:set", "tenantA:100"});
+
+        // queries through the base class find their overload too
+        celebi::Query &q = range;
+        REQUIRE(db->query(q)->recordKeys()->size() == 2);
+
+        // but a query of no known type has no result to give
+        class UnknownQuery : public celebi::Query {};
+        UnknownQuery unknown;
+        REQUIRE_THROWS_AS(db->query(unknown), std::invalid_argument);
+        REQUIRE_THROWS_AS(db->snapshot()->query(unknown), std::invalid_argument);
+    }
+
+    SECTION("Prefix scan of keys only on disk") {
+        std::unique_ptr<celebi::IDatabase> loaded(celebi::Celebi::loadDB(dbname));
+        celebi::PrefixQuery prefix("tenantB:");
+        auto diskKeys = loaded->query(prefix)->orderedRecordKeys();
+        REQUIRE(*diskKeys == std::vector<std::string>{"tenantB:001"});
+
+        celebi::PrefixQuery all("tenant", true, 1);
+        auto lastDiskKeys = loaded->query(all)->orderedRecordKeys();
+        REQUIRE(*lastDiskKeys == std::vector<std::string>{"tenantB:001"});
+    }
+
+    db->destroy();
+    REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+}
+
+TEST_CASE("snapshot query tests", "[query]") {
+    // Story:-
+    //   [Who]   As an analytics developer
+    //   [What]  I need gets, bucket queries and range queries to agree with each other
+    //   [Value] So a report over a live database is consistent without stopping the writers
+    SECTION("Bucket and range queries of one snapshot") {
+        std::string dbname("my-snapshot-db");
+        std::unique_ptr<celebi::IDatabase> db(celebi::Celebi::createEmptyDB(dbname));
+        const int orders = 500;
+
+        std::thread writer([&db]() {
+            for (int i = 0; i < orders; i++)
+                db->setKeyValue("order:" + std::to_string(i), std::to_string(i), "orders");
+        });
+
+        bool consistent = true;
+        for (int n = 0; n < 20; n++) {
+            auto snapshot = db->snapshot();
+            celebi::BucketQuery bucket("orders");
+            celebi::PrefixQuery prefix("order:");
+            auto bucketKeys = snapshot->query(bucket)->recordKeys();
+            auto rangeKeys = snapshot->query(prefix)->recordKeys();
+
+            consistent = consistent && bucketKeys->size() == rangeKeys->size();
+            for (auto &key : *bucketKeys)
+                consistent = consistent && !snapshot->getKeyValue(key).empty();
+        }
+        writer.join();
+        REQUIRE(consistent);
+
+        auto snapshot = db->snapshot();
+        db->setKeyValue("order:0", "changed", "orders");
+        db->setKeyValue("late order", "late", "orders");
+        celebi::BucketQuery bucket("orders");
+        REQUIRE("0" == snapshot->getKeyValue("order:0"));
+        REQUIRE(orders == snapshot->query(bucket)->recordKeys()->size());
+        REQUIRE(orders + 1 == db->query(bucket)->recordKeys()->size());
+        snapshot.reset();
+
+        db->destroy();
+        REQUIRE(!fs::exists(fs::status(db->getDirectory())));
+    }
+}
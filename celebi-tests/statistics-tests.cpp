@@ -0,0 +1,86 @@
+#include "tests.h"
+
+#include "statistics.h"
+
+#include <vector>
+
+TEST_CASE("compare benchmark runs", "[MannWhitney, bootstrapMedianRatio]") {
+    // Story:-
+    //   [Who]   As a developer whose change is gated on benchmark regressions
+    //   [What]  I need the test and the interval the gate uses to be right
+    //   [Value] So a change is held back for a real slowdown and never for a wrong p-value
+
+    SECTION("Exact p-value of small samples without ties") {
+        // every one of the C(10, 5) = 252 orders is as likely, two are this extreme
+        auto apart = celebibench::MannWhitney::test({ 1, 2, 3, 4, 5 }, { 6, 7, 8, 9, 10 });
+        REQUIRE(apart.m_exact);
+        REQUIRE(0 == apart.m_u);
+        REQUIRE(Approx(2.0 / 252) == apart.m_p);
+
+        auto interleaved = celebibench::MannWhitney::test({ 1, 3, 5, 7, 9 }, { 2, 4, 6, 8, 10 });
+        REQUIRE(interleaved.m_exact);
+        REQUIRE(10 == interleaved.m_u);
+        REQUIRE(Approx(174.0 / 252) == interleaved.m_p);
+
+        // scipy.stats.mannwhitneyu(males, females) of its documentation
+        auto scipy = celebibench::MannWhitney::test({ 19, 22, 16, 29, 24 }, { 20, 11, 17, 12 });
+        REQUIRE(scipy.m_exact);
+        REQUIRE(17 == scipy.m_u);
+        REQUIRE(Approx(1.0 / 9) == scipy.m_p);
+    }
+
+    SECTION("Normal approximation with the tie correction") {
+        // ties of 2, 4, 3, 3 and 2 values, U = 7.5, z = (|7.5 - 32| - 0.5) / sqrt(88)
+        auto tied = celebibench::MannWhitney::test({ 1, 2, 2, 3, 3, 3, 4, 5 }, { 3, 4, 4, 5, 5, 6, 6, 7 });
+        REQUIRE(!tied.m_exact);
+        REQUIRE(7.5 == tied.m_u);
+        REQUIRE(Approx(0.010515245935858918).epsilon(1e-9) == tied.m_p);
+
+        // every value tied has no variance and no evidence of a difference
+        auto same = celebibench::MannWhitney::test({ 5, 5, 5 }, { 5, 5, 5 });
+        REQUIRE(1 == same.m_p);
+
+        // more than 20 samples each go to the normal approximation too
+        std::vector<double> low, high;
+        for (int i = 0; i < 30; i++) {
+            low.push_back(i);
+            high.push_back(i + 0.5);
+        }
+        auto large = celebibench::MannWhitney::test(low, high);
+        REQUIRE(!large.m_exact);
+        REQUIRE(435 == large.m_u);
+        REQUIRE(Approx(0.8302552839111963).epsilon(1e-9) == large.m_p);
+    }
+
+    SECTION("Bootstrap interval of the median ratio") {
+        REQUIRE(2 == celebibench::median({ 3, 1, 2 }));
+        REQUIRE(2.5 == celebibench::median({ 4, 1, 3, 2 }));
+
+        // constant samples leave nothing to resample
+        auto constant = celebibench::bootstrapMedianRatio({ 100, 100, 100 }, { 150, 150, 150 }, 0.05, 2000);
+        REQUIRE(1.5 == constant.m_low);
+        REQUIRE(1.5 == constant.m_high);
+
+        // resampled medians of { 100, 200 } are 100, 150 and 200 a quarter, half and quarter of the time
+        auto spread = celebibench::bootstrapMedianRatio({ 100 }, { 100, 200 }, 0.05, 2000);
+        REQUIRE(1 == spread.m_low);
+        REQUIRE(2 == spread.m_high);
+        auto central = celebibench::bootstrapMedianRatio({ 100 }, { 100, 200 }, 0.6, 2000);
+        REQUIRE(1.5 == central.m_low);
+        REQUIRE(1.5 == central.m_high);
+
+        // the same seed gives the same interval, and it brackets the true ratio
+        std::vector<double> base, slower;
+        for (int i = 0; i < 15; i++) {
+            base.push_back(100 + i % 5);
+            slower.push_back(110 + i % 5);
+        }
+        auto first = celebibench::bootstrapMedianRatio(base, slower, 0.05, 2000, 7);
+        auto again = celebibench::bootstrapMedianRatio(base, slower, 0.05, 2000, 7);
+        REQUIRE(first.m_low == again.m_low);
+        REQUIRE(first.m_high == again.m_high);
+        REQUIRE(first.m_low <= 112.0 / 102);
+        REQUIRE(112.0 / 102 <= first.m_high);
+        REQUIRE(1 < first.m_low);
+    }
+}
@@ -2,11 +2,16 @@
 #define __CELEBI_DATABASE_H__
 
 #include "query.h"
+#include "stats.h"
 
+#include <chrono>
+#include <cstdint>
+#include <map>
 #include <string>
 #include <memory>
 #include <functional>
 #include <unordered_set>
+#include <vector>
 
 namespace celebi {
 
@@ -17,7 +22,38 @@ public:
 };
 
 /**
- * @brief The KeyValueStore class is key-value store layer for database
+ * @brief The KeyValueSnapshot class is read-only view of a key-value store as it was
+ *        when the snapshot was taken, it pins old versions until it goes and must not
+ *        outlive its store
+ */
+class KeyValueSnapshot {
+public:
+    KeyValueSnapshot() = default;
+    virtual ~KeyValueSnapshot() = default;
+
+    // Sequence number of the last write the snapshot sees, 0 if writes aren't numbered
+    virtual std::uint64_t sequence() const;
+
+    virtual std::string getKeyValue(const std::string &key) = 0;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) = 0;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) = 0;
+};
+
+/**
+ * @brief The MergeOperator enum is how a merge folds its operand into a string value,
+ *        stores take merges without reading the value first where they can
+ */
+enum class MergeOperator {
+    ADD,        // operand and value are signed decimals, a value which is not one counts as 0
+    APPEND,     // operand goes at the end of the value
+};
+
+/**
+ * @brief The KeyValueStore class is key-value store layer for database. Methods past
+ *        setting and getting have defaults made of those, which are not atomic, or
+ *        throw std::runtime_error where those can't do it.
  */
 class KeyValueStore : public Store {
 public:
@@ -35,13 +71,110 @@ public:
                              const std::unordered_set<std::string> &value) = 0;
     virtual void appendKeyValue(const std::string &key, const std::string &value) = 0;
 
+    // Merge methods, atomic for each key. Merging members into a set is appending each.
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op);
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members);
+
+    // Conditional write, sets the string value only if it is the expected one now, an empty
+    // expected value means the key must be unset. Returns false and writes nothing if not.
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value);
+
+    // Delete methods, deleting a key takes both its string and its set,
+    // removing takes one member out of its set
+    virtual void deleteKeyValue(const std::string &key);
+    virtual void removeKeyValue(const std::string &key, const std::string &value);
+
+    virtual std::string getKeyValue(const std::string &key) = 0;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) = 0;
+
+    // Non-blocking get methods, answer only from memory and never touch a slower tier.
+    // Return false if the value has to be loaded from a slower tier.
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value);
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value);
+
+    // Ordered scan method, calls back keys in [from, to) in order, or in reverse order,
+    // until the callback returns false. An empty bound leaves that end of the range open.
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb);
+
+    // Snapshot method, throws std::runtime_error if the store keeps no old versions
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot();
+
+    // Memory methods, what the store holds in memory and, given a key, what that key holds.
+    // They walk the store's tables, so they are for reports rather than hot paths.
+    virtual MemoryUsage memoryUsage() const;
+    virtual MemoryUsage memoryUsage(const std::string &key) const;
+};
+
+/**
+ * @brief The AccessMode enum is how a process opens a database other processes may use
+ */
+enum class AccessMode {
+    EXCLUSIVE,      // the only process using the database
+    SHARED_WRITER,  // the single writer among the processes sharing the database
+    SHARED_READER,  // one of many read-only processes, sees the writer's commits
+};
+
+/**
+ * @brief The ISnapshot class is read-only view of a database pinned at a sequence number,
+ *        writers carry on while it is read and it must not outlive its database
+ */
+class ISnapshot {
+public:
+    ISnapshot() = default;
+    virtual ~ISnapshot() = default;
+
+    virtual std::uint64_t sequence() const;
+
+    // Get methods
+    virtual std::string getKeyValue(const std::string &key) = 0;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) = 0;
+
+    // Query records methods, a query of no known type throws std::invalid_argument
+    virtual std::unique_ptr<IQueryResult> query(Query &q) const = 0;
+    virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) const = 0;
+    virtual std::unique_ptr<IQueryResult> query(RangeQuery &q) const = 0;
+};
+
+/**
+ * @brief The ITransaction class keeps its writes to itself until commit, which applies them
+ *        all at once if nothing the transaction read has been written in the meantime
+ */
+class ITransaction {
+public:
+    ITransaction() = default;
+    virtual ~ITransaction() = default;
+
+    // Get methods, a transaction sees its own writes
     virtual std::string getKeyValue(const std::string &key) = 0;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) = 0;
+    virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) = 0;
+
+    // Set methods
+    virtual void setKeyValue(const std::string &key, const std::string &value) = 0;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) = 0;
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             const std::string &bucket) = 0;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             const std::string &bucket) = 0;
+
+    // Returns false and writes nothing on a conflict, the transaction is over either way
+    virtual bool commit() = 0;
 };
 
 /**
- * @brief The IDatabase class which is client API and only knowledged by user
+ * @brief The IDatabase class which is client API and only knowledged by user. Methods
+ *        past setting, getting and bucket queries have defaults made of those, which
+ *        are not atomic, or throw std::runtime_error where those can't do it.
  */
 class IDatabase
 {
@@ -69,14 +202,89 @@ public:
                              const std::unordered_set<std::string> &value,
                              const std::string &bucket) = 0;
 
+    // Set methods with time to live, the key reads as unset once ttl has passed and goes
+    // from the store and its buckets by then, setting it again without ttl keeps it
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             std::chrono::milliseconds ttl);
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             std::chrono::milliseconds ttl);
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl);
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl);
+
+    // Number of keys removed because their time to live passed
+    virtual std::uint64_t expiredKeys() const;
+
+    // Merge methods, atomic without a read before the write. A counter is a signed
+    // decimal string value, an unset value or one which is not a number counts as 0.
+    virtual void incrementKeyValue(const std::string &key, std::int64_t delta = 1);
+    virtual void decrementKeyValue(const std::string &key, std::int64_t delta = 1);
+    virtual void appendToKeyValue(const std::string &key, const std::string &suffix);
+    virtual void mergeKeyValueSet(const std::string &key,
+                                  const std::unordered_set<std::string> &members);
+
+    // Conditional writes, return false and write nothing if the condition does not hold.
+    // Like a plain set they drop the key's time to live.
+    virtual bool compareAndSet(const std::string &key, const std::string &expected,
+                               const std::string &value);
+    virtual bool setIfAbsent(const std::string &key, const std::string &value);
+
+    // Versioned methods, a key's version changes with every write to it and may change with
+    // writes to other keys, so a write conditioned on it can fail without a write to the key
+    // but never succeeds over a write it did not see
+    virtual std::string getKeyValue(const std::string &key, std::uint64_t &version);
+    virtual bool setKeyValueIfVersion(const std::string &key, const std::string &value,
+                                      std::uint64_t version);
+
+    // Delete methods, a deleted key leaves every bucket it was set with
+    virtual void deleteKey(const std::string &key);
+    virtual void removeFromBucket(const std::string &key, const std::string &bucket);
+
     // Get methods
     virtual std::string getKeyValue(const std::string &key) = 0;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) = 0;
 
-    // Query records methods
+    // Non-blocking get methods, return false if the value is not in memory
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value);
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value);
+
+    // Query records methods, a query of no known type throws std::invalid_argument
     virtual std::unique_ptr<IQueryResult> query(Query &q) const = 0;
     virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) const = 0;
+    virtual std::unique_ptr<IQueryResult> query(RangeQuery &q) const;
+
+    // Non-blocking query method, return false if the index is not in memory
+    virtual bool tryQuery(BucketQuery &q, std::unique_ptr<IQueryResult> &result) const;
+
+    // Snapshot method, a consistent view across several reads and queries
+    virtual std::unique_ptr<ISnapshot> snapshot();
+
+    // Transaction methods, transact runs body in a new transaction until one commits
+    // and returns false if none did within the attempts
+    virtual std::unique_ptr<ITransaction> begin();
+    virtual bool transact(std::function<void(ITransaction &txn)> body, int attempts = 16);
+
+    // Stats methods, latencies of the calls into the database and each of its stores
+    // and counters since stats were enabled. Timing reads the clock twice per call and
+    // layer while it is on, so it is off until enabled.
+    virtual Stats stats() const;
+    virtual void enableStats(bool enabled);
+
+    // Slow log methods, keeps the newest capacity calls which took threshold or longer.
+    // A zero threshold turns it off, as it is by default, and then no call reads a clock
+    // for it.
+    virtual void setSlowThreshold(std::chrono::nanoseconds threshold, std::size_t capacity = 128);
+    virtual std::vector<SlowOperation> slowOperations() const;
+
+    // Memory methods, what the database and its stores hold in memory, the index as
+    // postings. By bucket, what each bucket's list of keys takes in the index.
+    virtual MemoryUsage memoryUsage() const;
+    virtual std::map<std::string, MemoryUsage> bucketMemoryUsage() const;
 };
 
 }
@@ -0,0 +1,55 @@
+#ifndef __CELEBI_EXTENSION_ART_H__
+#define __CELEBI_EXTENSION_ART_H__
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace celebiext {
+
+/**
+ * @brief The AdaptiveRadixTree class is an ordered set of keys, inner nodes grow
+ *        from 4 to 16, 48 and 256 children and keep the common prefix of their keys
+ *        once, so keys sharing long prefixes cost little memory. Writers must be
+ *        serialized by the caller, readers need no lock when the tree is built for
+ *        concurrent readers: whatever a writer replaces is retired to the epochs.
+ */
+class AdaptiveRadixTree {
+public:
+    explicit AdaptiveRadixTree(bool concurrentReaders = true);
+    ~AdaptiveRadixTree();
+
+    AdaptiveRadixTree(const AdaptiveRadixTree &) = delete;
+    AdaptiveRadixTree &operator=(const AdaptiveRadixTree &) = delete;
+
+    // Returns false if the key is in the tree already
+    bool insert(const std::string &key);
+    // Returns false if the key is not in the tree
+    bool erase(const std::string &key);
+    bool contains(const std::string &key) const;
+
+    // Calls back keys in [from, to) in order, or in reverse order, until the
+    // callback returns false. An empty bound leaves that end of the range open.
+    void scan(const std::string &from, const std::string &to, bool reverse,
+              const std::function<bool(const std::string &key)> &cb) const;
+
+    std::size_t size() const;
+    // Bytes held by the nodes and the key bytes they keep
+    std::size_t memoryUsage() const;
+
+    struct Node;
+
+private:
+    struct Range;
+    bool walk(const Node *node, std::string &path, const Range &range) const;
+    void retire(Node *node);
+
+    const bool m_concurrentReaders;
+    std::atomic<Node *> m_root;
+    std::atomic<std::size_t> m_size;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_ART_H__
@@ -0,0 +1,66 @@
+#ifndef __CELEBI_EXTENSION_BLOOMFILTER_H__
+#define __CELEBI_EXTENSION_BLOOMFILTER_H__
+
+#include "extensions/highwayhash.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace celebiext {
+
+/**
+ * @brief The BloomFilter class tells when a key is surely not in a store, so a miss
+ *        costs no disk access. It hashes once and derives the probes by double hashing.
+ *        Bits are set atomically, so adds may race with each other and with lookups.
+ */
+class BloomFilter {
+public:
+    BloomFilter(int bitsPerKey, std::size_t expectedKeys);
+    // Filter from encode(), an empty or damaged one may contain anything
+    explicit BloomFilter(const std::string &encoded);
+
+    // Returns false if every bit was set already, the key is then not counted again
+    bool add(const std::string &key);
+    bool mayContain(const std::string &key) const;
+
+    std::string encode() const;
+
+    int probes() const;
+    std::size_t keys() const;
+    std::size_t bits() const;
+    // False positive rate to expect for the keys added so far
+    double falsePositiveRate() const;
+
+private:
+    int m_probes;
+    std::atomic<std::size_t> m_keys;
+    std::size_t m_bytes;
+    std::unique_ptr<std::atomic<std::uint8_t>[]> m_bits;
+    HighwayHash m_hash;
+};
+
+/**
+ * @brief The FilterStats struct tells how well the bloom filters of a store work,
+ *        negatives were answered without disk and false positives went to disk for nothing
+ */
+struct FilterStats {
+    int m_bitsPerKey = 0;
+    std::size_t m_keys = 0;
+    std::size_t m_bits = 0;
+    double m_expectedFalsePositiveRate = 0.0;
+    std::uint64_t m_negatives = 0;
+    std::uint64_t m_falsePositives = 0;
+
+    // Share of the missing keys the filters let through
+    double falsePositiveRate() const
+    {
+        std::uint64_t misses = m_negatives + m_falsePositives;
+        return 0 == misses ? 0.0 : static_cast<double>(m_falsePositives) / misses;
+    }
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_BLOOMFILTER_H__
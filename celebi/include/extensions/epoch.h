@@ -0,0 +1,46 @@
+#ifndef __CELEBI_EXTENSION_EPOCH_H__
+#define __CELEBI_EXTENSION_EPOCH_H__
+
+#include <cstddef>
+
+namespace celebiext {
+
+/**
+ * @brief The EpochGuard class marks a lock-free read section, memory retired while
+ *        any guard is alive is not freed until that guard is gone. Guards may nest.
+ */
+class EpochGuard {
+public:
+    EpochGuard();
+    ~EpochGuard();
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard &operator=(const EpochGuard &) = delete;
+};
+
+/**
+ * @brief The Epoch class is epoch-based memory reclamation for lock-free readers,
+ *        writers unlink memory first and then retire it instead of freeing it
+ */
+class Epoch {
+public:
+    Epoch() = delete;
+
+    static void retire(void *ptr, void (*deleter)(void *));
+
+    template <typename T>
+    static void retire(T *ptr)
+    {
+        retire(ptr, [](void *p) { delete static_cast<T *>(p); });
+    }
+
+    // Try to advance the global epoch and free what no reader can see anymore
+    static void collect();
+
+    // Number of retired objects not freed yet
+    static std::size_t pending();
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_EPOCH_H__
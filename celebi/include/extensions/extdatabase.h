@@ -2,6 +2,10 @@
 #define __CELEBI_EXTENSION_EXTDATABASE_H__
 
 #include "celebi.h"
+#include "extensions/bloomfilter.h"
+#include "extensions/metrics.h"
+
+#include <vector>
 
 namespace celebiext {
 
@@ -12,14 +16,34 @@ enum class ValueType {
     STRING_SET,
 };
 
+// Folds the operand into the value, which folds two operands of one operator
+// into one operand as well, older one as the value
+std::string applyMerge(MergeOperator op, const std::string &value, const std::string &operand);
+
 /**
- * @brief The MemoryKeyValueStore class is memroy key-value store for database
+ * @brief The Concurrency enum is how MemoryKeyValueStore synchronizes its callers
+ */
+enum class Concurrency {
+    NONE,           // single threaded use, no synchronization at all
+    SHARDED,        // keyspace partitioned by hash, each shard has its own reader-writer lock
+    LOCK_FREE_READ, // sharded writers, readers take no locks and old values are
+                    // reclaimed by epochs, values are copied on every write
+};
+
+/**
+ * @brief The MemoryKeyValueStore class is memroy key-value store for database,
+ *        writes keep the older versions of a value while a snapshot still sees them.
+ *        Over a store it caches, a value not in memory is read from that store and
+ *        kept, so opening loads keys only and values come in as they are read.
  */
 class MemoryKeyValueStore : public KeyValueStore
 {
 public:
     MemoryKeyValueStore();
     MemoryKeyValueStore(std::unique_ptr<KeyValueStore> &toCache);
+    MemoryKeyValueStore(Concurrency concurrency, std::size_t shards = defaultShards);
+    MemoryKeyValueStore(std::unique_ptr<KeyValueStore> &toCache,
+                        Concurrency concurrency, std::size_t shards = defaultShards);
     virtual ~MemoryKeyValueStore();
 
     // Management methods
@@ -33,10 +57,32 @@ public:
                              const std::unordered_set<std::string> &value) override;
 
     virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
 
     virtual std::string getKeyValue(const std::string &key) override;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+    // Values older than the newest which are only kept for snapshots
+    std::size_t oldVersions() const;
+
+    static const std::size_t defaultShards;
 
 private:
     class Impl;
@@ -48,7 +94,9 @@ private:
  */
 class FileKeyValueStore : public KeyValueStore {
 public:
-    FileKeyValueStore(const std::string &fullpath);
+    // A bloom filter of bitsPerKey bits per key answers most misses without disk,
+    // 0 turns it off for directories other processes write to
+    FileKeyValueStore(const std::string &fullpath, int bitsPerKey = 10);
     virtual ~FileKeyValueStore();
 
     // Management methods
@@ -62,10 +110,248 @@ public:
                              const std::unordered_set<std::string> &value) override;
 
     virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
 
     virtual std::string getKeyValue(const std::string &key) override;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+    FilterStats filterStats() const;
+    // The file a key's string value lives in, the store syncs nothing itself
+    std::string filePath(const std::string &key) const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The SharedKeyValueStore class lets processes share a key-value store,
+ *        a single writer publishes every commit in a shared-memory keydir and
+ *        readers in other processes see it without reloading anything
+ */
+class SharedKeyValueStore : public KeyValueStore {
+public:
+    SharedKeyValueStore(std::unique_ptr<KeyValueStore> &toShare,
+                        const std::string &keydirPath, bool writer);
+    virtual ~SharedKeyValueStore();
+
+    // Management methods
+    virtual void loadKeysInto(std::function<void(std::string key,
+                                                 std::string vlaue)>) override;
+    virtual void clear() override;
+
+    // Set or get methods, setting throws std::runtime_error for readers
+    virtual void setKeyValue(const std::string &key, const std::string &value) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) override;
+    virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key) override;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The LsmOptions struct tunes LsmKeyValueStore
+ */
+struct LsmOptions {
+    std::size_t writeBufferSize = 4 << 20;  // memtable bytes before it is flushed to level 0
+    std::size_t blockSize = 4 << 10;        // table data block bytes
+    std::size_t targetFileSize = 2 << 20;   // table bytes written by a compaction
+    std::size_t levelBaseBytes = 10 << 20;  // level 1 bytes, every level below holds 10 times more
+    int level0CompactionTrigger = 4;        // level 0 tables which start a compaction
+    int level0StopWritesTrigger = 12;       // level 0 tables which hold writers up
+    int bitsPerKey = 10;                    // table bloom filter bits per key
+    bool sync = false;                      // sync the log on every write
+};
+
+/**
+ * @brief The LsmKeyValueStore class is log-structured merge tree key-value store,
+ *        writes go to a log and a memtable which is flushed to sorted tables, and
+ *        a background thread compacts the tables level by level
+ */
+class LsmKeyValueStore : public KeyValueStore {
+public:
+    LsmKeyValueStore(const std::string &fullpath, const LsmOptions &options = LsmOptions());
+    virtual ~LsmKeyValueStore();
+
+    // Management methods
+    virtual void loadKeysInto(std::function<void(std::string key,
+                                                 std::string vlaue)>) override;
+    virtual void clear() override;
+
+    // Set or get methods, appending only logs the member and reads merge them
+    virtual void setKeyValue(const std::string &key, const std::string &value) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) override;
+    virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key) override;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+    // Flush the memtable and wait until no compaction is due
+    void compact();
+    std::vector<std::size_t> tablesPerLevel() const;
+    FilterStats filterStats() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The BTreeOptions struct tunes BTreeKeyValueStore
+ */
+struct BTreeOptions {
+    std::size_t mapSize = 1 << 30;  // address space mapped up front, doubled when the file outgrows it
+    bool sync = true;               // sync every commit, a crash then loses no write which returned
+};
+
+/**
+ * @brief The BTreeKeyValueStore class keeps the whole store in one file as a copy-on-write
+ *        B+tree. Readers walk the mapped file without locks on the version committed when
+ *        they started, one writer at a time commits by switching between two meta pages.
+ */
+class BTreeKeyValueStore : public KeyValueStore {
+public:
+    BTreeKeyValueStore(const std::string &fullpath, const BTreeOptions &options = BTreeOptions());
+    virtual ~BTreeKeyValueStore();
+
+    // Management methods
+    virtual void loadKeysInto(std::function<void(std::string key,
+                                                 std::string vlaue)>) override;
+    virtual void clear() override;
+
+    // Set or get methods, set members are keys of their own so an append is one insert
+    virtual void setKeyValue(const std::string &key, const std::string &value) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) override;
+    virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key) override;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+    std::uint64_t fileSize() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The MeteredKeyValueStore class times every call into the store it wraps and
+ *        records it in metrics under the name of the store's layer, the metrics must
+ *        outlive it
+ */
+class MeteredKeyValueStore : public KeyValueStore {
+public:
+    MeteredKeyValueStore(std::unique_ptr<KeyValueStore> &toMeter, Metrics &metrics,
+                         const std::string &layer);
+    virtual ~MeteredKeyValueStore();
+
+    // Management methods
+    virtual void loadKeysInto(std::function<void(std::string key,
+                                                 std::string vlaue)>) override;
+    virtual void clear() override;
+
+    // Set or get methods
+    virtual void setKeyValue(const std::string &key, const std::string &value) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) override;
+    virtual void appendKeyValue(const std::string &key, const std::string &value) override;
+    virtual void mergeKeyValue(const std::string &key, const std::string &operand,
+                               MergeOperator op) override;
+    virtual void mergeKeyValue(const std::string &key,
+                               const std::unordered_set<std::string> &members) override;
+    virtual bool compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                       const std::string &value) override;
+    virtual void deleteKeyValue(const std::string &key) override;
+    virtual void removeKeyValue(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key) override;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override;
+    virtual std::unique_ptr<KeyValueSnapshot> snapshot() override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual MemoryUsage memoryUsage(const std::string &key) const override;
+
+    KeyValueStore &metered();
 
 private:
     class Impl;
@@ -78,6 +364,7 @@ private:
 class EmbeddedDatabase: public IDatabase {
 public:
     EmbeddedDatabase(const std::string &dbName, const std::string &fullpath);
+    EmbeddedDatabase(const std::string &dbName, const std::string &fullpath, AccessMode mode);
     EmbeddedDatabase(const std::string &dbName, const std::string &fullpath,
                      std::unique_ptr<KeyValueStore> &kvStore);
     virtual ~EmbeddedDatabase();
@@ -89,6 +376,7 @@ public:
     static const std::unique_ptr<IDatabase> createEmpty(const std::string &dbName,
                                                         std::unique_ptr<KeyValueStore> &kvStore);
     static const std::unique_ptr<IDatabase> load(const std::string &dbName);
+    static const std::unique_ptr<IDatabase> load(const std::string &dbName, AccessMode mode);
     virtual void destroy() override;
 
     // Set methods
@@ -103,14 +391,70 @@ public:
                              const std::unordered_set<std::string> &value,
                              const std::string &bucket) override;
 
+    // Set methods with time to live, readers of a shared database see a key until
+    // the writer's expiry removes it
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl) override;
+    virtual std::uint64_t expiredKeys() const override;
+
+    // Merge methods
+    virtual void incrementKeyValue(const std::string &key, std::int64_t delta = 1) override;
+    virtual void decrementKeyValue(const std::string &key, std::int64_t delta = 1) override;
+    virtual void appendToKeyValue(const std::string &key, const std::string &suffix) override;
+    virtual void mergeKeyValueSet(const std::string &key,
+                                  const std::unordered_set<std::string> &members) override;
+
+    // Conditional and versioned methods
+    virtual bool compareAndSet(const std::string &key, const std::string &expected,
+                               const std::string &value) override;
+    virtual bool setIfAbsent(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key, std::uint64_t &version) override;
+    virtual bool setKeyValueIfVersion(const std::string &key, const std::string &value,
+                                      std::uint64_t version) override;
+
+    // Delete methods
+    virtual void deleteKey(const std::string &key) override;
+    virtual void removeFromBucket(const std::string &key, const std::string &bucket) override;
+
     // Get methods
     virtual std::string getKeyValue(const std::string &key) override;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
 
     // Query records methods
     virtual std::unique_ptr<IQueryResult> query(Query &q) const override;
     virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) const override;
+    virtual std::unique_ptr<IQueryResult> query(RangeQuery &q) const override;
+    virtual bool tryQuery(BucketQuery &q, std::unique_ptr<IQueryResult> &result) const override;
+
+    // Snapshot method, throws std::runtime_error for databases shared between processes
+    virtual std::unique_ptr<ISnapshot> snapshot() override;
+
+    // Transaction methods, commits only see writes made through this database object
+    virtual std::unique_ptr<ITransaction> begin() override;
+    virtual bool transact(std::function<void(ITransaction &txn)> body, int attempts = 16) override;
+
+    // Stats methods
+    virtual Stats stats() const override;
+    virtual void enableStats(bool enabled) override;
+    virtual void setSlowThreshold(std::chrono::nanoseconds threshold,
+                                  std::size_t capacity = 128) override;
+    virtual std::vector<SlowOperation> slowOperations() const override;
+
+    // Memory methods
+    virtual MemoryUsage memoryUsage() const override;
+    virtual std::map<std::string, MemoryUsage> bucketMemoryUsage() const override;
 
 private:
     class Impl;
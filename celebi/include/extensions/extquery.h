@@ -11,12 +11,15 @@ class DefaultQueryResult : public IQueryResult {
 public:
     DefaultQueryResult();
     DefaultQueryResult(std::unique_ptr<std::unordered_set<std::string>> recordKeys);
+    DefaultQueryResult(std::unique_ptr<std::vector<std::string>> orderedRecordKeys);
     virtual ~DefaultQueryResult() = default;
 
     virtual const std::unique_ptr<std::unordered_set<std::string>> recordKeys() override;
+    virtual const std::unique_ptr<std::vector<std::string>> orderedRecordKeys() override;
 
 private:
     std::unique_ptr<std::unordered_set<std::string>> m_recordKeys;
+    std::unique_ptr<std::vector<std::string>> m_orderedRecordKeys;
 };
 
 }
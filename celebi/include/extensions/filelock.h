@@ -0,0 +1,35 @@
+#ifndef __CELEBI_EXTENSION_FILELOCK_H__
+#define __CELEBI_EXTENSION_FILELOCK_H__
+
+#include <memory>
+#include <string>
+
+namespace celebiext {
+
+/**
+ * @brief The FileLock class is advisory lock between processes, held until destruction.
+ *        Locks on the same file are shared by everything in one process, so only other
+ *        processes can conflict with it.
+ */
+class FileLock {
+public:
+    enum class Type {
+        SHARED,
+        EXCLUSIVE,
+    };
+
+    // throws std::runtime_error if another process holds a conflicting lock
+    FileLock(const std::string &path, Type type);
+    ~FileLock();
+
+    FileLock(const FileLock &) = delete;
+    FileLock &operator=(const FileLock &) = delete;
+
+private:
+    class Impl;
+    std::shared_ptr<Impl> m_impl;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_FILELOCK_H__
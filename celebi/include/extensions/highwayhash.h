@@ -9,6 +9,10 @@ namespace celebiext {
 
 using namespace highwayhash;
 
+/**
+ * @brief The HighwayHash class is hash functor for keys, it keeps no hashing state
+ *        between calls so that it can be shared by concurrent readers
+ */
 class HighwayHash {
 public:
     HighwayHash();
@@ -19,8 +23,6 @@ public:
 
 private:
     const HHKey m_key HH_ALIGNAS(64);
-    HighwayHashCatT<HH_TARGET> *m_hh;
-    HHResult64 *m_result;
 };
 
 }
@@ -0,0 +1,217 @@
+#ifndef __CELEBI_EXTENSION_METRICS_H__
+#define __CELEBI_EXTENSION_METRICS_H__
+
+#include "stats.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace celebiext {
+
+using namespace celebi;
+
+/**
+ * @brief The LatencyRecorder class fills a histogram from many threads, a thread counts
+ *        into one of a few stripes so threads seldom write the same cache line.
+ *        Recording is two relaxed atomic adds.
+ */
+class LatencyRecorder {
+public:
+    LatencyRecorder(const std::atomic<bool> &enabled, const Stats::Series &series);
+
+    // Layer and operation
+    const Stats::Series &series() const
+    {
+        return m_series;
+    }
+
+    bool enabled() const
+    {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    void record(std::uint64_t nanos)
+    {
+        Stripe &stripe = m_stripes[stripeOfThread()];
+        stripe.m_counts[Histogram::bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+        stripe.m_sum.fetch_add(nanos, std::memory_order_relaxed);
+    }
+
+    Histogram histogram() const;
+
+private:
+    static constexpr std::size_t stripes = 4;
+
+    struct alignas(64) Stripe {
+        std::array<std::atomic<std::uint64_t>, Histogram::buckets> m_counts{};
+        std::atomic<std::uint64_t> m_sum{0};
+    };
+
+    static std::size_t stripeOfThread();
+
+    const std::atomic<bool> &m_enabled;
+    const Stats::Series &m_series;
+    std::array<Stripe, stripes> m_stripes;
+};
+
+/**
+ * @brief The LayerTimes struct adds up the time one call spends in each layer, the layers
+ *        timed on a thread add to the thread's current one if it has any
+ */
+struct LayerTimes {
+    static constexpr std::size_t maxLayers = 8;
+
+    std::array<const std::string *, maxLayers> m_layers{};
+    std::array<std::uint64_t, maxLayers> m_nanos{};
+    std::size_t m_count = 0;
+
+    void add(const std::string &layer, std::uint64_t nanos);
+
+    static LayerTimes *&current()
+    {
+        thread_local LayerTimes *times = nullptr;
+        return times;
+    }
+};
+
+/**
+ * @brief The ScopedLatency class records the time a layer takes until it goes out of scope,
+ *        it reads no clock while its recorder's metrics are off and no call is timed by layer
+ */
+class ScopedLatency {
+public:
+    explicit ScopedLatency(LatencyRecorder &recorder)
+        : m_recorder(recorder.enabled() || LayerTimes::current() ? &recorder : nullptr),
+          m_start(m_recorder ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point())
+    {
+
+    }
+
+    ~ScopedLatency()
+    {
+        if (!m_recorder)
+            return;
+
+        const std::uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - m_start).count();
+        if (m_recorder->enabled())
+            m_recorder->record(nanos);
+        if (LayerTimes *times = LayerTimes::current())
+            times->add(m_recorder->series().first, nanos);
+    }
+
+    ScopedLatency(const ScopedLatency &) = delete;
+    ScopedLatency &operator=(const ScopedLatency &) = delete;
+
+private:
+    LatencyRecorder *m_recorder;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+/**
+ * @brief The SlowLog class keeps the newest calls which took its threshold or longer,
+ *        there are few of them so a lock is fine
+ */
+class SlowLog {
+public:
+    SlowLog();
+
+    // A zero threshold turns the log off
+    void configure(std::chrono::nanoseconds threshold, std::size_t capacity);
+
+    bool enabled() const
+    {
+        return 0 != m_threshold.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t threshold() const
+    {
+        return m_threshold.load(std::memory_order_relaxed);
+    }
+
+    void record(SlowOperation operation);
+    std::vector<SlowOperation> operations() const;
+
+private:
+    std::atomic<std::uint64_t> m_threshold;
+    mutable std::mutex m_lock;
+    std::size_t m_capacity;
+    std::deque<SlowOperation> m_operations;
+};
+
+/**
+ * @brief The TimedCall class times a call into the database for its histogram and the
+ *        slow log. Only the outermost call on a thread goes to the slow log, with the
+ *        time of the layers below it. The key and bucket must outlive the call.
+ */
+class TimedCall {
+public:
+    TimedCall(LatencyRecorder &recorder, SlowLog &slowLog, const std::string &key,
+              const std::string *bucket = nullptr);
+    ~TimedCall();
+
+    TimedCall(const TimedCall &) = delete;
+    TimedCall &operator=(const TimedCall &) = delete;
+
+    // The size of the value written or read, only worked out if the slow log may need it
+    void value(const std::string &value)
+    {
+        if (m_slowLog)
+            m_valueSize = value.size();
+    }
+
+    void value(const std::unordered_set<std::string> &value);
+
+private:
+    LatencyRecorder &m_recorder;
+    SlowLog *m_slowLog;
+    const std::string &m_key;
+    const std::string *m_bucket;
+    std::size_t m_valueSize;
+    bool m_timed;
+    std::chrono::steady_clock::time_point m_start;
+    LayerTimes m_layers;
+};
+
+/**
+ * @brief The Metrics class holds the recorders and counters of a database by layer and
+ *        operation. They are made on first use and live as long as the metrics, so hot
+ *        paths look them up once up front and keep the reference.
+ */
+class Metrics {
+public:
+    Metrics();
+
+    LatencyRecorder &latency(const std::string &layer, const std::string &operation);
+    std::atomic<std::uint64_t> &counter(const std::string &layer, const std::string &name);
+
+    // A collector adds what is counted elsewhere, e.g. by a store, to every stats() until
+    // it is removed again, which must happen before what it reads goes
+    std::size_t collect(std::function<void(Stats &stats)> collector);
+    void uncollect(std::size_t collector);
+
+    void enable(bool enabled);
+    Stats stats() const;
+
+private:
+    std::atomic<bool> m_enabled;
+    mutable std::mutex m_lock;
+    std::map<Stats::Series, std::unique_ptr<LatencyRecorder>> m_latencies;
+    std::map<Stats::Series, std::unique_ptr<std::atomic<std::uint64_t>>> m_counters;
+    std::map<std::size_t, std::function<void(Stats &stats)>> m_collectors;
+    std::size_t m_nextCollector;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_METRICS_H__
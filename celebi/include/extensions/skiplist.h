@@ -0,0 +1,212 @@
+#ifndef __CELEBI_EXTENSION_SKIPLIST_H__
+#define __CELEBI_EXTENSION_SKIPLIST_H__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <utility>
+
+namespace celebiext {
+
+/**
+ * @brief The SkipList class is ordered set of unique elements. Writers must be
+ *        serialized by the caller, but readers and iterators need no lock at all:
+ *        a node is fully built before a release store links it in.
+ */
+template <typename T, typename Compare = std::less<T>>
+class SkipList {
+private:
+    struct Node;
+
+public:
+    /**
+     * @brief The Iterator class walks the list in both directions,
+     *        stepping back costs a search from the head
+     */
+    class Iterator {
+    public:
+        explicit Iterator(const SkipList *list) : m_list(list), m_node(nullptr) {}
+
+        bool valid() const { return nullptr != m_node; }
+        const T &operator*() const { return m_node->m_value; }
+        const T *operator->() const { return &m_node->m_value; }
+
+        void next() { m_node = m_node->next(0); }
+        void prev() { m_node = m_list->findLessThan(m_node->m_value); }
+
+        // first element not less than value
+        void seek(const T &value) { m_node = m_list->findGreaterOrEqual(value, nullptr); }
+        // last element less than value
+        void seekBefore(const T &value) { m_node = m_list->findLessThan(value); }
+        void seekToFirst() { m_node = m_list->m_head->next(0); }
+        void seekToLast() { m_node = m_list->findLast(); }
+
+    private:
+        const SkipList *m_list;
+        const Node *m_node;
+    };
+
+    explicit SkipList(Compare compare = Compare())
+        : m_compare(compare), m_head(newNode(T(), maxHeight)), m_height(1), m_size(0), m_random(0xdeadbeef)
+    {
+
+    }
+
+    ~SkipList()
+    {
+        for (Node *node = m_head; node; ) {
+            Node *next = node->next(0);
+            deleteNode(node);
+            node = next;
+        }
+    }
+
+    SkipList(const SkipList &) = delete;
+    SkipList &operator=(const SkipList &) = delete;
+
+    // Returns false if an equal element is in the list already
+    bool insert(const T &value)
+    {
+        Node *prev[maxHeight];
+        Node *node = findGreaterOrEqual(value, prev);
+        if (node && !m_compare(value, node->m_value))
+            return false;
+
+        int height = randomHeight();
+        int current = m_height.load(std::memory_order_relaxed);
+        if (height > current) {
+            for (int i = current; i < height; i++)
+                prev[i] = m_head;
+            // readers seeing the new height before the node just find nullptr from head
+            m_height.store(height, std::memory_order_relaxed);
+        }
+
+        node = newNode(value, height);
+        for (int i = 0; i < height; i++) {
+            node->setNextRelaxed(i, prev[i]->nextRelaxed(i));
+            prev[i]->setNext(i, node);
+        }
+        m_size.fetch_add(1, std::memory_order_relaxed);
+
+        return true;
+    }
+
+    bool contains(const T &value) const
+    {
+        Node *node = findGreaterOrEqual(value, nullptr);
+
+        return node && !m_compare(value, node->m_value);
+    }
+
+    std::size_t size() const
+    {
+        return m_size.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr int maxHeight = 12;
+
+    struct Node {
+        explicit Node(const T &value) : m_value(value) {}
+
+        Node *next(int level) const { return m_next[level].load(std::memory_order_acquire); }
+        void setNext(int level, Node *node) { m_next[level].store(node, std::memory_order_release); }
+        Node *nextRelaxed(int level) const { return m_next[level].load(std::memory_order_relaxed); }
+        void setNextRelaxed(int level, Node *node) { m_next[level].store(node, std::memory_order_relaxed); }
+
+        const T m_value;
+        std::atomic<Node *> m_next[1];  // as many as the height, allocated past the node
+    };
+
+    static Node *newNode(const T &value, int height)
+    {
+        void *memory = ::operator new(sizeof(Node) + sizeof(std::atomic<Node *>) * (height - 1));
+        Node *node = new (memory) Node(value);
+        for (int i = 1; i < height; i++)
+            new (&node->m_next[i]) std::atomic<Node *>();
+        for (int i = 0; i < height; i++)
+            node->setNextRelaxed(i, nullptr);
+
+        return node;
+    }
+
+    static void deleteNode(Node *node)
+    {
+        node->~Node();
+        ::operator delete(node);
+    }
+
+    // each level holds a quarter of the elements of the one below
+    int randomHeight()
+    {
+        int height = 1;
+        while (height < maxHeight) {
+            m_random ^= m_random << 13;
+            m_random ^= m_random >> 7;
+            m_random ^= m_random << 17;
+            if (0 != (m_random & 3))
+                break;
+            height++;
+        }
+
+        return height;
+    }
+
+    Node *findGreaterOrEqual(const T &value, Node **prev) const
+    {
+        Node *node = m_head;
+        for (int level = m_height.load(std::memory_order_relaxed) - 1; ; ) {
+            Node *next = node->next(level);
+            if (next && m_compare(next->m_value, value)) {
+                node = next;
+            } else {
+                if (prev)
+                    prev[level] = node;
+                if (0 == level)
+                    return next;
+                level--;
+            }
+        }
+    }
+
+    Node *findLessThan(const T &value) const
+    {
+        Node *node = m_head;
+        for (int level = m_height.load(std::memory_order_relaxed) - 1; ; ) {
+            Node *next = node->next(level);
+            if (next && m_compare(next->m_value, value)) {
+                node = next;
+            } else {
+                if (0 == level)
+                    return node == m_head ? nullptr : node;
+                level--;
+            }
+        }
+    }
+
+    Node *findLast() const
+    {
+        Node *node = m_head;
+        for (int level = m_height.load(std::memory_order_relaxed) - 1; ; ) {
+            Node *next = node->next(level);
+            if (next) {
+                node = next;
+            } else {
+                if (0 == level)
+                    return node == m_head ? nullptr : node;
+                level--;
+            }
+        }
+    }
+
+    Compare m_compare;
+    Node *const m_head;
+    std::atomic<int> m_height;
+    std::atomic<std::size_t> m_size;
+    std::uint64_t m_random;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_SKIPLIST_H__
@@ -0,0 +1,227 @@
+#ifndef __CELEBI_EXTENSION_SSTABLE_H__
+#define __CELEBI_EXTENSION_SSTABLE_H__
+
+#include "extensions/bloomfilter.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace celebiext {
+
+using namespace celebi;
+
+/**
+ * @brief The EntryKind enum is what an entry of the LSM tree holds for its key,
+ *        strings and sets of the same key are separate columns like in the file store
+ */
+enum class EntryKind : std::uint8_t {
+    STRING = 0,         // a string value
+    SET = 1,            // a whole set, shadows anything older in the set column
+    SET_MERGE = 2,      // members to add to whatever set is older
+    STRING_DELETE = 3,  // tombstone of the string column, dropped by the compaction
+                        // which finds nothing older left below it
+    SET_DELETE = 4,     // tombstone of the set column, the same for sets
+    SET_REMOVE = 5,     // members to take out of whatever set is older
+    STRING_ADD = 6,     // a number to add to whatever string is older
+    STRING_APPEND = 7,  // a string to append to whatever string is older
+};
+
+inline std::uint8_t columnOf(EntryKind kind)
+{
+    switch (kind) {
+    case EntryKind::STRING:
+    case EntryKind::STRING_DELETE:
+    case EntryKind::STRING_ADD:
+    case EntryKind::STRING_APPEND:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// Returns false for entries which only change what is older in their column
+inline bool shadows(EntryKind kind)
+{
+    return EntryKind::SET_MERGE != kind && EntryKind::SET_REMOVE != kind &&
+            EntryKind::STRING_ADD != kind && EntryKind::STRING_APPEND != kind;
+}
+
+inline bool isTombstone(EntryKind kind)
+{
+    return EntryKind::STRING_DELETE == kind || EntryKind::SET_DELETE == kind;
+}
+
+/**
+ * @brief The InternalKey struct orders entries by key, column and newest first
+ */
+struct InternalKey {
+    static constexpr std::uint64_t maxSeq = UINT64_MAX;
+
+    std::string m_user;
+    std::uint64_t m_seq = 0;
+    EntryKind m_kind = EntryKind::STRING;
+
+    // Sorts before every entry of the key in that column
+    static InternalKey first(const std::string &user, std::uint8_t column);
+
+    std::string logicalKey() const;
+    void encodeTo(std::string &out) const;
+    static InternalKey decode(const char *data, std::size_t size);
+};
+
+int compare(const InternalKey &a, const InternalKey &b);
+
+/**
+ * @brief The Entry struct is a key with its value, as kept in memtables and tables
+ */
+struct Entry {
+    InternalKey m_key;
+    std::string m_value;
+};
+
+struct EntryCompare {
+    bool operator()(const Entry &a, const Entry &b) const { return compare(a.m_key, b.m_key) < 0; }
+};
+
+// [4 bytes key length][internal key][4 bytes value length][value], in blocks and logs
+void encodeEntry(const Entry &entry, std::string &out);
+// Returns false if the entry at pos is cut short
+bool decodeEntry(const std::string &in, std::size_t &pos, Entry &entry);
+
+std::string encodeSet(const std::unordered_set<std::string> &set);
+void decodeSetInto(const std::string &encoded, std::unordered_set<std::string> &set);
+
+/**
+ * @brief The EntryIterator class walks entries in internal key order, a scan goes
+ *        one way only: seek or seekToFirst then next, seekBefore or seekToLast then prev
+ */
+class EntryIterator {
+public:
+    EntryIterator() = default;
+    virtual ~EntryIterator() = default;
+
+    virtual bool valid() const = 0;
+    virtual const Entry &entry() const = 0;
+
+    virtual void seekToFirst() = 0;
+    virtual void seekToLast() = 0;
+    // first entry not less than target
+    virtual void seek(const InternalKey &target) = 0;
+    // last entry less than target
+    virtual void seekBefore(const InternalKey &target) = 0;
+    virtual void next() = 0;
+    virtual void prev() = 0;
+};
+
+/**
+ * @brief The TableBuilder class writes a sorted string table: data blocks,
+ *        an index with the last key of each block, a bloom filter and a footer
+ */
+class TableBuilder {
+public:
+    TableBuilder(const std::string &path, std::size_t blockSize, int bitsPerKey);
+    ~TableBuilder();
+
+    // Entries must come in internal key order
+    void add(const Entry &entry);
+    void finish(bool sync);
+
+    std::uint64_t fileSize() const;
+    std::size_t entries() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The Table class reads a sorted string table, its index and bloom filter
+ *        stay in memory and data blocks are read on demand. Iterators keep the table
+ *        alive, an obsolete table deletes its file once the last one is gone.
+ */
+class Table : public std::enable_shared_from_this<Table> {
+public:
+    static std::shared_ptr<Table> open(const std::string &path, std::uint64_t number);
+    ~Table();
+
+    std::uint64_t number() const;
+    std::uint64_t fileSize() const;
+    std::size_t entries() const;
+    const InternalKey &smallest() const;
+    const InternalKey &largest() const;
+
+    bool mayContain(const std::string &logicalKey) const;
+    const BloomFilter &filter() const;
+    std::unique_ptr<EntryIterator> iterator() const;
+
+    // Adds the index and filter the table keeps in memory
+    void memoryUsage(MemoryUsage &usage) const;
+
+    void markObsolete();
+
+    class Impl;
+
+private:
+    Table();
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The MergingIterator class merges sorted iterators into one,
+ *        children should be given newest first so ties go to the newest
+ */
+class MergingIterator : public EntryIterator {
+public:
+    explicit MergingIterator(std::vector<std::unique_ptr<EntryIterator>> children);
+
+    virtual bool valid() const override;
+    virtual const Entry &entry() const override;
+    virtual void seekToFirst() override;
+    virtual void seekToLast() override;
+    virtual void seek(const InternalKey &target) override;
+    virtual void seekBefore(const InternalKey &target) override;
+    virtual void next() override;
+    virtual void prev() override;
+
+private:
+    void pickSmallest();
+    void pickLargest();
+
+    std::vector<std::unique_ptr<EntryIterator>> m_children;
+    EntryIterator *m_current;
+};
+
+/**
+ * @brief The ConcatenatingIterator class walks tables which hold disjoint
+ *        key ranges in order, one table open at a time
+ */
+class ConcatenatingIterator : public EntryIterator {
+public:
+    explicit ConcatenatingIterator(std::vector<std::shared_ptr<Table>> tables);
+
+    virtual bool valid() const override;
+    virtual const Entry &entry() const override;
+    virtual void seekToFirst() override;
+    virtual void seekToLast() override;
+    virtual void seek(const InternalKey &target) override;
+    virtual void seekBefore(const InternalKey &target) override;
+    virtual void next() override;
+    virtual void prev() override;
+
+private:
+    void openTable(std::size_t index);
+    void skipForward();
+    void skipBackward();
+
+    std::vector<std::shared_ptr<Table>> m_tables;
+    std::size_t m_index;
+    std::unique_ptr<EntryIterator> m_current;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_SSTABLE_H__
@@ -0,0 +1,51 @@
+#ifndef __CELEBI_EXTENSION_TIMINGWHEEL_H__
+#define __CELEBI_EXTENSION_TIMINGWHEEL_H__
+
+#include "stats.h"
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace celebiext {
+
+/**
+ * @brief The TimingWheel class is a hierarchical timing wheel of keys to expire,
+ *        scheduling is O(1) and each key cascades down at most once per level.
+ *        Deadlines are in milliseconds of any clock, the wheel is not thread safe.
+ */
+class TimingWheel {
+public:
+    static constexpr std::size_t slots = 256;
+    static constexpr std::size_t levels = 4;
+
+    TimingWheel(std::uint64_t now, std::uint64_t tickMs);
+
+    void schedule(const std::string &key, std::uint64_t deadline);
+    // Fires every key due by now, a key scheduled twice fires twice
+    void advance(std::uint64_t now, const std::function<void(const std::string &, std::uint64_t)> &fire);
+
+    std::size_t size() const;
+    std::uint64_t tickMs() const;
+    // Adds the slots and the keys of the timers in them
+    void memoryUsage(celebi::MemoryUsage &usage) const;
+
+private:
+    struct Timer {
+        std::string m_key;
+        std::uint64_t m_deadline;
+    };
+
+    void place(Timer timer, std::uint64_t earliest);
+
+    std::uint64_t m_tickMs;
+    std::uint64_t m_tick;
+    std::size_t m_size;
+    std::array<std::array<std::vector<Timer>, slots>, levels> m_wheels;
+};
+
+}
+
+#endif // __CELEBI_EXTENSION_TIMINGWHEEL_H__
@@ -0,0 +1,106 @@
+#ifndef __CELEBI_EXTENSION_TRACE_H__
+#define __CELEBI_EXTENSION_TRACE_H__
+
+#include <cstdint>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace celebiext {
+
+/**
+ * @brief The TraceEvent struct is one span, times are nanoseconds of the steady clock
+ */
+struct TraceEvent {
+    const char *m_name;
+    std::uint64_t m_start;
+    std::uint64_t m_duration;
+    std::uint64_t m_keyHash;
+    std::uint64_t m_bytes;
+    std::uint32_t m_thread;
+};
+
+/**
+ * @brief The Tracer class collects spans into a ring per thread. The thread writes its
+ *        ring without locks or waiting, a reader skips a slot it finds half written and
+ *        a full ring overwrites its oldest spans. Tracing is off until enabled.
+ */
+class Tracer {
+public:
+    Tracer() = delete;
+
+    static constexpr std::size_t ringSize = 4096;
+
+    static void enable(bool enabled);
+    static bool enabled();
+
+    // Span names must be string literals, rings keep the pointer
+    static void record(const char *name, std::uint64_t start, std::uint64_t end,
+                       std::uint64_t keyHash, std::uint64_t bytes);
+    static std::uint64_t now();
+
+    // Spans still in the rings and started after the last clear, oldest first
+    static std::vector<TraceEvent> events();
+    static void clear();
+
+    // Chrome trace event format, loads in chrome://tracing and Perfetto
+    static std::string chromeTrace();
+    static void writeChromeTrace(const std::string &path);
+};
+
+/**
+ * @brief The TraceSpan class records a span from its construction until it goes out of
+ *        scope, while tracing is off it reads no clock and records nothing
+ */
+class TraceSpan {
+public:
+    TraceSpan(const char *name, const std::string &key, std::uint64_t bytes = 0);
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    bool on() const
+    {
+        return 0 != m_start;
+    }
+
+    void bytes(std::uint64_t bytes)
+    {
+        m_bytes = bytes;
+    }
+
+    static std::uint64_t bytesOf(const std::string &value)
+    {
+        return value.size();
+    }
+
+    static std::uint64_t bytesOf(const std::unordered_set<std::string> &value)
+    {
+        std::uint64_t bytes = 0;
+        for (auto &member : value)
+            bytes += member.size();
+
+        return bytes;
+    }
+
+private:
+    const char *m_name;
+    std::uint64_t m_start;
+    std::uint64_t m_keyHash;
+    std::uint64_t m_bytes;
+};
+
+}
+
+// Trace points are compiled in with CELEBI_TRACING only, otherwise they and their
+// arguments are gone. A span lasts until the end of the enclosing scope.
+#ifdef CELEBI_TRACING
+#define CELEBI_TRACE_SPAN(span, name, ...) celebiext::TraceSpan span(name, __VA_ARGS__)
+#define CELEBI_TRACE_BYTES(span, count) do { if (span.on()) span.bytes(count); } while (0)
+#else
+#define CELEBI_TRACE_SPAN(span, name, ...) do {} while (0)
+#define CELEBI_TRACE_BYTES(span, count) do {} while (0)
+#endif
+
+#endif // __CELEBI_EXTENSION_TRACE_H__
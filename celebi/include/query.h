@@ -4,6 +4,7 @@
 #include <memory>
 #include <unordered_set>
 #include <string>
+#include <vector>
 
 namespace celebi {
 
@@ -25,12 +26,49 @@ private:
     std::unique_ptr<Impl> m_impl;
 };
 
+/**
+ * @brief The RangeQuery class selects keys in [from, to) in lexicographic order,
+ *        an empty bound leaves that end open and a limit of 0 means no limit
+ */
+class RangeQuery : public Query {
+public:
+    RangeQuery(const std::string &from, const std::string &to,
+               bool reverse = false, std::size_t limit = 0);
+    virtual ~RangeQuery();
+
+    virtual const std::string from() const;
+    virtual const std::string to() const;
+    virtual bool reverse() const;
+    virtual std::size_t limit() const;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+/**
+ * @brief The PrefixQuery class selects keys starting with a prefix,
+ *        which is the range from the prefix up to its successor
+ */
+class PrefixQuery : public RangeQuery {
+public:
+    PrefixQuery(const std::string &prefix, bool reverse = false, std::size_t limit = 0);
+    virtual ~PrefixQuery();
+
+    virtual const std::string prefix() const;
+
+private:
+    std::string m_prefix;
+};
+
 class IQueryResult {
 public:
     IQueryResult() = default;
     virtual ~IQueryResult() = default;
 
     virtual const std::unique_ptr<std::unordered_set<std::string>> recordKeys() = 0;
+    // Same keys, in the order of a range query or sorted for other queries
+    virtual const std::unique_ptr<std::vector<std::string>> orderedRecordKeys();
 };
 
 }
@@ -0,0 +1,109 @@
+#ifndef __CELEBI_STATS_H__
+#define __CELEBI_STATS_H__
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <utility>
+
+namespace celebi {
+
+/**
+ * @brief The Histogram struct is a latency distribution in nanoseconds, HDR style:
+ *        each power of two is split into linear sub-buckets, so a percentile read
+ *        from it is within 1/16 of the true one whatever the scale
+ */
+struct Histogram {
+    static constexpr unsigned subBucketBits = 4;
+    static constexpr std::uint64_t subBuckets = std::uint64_t(1) << subBucketBits;
+    static constexpr unsigned maxExponent = 40;     // about 18 minutes, longer counts as that
+    static constexpr std::size_t buckets = 2 * subBuckets + (maxExponent - subBucketBits) * subBuckets;
+
+    std::array<std::uint64_t, buckets> m_counts{};
+    std::uint64_t m_count = 0;
+    std::uint64_t m_sum = 0;
+
+    static std::size_t bucketOf(std::uint64_t nanos);
+    // Largest value of the bucket
+    static std::uint64_t upperBound(std::size_t bucket);
+
+    // Upper bound of the bucket holding the q-th quantile, q in [0, 1]
+    std::uint64_t percentile(double q) const;
+    std::uint64_t max() const;
+    double mean() const;
+
+    void merge(const Histogram &other);
+};
+
+/**
+ * @brief The Stats struct is what a database has counted so far, by layer and
+ *        operation, e.g. ("database", "get") or ("file", "get")
+ */
+struct Stats {
+    using Series = std::pair<std::string, std::string>;
+
+    std::map<Series, Histogram> m_latencies;
+    std::map<Series, std::uint64_t> m_counters;
+
+    const Histogram &latency(const std::string &layer, const std::string &operation) const;
+    std::uint64_t counter(const std::string &layer, const std::string &name) const;
+
+    // Prometheus text exposition format, written to a file by renaming a temporary
+    // one over it so a scraper never reads half of it
+    std::string prometheus() const;
+    void writePrometheus(const std::string &path) const;
+};
+
+/**
+ * @brief The SlowOperation struct is a call which took the slow log's threshold or longer,
+ *        with the time it spent in each layer below, a layer's time includes the layers
+ *        it calls into
+ */
+struct SlowOperation {
+    static constexpr std::size_t maxKeySize = 64;   // longer keys are kept cut to this
+
+    std::string m_operation;
+    std::string m_key;
+    std::size_t m_keySize = 0;
+    std::size_t m_valueSize = 0;
+    std::string m_bucket;
+    std::chrono::nanoseconds m_duration{0};
+    std::chrono::system_clock::time_point m_time;
+    std::map<std::string, std::chrono::nanoseconds> m_layers;
+};
+
+/**
+ * @brief The MemoryUsage struct is the memory something holds in bytes, by what it holds
+ *        it for. A block counts at the size the allocator hands out for it, whatever is
+ *        past the bytes asked for is slack.
+ */
+struct MemoryUsage {
+    std::size_t m_keys = 0;         // key characters
+    std::size_t m_values = 0;       // string value characters
+    std::size_t m_members = 0;      // set member characters
+    std::size_t m_postings = 0;     // characters of the index, bucket members and key buckets
+    std::size_t m_overhead = 0;     // tables, nodes, headers, filters and bookkeeping
+    std::size_t m_mapped = 0;       // files and shared memory mapped in, the kernel may page it out
+    std::size_t m_slack = 0;        // allocator rounding and spare string capacity
+
+    std::size_t total() const;
+    MemoryUsage &operator+=(const MemoryUsage &other);
+
+    // Size of the chunk malloc takes for a request, as glibc rounds it
+    static std::size_t allocated(std::size_t bytes);
+
+    // Counts a heap block as overhead
+    void block(std::size_t bytes);
+    // Counts the characters of a string to a field, its object is counted with its holder
+    void string(const std::string &value, std::size_t MemoryUsage::*field);
+    // Counts the bucket array and nodes of a set as overhead and its members to a field
+    void set(const std::unordered_set<std::string> &value, std::size_t MemoryUsage::*field);
+};
+
+}
+
+#endif // __CELEBI_STATS_H__
@@ -0,0 +1,661 @@
+#include "extensions/art.h"
+#include "extensions/epoch.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace celebiext {
+
+enum class NodeType : std::uint8_t {
+    LEAF,
+    NODE4,
+    NODE16,
+    NODE48,
+    NODE256,
+};
+
+struct AdaptiveRadixTree::Node {
+    explicit Node(NodeType type) : m_type(type) {}
+
+    const NodeType m_type;
+};
+
+namespace {
+
+using Node = AdaptiveRadixTree::Node;
+
+// A key ends in a leaf, which keeps only the bytes below its place in the tree
+struct Leaf : Node {
+    explicit Leaf(const std::string &suffix) : Node(NodeType::LEAF), m_suffix(suffix) {}
+
+    const std::string m_suffix;
+};
+
+// Inner nodes never change their prefix, a writer copies the node to change it.
+// m_terminal marks the key which ends right after the prefix.
+struct Inner : Node {
+    Inner(NodeType type, const std::string &prefix)
+        : Node(type), m_prefix(prefix), m_terminal(false), m_count(0) {}
+
+    const std::string m_prefix;
+    std::atomic<bool> m_terminal;
+    std::uint16_t m_count;
+};
+
+// Node4 and Node16 keep their keys sorted and are copied to add a child,
+// so readers always see a complete key array
+struct Node4 : Inner {
+    explicit Node4(const std::string &prefix) : Inner(NodeType::NODE4, prefix) {}
+
+    static constexpr std::size_t capacity = 4;
+    std::uint8_t m_keys[capacity] = {};
+    std::atomic<Node *> m_children[capacity] = {};
+};
+
+struct Node16 : Inner {
+    explicit Node16(const std::string &prefix) : Inner(NodeType::NODE16, prefix) {}
+
+    static constexpr std::size_t capacity = 16;
+    alignas(16) std::uint8_t m_keys[capacity] = {};
+    std::atomic<Node *> m_children[capacity] = {};
+};
+
+// Node48 and Node256 take new children in place: the child is stored before
+// the slot which points to it, 0 in m_index is an empty slot
+struct Node48 : Inner {
+    explicit Node48(const std::string &prefix) : Inner(NodeType::NODE48, prefix) {}
+
+    static constexpr std::size_t capacity = 48;
+    std::atomic<std::uint8_t> m_index[256] = {};
+    std::atomic<Node *> m_children[capacity] = {};
+};
+
+struct Node256 : Inner {
+    explicit Node256(const std::string &prefix) : Inner(NodeType::NODE256, prefix) {}
+
+    static constexpr std::size_t capacity = 256;
+    std::atomic<Node *> m_children[capacity] = {};
+};
+
+void deleteNode(void *ptr)
+{
+    Node *node = static_cast<Node *>(ptr);
+    switch (node->m_type) {
+    case NodeType::LEAF:
+        delete static_cast<Leaf *>(node);
+        break;
+    case NodeType::NODE4:
+        delete static_cast<Node4 *>(node);
+        break;
+    case NodeType::NODE16:
+        delete static_cast<Node16 *>(node);
+        break;
+    case NodeType::NODE48:
+        delete static_cast<Node48 *>(node);
+        break;
+    case NodeType::NODE256:
+        delete static_cast<Node256 *>(node);
+        break;
+    }
+}
+
+// Visits the children of a node in key order, or in reverse, until f returns false
+template <typename F>
+bool forEachChild(const Inner *inner, bool reverse, F f)
+{
+    auto visit = [&f](std::uint8_t key, const std::atomic<Node *> &child) {
+        Node *node = child.load(std::memory_order_acquire);
+        return !node || f(key, node);
+    };
+
+    switch (inner->m_type) {
+    case NodeType::NODE4:
+    case NodeType::NODE16: {
+        const std::uint8_t *keys;
+        const std::atomic<Node *> *children;
+        if (NodeType::NODE4 == inner->m_type) {
+            keys = static_cast<const Node4 *>(inner)->m_keys;
+            children = static_cast<const Node4 *>(inner)->m_children;
+        } else {
+            keys = static_cast<const Node16 *>(inner)->m_keys;
+            children = static_cast<const Node16 *>(inner)->m_children;
+        }
+        for (std::size_t n = 0; n < inner->m_count; n++) {
+            std::size_t i = reverse ? inner->m_count - 1 - n : n;
+            if (!visit(keys[i], children[i]))
+                return false;
+        }
+        return true;
+    }
+    case NodeType::NODE48: {
+        auto *node = static_cast<const Node48 *>(inner);
+        for (std::size_t n = 0; n < 256; n++) {
+            std::size_t key = reverse ? 255 - n : n;
+            std::uint8_t slot = node->m_index[key].load(std::memory_order_acquire);
+            if (slot && !visit(static_cast<std::uint8_t>(key), node->m_children[slot - 1]))
+                return false;
+        }
+        return true;
+    }
+    case NodeType::NODE256: {
+        auto *node = static_cast<const Node256 *>(inner);
+        for (std::size_t n = 0; n < 256; n++) {
+            std::size_t key = reverse ? 255 - n : n;
+            if (!visit(static_cast<std::uint8_t>(key), node->m_children[key]))
+                return false;
+        }
+        return true;
+    }
+    case NodeType::LEAF:
+        break;
+    }
+
+    return true;
+}
+
+std::atomic<Node *> *findChild(const Inner *inner, std::uint8_t key)
+{
+    switch (inner->m_type) {
+    case NodeType::NODE4: {
+        auto *node = const_cast<Node4 *>(static_cast<const Node4 *>(inner));
+        for (std::size_t i = 0; i < node->m_count; i++)
+            if (node->m_keys[i] == key)
+                return &node->m_children[i];
+        return nullptr;
+    }
+    case NodeType::NODE16: {
+        auto *node = const_cast<Node16 *>(static_cast<const Node16 *>(inner));
+#if defined(__SSE2__)
+        // compare all 16 keys at once, the bits past the count are masked off
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(key)),
+                                     _mm_load_si128(reinterpret_cast<const __m128i *>(node->m_keys)));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(cmp)) & ((1u << node->m_count) - 1);
+        return mask ? &node->m_children[__builtin_ctz(mask)] : nullptr;
+#else
+        for (std::size_t i = 0; i < node->m_count; i++)
+            if (node->m_keys[i] == key)
+                return &node->m_children[i];
+        return nullptr;
+#endif
+    }
+    case NodeType::NODE48: {
+        auto *node = const_cast<Node48 *>(static_cast<const Node48 *>(inner));
+        std::uint8_t slot = node->m_index[key].load(std::memory_order_acquire);
+        return slot ? &node->m_children[slot - 1] : nullptr;
+    }
+    case NodeType::NODE256: {
+        auto *node = const_cast<Node256 *>(static_cast<const Node256 *>(inner));
+        return node->m_children[key].load(std::memory_order_acquire) ? &node->m_children[key] : nullptr;
+    }
+    case NodeType::LEAF:
+        break;
+    }
+
+    return nullptr;
+}
+
+template <typename N>
+void insertSorted(N *node, std::uint8_t key, Node *child)
+{
+    std::size_t i = node->m_count;
+    for (; i > 0 && node->m_keys[i - 1] > key; i--) {
+        node->m_keys[i] = node->m_keys[i - 1];
+        node->m_children[i].store(node->m_children[i - 1].load(std::memory_order_relaxed),
+                                  std::memory_order_relaxed);
+    }
+    node->m_keys[i] = key;
+    node->m_children[i].store(child, std::memory_order_relaxed);
+    node->m_count++;
+}
+
+// Adds a child in place, only valid for nodes readers can't see yet,
+// or for Node48 with a free slot and Node256
+void addChild(Inner *inner, std::uint8_t key, Node *child)
+{
+    switch (inner->m_type) {
+    case NodeType::NODE4:
+        insertSorted(static_cast<Node4 *>(inner), key, child);
+        break;
+    case NodeType::NODE16:
+        insertSorted(static_cast<Node16 *>(inner), key, child);
+        break;
+    case NodeType::NODE48: {
+        auto *node = static_cast<Node48 *>(inner);
+        node->m_children[node->m_count].store(child, std::memory_order_release);
+        node->m_index[key].store(static_cast<std::uint8_t>(node->m_count + 1), std::memory_order_release);
+        node->m_count++;
+        break;
+    }
+    case NodeType::NODE256:
+        static_cast<Node256 *>(inner)->m_children[key].store(child, std::memory_order_release);
+        inner->m_count++;
+        break;
+    case NodeType::LEAF:
+        break;
+    }
+}
+
+bool hasRoom(const Inner *inner)
+{
+    switch (inner->m_type) {
+    case NodeType::NODE4:
+        return inner->m_count < Node4::capacity;
+    case NodeType::NODE16:
+        return inner->m_count < Node16::capacity;
+    case NodeType::NODE48:
+        return inner->m_count < Node48::capacity;
+    default:
+        return true;
+    }
+}
+
+// A new unpublished node with the given prefix, holding the children of
+// another one and room for extra more, in the smallest type that fits
+Inner *copyInner(const Inner *inner, const std::string &prefix, std::size_t extra)
+{
+    std::size_t count = inner->m_count + extra;
+    Inner *copy;
+    if (count <= Node4::capacity)
+        copy = new Node4(prefix);
+    else if (count <= Node16::capacity)
+        copy = new Node16(prefix);
+    else if (count <= Node48::capacity)
+        copy = new Node48(prefix);
+    else
+        copy = new Node256(prefix);
+
+    copy->m_terminal.store(inner->m_terminal.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    forEachChild(inner, false, [copy](std::uint8_t key, Node *child) {
+        addChild(copy, key, child);
+        return true;
+    });
+
+    return copy;
+}
+
+// A new unpublished node holding the children of another one but the one at key,
+// nullptr if nothing would be left in it
+Inner *copyWithout(const Inner *inner, std::uint8_t key)
+{
+    std::size_t count = 0;
+    forEachChild(inner, false, [&count, key](std::uint8_t k, Node *) {
+        count += k != key;
+        return true;
+    });
+    bool terminal = inner->m_terminal.load(std::memory_order_relaxed);
+    if (0 == count && !terminal)
+        return nullptr;
+
+    Inner *copy;
+    if (count <= Node4::capacity)
+        copy = new Node4(inner->m_prefix);
+    else if (count <= Node16::capacity)
+        copy = new Node16(inner->m_prefix);
+    else
+        copy = new Node48(inner->m_prefix);
+
+    copy->m_terminal.store(terminal, std::memory_order_relaxed);
+    forEachChild(inner, false, [copy, key](std::uint8_t k, Node *child) {
+        if (k != key)
+            addChild(copy, k, child);
+        return true;
+    });
+
+    return copy;
+}
+
+std::size_t stringBytes(const std::string &s)
+{
+    // short strings live inside the object
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+std::size_t nodeBytes(const Node *node)
+{
+    switch (node->m_type) {
+    case NodeType::LEAF:
+        return sizeof(Leaf) + stringBytes(static_cast<const Leaf *>(node)->m_suffix);
+    case NodeType::NODE4:
+        return sizeof(Node4) + stringBytes(static_cast<const Inner *>(node)->m_prefix);
+    case NodeType::NODE16:
+        return sizeof(Node16) + stringBytes(static_cast<const Inner *>(node)->m_prefix);
+    case NodeType::NODE48:
+        return sizeof(Node48) + stringBytes(static_cast<const Inner *>(node)->m_prefix);
+    case NodeType::NODE256:
+        return sizeof(Node256) + stringBytes(static_cast<const Inner *>(node)->m_prefix);
+    }
+
+    return 0;
+}
+
+// Frees a whole subtree at once, only when no reader can be left in it
+void deleteTree(Node *node)
+{
+    if (NodeType::LEAF != node->m_type) {
+        forEachChild(static_cast<Inner *>(node), false, [](std::uint8_t, Node *child) {
+            deleteTree(child);
+            return true;
+        });
+    }
+
+    deleteNode(node);
+}
+
+std::size_t treeBytes(const Node *node)
+{
+    std::size_t bytes = nodeBytes(node);
+    if (NodeType::LEAF != node->m_type) {
+        forEachChild(static_cast<const Inner *>(node), false, [&bytes](std::uint8_t, Node *child) {
+            bytes += treeBytes(child);
+            return true;
+        });
+    }
+
+    return bytes;
+}
+
+std::size_t commonPrefix(const std::string &a, std::size_t aFrom, const std::string &b, std::size_t bFrom)
+{
+    std::size_t n = 0;
+    while (aFrom + n < a.size() && bFrom + n < b.size() && a[aFrom + n] == b[bFrom + n])
+        n++;
+
+    return n;
+}
+
+}
+
+struct AdaptiveRadixTree::Range {
+    const std::string &m_from;
+    const std::string &m_to;
+    bool m_reverse;
+    const std::function<bool(const std::string &key)> &m_cb;
+
+    // Returns false once the scan is over, past the end of the range or stopped
+    bool emit(const std::string &key) const
+    {
+        if (!m_from.empty() && key < m_from)
+            return !m_reverse;
+        if (!m_to.empty() && key >= m_to)
+            return m_reverse;
+
+        return m_cb(key);
+    }
+};
+
+AdaptiveRadixTree::AdaptiveRadixTree(bool concurrentReaders)
+    : m_concurrentReaders(concurrentReaders), m_root(nullptr), m_size(0)
+{
+
+}
+
+AdaptiveRadixTree::~AdaptiveRadixTree()
+{
+    if (Node *root = m_root.load(std::memory_order_relaxed))
+        deleteTree(root);
+}
+
+void AdaptiveRadixTree::retire(Node *node)
+{
+    if (m_concurrentReaders)
+        Epoch::retire(node, deleteNode);
+    else
+        deleteNode(node);
+}
+
+bool AdaptiveRadixTree::insert(const std::string &key)
+{
+    std::atomic<Node *> *ref = &m_root;
+    std::size_t depth = 0;
+
+    for (;;) {
+        Node *node = ref->load(std::memory_order_relaxed);
+        if (!node) {
+            ref->store(new Leaf(key.substr(depth)), std::memory_order_release);
+            break;
+        }
+
+        if (NodeType::LEAF == node->m_type) {
+            const std::string &suffix = static_cast<Leaf *>(node)->m_suffix;
+            if (0 == key.compare(depth, std::string::npos, suffix))
+                return false;
+
+            // both keys go below a new node holding what they have in common
+            std::size_t common = commonPrefix(suffix, 0, key, depth);
+            auto *split = new Node4(suffix.substr(0, common));
+            if (suffix.size() == common)
+                split->m_terminal.store(true, std::memory_order_relaxed);
+            else
+                addChild(split, static_cast<std::uint8_t>(suffix[common]), new Leaf(suffix.substr(common + 1)));
+            if (key.size() == depth + common)
+                split->m_terminal.store(true, std::memory_order_relaxed);
+            else
+                addChild(split, static_cast<std::uint8_t>(key[depth + common]),
+                         new Leaf(key.substr(depth + common + 1)));
+
+            ref->store(split, std::memory_order_release);
+            retire(node);
+            break;
+        }
+
+        auto *inner = static_cast<Inner *>(node);
+        const std::string &prefix = inner->m_prefix;
+        std::size_t common = commonPrefix(prefix, 0, key, depth);
+        if (common < prefix.size()) {
+            // the key leaves the prefix early, cut the prefix where they part
+            auto *split = new Node4(prefix.substr(0, common));
+            addChild(split, static_cast<std::uint8_t>(prefix[common]),
+                     copyInner(inner, prefix.substr(common + 1), 0));
+            if (key.size() == depth + common)
+                split->m_terminal.store(true, std::memory_order_relaxed);
+            else
+                addChild(split, static_cast<std::uint8_t>(key[depth + common]),
+                         new Leaf(key.substr(depth + common + 1)));
+
+            ref->store(split, std::memory_order_release);
+            retire(inner);
+            break;
+        }
+
+        depth += prefix.size();
+        if (key.size() == depth) {
+            if (inner->m_terminal.load(std::memory_order_relaxed))
+                return false;
+            inner->m_terminal.store(true, std::memory_order_release);
+            break;
+        }
+
+        std::uint8_t byte = static_cast<std::uint8_t>(key[depth]);
+        if (std::atomic<Node *> *child = findChild(inner, byte)) {
+            ref = child;
+            depth++;
+            continue;
+        }
+
+        Node *leaf = new Leaf(key.substr(depth + 1));
+        if (hasRoom(inner) && (NodeType::NODE48 == inner->m_type || NodeType::NODE256 == inner->m_type)) {
+            addChild(inner, byte, leaf);
+        } else {
+            Inner *grown = copyInner(inner, prefix, 1);
+            addChild(grown, byte, leaf);
+            ref->store(grown, std::memory_order_release);
+            retire(inner);
+        }
+        break;
+    }
+
+    m_size.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+// A leaf goes with its slot in the parent: Node256 clears the slot in place, the other
+// types are copied without it, as a Node48 slot can't be handed out twice
+bool AdaptiveRadixTree::erase(const std::string &key)
+{
+    std::atomic<Node *> *ref = &m_root;
+    std::atomic<Node *> *parentRef = nullptr;
+    std::uint8_t byte = 0;
+    std::size_t depth = 0;
+
+    for (;;) {
+        Node *node = ref->load(std::memory_order_relaxed);
+        if (!node)
+            return false;
+
+        if (NodeType::LEAF == node->m_type) {
+            if (0 != key.compare(depth, std::string::npos, static_cast<Leaf *>(node)->m_suffix))
+                return false;
+
+            auto *parent = parentRef ? static_cast<Inner *>(parentRef->load(std::memory_order_relaxed)) : nullptr;
+            if (!parent) {
+                ref->store(nullptr, std::memory_order_release);
+            } else if (NodeType::NODE256 == parent->m_type) {
+                ref->store(nullptr, std::memory_order_release);
+                parent->m_count--;
+            } else {
+                parentRef->store(copyWithout(parent, byte), std::memory_order_release);
+                retire(parent);
+            }
+            retire(node);
+            break;
+        }
+
+        auto *inner = static_cast<Inner *>(node);
+        const std::string &prefix = inner->m_prefix;
+        if (key.size() < depth + prefix.size() || 0 != key.compare(depth, prefix.size(), prefix))
+            return false;
+
+        depth += prefix.size();
+        if (key.size() == depth) {
+            if (!inner->m_terminal.load(std::memory_order_relaxed))
+                return false;
+            inner->m_terminal.store(false, std::memory_order_release);
+            break;
+        }
+
+        byte = static_cast<std::uint8_t>(key[depth]);
+        std::atomic<Node *> *child = findChild(inner, byte);
+        if (!child)
+            return false;
+
+        parentRef = ref;
+        ref = child;
+        depth++;
+    }
+
+    m_size.fetch_sub(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+bool AdaptiveRadixTree::contains(const std::string &key) const
+{
+    std::optional<EpochGuard> guard;
+    if (m_concurrentReaders)
+        guard.emplace();
+
+    const Node *node = m_root.load(std::memory_order_acquire);
+    std::size_t depth = 0;
+
+    while (node) {
+        if (NodeType::LEAF == node->m_type)
+            return 0 == key.compare(depth, std::string::npos, static_cast<const Leaf *>(node)->m_suffix);
+
+        auto *inner = static_cast<const Inner *>(node);
+        const std::string &prefix = inner->m_prefix;
+        if (key.size() < depth + prefix.size() || 0 != key.compare(depth, prefix.size(), prefix))
+            return false;
+
+        depth += prefix.size();
+        if (key.size() == depth)
+            return inner->m_terminal.load(std::memory_order_acquire);
+
+        std::atomic<Node *> *child = findChild(inner, static_cast<std::uint8_t>(key[depth]));
+        node = child ? child->load(std::memory_order_acquire) : nullptr;
+        depth++;
+    }
+
+    return false;
+}
+
+// Subtrees wholly outside the range are skipped by their path,
+// every key below a node starts with the path to it
+bool AdaptiveRadixTree::walk(const Node *node, std::string &path, const Range &range) const
+{
+    std::size_t length = path.size();
+
+    if (NodeType::LEAF == node->m_type) {
+        path += static_cast<const Leaf *>(node)->m_suffix;
+        bool more = range.emit(path);
+        path.resize(length);
+        return more;
+    }
+
+    auto *inner = static_cast<const Inner *>(node);
+    path += inner->m_prefix;
+
+    bool more = true;
+    if (!range.m_from.empty() && path.compare(0, path.size(), range.m_from, 0, path.size()) < 0) {
+        more = !range.m_reverse;
+    } else if (!range.m_to.empty() && path.compare(range.m_to) >= 0) {
+        more = range.m_reverse;
+    } else {
+        bool terminal = inner->m_terminal.load(std::memory_order_acquire);
+        if (terminal && !range.m_reverse)
+            more = range.emit(path);
+
+        more = more && forEachChild(inner, range.m_reverse, [&](std::uint8_t key, Node *child) {
+            path.push_back(static_cast<char>(key));
+            bool next = walk(child, path, range);
+            path.pop_back();
+            return next;
+        });
+
+        if (more && terminal && range.m_reverse)
+            more = range.emit(path);
+    }
+
+    path.resize(length);
+
+    return more;
+}
+
+void AdaptiveRadixTree::scan(const std::string &from, const std::string &to, bool reverse,
+                             const std::function<bool(const std::string &key)> &cb) const
+{
+    std::optional<EpochGuard> guard;
+    if (m_concurrentReaders)
+        guard.emplace();
+
+    const Node *root = m_root.load(std::memory_order_acquire);
+    if (!root)
+        return;
+
+    std::string path;
+    walk(root, path, Range{from, to, reverse, cb});
+}
+
+std::size_t AdaptiveRadixTree::size() const
+{
+    return m_size.load(std::memory_order_relaxed);
+}
+
+// Walks the whole tree, meant for reports rather than hot paths
+std::size_t AdaptiveRadixTree::memoryUsage() const
+{
+    std::optional<EpochGuard> guard;
+    if (m_concurrentReaders)
+        guard.emplace();
+
+    const Node *root = m_root.load(std::memory_order_acquire);
+
+    return sizeof(*this) + (root ? treeBytes(root) : 0);
+}
+
+}
@@ -0,0 +1,121 @@
+#include "extensions/bloomfilter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace celebiext {
+
+namespace {
+
+// Probes are k = ln2 * bits per key, which gives the fewest false positives
+int probesFor(int bitsPerKey)
+{
+    return std::clamp(static_cast<int>(bitsPerKey * 0.69), 1, 30);
+}
+
+}
+
+BloomFilter::BloomFilter(int bitsPerKey, std::size_t expectedKeys)
+    : m_probes(probesFor(bitsPerKey)), m_keys(0),
+      m_bytes((std::max<std::size_t>(expectedKeys * std::max(bitsPerKey, 1), 64) + 7) / 8),
+      m_bits(new std::atomic<std::uint8_t>[m_bytes]()), m_hash()
+{
+
+}
+
+// [1 byte probes][8 bytes keys][bits...]
+BloomFilter::BloomFilter(const std::string &encoded)
+    : m_probes(0), m_keys(0), m_bytes(0), m_bits(), m_hash()
+{
+    if (encoded.size() <= 1 + sizeof(std::uint64_t))
+        return;
+
+    std::uint64_t keys;
+    std::memcpy(&keys, encoded.data() + 1, sizeof(keys));
+    m_probes = static_cast<std::uint8_t>(encoded[0]);
+    m_keys = keys;
+    m_bytes = encoded.size() - 1 - sizeof(keys);
+    m_bits.reset(new std::atomic<std::uint8_t>[m_bytes]());
+    for (std::size_t i = 0; i < m_bytes; i++)
+        m_bits[i].store(static_cast<std::uint8_t>(encoded[1 + sizeof(keys) + i]), std::memory_order_relaxed);
+}
+
+bool BloomFilter::add(const std::string &key)
+{
+    if (0 == m_bytes)
+        return false;
+
+    std::uint64_t hash = m_hash(key);
+    const std::uint64_t delta = (hash >> 33) | (hash << 31);
+    const std::uint64_t bits = m_bytes * 8;
+    bool added = false;
+
+    for (int i = 0; i < m_probes; i++) {
+        std::uint64_t bit = hash % bits;
+        const std::uint8_t mask = static_cast<std::uint8_t>(1 << (bit % 8));
+        if (0 == (m_bits[bit / 8].fetch_or(mask, std::memory_order_relaxed) & mask))
+            added = true;
+        hash += delta;
+    }
+    if (added)
+        m_keys.fetch_add(1, std::memory_order_relaxed);
+
+    return added;
+}
+
+bool BloomFilter::mayContain(const std::string &key) const
+{
+    if (0 == m_bytes || 0 == m_probes)
+        return true;
+
+    std::uint64_t hash = m_hash(key);
+    const std::uint64_t delta = (hash >> 33) | (hash << 31);
+    const std::uint64_t bits = m_bytes * 8;
+
+    for (int i = 0; i < m_probes; i++) {
+        std::uint64_t bit = hash % bits;
+        if (0 == (m_bits[bit / 8].load(std::memory_order_relaxed) & (1 << (bit % 8))))
+            return false;
+        hash += delta;
+    }
+
+    return true;
+}
+
+std::string BloomFilter::encode() const
+{
+    std::string encoded(1, static_cast<char>(m_probes));
+    std::uint64_t keys = m_keys;
+    encoded.append(reinterpret_cast<const char *>(&keys), sizeof(keys));
+    encoded.reserve(encoded.size() + m_bytes);
+    for (std::size_t i = 0; i < m_bytes; i++)
+        encoded.push_back(static_cast<char>(m_bits[i].load(std::memory_order_relaxed)));
+
+    return encoded;
+}
+
+int BloomFilter::probes() const
+{
+    return m_probes;
+}
+
+std::size_t BloomFilter::keys() const
+{
+    return m_keys;
+}
+
+std::size_t BloomFilter::bits() const
+{
+    return m_bytes * 8;
+}
+
+double BloomFilter::falsePositiveRate() const
+{
+    if (0 == m_bytes || 0 == m_probes)
+        return 1.0;
+
+    return std::pow(1.0 - std::exp(-static_cast<double>(m_probes) * keys() / bits()), m_probes);
+}
+
+}
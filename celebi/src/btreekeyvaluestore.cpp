@@ -0,0 +1,1427 @@
+#include "extensions/extdatabase.h"
+#include "extensions/epoch.h"
+#include "extensions/highwayhash.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace celebiext {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+/*
+ * The file is an array of pages. Pages 0 and 1 are meta pages which take turns, a commit
+ * writes its new pages first and then the older meta page, so the newer valid meta page
+ * always names a complete tree and no log is needed. Pages are never changed once a meta
+ * page names them: a writer copies every page on the path it changes.
+ *
+ * Leaf and branch pages start with a header and an array of cell offsets in key order,
+ * cells are at the end of the page. A leaf cell is a key and its value, values which don't
+ * fit in a quarter page are in a chain of overflow pages. A branch cell is the first key of
+ * a child, the first cell of a branch stands for every key below the second one.
+ *
+ * The pages no tree uses are listed in a chain of free list pages the meta page names,
+ * so opening reads them instead of walking the tree. Each commit writes a new chain,
+ * the one of the other meta page stays as it is in case the commit is torn.
+ */
+const std::size_t pageSize = 4096;
+const std::size_t headerSize = 8;
+const std::size_t maxCellSize = pageSize / 4;
+const std::size_t leafCellHeader = 8;     // [2 key length][1 overflow][1][4 value length]
+const std::size_t branchCellHeader = 10;  // [2 key length][8 child]
+const std::size_t overflowHeader = 16;    // [1 type][3][4 length][8 next]
+const std::size_t freeListHeader = 16;    // [1 type][3][4 count][8 next]
+const std::size_t freeListCapacity = (pageSize - freeListHeader) / sizeof(std::uint64_t);
+const std::size_t maxKeySize = maxCellSize - leafCellHeader - sizeof(std::uint64_t);
+const std::uint64_t metaMagic = 0x6565727442626c63;  // "clbBtree"
+const std::uint32_t formatVersion = 2;
+const std::string dataFilename = "data.btree";
+
+enum class PageType : std::uint8_t {
+    LEAF = 1,
+    BRANCH = 2,
+    OVERFLOW_DATA = 3,
+    FREE_LIST = 4,
+};
+
+struct Meta {
+    std::uint64_t m_magic;
+    std::uint32_t m_version;
+    std::uint32_t m_pageSize;
+    std::uint64_t m_txn;
+    std::uint64_t m_root;       // 0 for an empty tree
+    std::uint64_t m_pageCount;  // pages in use or free, the file may be longer
+    std::uint64_t m_freeList;   // first free list page, 0 for none
+    std::uint64_t m_checksum;
+};
+
+/*
+ * Keys of the tree are user keys with a column, like string and set files beside each
+ * other in the file store. Zero bytes of the user key are escaped and the key ends with
+ * 0x00 0x01, which keeps the order of user keys and lets any bytes follow.
+ */
+const char stringColumn = 0;
+const char setColumn = 1;       // present for every set key, even an empty set
+const char memberColumn = 2;    // followed by the member
+
+std::string escape(const std::string &user)
+{
+    std::string escaped;
+    escaped.reserve(user.size() + 2);
+    for (char c : user) {
+        escaped.push_back(c);
+        if ('\0' == c)
+            escaped.push_back('\xff');
+    }
+
+    return escaped;
+}
+
+std::string columnKey(const std::string &user, char column)
+{
+    std::string key = escape(user);
+    key.push_back('\0');
+    key.push_back('\1');
+    key.push_back(column);
+
+    return key;
+}
+
+// Splits a tree key into its user key and where the column starts
+std::string userOf(std::string_view key, std::size_t &columnAt)
+{
+    std::string user;
+    std::size_t i = 0;
+    for (; i + 1 < key.size(); i++) {
+        if ('\0' != key[i]) {
+            user.push_back(key[i]);
+        } else if ('\xff' == key[i + 1]) {
+            user.push_back('\0');
+            i++;
+        } else {
+            break;
+        }
+    }
+    columnAt = i + 2;
+
+    return user;
+}
+
+template <typename T>
+T load(const char *p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+template <typename T>
+void store(char *p, T value)
+{
+    std::memcpy(p, &value, sizeof(T));
+}
+
+void writeFully(int fd, const char *data, std::size_t size, std::uint64_t offset)
+{
+    while (size > 0) {
+        ssize_t n = ::pwrite(fd, data, size, static_cast<off_t>(offset));
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            throw std::runtime_error(std::string("cannot write B+tree file: ") + std::strerror(errno));
+        }
+        data += n;
+        size -= static_cast<std::size_t>(n);
+        offset += static_cast<std::uint64_t>(n);
+    }
+}
+
+/*
+ * Reads a leaf or branch page in place
+ */
+class PageView {
+public:
+    explicit PageView(const char *page) : m_page(page) {}
+
+    PageType type() const { return static_cast<PageType>(m_page[0]); }
+    std::size_t count() const { return load<std::uint16_t>(m_page + 2); }
+
+    std::string_view key(std::size_t i) const
+    {
+        const char *cell = this->cell(i);
+        std::size_t header = PageType::LEAF == type() ? leafCellHeader : branchCellHeader;
+        return std::string_view(cell + header, load<std::uint16_t>(cell));
+    }
+
+    std::uint64_t child(std::size_t i) const { return load<std::uint64_t>(cell(i) + 2); }
+    bool overflow(std::size_t i) const { return 0 != cell(i)[2]; }
+    std::uint32_t valueSize(std::size_t i) const { return load<std::uint32_t>(cell(i) + 4); }
+
+    // Inline value, or the first overflow page number
+    const char *value(std::size_t i) const
+    {
+        const char *cell = this->cell(i);
+        return cell + leafCellHeader + load<std::uint16_t>(cell);
+    }
+
+    // First cell whose key is not less than key
+    std::size_t lowerBound(std::string_view key) const
+    {
+        std::size_t lo = 0, hi = count();
+        while (lo < hi) {
+            std::size_t mid = (lo + hi) / 2;
+            if (this->key(mid) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    // Child of a branch whose keys include key
+    std::size_t childFor(std::string_view key) const
+    {
+        std::size_t lo = 1, hi = count();
+        while (lo < hi) {
+            std::size_t mid = (lo + hi) / 2;
+            if (this->key(mid) <= key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo - 1;
+    }
+
+private:
+    const char *cell(std::size_t i) const
+    {
+        return m_page + load<std::uint16_t>(m_page + headerSize + 2 * i);
+    }
+
+    const char *m_page;
+};
+
+/*
+ * A page the writer changes is decoded into a node and written back at commit
+ */
+struct Cell {
+    std::string m_key;
+    std::string m_value;            // inline value
+    std::uint64_t m_overflow = 0;   // first overflow page of a value which isn't inline
+    std::uint32_t m_valueSize = 0;
+    std::uint64_t m_child = 0;      // branch cells only
+};
+
+struct Node {
+    PageType m_type;
+    std::vector<Cell> m_cells;
+
+    bool leaf() const { return PageType::LEAF == m_type; }
+
+    std::size_t cellSize(const Cell &cell) const
+    {
+        if (!leaf())
+            return 2 + branchCellHeader + cell.m_key.size();
+
+        return 2 + leafCellHeader + cell.m_key.size() +
+                (cell.m_overflow ? sizeof(std::uint64_t) : cell.m_value.size());
+    }
+
+    std::size_t size() const
+    {
+        std::size_t size = headerSize;
+        for (auto &cell : m_cells)
+            size += cellSize(cell);
+        return size;
+    }
+
+    std::size_t lowerBound(const std::string &key) const
+    {
+        return std::lower_bound(m_cells.begin(), m_cells.end(), key, [](const Cell &cell, const std::string &k) {
+            return cell.m_key < k;
+        }) - m_cells.begin();
+    }
+
+    std::size_t childFor(const std::string &key) const
+    {
+        auto it = std::upper_bound(m_cells.begin() + 1, m_cells.end(), key, [](const std::string &k, const Cell &cell) {
+            return k < cell.m_key;
+        });
+        return it - m_cells.begin() - 1;
+    }
+
+    static std::unique_ptr<Node> decode(const char *page)
+    {
+        PageView view(page);
+        auto node = std::make_unique<Node>();
+        node->m_type = view.type();
+        node->m_cells.resize(view.count());
+        for (std::size_t i = 0; i < node->m_cells.size(); i++) {
+            Cell &cell = node->m_cells[i];
+            cell.m_key = view.key(i);
+            if (!node->leaf()) {
+                cell.m_child = view.child(i);
+            } else if (view.overflow(i)) {
+                cell.m_overflow = load<std::uint64_t>(view.value(i));
+                cell.m_valueSize = view.valueSize(i);
+            } else {
+                cell.m_valueSize = view.valueSize(i);
+                cell.m_value.assign(view.value(i), cell.m_valueSize);
+            }
+        }
+        return node;
+    }
+
+    void encode(char *page) const
+    {
+        std::memset(page, 0, headerSize);
+        page[0] = static_cast<char>(m_type);
+        store<std::uint16_t>(page + 2, static_cast<std::uint16_t>(m_cells.size()));
+
+        std::size_t end = pageSize;
+        for (std::size_t i = 0; i < m_cells.size(); i++) {
+            const Cell &cell = m_cells[i];
+            end -= cellSize(cell) - 2;
+            store<std::uint16_t>(page + headerSize + 2 * i, static_cast<std::uint16_t>(end));
+
+            char *p = page + end;
+            store<std::uint16_t>(p, static_cast<std::uint16_t>(cell.m_key.size()));
+            if (!leaf()) {
+                store<std::uint64_t>(p + 2, cell.m_child);
+                std::memcpy(p + branchCellHeader, cell.m_key.data(), cell.m_key.size());
+                continue;
+            }
+
+            p[2] = cell.m_overflow ? 1 : 0;
+            p[3] = 0;
+            store<std::uint32_t>(p + 4, cell.m_valueSize);
+            std::memcpy(p + leafCellHeader, cell.m_key.data(), cell.m_key.size());
+            if (cell.m_overflow)
+                store<std::uint64_t>(p + leafCellHeader + cell.m_key.size(), cell.m_overflow);
+            else
+                std::memcpy(p + leafCellHeader + cell.m_key.size(), cell.m_value.data(), cell.m_value.size());
+        }
+    }
+};
+
+struct Mapping {
+    char *m_base;
+    std::size_t m_size;
+
+    ~Mapping()
+    {
+        ::munmap(m_base, m_size);
+    }
+};
+
+// What readers see, the version a commit published. The mapping goes with the last
+// version on it, pinned snapshots may keep one long after a bigger mapping replaced it.
+struct Snapshot {
+    std::uint64_t m_txn;
+    std::uint64_t m_root;
+    std::uint64_t m_pageCount;
+    std::shared_ptr<const Mapping> m_map;
+
+    const char *page(std::uint64_t pgno) const { return m_map->m_base + pgno * pageSize; }
+};
+
+// Pages become free only once no reader can be on a version which still uses them.
+// Pages freed by commit txn are used by the versions before it, so they are held back
+// while a snapshot is pinned on one of those.
+struct FreePool {
+    std::mutex m_lock;
+    std::vector<std::uint64_t> m_pages;
+    std::multiset<std::uint64_t> m_pinned;
+    std::vector<std::pair<std::uint64_t, std::vector<std::uint64_t>>> m_held;
+
+    // The caller holds the lock
+    void release(std::uint64_t txn, std::vector<std::uint64_t> &pages)
+    {
+        if (!m_pinned.empty() && *m_pinned.begin() < txn)
+            m_held.emplace_back(txn, std::move(pages));
+        else
+            m_pages.insert(m_pages.end(), pages.begin(), pages.end());
+    }
+
+    void unpin(std::uint64_t txn)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_pinned.erase(m_pinned.find(txn));
+
+        std::vector<std::pair<std::uint64_t, std::vector<std::uint64_t>>> held;
+        held.swap(m_held);
+        for (auto &freed : held)
+            release(freed.first, freed.second);
+    }
+};
+
+struct FreedPages {
+    std::shared_ptr<FreePool> m_pool;
+    std::uint64_t m_txn;
+    std::vector<std::uint64_t> m_pages;
+};
+
+std::string readValue(const Snapshot &snapshot, const PageView &leaf, std::size_t i)
+{
+    std::uint32_t size = leaf.valueSize(i);
+    if (!leaf.overflow(i))
+        return std::string(leaf.value(i), size);
+
+    std::string value;
+    value.reserve(size);
+    for (std::uint64_t pgno = load<std::uint64_t>(leaf.value(i)); pgno; ) {
+        const char *page = snapshot.page(pgno);
+        value.append(page + overflowHeader, load<std::uint32_t>(page + 4));
+        pgno = load<std::uint64_t>(page + 8);
+    }
+
+    return value;
+}
+
+/*
+ * Walks the leaves of a snapshot in key order, from the root down on every seek
+ */
+class Cursor {
+public:
+    explicit Cursor(const Snapshot &snapshot) : m_snapshot(snapshot), m_path() {}
+
+    bool valid() const { return !m_path.empty(); }
+    std::string_view key() const { return leaf().key(m_path.back().second); }
+    std::string value() const { return readValue(m_snapshot, leaf(), m_path.back().second); }
+
+    // First key not less than key
+    void seek(std::string_view key)
+    {
+        m_path.clear();
+        if (!m_snapshot.m_root)
+            return;
+
+        for (std::uint64_t pgno = m_snapshot.m_root; ; ) {
+            PageView view(m_snapshot.page(pgno));
+            if (PageType::LEAF == view.type()) {
+                m_path.emplace_back(pgno, view.lowerBound(key));
+                if (m_path.back().second == view.count())
+                    nextLeaf();
+                return;
+            }
+            std::size_t i = view.childFor(key);
+            m_path.emplace_back(pgno, i);
+            pgno = view.child(i);
+        }
+    }
+
+    // Last key less than key, the last key of all for an empty one
+    void seekBefore(std::string_view key)
+    {
+        m_path.clear();
+        if (!m_snapshot.m_root)
+            return;
+
+        for (std::uint64_t pgno = m_snapshot.m_root; ; ) {
+            PageView view(m_snapshot.page(pgno));
+            if (PageType::LEAF == view.type()) {
+                std::size_t i = key.empty() ? view.count() : view.lowerBound(key);
+                m_path.emplace_back(pgno, i);
+                if (0 == i)
+                    prevLeaf();
+                else
+                    m_path.back().second--;
+                return;
+            }
+            std::size_t i = key.empty() ? view.count() - 1 : view.childFor(key);
+            m_path.emplace_back(pgno, i);
+            pgno = view.child(i);
+        }
+    }
+
+    void next()
+    {
+        if (++m_path.back().second == leaf().count())
+            nextLeaf();
+    }
+
+    void prev()
+    {
+        if (0 == m_path.back().second)
+            prevLeaf();
+        else
+            m_path.back().second--;
+    }
+
+private:
+    PageView leaf() const { return PageView(m_snapshot.page(m_path.back().first)); }
+
+    void nextLeaf()
+    {
+        m_path.pop_back();
+        while (!m_path.empty()) {
+            auto &top = m_path.back();
+            PageView view(m_snapshot.page(top.first));
+            if (++top.second < view.count()) {
+                descend(view.child(top.second), false);
+                return;
+            }
+            m_path.pop_back();
+        }
+    }
+
+    void prevLeaf()
+    {
+        m_path.pop_back();
+        while (!m_path.empty()) {
+            auto &top = m_path.back();
+            if (top.second > 0) {
+                top.second--;
+                descend(PageView(m_snapshot.page(top.first)).child(top.second), true);
+                return;
+            }
+            m_path.pop_back();
+        }
+    }
+
+    void descend(std::uint64_t pgno, bool last)
+    {
+        for (;;) {
+            PageView view(m_snapshot.page(pgno));
+            std::size_t i = last ? view.count() - 1 : 0;
+            m_path.emplace_back(pgno, i);
+            if (PageType::LEAF == view.type())
+                return;
+            pgno = view.child(i);
+        }
+    }
+
+    const Snapshot &m_snapshot;
+    std::vector<std::pair<std::uint64_t, std::size_t>> m_path;
+};
+
+std::string getValue(const Snapshot &snapshot, const std::string &key)
+{
+    const std::string target = columnKey(key, stringColumn);
+
+    for (std::uint64_t pgno = snapshot.m_root; pgno; ) {
+        PageView view(snapshot.page(pgno));
+        if (PageType::LEAF == view.type()) {
+            std::size_t i = view.lowerBound(target);
+            if (i < view.count() && view.key(i) == target)
+                return readValue(snapshot, view, i);
+            break;
+        }
+        pgno = view.child(view.childFor(target));
+    }
+
+    return std::string();
+}
+
+std::unique_ptr<std::unordered_set<std::string>> getSet(const Snapshot &snapshot,
+                                                        const std::string &key)
+{
+    const std::string prefix = columnKey(key, memberColumn);
+    auto values = std::make_unique<std::unordered_set<std::string>>();
+
+    Cursor cursor(snapshot);
+    for (cursor.seek(prefix); cursor.valid(); cursor.next()) {
+        std::string_view k = cursor.key();
+        if (0 != k.compare(0, prefix.size(), prefix))
+            break;
+        values->emplace(k.substr(prefix.size()));
+    }
+
+    return values;
+}
+
+// Every column and member of a user key is skipped with one seek past them
+void scan(const Snapshot &snapshot, const std::string &from, const std::string &to, bool reverse,
+          const std::function<bool(const std::string &key)> &cb)
+{
+    Cursor cursor(snapshot);
+    std::size_t columnAt;
+
+    if (reverse) {
+        for (cursor.seekBefore(to.empty() ? std::string() : escape(to)); cursor.valid(); ) {
+            std::string user = userOf(cursor.key(), columnAt);
+            if ((!from.empty() && user < from) || !cb(user))
+                break;
+            cursor.seekBefore(columnKey(user, stringColumn));
+        }
+    } else {
+        for (cursor.seek(from.empty() ? std::string() : escape(from)); cursor.valid(); ) {
+            std::string user = userOf(cursor.key(), columnAt);
+            if ((!to.empty() && user >= to) || !cb(user))
+                break;
+            std::string past = escape(user);
+            past.push_back('\0');
+            past.push_back('\2');
+            cursor.seek(past);
+        }
+    }
+}
+
+}
+
+class BTreeKeyValueStore::Impl {
+public:
+    Impl(const std::string &fullpath, const BTreeOptions &options);
+    ~Impl();
+
+    class Txn;
+    class PinnedSnapshot;
+
+    void open();
+    void close();
+    std::uint64_t checksum(const Meta &meta) const;
+    void writeMeta(const Meta &meta);
+    void loadFreePages(std::uint64_t freeList, std::uint64_t pageCount);
+    std::shared_ptr<Mapping> remap(std::size_t size);
+
+    template <typename F>
+    auto read(F f) const;
+    template <typename F>
+    void update(F change);
+
+    const std::string m_path;
+    const BTreeOptions m_options;
+    HighwayHash m_hash;
+
+    std::mutex m_writeLock;                     // one writer at a time
+    int m_fd;
+    std::shared_ptr<Mapping> m_map;             // the writer's, readers reach it through m_snapshot
+    std::atomic<Snapshot *> m_snapshot;
+    std::shared_ptr<FreePool> m_pool;
+    std::vector<std::uint64_t> m_free;          // free as of the current version, the writer's
+    std::vector<std::uint64_t> m_freeListPages; // the current version's free list
+    std::vector<std::uint64_t> m_spareListPages; // the previous version's, free but not pooled
+};
+
+/*
+ * A write transaction, the pages it copies and adds are private until commit
+ */
+class BTreeKeyValueStore::Impl::Txn {
+public:
+    explicit Txn(Impl &impl);
+
+    void put(const std::string &key, const std::string &value);
+    bool contains(const std::string &key);
+    // The tree as last committed, without what this transaction has written
+    const Snapshot &base() const;
+    // Erases keys in [from, to)
+    void erase(const std::string &from, const std::string &to);
+
+    void commit();
+    void abort();
+
+private:
+    using Split = std::optional<std::pair<std::string, std::uint64_t>>;
+
+    const Node &peek(std::uint64_t pgno);
+    Node *touch(std::uint64_t &pgno);
+    std::uint64_t allocate();
+    void release(std::uint64_t pgno);
+    void freeValue(const Cell &cell);
+    Cell makeCell(const std::string &key, const std::string &value);
+
+    Split insert(std::uint64_t &pgno, Cell cell);
+    bool erase(std::uint64_t &pgno, const std::string &from, const std::string &to);
+    Split splitIfFull(Node &node);
+
+    Impl &m_impl;
+    const Snapshot &m_base;
+    std::uint64_t m_root;
+    std::uint64_t m_pageCount;
+    std::unordered_map<std::uint64_t, std::unique_ptr<Node>> m_dirty;
+    std::unordered_map<std::uint64_t, std::unique_ptr<Node>> m_clean;  // decoded, unchanged
+    std::vector<std::uint64_t> m_freed;
+    std::vector<std::uint64_t> m_reused;
+};
+
+BTreeKeyValueStore::Impl::Txn::Txn(Impl &impl)
+    : m_impl(impl), m_base(*impl.m_snapshot.load(std::memory_order_relaxed)),
+      m_root(m_base.m_root), m_pageCount(m_base.m_pageCount)
+{
+
+}
+
+const Snapshot &BTreeKeyValueStore::Impl::Txn::base() const
+{
+    return m_base;
+}
+
+// Node of a page, as this transaction sees it
+const Node &BTreeKeyValueStore::Impl::Txn::peek(std::uint64_t pgno)
+{
+    auto dirty = m_dirty.find(pgno);
+    if (dirty != m_dirty.end())
+        return *dirty->second;
+
+    auto &clean = m_clean[pgno];
+    if (!clean)
+        clean = Node::decode(m_base.page(pgno));
+
+    return *clean;
+}
+
+// Node of a page this transaction may change, a committed page is copied to a new one
+Node *BTreeKeyValueStore::Impl::Txn::touch(std::uint64_t &pgno)
+{
+    auto dirty = m_dirty.find(pgno);
+    if (dirty != m_dirty.end())
+        return dirty->second.get();
+
+    peek(pgno);
+    auto clean = m_clean.find(pgno);
+    std::unique_ptr<Node> node = std::move(clean->second);
+    m_clean.erase(clean);
+
+    m_freed.push_back(pgno);
+    pgno = allocate();
+    Node *touched = node.get();
+    m_dirty.emplace(pgno, std::move(node));
+
+    return touched;
+}
+
+std::uint64_t BTreeKeyValueStore::Impl::Txn::allocate()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_impl.m_pool->m_lock);
+        if (!m_impl.m_pool->m_pages.empty()) {
+            std::uint64_t pgno = m_impl.m_pool->m_pages.back();
+            m_impl.m_pool->m_pages.pop_back();
+            m_reused.push_back(pgno);
+            return pgno;
+        }
+    }
+
+    return m_pageCount++;
+}
+
+void BTreeKeyValueStore::Impl::Txn::release(std::uint64_t pgno)
+{
+    m_dirty.erase(pgno);
+    m_freed.push_back(pgno);
+}
+
+void BTreeKeyValueStore::Impl::Txn::freeValue(const Cell &cell)
+{
+    for (std::uint64_t pgno = cell.m_overflow; pgno; ) {
+        char header[overflowHeader];
+        if (::pread(m_impl.m_fd, header, sizeof(header), static_cast<off_t>(pgno * pageSize)) !=
+                static_cast<ssize_t>(sizeof(header)))
+            throw std::runtime_error("cannot read B+tree overflow page");
+        m_freed.push_back(pgno);
+        pgno = load<std::uint64_t>(header + 8);
+    }
+}
+
+// Values too large for a leaf are written to overflow pages right away,
+// nothing points at them before the commit
+Cell BTreeKeyValueStore::Impl::Txn::makeCell(const std::string &key, const std::string &value)
+{
+    if (key.size() > maxKeySize)
+        throw std::runtime_error("key is too long for a B+tree page: " + key.substr(0, 32) + "...");
+
+    Cell cell;
+    cell.m_key = key;
+    cell.m_valueSize = static_cast<std::uint32_t>(value.size());
+    if (leafCellHeader + key.size() + value.size() <= maxCellSize) {
+        cell.m_value = value;
+        return cell;
+    }
+
+    const std::size_t chunk = pageSize - overflowHeader;
+    std::size_t pages = (value.size() + chunk - 1) / chunk;
+    std::vector<std::uint64_t> pgnos;
+    for (std::size_t i = 0; i < pages; i++)
+        pgnos.push_back(allocate());
+
+    std::vector<char> page(pageSize);
+    for (std::size_t i = 0; i < pages; i++) {
+        std::size_t length = std::min(chunk, value.size() - i * chunk);
+        std::memset(page.data(), 0, overflowHeader);
+        page[0] = static_cast<char>(PageType::OVERFLOW_DATA);
+        store<std::uint32_t>(page.data() + 4, static_cast<std::uint32_t>(length));
+        store<std::uint64_t>(page.data() + 8, i + 1 < pages ? pgnos[i + 1] : 0);
+        std::memcpy(page.data() + overflowHeader, value.data() + i * chunk, length);
+        writeFully(m_impl.m_fd, page.data(), pageSize, pgnos[i] * pageSize);
+    }
+    cell.m_overflow = pgnos.front();
+
+    return cell;
+}
+
+// A node larger than a page is split in two halves by size
+BTreeKeyValueStore::Impl::Txn::Split BTreeKeyValueStore::Impl::Txn::splitIfFull(Node &node)
+{
+    if (node.size() <= pageSize)
+        return std::nullopt;
+
+    std::size_t half = (node.size() - headerSize) / 2, size = 0, at = 0;
+    while (at + 1 < node.m_cells.size() && size + node.cellSize(node.m_cells[at]) <= half)
+        size += node.cellSize(node.m_cells[at++]);
+    at = std::max<std::size_t>(at, 1);
+
+    auto right = std::make_unique<Node>();
+    right->m_type = node.m_type;
+    right->m_cells.assign(std::make_move_iterator(node.m_cells.begin() + at),
+                          std::make_move_iterator(node.m_cells.end()));
+    node.m_cells.erase(node.m_cells.begin() + at, node.m_cells.end());
+
+    std::string separator = right->m_cells.front().m_key;
+    std::uint64_t pgno = allocate();
+    m_dirty.emplace(pgno, std::move(right));
+
+    return std::make_pair(separator, pgno);
+}
+
+BTreeKeyValueStore::Impl::Txn::Split
+BTreeKeyValueStore::Impl::Txn::insert(std::uint64_t &pgno, Cell cell)
+{
+    Node *node = touch(pgno);
+
+    if (node->leaf()) {
+        std::size_t i = node->lowerBound(cell.m_key);
+        if (i < node->m_cells.size() && node->m_cells[i].m_key == cell.m_key) {
+            freeValue(node->m_cells[i]);
+            node->m_cells[i] = std::move(cell);
+        } else {
+            node->m_cells.insert(node->m_cells.begin() + i, std::move(cell));
+        }
+    } else {
+        std::size_t i = node->childFor(cell.m_key);
+        std::uint64_t child = node->m_cells[i].m_child;
+        Split split = insert(child, std::move(cell));
+        node->m_cells[i].m_child = child;
+        if (split) {
+            Cell separator;
+            separator.m_key = split->first;
+            separator.m_child = split->second;
+            node->m_cells.insert(node->m_cells.begin() + i + 1, std::move(separator));
+        }
+    }
+
+    return splitIfFull(*node);
+}
+
+void BTreeKeyValueStore::Impl::Txn::put(const std::string &key, const std::string &value)
+{
+    Cell cell = makeCell(key, value);
+
+    if (!m_root) {
+        auto leaf = std::make_unique<Node>();
+        leaf->m_type = PageType::LEAF;
+        leaf->m_cells.push_back(std::move(cell));
+        m_root = allocate();
+        m_dirty.emplace(m_root, std::move(leaf));
+        return;
+    }
+
+    Split split = insert(m_root, std::move(cell));
+    if (split) {
+        auto root = std::make_unique<Node>();
+        root->m_type = PageType::BRANCH;
+        root->m_cells.resize(2);
+        root->m_cells[0].m_child = m_root;
+        root->m_cells[1].m_key = split->first;
+        root->m_cells[1].m_child = split->second;
+        m_root = allocate();
+        m_dirty.emplace(m_root, std::move(root));
+    }
+}
+
+bool BTreeKeyValueStore::Impl::Txn::contains(const std::string &key)
+{
+    for (std::uint64_t pgno = m_root; pgno; ) {
+        const Node &node = peek(pgno);
+        if (node.leaf()) {
+            std::size_t i = node.lowerBound(key);
+            return i < node.m_cells.size() && node.m_cells[i].m_key == key;
+        }
+        pgno = node.m_cells[node.childFor(key)].m_child;
+    }
+
+    return false;
+}
+
+// Returns true if anything was erased, pgno then names the copy. Emptied nodes are
+// dropped from their parent, nodes which are merely small are left as they are.
+bool BTreeKeyValueStore::Impl::Txn::erase(std::uint64_t &pgno, const std::string &from,
+                                         const std::string &to)
+{
+    const Node &peeked = peek(pgno);
+
+    if (peeked.leaf()) {
+        std::size_t first = peeked.lowerBound(from);
+        std::size_t last = peeked.lowerBound(to);
+        if (first >= last)
+            return false;
+
+        Node *node = touch(pgno);
+        for (std::size_t i = first; i < last; i++)
+            freeValue(node->m_cells[i]);
+        node->m_cells.erase(node->m_cells.begin() + first, node->m_cells.begin() + last);
+        return true;
+    }
+
+    const Node *node = &peeked;
+    Node *touched = nullptr;
+    std::size_t i = node->childFor(from);
+    std::size_t end = node->childFor(to) + 1;
+    while (i < end) {
+        std::uint64_t child = node->m_cells[i].m_child;
+        if (!erase(child, from, to)) {
+            i++;
+            continue;
+        }
+
+        if (!touched) {
+            touched = touch(pgno);
+            node = touched;
+        }
+        touched->m_cells[i].m_child = child;
+        if (peek(child).m_cells.empty()) {
+            release(child);
+            touched->m_cells.erase(touched->m_cells.begin() + i);
+            end--;
+        } else {
+            i++;
+        }
+    }
+
+    return nullptr != touched;
+}
+
+void BTreeKeyValueStore::Impl::Txn::erase(const std::string &from, const std::string &to)
+{
+    if (!m_root || !erase(m_root, from, to))
+        return;
+
+    // the root shrinks while it is empty or has a single child
+    for (;;) {
+        const Node &root = peek(m_root);
+        if (root.m_cells.empty()) {
+            release(m_root);
+            m_root = 0;
+            return;
+        }
+        if (root.leaf() || root.m_cells.size() > 1)
+            return;
+
+        std::uint64_t child = root.m_cells.front().m_child;
+        release(m_root);
+        m_root = child;
+    }
+}
+
+// New pages first, then the meta page which makes them the current version
+void BTreeKeyValueStore::Impl::Txn::commit()
+{
+    if (m_dirty.empty() && m_freed.empty())
+        return;
+
+    std::vector<char> page(pageSize);
+    for (auto &dirty : m_dirty) {
+        std::memset(page.data(), 0, pageSize);
+        dirty.second->encode(page.data());
+        writeFully(m_impl.m_fd, page.data(), pageSize, dirty.first * pageSize);
+    }
+
+    // Free once this version is current: what was free and this transaction didn't take,
+    // what it freed, and the current free list. The new list goes to the pages of the one
+    // before, which no meta page names after this commit, and to new pages if it is longer.
+    // Its pages are counted before the list is made, so the last one may stay empty.
+    const std::size_t most = m_impl.m_free.size() + m_freed.size() + m_impl.m_freeListPages.size();
+    const std::size_t length = (most + freeListCapacity - 1) / freeListCapacity;
+    const std::size_t spare = std::min(length, m_impl.m_spareListPages.size());
+    std::vector<std::uint64_t> chain(m_impl.m_spareListPages.begin(), m_impl.m_spareListPages.begin() + spare);
+    while (chain.size() < length)
+        chain.push_back(allocate());
+
+    std::vector<std::uint64_t> taken(m_reused);
+    taken.insert(taken.end(), chain.begin(), chain.begin() + spare);
+    std::vector<std::uint64_t> added(m_freed);
+    added.insert(added.end(), m_impl.m_freeListPages.begin(), m_impl.m_freeListPages.end());
+    std::sort(taken.begin(), taken.end());
+    std::sort(added.begin(), added.end());
+    added.erase(std::unique(added.begin(), added.end()), added.end());
+
+    std::vector<std::uint64_t> kept, free;
+    std::set_difference(m_impl.m_free.begin(), m_impl.m_free.end(), taken.begin(), taken.end(),
+                        std::back_inserter(kept));
+    std::set_union(kept.begin(), kept.end(), added.begin(), added.end(), std::back_inserter(free));
+
+    auto next = free.begin();
+    for (std::size_t i = 0; i < chain.size(); i++) {
+        std::memset(page.data(), 0, pageSize);
+        page[0] = static_cast<char>(PageType::FREE_LIST);
+        std::uint32_t count = 0;
+        for (; next != free.end() && count < freeListCapacity; next++, count++)
+            store<std::uint64_t>(page.data() + freeListHeader + count * sizeof(std::uint64_t), *next);
+        store<std::uint32_t>(page.data() + 4, count);
+        store<std::uint64_t>(page.data() + 8, i + 1 < chain.size() ? chain[i + 1] : 0);
+        writeFully(m_impl.m_fd, page.data(), pageSize, chain[i] * pageSize);
+    }
+    if (m_impl.m_options.sync && 0 != ::fdatasync(m_impl.m_fd))
+        throw std::runtime_error("cannot sync B+tree file " + m_impl.m_path);
+
+    Meta meta{metaMagic, formatVersion, pageSize, m_base.m_txn + 1, m_root, m_pageCount,
+              chain.empty() ? 0 : chain.front(), 0};
+    m_impl.writeMeta(meta);
+
+    // Readers never see free list pages, the current one is kept for the next commit
+    // instead of waiting in the pool, spare ones the list didn't need go to the pool
+    m_freed.insert(m_freed.end(), m_impl.m_spareListPages.begin() + spare, m_impl.m_spareListPages.end());
+    m_impl.m_spareListPages = std::move(m_impl.m_freeListPages);
+    m_impl.m_freeListPages = std::move(chain);
+    m_impl.m_free = std::move(free);
+
+    // the old mapping goes with the last snapshot on it
+    if (m_pageCount * pageSize > m_impl.m_map->m_size)
+        m_impl.remap(std::max(m_impl.m_map->m_size * 2, m_pageCount * pageSize));
+
+    Snapshot *old = m_impl.m_snapshot.load(std::memory_order_relaxed);
+    m_impl.m_snapshot.store(new Snapshot{meta.m_txn, m_root, m_pageCount, m_impl.m_map},
+                            std::memory_order_release);
+    Epoch::retire(old);
+
+    if (!m_freed.empty()) {
+        Epoch::retire(new FreedPages{m_impl.m_pool, meta.m_txn, std::move(m_freed)}, [](void *p) {
+            auto *freed = static_cast<FreedPages *>(p);
+            {
+                std::lock_guard<std::mutex> lock(freed->m_pool->m_lock);
+                freed->m_pool->release(freed->m_txn, freed->m_pages);
+            }
+            delete freed;
+        });
+    }
+}
+
+// Nothing was published, the free pages taken go back
+void BTreeKeyValueStore::Impl::Txn::abort()
+{
+    std::lock_guard<std::mutex> lock(m_impl.m_pool->m_lock);
+    m_impl.m_pool->m_pages.insert(m_impl.m_pool->m_pages.end(), m_reused.begin(), m_reused.end());
+}
+
+BTreeKeyValueStore::Impl::Impl(const std::string &fullpath, const BTreeOptions &options)
+    : m_path(fullpath), m_options(options), m_hash(), m_fd(-1), m_map(nullptr),
+      m_snapshot(nullptr), m_pool()
+{
+    open();
+}
+
+BTreeKeyValueStore::Impl::~Impl()
+{
+    close();
+}
+
+std::uint64_t BTreeKeyValueStore::Impl::checksum(const Meta &meta) const
+{
+    return m_hash(std::string(reinterpret_cast<const char *>(&meta), offsetof(Meta, m_checksum)));
+}
+
+// Meta pages take turns, the one being written is never the current one
+void BTreeKeyValueStore::Impl::writeMeta(const Meta &meta)
+{
+    Meta sealed = meta;
+    sealed.m_checksum = checksum(meta);
+
+    std::vector<char> page(pageSize, 0);
+    std::memcpy(page.data(), &sealed, sizeof(sealed));
+    writeFully(m_fd, page.data(), pageSize, (meta.m_txn % 2) * pageSize);
+    if (m_options.sync && 0 != ::fdatasync(m_fd))
+        throw std::runtime_error("cannot sync B+tree file " + m_path);
+}
+
+// Opens the file, or creates it, at the newest complete version
+void BTreeKeyValueStore::Impl::open()
+{
+    fs::create_directories(m_path);
+    const std::string path = m_path + "/" + dataFilename;
+
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::runtime_error("cannot open B+tree file " + path + ": " + std::strerror(errno));
+
+    struct stat st;
+    ::fstat(m_fd, &st);
+    if (0 == st.st_size) {
+        writeMeta(Meta{metaMagic, formatVersion, pageSize, 0, 0, 2, 0, 0});
+        writeMeta(Meta{metaMagic, formatVersion, pageSize, 1, 0, 2, 0, 0});
+    }
+
+    std::optional<Meta> current;
+    for (int i = 0; i < 2; i++) {
+        Meta meta;
+        if (::pread(m_fd, &meta, sizeof(meta), i * pageSize) != static_cast<ssize_t>(sizeof(meta)))
+            continue;
+        if (metaMagic != meta.m_magic || formatVersion != meta.m_version ||
+                pageSize != meta.m_pageSize || checksum(meta) != meta.m_checksum)
+            continue;
+        if (!current || meta.m_txn > current->m_txn)
+            current = meta;
+    }
+    if (!current) {
+        ::close(m_fd);
+        m_fd = -1;
+        throw std::runtime_error("not a B+tree store: " + path);
+    }
+
+    remap(std::max(m_options.mapSize, current->m_pageCount * pageSize));
+    Snapshot *old = m_snapshot.exchange(new Snapshot{current->m_txn, current->m_root,
+                                                     current->m_pageCount, m_map});
+    if (old)
+        Epoch::retire(old);
+    loadFreePages(current->m_freeList, current->m_pageCount);
+}
+
+void BTreeKeyValueStore::Impl::close()
+{
+    delete m_snapshot.exchange(nullptr);
+    if (m_fd < 0)
+        return;
+
+    m_map.reset();
+    ::close(m_fd);
+    m_fd = -1;
+
+    // snapshots retired by the last commits still hold the mapping
+    Epoch::collect();
+    Epoch::collect();
+}
+
+// The free list is read with pread, no page of the file is touched through the
+// mapping until a lookup needs it
+void BTreeKeyValueStore::Impl::loadFreePages(std::uint64_t freeList, std::uint64_t pageCount)
+{
+    m_free.clear();
+    m_freeListPages.clear();
+    m_spareListPages.clear();
+
+    std::vector<char> page(pageSize);
+    for (std::uint64_t pgno = freeList; pgno; pgno = load<std::uint64_t>(page.data() + 8)) {
+        const bool read = pgno >= 2 && pgno < pageCount && m_freeListPages.size() < pageCount &&
+                ::pread(m_fd, page.data(), pageSize, pgno * pageSize) == static_cast<ssize_t>(pageSize);
+        const std::uint32_t count = load<std::uint32_t>(page.data() + 4);
+        if (!read || PageType::FREE_LIST != static_cast<PageType>(page[0]) || count > freeListCapacity) {
+            close();
+            throw std::runtime_error("corrupt B+tree free list in " + m_path);
+        }
+
+        m_freeListPages.push_back(pgno);
+        for (std::uint32_t i = 0; i < count; i++)
+            m_free.push_back(load<std::uint64_t>(page.data() + freeListHeader + i * sizeof(std::uint64_t)));
+    }
+
+    // lowest pages are taken first
+    m_pool = std::make_shared<FreePool>();
+    m_pool->m_pages.assign(m_free.rbegin(), m_free.rend());
+}
+
+// A bigger mapping replaces the old one, which is returned and stays mapped
+// while snapshots still hold it
+std::shared_ptr<Mapping> BTreeKeyValueStore::Impl::remap(std::size_t size)
+{
+    void *base = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+    if (MAP_FAILED == base)
+        throw std::runtime_error("cannot map B+tree file " + m_path + ": " + std::strerror(errno));
+
+    std::shared_ptr<Mapping> old = std::move(m_map);
+    m_map.reset(new Mapping{static_cast<char *>(base), size});
+
+    return old;
+}
+
+template <typename F>
+auto BTreeKeyValueStore::Impl::read(F f) const
+{
+    EpochGuard guard;
+    return f(*m_snapshot.load(std::memory_order_acquire));
+}
+
+template <typename F>
+void BTreeKeyValueStore::Impl::update(F change)
+{
+    std::lock_guard<std::mutex> lock(m_writeLock);
+    if (m_fd < 0)
+        open();
+
+    Txn txn(*this);
+    try {
+        change(txn);
+        txn.commit();
+    } catch (...) {
+        txn.abort();
+        throw;
+    }
+}
+
+/*
+ * A version pinned in the free pool, so its pages stay as they are until it goes.
+ * It is pinned while the epoch guard still keeps the commit after it from freeing them.
+ */
+class BTreeKeyValueStore::Impl::PinnedSnapshot : public KeyValueSnapshot {
+public:
+    explicit PinnedSnapshot(const Impl &impl) : m_snapshot(), m_pool()
+    {
+        impl.read([this, &impl](const Snapshot &snapshot) {
+            m_snapshot = snapshot;
+            m_pool = impl.m_pool;
+            std::lock_guard<std::mutex> lock(m_pool->m_lock);
+            m_pool->m_pinned.insert(snapshot.m_txn);
+            return true;
+        });
+    }
+
+    virtual ~PinnedSnapshot() { m_pool->unpin(m_snapshot.m_txn); }
+
+    virtual std::uint64_t sequence() const override { return m_snapshot.m_txn; }
+
+    virtual std::string getKeyValue(const std::string &key) override
+    {
+        return getValue(m_snapshot, key);
+    }
+
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override
+    {
+        return getSet(m_snapshot, key);
+    }
+
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override
+    {
+        scan(m_snapshot, from, to, reverse, cb);
+    }
+
+private:
+    Snapshot m_snapshot;
+    std::shared_ptr<FreePool> m_pool;
+};
+
+BTreeKeyValueStore::BTreeKeyValueStore(const std::string &fullpath, const BTreeOptions &options)
+    : m_impl(std::make_unique<Impl>(fullpath, options))
+{
+
+}
+
+BTreeKeyValueStore::~BTreeKeyValueStore()
+{
+
+}
+
+// Management methods
+void BTreeKeyValueStore::loadKeysInto(std::function<void(std::string key, std::string vlaue)> cb)
+{
+    m_impl->read([&cb](const Snapshot &snapshot) {
+        Cursor cursor(snapshot);
+        for (cursor.seek(std::string_view()); cursor.valid(); cursor.next()) {
+            std::size_t columnAt;
+            std::string user = userOf(cursor.key(), columnAt);
+            if (stringColumn == cursor.key()[columnAt])
+                cb(user, cursor.value());
+        }
+        return true;
+    });
+}
+
+// The file goes with the directory, readers still on it keep their mapping until they are done
+void BTreeKeyValueStore::clear()
+{
+    std::lock_guard<std::mutex> lock(m_impl->m_writeLock);
+    if (m_impl->m_fd >= 0) {
+        Snapshot *old = m_impl->m_snapshot.exchange(new Snapshot{0, 0, 0, nullptr});
+        Epoch::retire(old);
+        m_impl->m_map.reset();
+        ::close(m_impl->m_fd);
+        m_impl->m_fd = -1;
+        m_impl->m_pool = std::make_shared<FreePool>();
+        m_impl->m_free.clear();
+        m_impl->m_freeListPages.clear();
+        m_impl->m_spareListPages.clear();
+    }
+
+    if (fs::exists(m_impl->m_path))
+        fs::remove_all(m_impl->m_path);
+}
+
+// Set or get methods
+void BTreeKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->update([&key, &value](Impl::Txn &txn) {
+        txn.put(columnKey(key, stringColumn), value);
+    });
+}
+
+void BTreeKeyValueStore::setKeyValue(const std::string &key,
+                                     const std::unordered_set<std::string> &value)
+{
+    m_impl->update([&key, &value](Impl::Txn &txn) {
+        txn.erase(columnKey(key, setColumn), columnKey(key, memberColumn + 1));
+        txn.put(columnKey(key, setColumn), std::string());
+
+        const std::string prefix = columnKey(key, memberColumn);
+        for (auto &member : value)
+            txn.put(prefix + member, std::string());
+    });
+}
+
+void BTreeKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->update([&key, &value](Impl::Txn &txn) {
+        const std::string setKey = columnKey(key, setColumn);
+        if (!txn.contains(setKey))
+            txn.put(setKey, std::string());
+        txn.put(columnKey(key, memberColumn) + value, std::string());
+    });
+}
+
+// The writer lock keeps every other write out, so reading the value first is atomic
+void BTreeKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                       MergeOperator op)
+{
+    m_impl->update([&key, &operand, op](Impl::Txn &txn) {
+        txn.put(columnKey(key, stringColumn), applyMerge(op, getValue(txn.base(), key), operand));
+    });
+}
+
+void BTreeKeyValueStore::mergeKeyValue(const std::string &key,
+                                       const std::unordered_set<std::string> &members)
+{
+    if (members.empty())
+        return;
+
+    m_impl->update([&key, &members](Impl::Txn &txn) {
+        const std::string setKey = columnKey(key, setColumn);
+        if (!txn.contains(setKey))
+            txn.put(setKey, std::string());
+
+        const std::string prefix = columnKey(key, memberColumn);
+        for (auto &member : members)
+            txn.put(prefix + member, std::string());
+    });
+}
+
+// A transaction which writes nothing commits nothing
+bool BTreeKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                               const std::string &value)
+{
+    bool set = false;
+    m_impl->update([&key, &expected, &value, &set](Impl::Txn &txn) {
+        if (getValue(txn.base(), key) != expected)
+            return;
+        txn.put(columnKey(key, stringColumn), value);
+        set = true;
+    });
+
+    return set;
+}
+
+// Pages are copied on write and freed by the commit, so a delete needs no tombstone
+void BTreeKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    m_impl->update([&key](Impl::Txn &txn) {
+        txn.erase(columnKey(key, stringColumn), columnKey(key, memberColumn + 1));
+    });
+}
+
+void BTreeKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->update([&key, &value](Impl::Txn &txn) {
+        const std::string member = columnKey(key, memberColumn) + value;
+        txn.erase(member, member + '\0');
+    });
+}
+
+std::string BTreeKeyValueStore::getKeyValue(const std::string &key)
+{
+    return m_impl->read([&key](const Snapshot &snapshot) { return getValue(snapshot, key); });
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+BTreeKeyValueStore::getKeyValueSet(const std::string &key)
+{
+    return m_impl->read([&key](const Snapshot &snapshot) { return getSet(snapshot, key); });
+}
+
+// Pages of the map may have to be read from disk first
+bool BTreeKeyValueStore::tryGetKeyValue(const std::string &, std::string &)
+{
+    return false;
+}
+
+bool BTreeKeyValueStore::tryGetKeyValueSet(const std::string &,
+                                           std::unique_ptr<std::unordered_set<std::string>> &)
+{
+    return false;
+}
+
+void BTreeKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                  std::function<bool(const std::string &key)> cb)
+{
+    m_impl->read([&](const Snapshot &snapshot) {
+        scan(snapshot, from, to, reverse, cb);
+        return true;
+    });
+}
+
+// A copy-on-write version is a snapshot already, pinning it only keeps its pages from reuse
+std::unique_ptr<KeyValueSnapshot> BTreeKeyValueStore::snapshot()
+{
+    return std::make_unique<Impl::PinnedSnapshot>(*m_impl);
+}
+
+// Pages are mapped from the file, the page cache holds them rather than the heap. The
+// mapping reserves room to grow into, only the pages in use count.
+MemoryUsage BTreeKeyValueStore::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.block(sizeof(Impl));
+    usage.string(m_impl->m_path, &MemoryUsage::m_overhead);
+    usage.block(m_impl->m_free.capacity() * sizeof(std::uint64_t));
+    usage.block(m_impl->m_freeListPages.capacity() * sizeof(std::uint64_t));
+    usage.block(m_impl->m_spareListPages.capacity() * sizeof(std::uint64_t));
+    usage.m_mapped += fileSize();
+
+    std::lock_guard<std::mutex> lock(m_impl->m_pool->m_lock);
+    usage.block(sizeof(FreePool));
+    usage.block(m_impl->m_pool->m_pages.capacity() * sizeof(std::uint64_t));
+    usage.block(m_impl->m_pool->m_held.capacity() *
+                sizeof(std::pair<std::uint64_t, std::vector<std::uint64_t>>));
+    for (auto &held : m_impl->m_pool->m_held)
+        usage.block(held.second.capacity() * sizeof(std::uint64_t));
+    for (std::size_t i = 0; i < m_impl->m_pool->m_pinned.size(); i++)
+        usage.block(4 * sizeof(void *) + sizeof(std::uint64_t));
+
+    return usage;
+}
+
+// Keys live in pages, none is kept apart
+MemoryUsage BTreeKeyValueStore::memoryUsage(const std::string &) const
+{
+    return MemoryUsage();
+}
+
+std::uint64_t BTreeKeyValueStore::fileSize() const
+{
+    return m_impl->read([](const Snapshot &snapshot) { return snapshot.m_pageCount * pageSize; });
+}
+
+}
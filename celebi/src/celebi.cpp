@@ -19,3 +19,8 @@ const std::unique_ptr<IDatabase> Celebi::loadDB(const std::string &dbName)
 {
    return EmbeddedDatabase::load(dbName);
 }
+
+const std::unique_ptr<IDatabase> Celebi::loadDB(const std::string &dbName, AccessMode mode)
+{
+   return EmbeddedDatabase::load(dbName, mode);
+}
@@ -1,11 +1,26 @@
 #include "database.h"
 #include "extensions/extdatabase.h"
 #include "extensions/extquery.h"
-
+#include "extensions/filelock.h"
+#include "extensions/timingwheel.h"
+#include "extensions/trace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <string>
 #include <fstream>
 #include <filesystem>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 using namespace celebi;
 using namespace celebiext;
@@ -20,6 +35,7 @@ namespace fs = std::filesystem;
 class EmbeddedDatabase::Impl : public IDatabase {
 public:
     Impl(const std::string &dbName, const std::string &fullpath);
+    Impl(const std::string &dbName, const std::string &fullpath, AccessMode mode);
     Impl(const std::string &dbName, const std::string &fullpath,
          std::unique_ptr<KeyValueStore> &kvStore);
     virtual ~Impl();
@@ -31,6 +47,7 @@ public:
     static const std::unique_ptr<IDatabase> createEmpty(const std::string &dbName,
                                                         std::unique_ptr<KeyValueStore> &kvStore);
     static const std::unique_ptr<IDatabase> load(const std::string &dbName);
+    static const std::unique_ptr<IDatabase> load(const std::string &dbName, AccessMode mode);
     virtual void destroy() override;
 
     // Set methods
@@ -45,61 +62,361 @@ public:
                              const std::unordered_set<std::string> &value,
                              const std::string &bucket) override;
 
+    // Set methods with time to live
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             const std::string &bucket, std::chrono::milliseconds ttl) override;
+    virtual std::uint64_t expiredKeys() const override;
+
+    // Merge methods
+    virtual void incrementKeyValue(const std::string &key, std::int64_t delta = 1) override;
+    virtual void decrementKeyValue(const std::string &key, std::int64_t delta = 1) override;
+    virtual void appendToKeyValue(const std::string &key, const std::string &suffix) override;
+    virtual void mergeKeyValueSet(const std::string &key,
+                                  const std::unordered_set<std::string> &members) override;
+
+    // Conditional and versioned methods
+    virtual bool compareAndSet(const std::string &key, const std::string &expected,
+                               const std::string &value) override;
+    virtual bool setIfAbsent(const std::string &key, const std::string &value) override;
+    virtual std::string getKeyValue(const std::string &key, std::uint64_t &version) override;
+    virtual bool setKeyValueIfVersion(const std::string &key, const std::string &value,
+                                      std::uint64_t version) override;
+
+    // Delete methods
+    virtual void deleteKey(const std::string &key) override;
+    virtual void removeFromBucket(const std::string &key, const std::string &bucket) override;
+
     virtual std::string getKeyValue(const std::string &key) override;
     virtual std::unique_ptr<std::unordered_set<std::string>>
                         getKeyValueSet(const std::string &key) override;
+    virtual bool tryGetKeyValue(const std::string &key, std::string &value) override;
+    virtual bool tryGetKeyValueSet(const std::string &key,
+                                   std::unique_ptr<std::unordered_set<std::string>> &value) override;
 
     // Query records methods
     virtual std::unique_ptr<IQueryResult> query(Query &query) const override;
     virtual std::unique_ptr<IQueryResult> query(BucketQuery &query) const override;
+    virtual std::unique_ptr<IQueryResult> query(RangeQuery &query) const override;
+    virtual bool tryQuery(BucketQuery &query, std::unique_ptr<IQueryResult> &result) const override;
+
+    virtual std::unique_ptr<ISnapshot> snapshot() override;
+
+    virtual std::unique_ptr<ITransaction> begin() override;
+    virtual bool transact(std::function<void(ITransaction &txn)> body, int attempts = 16) override;
+
+    virtual Stats stats() const override;
+    virtual void enableStats(bool enabled) override;
+
+    virtual void setSlowThreshold(std::chrono::nanoseconds threshold, std::size_t capacity = 128) override;
+    virtual std::vector<SlowOperation> slowOperations() const override;
+
+    virtual MemoryUsage memoryUsage() const override;
+    virtual std::map<std::string, MemoryUsage> bucketMemoryUsage() const override;
 
 private:
+    class Snapshot;
+    class Transaction;
+
+    // Keys hash to stripes. A stripe's sequence number is odd while a writer holds it
+    // and goes up by two with every write, transactions validate their reads against it.
+    struct Stripe {
+        std::mutex m_lock;
+        std::atomic<std::uint64_t> m_sequence{0};
+    };
+
+    // Stripes locked in ascending order, so two writers never wait on each other in a cycle
+    class StripeLocks {
+    public:
+        StripeLocks(Impl &impl, std::vector<std::size_t> stripes);
+        ~StripeLocks();
+
+        bool holds(std::size_t stripe) const;
+
+    private:
+        Impl &m_impl;
+        std::vector<std::size_t> m_stripes;
+    };
+
+    // Deadlines of the keys with a time to live, in milliseconds of the system clock
+    // so they mean the same after a restart. A key's deadline changes under its stripe.
+    struct ExpiryShard {
+        mutable std::mutex m_lock;
+        std::unordered_map<std::string, std::uint64_t> m_deadlines;
+    };
+
+    std::size_t stripeFor(const std::string &key) const;
+    template <typename F>
+    auto readStamped(const std::string &key, std::uint64_t &sequence, F read);
+
     const std::string getIndexDirPath() const;
     static const std::string getDbDirPath(const std::string &dbName);
     static const std::string getIndexKey(const std::string &bucket);
+    static const std::string getBucketsKey(const std::string &key);
+    static MemoryUsage asPostings(MemoryUsage usage);
+    static const std::string getExpiresKey(const std::string &key);
     void indexForBucket(const std::string &key, const std::string &bucket);
-    void appendKeyForBucket(const std::string &key, const std::string &bucket);
+    void lock(AccessMode mode);
+
+    static std::uint64_t now();
+    ExpiryShard &expiryShardFor(const std::string &key) const;
+    std::optional<std::uint64_t> deadlineOf(const std::string &key) const;
+    bool expired(const std::string &key) const;
+    bool expireIfDue(const std::string &key);
+    void expireAt(const std::string &key, std::uint64_t deadline);
+    void forgetExpiry(const std::string &key);
+    void restoreExpiries();
+    void expireLoop();
+    std::uint64_t deadlineAfter(std::chrono::milliseconds ttl) const;
+    template <typename V>
+    void setExpiring(const std::string &key, const V &value, const std::string *bucket,
+                     std::chrono::milliseconds ttl);
+    bool removeKey(const std::string &key, std::optional<std::uint64_t> due);
+    template <typename F>
+    void merge(const std::string &key, F write);
+
+    // Calls timed at the top, each store below is timed as a layer of its own
+    enum class Operation {
+        GET,
+        TRY_GET,
+        SET,
+        SET_BUCKET,
+        SET_TTL,
+        MERGE,
+        CONDITIONAL,
+        DELETE,
+        QUERY,
+        COMMIT,
+    };
+    static constexpr std::size_t operations = static_cast<std::size_t>(Operation::COMMIT) + 1;
+    static const std::array<const char *, operations> operationNames;
+
+    void instrument();
+    LatencyRecorder &latency(Operation op) const;
+    std::unique_ptr<KeyValueStore> metered(const std::string &layer,
+                                           std::unique_ptr<KeyValueStore> store);
 
     static const std::string baseDir;
     static const std::string indexDir;
     std::string m_name;
     std::string m_fullpath;
+    std::vector<std::unique_ptr<FileLock>> m_locks;
+    Metrics m_metrics;                          // before the stores, which record into it
+    std::array<LatencyRecorder *, operations> m_latencies;
+    std::atomic<std::uint64_t> *m_commitConflicts;
+    mutable SlowLog m_slowLog;
     std::unique_ptr<KeyValueStore> m_keyValueStore;
     std::unique_ptr<KeyValueStore> m_indexStore;
+    std::shared_mutex m_snapshotLock;   // shared by writes to both stores, so no snapshot splits one
+    static constexpr std::size_t stripes = 1024;
+    std::array<Stripe, stripes> m_stripes;
+
+    static constexpr std::size_t expiryShards = 64;
+    static constexpr std::chrono::milliseconds expiryTick{10};
+    mutable std::array<ExpiryShard, expiryShards> m_expiryShards;
+    std::atomic<std::size_t> m_expiring{0};     // keys with a deadline, none skips every check
+    bool m_sharedReader = false;                // deadlines are the writer's, read from the index
+    std::atomic<std::uint64_t> m_expired{0};
+    mutable std::mutex m_wheelLock;             // guards the wheel and the expiry thread
+    std::condition_variable m_wheelWake;
+    TimingWheel m_wheel{now(), static_cast<std::uint64_t>(expiryTick.count())};
+    bool m_stopping = false;
+    std::thread m_expirer;
+};
+
+/*
+ * A snapshot of each store, taken while no write is halfway between them
+ */
+class EmbeddedDatabase::Impl::Snapshot : public ISnapshot {
+public:
+    Snapshot(std::unique_ptr<KeyValueSnapshot> values, std::unique_ptr<KeyValueSnapshot> indexes)
+        : m_values(std::move(values)), m_indexes(std::move(indexes)) {}
+
+    virtual std::uint64_t sequence() const override { return m_values->sequence(); }
+
+    virtual std::string getKeyValue(const std::string &key) override
+    {
+        return m_values->getKeyValue(key);
+    }
+
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override
+    {
+        return m_values->getKeyValueSet(key);
+    }
+
+    virtual std::unique_ptr<IQueryResult> query(Query &q) const override
+    {
+        if (auto *bucketQuery = dynamic_cast<BucketQuery *>(&q))
+            return query(*bucketQuery);
+        if (auto *rangeQuery = dynamic_cast<RangeQuery *>(&q))
+            return query(*rangeQuery);
+
+        throw std::invalid_argument("unknown query type");
+    }
+
+    virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) const override
+    {
+        return std::make_unique<DefaultQueryResult>(m_indexes->getKeyValueSet(getIndexKey(q.bucket())));
+    }
+
+    virtual std::unique_ptr<IQueryResult> query(RangeQuery &q) const override
+    {
+        auto recordKeys = std::make_unique<std::vector<std::string>>();
+        const std::size_t limit = q.limit();
+
+        m_values->scanKeys(q.from(), q.to(), q.reverse(), [&recordKeys, limit](const std::string &key) {
+            recordKeys->push_back(key);
+            return 0 == limit || recordKeys->size() < limit;
+        });
+
+        return std::make_unique<DefaultQueryResult>(std::move(recordKeys));
+    }
+
+private:
+    std::unique_ptr<KeyValueSnapshot> m_values;
+    std::unique_ptr<KeyValueSnapshot> m_indexes;
+};
+
+/*
+ * Reads go to the stores and note the sequence number of their stripe, writes wait in
+ * the transaction. Commit locks the stripes it writes, checks that every stripe it read
+ * is neither changed nor held by another writer, and only then writes to the stores.
+ */
+class EmbeddedDatabase::Impl::Transaction : public ITransaction {
+public:
+    explicit Transaction(Impl &impl);
+
+    virtual std::string getKeyValue(const std::string &key) override;
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override;
+    virtual std::unique_ptr<IQueryResult> query(BucketQuery &q) override;
+
+    virtual void setKeyValue(const std::string &key, const std::string &value) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value) override;
+    virtual void setKeyValue(const std::string &key, const std::string &value,
+                             const std::string &bucket) override;
+    virtual void setKeyValue(const std::string &key,
+                             const std::unordered_set<std::string> &value,
+                             const std::string &bucket) override;
+
+    virtual bool commit() override;
+
+private:
+    struct Write {
+        std::string m_key;
+        std::optional<std::string> m_value;
+        std::optional<std::unordered_set<std::string>> m_members;
+        std::optional<std::string> m_bucket;
+    };
+
+    void read(const std::string &key, std::uint64_t sequence);
+    void write(Write write);
+
+    Impl &m_impl;
+    bool m_done;
+    std::unordered_map<std::size_t, std::uint64_t> m_reads;     // stripe, sequence first read
+    std::vector<Write> m_writes;
+    std::unordered_map<std::string, std::string> m_values;
+    std::unordered_map<std::string, std::unordered_set<std::string>> m_sets;
+    std::unordered_map<std::string, std::unordered_set<std::string>> m_buckets;
 };
 
 const std::string EmbeddedDatabase::Impl::baseDir = ".celebi";
 const std::string EmbeddedDatabase::Impl::indexDir = ".indexes";
+const std::array<const char *, EmbeddedDatabase::Impl::operations>
+EmbeddedDatabase::Impl::operationNames = {
+    "get", "try_get", "set", "set_bucket", "set_ttl", "merge", "conditional", "delete", "query", "commit",
+};
 
-// Use memory storage and file persistence by default
+// Use memory storage and file persistence by default,
+// both stores are sharded so the database can be shared between threads
 EmbeddedDatabase::Impl::Impl(const std::string &dbName, const std::string &fullpath)
+    : Impl(dbName, fullpath, AccessMode::EXCLUSIVE)
+{
+
+}
+
+// Processes sharing the database read the files directly instead of keeping them
+// in memory each, the keydirs tell readers when the writer has changed a value.
+// Keydirs live beside the database folder, so clearing the store can't unlink them.
+// Bloom filters are off, a reader's filter would not know the writer's new files.
+EmbeddedDatabase::Impl::Impl(const std::string &dbName, const std::string &fullpath,
+                             AccessMode mode)
     : m_name(dbName), m_fullpath(fullpath)
 {
-    std::unique_ptr<KeyValueStore> fileStore = std::make_unique<FileKeyValueStore>(fullpath);
-    std::unique_ptr<KeyValueStore> memoryStore = std::make_unique<MemoryKeyValueStore>(fileStore);
-    m_keyValueStore = std::move(memoryStore);
+    instrument();
+    lock(mode);
+
+    if (AccessMode::EXCLUSIVE != mode) {
+        bool writer = AccessMode::SHARED_WRITER == mode;
+
+        std::unique_ptr<KeyValueStore> fileStore =
+                metered("file", std::make_unique<FileKeyValueStore>(fullpath, 0));
+        std::unique_ptr<KeyValueStore> sharedStore =
+                std::make_unique<SharedKeyValueStore>(fileStore, fullpath + ".keydir", writer);
+        m_keyValueStore = metered("shared", std::move(sharedStore));
+
+        std::unique_ptr<KeyValueStore> fileIndexStore =
+                std::make_unique<FileKeyValueStore>(getIndexDirPath(), 0);
+        std::unique_ptr<KeyValueStore> sharedIndexStore =
+                std::make_unique<SharedKeyValueStore>(fileIndexStore,
+                                                      fullpath + indexDir + ".keydir", writer);
+        m_indexStore = metered("index", std::move(sharedIndexStore));
+        m_sharedReader = !writer;
+        if (writer)
+            restoreExpiries();
+        return;
+    }
+
+    std::unique_ptr<KeyValueStore> fileStore =
+            metered("file", std::make_unique<FileKeyValueStore>(fullpath));
+    std::unique_ptr<KeyValueStore> memoryStore =
+            std::make_unique<MemoryKeyValueStore>(fileStore, Concurrency::SHARDED);
+    m_keyValueStore = metered("memory", std::move(memoryStore));
 
     std::unique_ptr<KeyValueStore> fileIndexStore =
             std::make_unique<FileKeyValueStore>(getIndexDirPath());
     std::unique_ptr<KeyValueStore> memoryIndexStore =
-            std::make_unique<MemoryKeyValueStore>(fileIndexStore);
-    m_indexStore = std::move(memoryIndexStore);
+            std::make_unique<MemoryKeyValueStore>(fileIndexStore, Concurrency::SHARDED);
+    m_indexStore = metered("index", std::move(memoryIndexStore));
+    restoreExpiries();
 }
 
-// User can specify kv store for database
+// User can specify kv store for database, it is as thread-safe as that store is
 EmbeddedDatabase::Impl::Impl(const std::string &dbName, const std::string &fullpath,
                              std::unique_ptr<KeyValueStore> &kvStore)
-    : m_name(dbName), m_fullpath(fullpath), m_keyValueStore(kvStore.release())
+    : m_name(dbName), m_fullpath(fullpath)
 {
+    instrument();
+    m_keyValueStore = metered("store", std::unique_ptr<KeyValueStore>(kvStore.release()));
+    lock(AccessMode::EXCLUSIVE);
+
     std::unique_ptr<KeyValueStore> fileIndexStore =
             std::make_unique<FileKeyValueStore>(getIndexDirPath());
     std::unique_ptr<KeyValueStore> memoryIndexStore =
-            std::make_unique<MemoryKeyValueStore>(fileIndexStore);
-    m_indexStore = std::move(memoryIndexStore);
+            std::make_unique<MemoryKeyValueStore>(fileIndexStore, Concurrency::SHARDED);
+    m_indexStore = metered("index", std::move(memoryIndexStore));
+    restoreExpiries();
 }
 
 EmbeddedDatabase::Impl::~Impl()
 {
+    {
+        std::lock_guard<std::mutex> lock(m_wheelLock);
+        m_stopping = true;
+    }
+    m_wheelWake.notify_all();
+    if (m_expirer.joinable())
+        m_expirer.join();
 }
 
 inline const std::string EmbeddedDatabase::Impl::getIndexDirPath() const
@@ -120,6 +437,335 @@ inline const std::string EmbeddedDatabase::Impl::getIndexKey(const std::string &
     return "bucket::" + bucket;
 }
 
+// The buckets a key was set with, so deleting it needs no look into every bucket
+inline const std::string EmbeddedDatabase::Impl::getBucketsKey(const std::string &key)
+{
+    return "buckets::" + key;
+}
+
+// The deadline of a key with a time to live, persisted so a restart still expires it
+inline const std::string EmbeddedDatabase::Impl::getExpiresKey(const std::string &key)
+{
+    return "expires::" + key;
+}
+
+inline std::size_t EmbeddedDatabase::Impl::stripeFor(const std::string &key) const
+{
+    return std::hash<std::string>()(key) % stripes;
+}
+
+EmbeddedDatabase::Impl::StripeLocks::StripeLocks(Impl &impl, std::vector<std::size_t> stripes)
+    : m_impl(impl), m_stripes(std::move(stripes))
+{
+    std::sort(m_stripes.begin(), m_stripes.end());
+    m_stripes.erase(std::unique(m_stripes.begin(), m_stripes.end()), m_stripes.end());
+
+    for (std::size_t stripe : m_stripes) {
+        m_impl.m_stripes[stripe].m_lock.lock();
+        m_impl.m_stripes[stripe].m_sequence.fetch_add(1);
+    }
+}
+
+EmbeddedDatabase::Impl::StripeLocks::~StripeLocks()
+{
+    for (std::size_t stripe : m_stripes) {
+        m_impl.m_stripes[stripe].m_sequence.fetch_add(1);
+        m_impl.m_stripes[stripe].m_lock.unlock();
+    }
+}
+
+bool EmbeddedDatabase::Impl::StripeLocks::holds(std::size_t stripe) const
+{
+    return std::binary_search(m_stripes.begin(), m_stripes.end(), stripe);
+}
+
+// Reads while no writer holds the stripe, so the sequence number goes with what was read
+template <typename F>
+auto EmbeddedDatabase::Impl::readStamped(const std::string &key, std::uint64_t &sequence, F read)
+{
+    Stripe &stripe = m_stripes[stripeFor(key)];
+    for (;;) {
+        sequence = stripe.m_sequence.load();
+        if (sequence % 2) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        auto value = read();
+        if (stripe.m_sequence.load() == sequence)
+            return value;
+    }
+}
+
+// Stats
+
+void EmbeddedDatabase::Impl::instrument()
+{
+    for (std::size_t op = 0; op < operations; op++)
+        m_latencies[op] = &m_metrics.latency("database", operationNames[op]);
+    m_commitConflicts = &m_metrics.counter("database", "commit_conflicts");
+    m_metrics.collect([this](Stats &stats) {
+        stats.m_counters[{ "database", "expired_keys" }] = m_expired.load();
+    });
+}
+
+inline LatencyRecorder &EmbeddedDatabase::Impl::latency(Operation op) const
+{
+    return *m_latencies[static_cast<std::size_t>(op)];
+}
+
+std::unique_ptr<KeyValueStore> EmbeddedDatabase::Impl::metered(const std::string &layer,
+                                                               std::unique_ptr<KeyValueStore> store)
+{
+    return std::make_unique<MeteredKeyValueStore>(store, m_metrics, layer);
+}
+
+Stats EmbeddedDatabase::Impl::stats() const
+{
+    return m_metrics.stats();
+}
+
+void EmbeddedDatabase::Impl::enableStats(bool enabled)
+{
+    m_metrics.enable(enabled);
+}
+
+void EmbeddedDatabase::Impl::setSlowThreshold(std::chrono::nanoseconds threshold, std::size_t capacity)
+{
+    m_slowLog.configure(threshold, capacity);
+}
+
+std::vector<SlowOperation> EmbeddedDatabase::Impl::slowOperations() const
+{
+    return m_slowLog.operations();
+}
+
+// Whatever the index store holds for its keys is postings to the database
+MemoryUsage EmbeddedDatabase::Impl::asPostings(MemoryUsage usage)
+{
+    usage.m_postings += usage.m_keys + usage.m_values + usage.m_members;
+    usage.m_keys = usage.m_values = usage.m_members = 0;
+
+    return usage;
+}
+
+// The database itself adds its stripes and the deadlines of keys with a time to live
+MemoryUsage EmbeddedDatabase::Impl::memoryUsage() const
+{
+    MemoryUsage usage = m_keyValueStore->memoryUsage();
+    usage += asPostings(m_indexStore->memoryUsage());
+    usage.block(sizeof(Impl));
+
+    for (auto &shard : m_expiryShards) {
+        std::lock_guard<std::mutex> lock(shard.m_lock);
+        if (shard.m_deadlines.bucket_count() > 1)
+            usage.block(shard.m_deadlines.bucket_count() * sizeof(void *));
+        for (auto &deadline : shard.m_deadlines) {
+            usage.block(sizeof(void *) + sizeof(deadline) + sizeof(std::size_t));
+            usage.string(deadline.first, &MemoryUsage::m_overhead);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_wheelLock);
+    m_wheel.memoryUsage(usage);
+
+    return usage;
+}
+
+// Index keys of buckets sort together, so one scan finds every bucket
+std::map<std::string, MemoryUsage> EmbeddedDatabase::Impl::bucketMemoryUsage() const
+{
+    const std::string prefix = getIndexKey("");
+    std::string end = prefix;
+    end.back()++;
+
+    std::vector<std::string> indexKeys;
+    m_indexStore->scanKeys(prefix, end, false, [&indexKeys](const std::string &key) {
+        indexKeys.push_back(key);
+        return true;
+    });
+
+    std::map<std::string, MemoryUsage> buckets;
+    for (auto &indexKey : indexKeys)
+        buckets.emplace(indexKey.substr(prefix.size()), asPostings(m_indexStore->memoryUsage(indexKey)));
+
+    return buckets;
+}
+
+// Lock files live beside the database folder, destroying the database removes them.
+// Every process holds the shared lock except an exclusive one, and writers also
+// hold the writer lock, so there is one writer at most and nobody else beside an
+// exclusive process.
+void EmbeddedDatabase::Impl::lock(AccessMode mode)
+{
+    if (AccessMode::EXCLUSIVE == mode) {
+        m_locks.push_back(std::make_unique<FileLock>(m_fullpath + ".lock",
+                                                     FileLock::Type::EXCLUSIVE));
+        return;
+    }
+
+    m_locks.push_back(std::make_unique<FileLock>(m_fullpath + ".lock", FileLock::Type::SHARED));
+    if (AccessMode::SHARED_WRITER == mode)
+        m_locks.push_back(std::make_unique<FileLock>(m_fullpath + ".writer.lock",
+                                                     FileLock::Type::EXCLUSIVE));
+}
+
+// Time to live
+
+std::uint64_t EmbeddedDatabase::Impl::now()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::uint64_t EmbeddedDatabase::Impl::deadlineAfter(std::chrono::milliseconds ttl) const
+{
+    return now() + std::max<std::int64_t>(ttl.count(), 0);
+}
+
+inline EmbeddedDatabase::Impl::ExpiryShard &
+EmbeddedDatabase::Impl::expiryShardFor(const std::string &key) const
+{
+    return m_expiryShards[std::hash<std::string>()(key) % expiryShards];
+}
+
+std::optional<std::uint64_t> EmbeddedDatabase::Impl::deadlineOf(const std::string &key) const
+{
+    if (m_sharedReader) {
+        const std::string deadline = m_indexStore->getKeyValue(getExpiresKey(key));
+        if (deadline.empty())
+            return std::nullopt;
+
+        return std::stoull(deadline);
+    }
+
+    if (0 == m_expiring.load(std::memory_order_relaxed))
+        return std::nullopt;
+
+    ExpiryShard &shard = expiryShardFor(key);
+    std::lock_guard<std::mutex> lock(shard.m_lock);
+    auto found = shard.m_deadlines.find(key);
+    if (found == shard.m_deadlines.end())
+        return std::nullopt;
+
+    return found->second;
+}
+
+bool EmbeddedDatabase::Impl::expired(const std::string &key) const
+{
+    auto deadline = deadlineOf(key);
+
+    return deadline && *deadline <= now();
+}
+
+// Lazy expiration, a read which finds the key past its deadline removes it. A shared
+// reader can't, it answers unset and leaves removing it to the writer.
+bool EmbeddedDatabase::Impl::expireIfDue(const std::string &key)
+{
+    auto deadline = deadlineOf(key);
+    if (!deadline || *deadline > now())
+        return false;
+    if (m_sharedReader)
+        return true;
+
+    CELEBI_TRACE_SPAN(span, "database.expire", key);
+    removeKey(key, deadline);
+
+    return true;
+}
+
+// Caller holds the key's stripe. The deadline is persisted before the value is
+// written, so a crash in between can't leave a key which never expires.
+void EmbeddedDatabase::Impl::expireAt(const std::string &key, std::uint64_t deadline)
+{
+    m_indexStore->setKeyValue(getExpiresKey(key), std::to_string(deadline));
+
+    ExpiryShard &shard = expiryShardFor(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.m_lock);
+        if (shard.m_deadlines.insert_or_assign(key, deadline).second)
+            m_expiring.fetch_add(1);
+    }
+
+    std::lock_guard<std::mutex> lock(m_wheelLock);
+    m_wheel.schedule(key, deadline);
+    if (!m_expirer.joinable())
+        m_expirer = std::thread(&Impl::expireLoop, this);
+}
+
+// Caller holds the key's stripe, the wheel keeps the old timer which then finds
+// no deadline to match and is dropped
+void EmbeddedDatabase::Impl::forgetExpiry(const std::string &key)
+{
+    if (0 == m_expiring.load(std::memory_order_relaxed))
+        return;
+
+    ExpiryShard &shard = expiryShardFor(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.m_lock);
+        if (0 == shard.m_deadlines.erase(key))
+            return;
+        m_expiring.fetch_sub(1);
+    }
+
+    m_indexStore->deleteKeyValue(getExpiresKey(key));
+}
+
+void EmbeddedDatabase::Impl::restoreExpiries()
+{
+    const std::string prefix = getExpiresKey("");
+    std::vector<std::string> expiresKeys;
+    m_indexStore->scanKeys(prefix, prefix.substr(0, prefix.size() - 1) + ";", false,
+                           [&expiresKeys](const std::string &key) {
+        expiresKeys.push_back(key);
+        return true;
+    });
+
+    for (auto &expiresKey : expiresKeys) {
+        const std::string deadline = m_indexStore->getKeyValue(expiresKey);
+        if (deadline.empty())
+            continue;
+
+        const std::string key = expiresKey.substr(prefix.size());
+        const std::uint64_t due = std::stoull(deadline);
+        expiryShardFor(key).m_deadlines[key] = due;
+        m_expiring.fetch_add(1);
+        m_wheel.schedule(key, due);
+    }
+
+    if (!expiresKeys.empty())
+        m_expirer = std::thread(&Impl::expireLoop, this);
+}
+
+// Active expiration, every tick the wheel hands over the keys due by now. A timer
+// whose deadline is no longer the key's, because it was set again, removes nothing.
+void EmbeddedDatabase::Impl::expireLoop()
+{
+    std::unique_lock<std::mutex> lock(m_wheelLock);
+    while (!m_stopping) {
+        m_wheelWake.wait_for(lock, expiryTick);
+        if (m_stopping)
+            break;
+
+        std::vector<std::pair<std::string, std::uint64_t>> due;
+        m_wheel.advance(now(), [&due](const std::string &key, std::uint64_t deadline) {
+            due.emplace_back(key, deadline);
+        });
+        if (due.empty())
+            continue;
+
+        lock.unlock();
+        for (auto &timer : due) {
+            try {
+                removeKey(timer.first, timer.second);
+            } catch (const std::exception &) {
+                // the deadline stays, so the next read of the key tries again
+            }
+        }
+        lock.lock();
+    }
+}
+
 // Management methods
 
 const std::unique_ptr<IDatabase> EmbeddedDatabase::Impl::createEmpty(const std::string &dbName)
@@ -147,9 +793,32 @@ const std::unique_ptr<IDatabase> EmbeddedDatabase::Impl::load(const std::string
     return std::make_unique<EmbeddedDatabase::Impl>(dbName, dbFolder);
 }
 
+const std::unique_ptr<IDatabase> EmbeddedDatabase::Impl::load(const std::string &dbName,
+                                                              AccessMode mode)
+{
+    std::string dbFolder = getDbDirPath(dbName);
+
+    return std::make_unique<EmbeddedDatabase::Impl>(dbName, dbFolder, mode);
+}
+
+// Clearing throws for shared readers, so the files beside the folder are only
+// removed by an exclusive process or the writer, while it still holds its locks
 void EmbeddedDatabase::Impl::destroy()
 {
    m_keyValueStore->clear();
+
+   for (auto &shard : m_expiryShards) {
+       std::lock_guard<std::mutex> lock(shard.m_lock);
+       for (auto &deadline : shard.m_deadlines)
+           m_indexStore->deleteKeyValue(getExpiresKey(deadline.first));
+       m_expiring.fetch_sub(shard.m_deadlines.size());
+       shard.m_deadlines.clear();
+   }
+
+   std::error_code ec;
+   for (const std::string &suffix : { std::string(".keydir"), indexDir + ".keydir",
+                                      std::string(".writer.lock"), std::string(".lock") })
+       fs::remove(m_fullpath + suffix, ec);
 }
 
 const std::string EmbeddedDatabase::Impl::getDirectory() const
@@ -157,47 +826,38 @@ const std::string EmbeddedDatabase::Impl::getDirectory() const
     return m_fullpath;
 }
 
+// Appending is a single atomic step in the index store, under the lock of the shard
+// holding this bucket's postings only, so writers of other buckets are never held up
+// and two writers of the same bucket can't lose each other's keys
 void EmbeddedDatabase::Impl::indexForBucket(const std::string &key, const std::string &bucket)
 {
     // add to bucket index
-    std::string indexKey = getIndexKey(bucket);
-    // query the key index
-    std::unique_ptr<std::unordered_set<std::string>> recordKeys =
-            m_indexStore->getKeyValueSet(indexKey);
-
-    if (recordKeys->find(key) == recordKeys->end()) {
-        recordKeys->insert(key);
-        m_indexStore->setKeyValue(indexKey, *recordKeys.release());
-    }
-}
-
-void EmbeddedDatabase::Impl::appendKeyForBucket(const std::string &key, const std::string &bucket)
-{
-    // add to bucket index
-    std::string indexKey = getIndexKey(bucket);
-    // query the key index
-    std::unique_ptr<std::unordered_set<std::string>> recordKeys =
-            m_indexStore->getKeyValueSet(indexKey);
-
-    if (0 == recordKeys->size()) {
-        recordKeys->insert(key);
-        m_indexStore->setKeyValue(indexKey, *recordKeys.release());
-    } else if (recordKeys->find(key) == recordKeys->end()) {
-        m_indexStore->appendKeyValue(indexKey, key);
-    }
+    m_indexStore->appendKeyValue(getIndexKey(bucket), key);
+    m_indexStore->appendKeyValue(getBucketsKey(key), bucket);
 }
 
 // Set or get methods
 
+// Every write holds the stripes of what it changes, so transactions which read them see it
 void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
                                          const std::string &value)
 {
+    TimedCall timer(latency(Operation::SET), m_slowLog, key);
+    timer.value(value);
+    CELEBI_TRACE_SPAN(span, "database.set", key, TraceSpan::bytesOf(value));
+    StripeLocks stripes(*this, { stripeFor(key) });
+    forgetExpiry(key);
     m_keyValueStore->setKeyValue(key, value);
 }
 
 void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
                                          const std::unordered_set<std::string> &value)
 {
+    TimedCall timer(latency(Operation::SET), m_slowLog, key);
+    timer.value(value);
+    CELEBI_TRACE_SPAN(span, "database.set", key, TraceSpan::bytesOf(value));
+    StripeLocks stripes(*this, { stripeFor(key) });
+    forgetExpiry(key);
     m_keyValueStore->setKeyValue(key, value);
 }
 
@@ -205,7 +865,13 @@ void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
                                          const std::string &value,
                                          const std::string &bucket)
 {
-    setKeyValue(key, value);
+    TimedCall timer(latency(Operation::SET_BUCKET), m_slowLog, key, &bucket);
+    timer.value(value);
+    CELEBI_TRACE_SPAN(span, "database.set_bucket", key, TraceSpan::bytesOf(value));
+    StripeLocks stripes(*this, { stripeFor(key), stripeFor(getIndexKey(bucket)) });
+    std::shared_lock<std::shared_mutex> lock(m_snapshotLock);
+    forgetExpiry(key);
+    m_keyValueStore->setKeyValue(key, value);
     indexForBucket(key, bucket);
 }
 
@@ -213,102 +879,587 @@ void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
                                          const std::unordered_set<std::string> &value,
                                          const std::string &bucket)
 {
-    setKeyValue(key, value);
+    TimedCall timer(latency(Operation::SET_BUCKET), m_slowLog, key, &bucket);
+    timer.value(value);
+    CELEBI_TRACE_SPAN(span, "database.set_bucket", key, TraceSpan::bytesOf(value));
+    StripeLocks stripes(*this, { stripeFor(key), stripeFor(getIndexKey(bucket)) });
+    std::shared_lock<std::shared_mutex> lock(m_snapshotLock);
+    forgetExpiry(key);
+    m_keyValueStore->setKeyValue(key, value);
     indexForBucket(key, bucket);
 }
 
-std::string EmbeddedDatabase::Impl::getKeyValue(const std::string &key)
+// Set methods with time to live
+
+template <typename V>
+void EmbeddedDatabase::Impl::setExpiring(const std::string &key, const V &value,
+                                         const std::string *bucket,
+                                         std::chrono::milliseconds ttl)
 {
-    return m_keyValueStore->getKeyValue(key);
+    TimedCall timer(latency(Operation::SET_TTL), m_slowLog, key, bucket);
+    timer.value(value);
+    CELEBI_TRACE_SPAN(span, "database.set_ttl", key, TraceSpan::bytesOf(value));
+    std::vector<std::size_t> locked{ stripeFor(key) };
+    if (bucket)
+        locked.push_back(stripeFor(getIndexKey(*bucket)));
+
+    StripeLocks stripes(*this, std::move(locked));
+    std::shared_lock<std::shared_mutex> lock(m_snapshotLock);
+    expireAt(key, deadlineAfter(ttl));
+    m_keyValueStore->setKeyValue(key, value);
+    if (bucket)
+        indexForBucket(key, *bucket);
 }
 
-std::unique_ptr<std::unordered_set<std::string>>
-EmbeddedDatabase::Impl::getKeyValueSet(const std::string &key)
+void EmbeddedDatabase::Impl::setKeyValue(const std::string &key, const std::string &value,
+                                         std::chrono::milliseconds ttl)
 {
-    return m_keyValueStore->getKeyValueSet(key);
+    setExpiring(key, value, nullptr, ttl);
 }
 
-std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::query(Query &q) const
+void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
+                                         const std::unordered_set<std::string> &value,
+                                         std::chrono::milliseconds ttl)
 {
-    // Query is abstract, so try overloading here
-    return query(static_cast<decltype(q)>(q));
+    setExpiring(key, value, nullptr, ttl);
 }
 
-std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::query(BucketQuery &q) const
+void EmbeddedDatabase::Impl::setKeyValue(const std::string &key, const std::string &value,
+                                         const std::string &bucket, std::chrono::milliseconds ttl)
 {
-    const std::string indexKey = getIndexKey(q.bucket());
-
-    return std::make_unique<DefaultQueryResult>(m_indexStore->getKeyValueSet(indexKey));
+    setExpiring(key, value, &bucket, ttl);
 }
 
-/*
- ****************************************************************************
- * High level database client API implementation below
- ****************************************************************************
- */
-
-EmbeddedDatabase::EmbeddedDatabase(const std::string &dbName, const std::string &fullpath)
-    : m_impl(std::make_unique<EmbeddedDatabase::Impl>(dbName, fullpath))
+void EmbeddedDatabase::Impl::setKeyValue(const std::string &key,
+                                         const std::unordered_set<std::string> &value,
+                                         const std::string &bucket, std::chrono::milliseconds ttl)
 {
-
+    setExpiring(key, value, &bucket, ttl);
 }
 
-EmbeddedDatabase::EmbeddedDatabase(const std::string &dbName, const std::string &fullpath,
-                                   std::unique_ptr<KeyValueStore> &kvStore)
-    : m_impl(std::make_unique<EmbeddedDatabase::Impl>(dbName, fullpath, kvStore))
+std::uint64_t EmbeddedDatabase::Impl::expiredKeys() const
 {
-
+    return m_expired.load();
 }
 
-EmbeddedDatabase::~EmbeddedDatabase()
+// Merge methods
+
+// The stores merge atomically, the stripe is only held so that transactions which
+// read the key see the merge. A key past its deadline is merged into as unset.
+template <typename F>
+void EmbeddedDatabase::Impl::merge(const std::string &key, F write)
 {
+    TimedCall timer(latency(Operation::MERGE), m_slowLog, key);
+    expireIfDue(key);
 
+    StripeLocks stripes(*this, { stripeFor(key) });
+    write(*m_keyValueStore);
 }
 
-// Management methods
-const std::unique_ptr<IDatabase> EmbeddedDatabase::createEmpty(const std::string &dbName)
+void EmbeddedDatabase::Impl::incrementKeyValue(const std::string &key, std::int64_t delta)
 {
-    return EmbeddedDatabase::Impl::createEmpty(dbName);
+    merge(key, [&key, delta](KeyValueStore &store) {
+        store.mergeKeyValue(key, std::to_string(delta), MergeOperator::ADD);
+    });
 }
 
-const std::unique_ptr<IDatabase> EmbeddedDatabase::createEmpty(const std::string &dbName,
-                                                               std::unique_ptr<KeyValueStore> &kvStore)
+// Negated in unsigned arithmetic, so the smallest delta wraps like the counter does
+void EmbeddedDatabase::Impl::decrementKeyValue(const std::string &key, std::int64_t delta)
 {
-    return EmbeddedDatabase::Impl::createEmpty(dbName, kvStore);
+    incrementKeyValue(key, static_cast<std::int64_t>(0 - static_cast<std::uint64_t>(delta)));
 }
 
-const std::unique_ptr<IDatabase> EmbeddedDatabase::load(const std::string &dbName)
+void EmbeddedDatabase::Impl::appendToKeyValue(const std::string &key, const std::string &suffix)
 {
-    return EmbeddedDatabase::Impl::load(dbName);
+    merge(key, [&key, &suffix](KeyValueStore &store) {
+        store.mergeKeyValue(key, suffix, MergeOperator::APPEND);
+    });
 }
 
-void EmbeddedDatabase::destroy()
+void EmbeddedDatabase::Impl::mergeKeyValueSet(const std::string &key,
+                                              const std::unordered_set<std::string> &members)
 {
-    m_impl->destroy();
+    merge(key, [&key, &members](KeyValueStore &store) {
+        store.mergeKeyValue(key, members);
+    });
 }
 
-const std::string EmbeddedDatabase::getDirectory() const
+// Conditional and versioned methods
+
+// The store compares and sets in one step, the stripe is held like for a plain set
+bool EmbeddedDatabase::Impl::compareAndSet(const std::string &key, const std::string &expected,
+                                           const std::string &value)
 {
-    return m_impl->getDirectory();
+    TimedCall timer(latency(Operation::CONDITIONAL), m_slowLog, key);
+    timer.value(value);
+    expireIfDue(key);
+
+    StripeLocks stripes(*this, { stripeFor(key) });
+    if (!m_keyValueStore->compareAndSetKeyValue(key, expected, value))
+        return false;
+    forgetExpiry(key);
+
+    return true;
 }
 
-// Set or get methods
-void EmbeddedDatabase::setKeyValue(const std::string &key, const std::string &value)
+bool EmbeddedDatabase::Impl::setIfAbsent(const std::string &key, const std::string &value)
 {
-    m_impl->setKeyValue(key, value);
+    return compareAndSet(key, std::string(), value);
 }
 
-void EmbeddedDatabase::setKeyValue(const std::string &key,
-                                   const std::unordered_set<std::string> &value)
+// The version is the sequence number of the key's stripe, the one transactions validate with
+std::string EmbeddedDatabase::Impl::getKeyValue(const std::string &key, std::uint64_t &version)
 {
-    m_impl->setKeyValue(key, value);
+    TimedCall timer(latency(Operation::GET), m_slowLog, key);
+    expireIfDue(key);
+
+    std::string value = readStamped(key, version, [this, &key]() {
+        return expired(key) ? std::string() : m_keyValueStore->getKeyValue(key);
+    });
+    timer.value(value);
+
+    return value;
 }
 
-void EmbeddedDatabase::setKeyValue(const std::string &key,
-                                   const std::string &value,
-                                   const std::string &bucket)
+// Locking the stripe bumps its sequence number by one, anything more is another write
+bool EmbeddedDatabase::Impl::setKeyValueIfVersion(const std::string &key, const std::string &value,
+                                                  std::uint64_t version)
 {
-    m_impl->setKeyValue(key, value, bucket);
+    TimedCall timer(latency(Operation::CONDITIONAL), m_slowLog, key);
+    timer.value(value);
+    const std::size_t stripe = stripeFor(key);
+    StripeLocks stripes(*this, { stripe });
+    if (m_stripes[stripe].m_sequence.load() != version + 1)
+        return false;
+
+    forgetExpiry(key);
+    m_keyValueStore->setKeyValue(key, value);
+
+    return true;
+}
+
+// Delete methods
+
+// The key's buckets are only known once they are read, so they are read again under
+// the stripes and the delete starts over if a bucket was added in between
+void EmbeddedDatabase::Impl::deleteKey(const std::string &key)
+{
+    TimedCall timer(latency(Operation::DELETE), m_slowLog, key);
+    CELEBI_TRACE_SPAN(span, "database.delete", key);
+    removeKey(key, std::nullopt);
+}
+
+// An expiry removes the key only if its deadline is still the one which came due
+bool EmbeddedDatabase::Impl::removeKey(const std::string &key, std::optional<std::uint64_t> due)
+{
+    const std::string bucketsKey = getBucketsKey(key);
+    for (;;) {
+        auto buckets = m_indexStore->getKeyValueSet(bucketsKey);
+        std::vector<std::size_t> locked{ stripeFor(key) };
+        for (auto &bucket : *buckets)
+            locked.push_back(stripeFor(getIndexKey(bucket)));
+
+        StripeLocks stripes(*this, std::move(locked));
+        auto current = m_indexStore->getKeyValueSet(bucketsKey);
+        if (std::any_of(current->begin(), current->end(), [&buckets](const std::string &bucket) {
+            return !buckets->count(bucket);
+        }))
+            continue;
+        if (due && deadlineOf(key) != due)
+            return false;
+
+        std::shared_lock<std::shared_mutex> lock(m_snapshotLock);
+        m_keyValueStore->deleteKeyValue(key);
+        for (auto &bucket : *current)
+            m_indexStore->removeKeyValue(getIndexKey(bucket), key);
+        m_indexStore->deleteKeyValue(bucketsKey);
+        forgetExpiry(key);
+        if (due)
+            m_expired.fetch_add(1);
+        return true;
+    }
+}
+
+void EmbeddedDatabase::Impl::removeFromBucket(const std::string &key, const std::string &bucket)
+{
+    TimedCall timer(latency(Operation::DELETE), m_slowLog, key, &bucket);
+    StripeLocks stripes(*this, { stripeFor(key), stripeFor(getIndexKey(bucket)) });
+    std::shared_lock<std::shared_mutex> lock(m_snapshotLock);
+    m_indexStore->removeKeyValue(getIndexKey(bucket), key);
+    m_indexStore->removeKeyValue(getBucketsKey(key), bucket);
+}
+
+std::string EmbeddedDatabase::Impl::getKeyValue(const std::string &key)
+{
+    TimedCall timer(latency(Operation::GET), m_slowLog, key);
+    CELEBI_TRACE_SPAN(span, "database.get", key);
+    if (expireIfDue(key))
+        return "";
+
+    std::string value = m_keyValueStore->getKeyValue(key);
+    timer.value(value);
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(value));
+
+    return value;
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+EmbeddedDatabase::Impl::getKeyValueSet(const std::string &key)
+{
+    TimedCall timer(latency(Operation::GET), m_slowLog, key);
+    CELEBI_TRACE_SPAN(span, "database.get_set", key);
+    if (expireIfDue(key))
+        return std::make_unique<std::unordered_set<std::string>>();
+
+    auto value = m_keyValueStore->getKeyValueSet(key);
+    timer.value(*value);
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(*value));
+
+    return value;
+}
+
+// Removing an expired key may wait on disk, so these only answer it is unset
+bool EmbeddedDatabase::Impl::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    TimedCall timer(latency(Operation::TRY_GET), m_slowLog, key);
+    if (expired(key)) {
+        value.clear();
+        return true;
+    }
+
+    if (!m_keyValueStore->tryGetKeyValue(key, value))
+        return false;
+    timer.value(value);
+
+    return true;
+}
+
+bool EmbeddedDatabase::Impl::tryGetKeyValueSet(const std::string &key,
+                                               std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    TimedCall timer(latency(Operation::TRY_GET), m_slowLog, key);
+    if (expired(key)) {
+        value = std::make_unique<std::unordered_set<std::string>>();
+        return true;
+    }
+
+    if (!m_keyValueStore->tryGetKeyValueSet(key, value))
+        return false;
+    timer.value(*value);
+
+    return true;
+}
+
+std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::query(Query &q) const
+{
+    // Query is abstract, so find the overload for its dynamic type here
+    if (auto *bucketQuery = dynamic_cast<BucketQuery *>(&q))
+        return query(*bucketQuery);
+    if (auto *rangeQuery = dynamic_cast<RangeQuery *>(&q))
+        return query(*rangeQuery);
+
+    // an empty result would have no record keys at all
+    throw std::invalid_argument("unknown query type");
+}
+
+std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::query(BucketQuery &q) const
+{
+    const std::string bucket = q.bucket();
+    TimedCall timer(latency(Operation::QUERY), m_slowLog, bucket, &bucket);
+    CELEBI_TRACE_SPAN(span, "database.query", bucket);
+    const std::string indexKey = getIndexKey(bucket);
+    auto recordKeys = m_indexStore->getKeyValueSet(indexKey);
+    if (0 != m_expiring.load(std::memory_order_relaxed))
+        for (auto it = recordKeys->begin(); it != recordKeys->end();)
+            it = expired(*it) ? recordKeys->erase(it) : std::next(it);
+
+    return std::make_unique<DefaultQueryResult>(std::move(recordKeys));
+}
+
+std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::query(RangeQuery &q) const
+{
+    const std::string from = q.from();
+    TimedCall timer(latency(Operation::QUERY), m_slowLog, from);
+    auto recordKeys = std::make_unique<std::vector<std::string>>();
+    const std::size_t limit = q.limit();
+
+    m_keyValueStore->scanKeys(q.from(), q.to(), q.reverse(),
+                              [this, &recordKeys, limit](const std::string &key) {
+        if (expired(key))
+            return true;
+        recordKeys->push_back(key);
+        return 0 == limit || recordKeys->size() < limit;
+    });
+
+    return std::make_unique<DefaultQueryResult>(std::move(recordKeys));
+}
+
+bool EmbeddedDatabase::Impl::tryQuery(BucketQuery &q, std::unique_ptr<IQueryResult> &result) const
+{
+    const std::string bucket = q.bucket();
+    TimedCall timer(latency(Operation::QUERY), m_slowLog, bucket, &bucket);
+    const std::string indexKey = getIndexKey(bucket);
+    std::unique_ptr<std::unordered_set<std::string>> recordKeys;
+
+    if (!m_indexStore->tryGetKeyValueSet(indexKey, recordKeys))
+        return false;
+    if (0 != m_expiring.load(std::memory_order_relaxed))
+        for (auto it = recordKeys->begin(); it != recordKeys->end();)
+            it = expired(*it) ? recordKeys->erase(it) : std::next(it);
+
+    result = std::make_unique<DefaultQueryResult>(std::move(recordKeys));
+
+    return true;
+}
+
+// Writes to one store are whole in that store's snapshot already, only writes
+// which also index a bucket are kept out while both snapshots are taken
+std::unique_ptr<ISnapshot> EmbeddedDatabase::Impl::snapshot()
+{
+    std::unique_lock<std::shared_mutex> lock(m_snapshotLock);
+
+    return std::make_unique<Snapshot>(m_keyValueStore->snapshot(), m_indexStore->snapshot());
+}
+
+std::unique_ptr<ITransaction> EmbeddedDatabase::Impl::begin()
+{
+    return std::make_unique<Transaction>(*this);
+}
+
+bool EmbeddedDatabase::Impl::transact(std::function<void(ITransaction &txn)> body, int attempts)
+{
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        Transaction txn(*this);
+        body(txn);
+        if (txn.commit())
+            return true;
+    }
+
+    return false;
+}
+
+EmbeddedDatabase::Impl::Transaction::Transaction(Impl &impl)
+    : m_impl(impl), m_done(false)
+{
+
+}
+
+// A stripe read twice keeps the first sequence number, commit fails if they differ
+void EmbeddedDatabase::Impl::Transaction::read(const std::string &key, std::uint64_t sequence)
+{
+    m_reads.emplace(m_impl.stripeFor(key), sequence);
+}
+
+void EmbeddedDatabase::Impl::Transaction::write(Write write)
+{
+    if (m_done)
+        throw std::runtime_error("the transaction is already over");
+
+    if (write.m_value)
+        m_values[write.m_key] = *write.m_value;
+    else
+        m_sets[write.m_key] = *write.m_members;
+    if (write.m_bucket)
+        m_buckets[getIndexKey(*write.m_bucket)].insert(write.m_key);
+
+    m_writes.push_back(std::move(write));
+}
+
+std::string EmbeddedDatabase::Impl::Transaction::getKeyValue(const std::string &key)
+{
+    auto own = m_values.find(key);
+    if (own != m_values.end())
+        return own->second;
+
+    std::uint64_t sequence;
+    std::string value = m_impl.readStamped(key, sequence, [this, &key]() {
+        return m_impl.expired(key) ? std::string() : m_impl.m_keyValueStore->getKeyValue(key);
+    });
+    read(key, sequence);
+
+    return value;
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+EmbeddedDatabase::Impl::Transaction::getKeyValueSet(const std::string &key)
+{
+    auto own = m_sets.find(key);
+    if (own != m_sets.end())
+        return std::make_unique<std::unordered_set<std::string>>(own->second);
+
+    std::uint64_t sequence;
+    auto value = m_impl.readStamped(key, sequence, [this, &key]() {
+        return m_impl.expired(key) ? std::make_unique<std::unordered_set<std::string>>()
+                                   : m_impl.m_keyValueStore->getKeyValueSet(key);
+    });
+    read(key, sequence);
+
+    return value;
+}
+
+std::unique_ptr<IQueryResult> EmbeddedDatabase::Impl::Transaction::query(BucketQuery &q)
+{
+    const std::string indexKey = getIndexKey(q.bucket());
+
+    std::uint64_t sequence;
+    auto recordKeys = m_impl.readStamped(indexKey, sequence, [this, &indexKey]() {
+        return m_impl.m_indexStore->getKeyValueSet(indexKey);
+    });
+    read(indexKey, sequence);
+
+    auto own = m_buckets.find(indexKey);
+    if (own != m_buckets.end())
+        recordKeys->insert(own->second.begin(), own->second.end());
+
+    return std::make_unique<DefaultQueryResult>(std::move(recordKeys));
+}
+
+void EmbeddedDatabase::Impl::Transaction::setKeyValue(const std::string &key, const std::string &value)
+{
+    write(Write{key, value, std::nullopt, std::nullopt});
+}
+
+void EmbeddedDatabase::Impl::Transaction::setKeyValue(const std::string &key,
+                                                      const std::unordered_set<std::string> &value)
+{
+    write(Write{key, std::nullopt, value, std::nullopt});
+}
+
+void EmbeddedDatabase::Impl::Transaction::setKeyValue(const std::string &key, const std::string &value,
+                                                      const std::string &bucket)
+{
+    write(Write{key, value, std::nullopt, bucket});
+}
+
+void EmbeddedDatabase::Impl::Transaction::setKeyValue(const std::string &key,
+                                                      const std::unordered_set<std::string> &value,
+                                                      const std::string &bucket)
+{
+    write(Write{key, std::nullopt, value, bucket});
+}
+
+// A stripe this commit holds has gone up by one since it was read, any other stripe
+// must not have moved at all, or a writer got in between the read and now
+bool EmbeddedDatabase::Impl::Transaction::commit()
+{
+    if (m_done)
+        throw std::runtime_error("the transaction is already over");
+    m_done = true;
+    static const std::string noKey;
+    TimedCall timer(m_impl.latency(Operation::COMMIT), m_impl.m_slowLog, noKey);
+    CELEBI_TRACE_SPAN(span, "database.commit", noKey);
+
+    std::vector<std::size_t> written;
+    for (auto &write : m_writes) {
+        written.push_back(m_impl.stripeFor(write.m_key));
+        if (write.m_bucket)
+            written.push_back(m_impl.stripeFor(getIndexKey(*write.m_bucket)));
+    }
+
+    StripeLocks stripes(m_impl, std::move(written));
+    for (auto &read : m_reads) {
+        std::uint64_t expected = read.second + (stripes.holds(read.first) ? 1 : 0);
+        if (m_impl.m_stripes[read.first].m_sequence.load() != expected) {
+            m_impl.m_commitConflicts->fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    std::shared_lock<std::shared_mutex> lock(m_impl.m_snapshotLock);
+    for (auto &write : m_writes) {
+        m_impl.forgetExpiry(write.m_key);
+        if (write.m_value)
+            m_impl.m_keyValueStore->setKeyValue(write.m_key, *write.m_value);
+        else
+            m_impl.m_keyValueStore->setKeyValue(write.m_key, *write.m_members);
+        if (write.m_bucket)
+            m_impl.indexForBucket(write.m_key, *write.m_bucket);
+    }
+
+    return true;
+}
+
+/*
+ ****************************************************************************
+ * High level database client API implementation below
+ ****************************************************************************
+ */
+
+EmbeddedDatabase::EmbeddedDatabase(const std::string &dbName, const std::string &fullpath)
+    : m_impl(std::make_unique<EmbeddedDatabase::Impl>(dbName, fullpath))
+{
+
+}
+
+EmbeddedDatabase::EmbeddedDatabase(const std::string &dbName, const std::string &fullpath,
+                                   AccessMode mode)
+    : m_impl(std::make_unique<EmbeddedDatabase::Impl>(dbName, fullpath, mode))
+{
+
+}
+
+EmbeddedDatabase::EmbeddedDatabase(const std::string &dbName, const std::string &fullpath,
+                                   std::unique_ptr<KeyValueStore> &kvStore)
+    : m_impl(std::make_unique<EmbeddedDatabase::Impl>(dbName, fullpath, kvStore))
+{
+
+}
+
+EmbeddedDatabase::~EmbeddedDatabase()
+{
+
+}
+
+// Management methods
+const std::unique_ptr<IDatabase> EmbeddedDatabase::createEmpty(const std::string &dbName)
+{
+    return EmbeddedDatabase::Impl::createEmpty(dbName);
+}
+
+const std::unique_ptr<IDatabase> EmbeddedDatabase::createEmpty(const std::string &dbName,
+                                                               std::unique_ptr<KeyValueStore> &kvStore)
+{
+    return EmbeddedDatabase::Impl::createEmpty(dbName, kvStore);
+}
+
+const std::unique_ptr<IDatabase> EmbeddedDatabase::load(const std::string &dbName)
+{
+    return EmbeddedDatabase::Impl::load(dbName);
+}
+
+const std::unique_ptr<IDatabase> EmbeddedDatabase::load(const std::string &dbName,
+                                                        AccessMode mode)
+{
+    return EmbeddedDatabase::Impl::load(dbName, mode);
+}
+
+void EmbeddedDatabase::destroy()
+{
+    m_impl->destroy();
+}
+
+const std::string EmbeddedDatabase::getDirectory() const
+{
+    return m_impl->getDirectory();
+}
+
+// Set or get methods
+void EmbeddedDatabase::setKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->setKeyValue(key, value);
+}
+
+void EmbeddedDatabase::setKeyValue(const std::string &key,
+                                   const std::unordered_set<std::string> &value)
+{
+    m_impl->setKeyValue(key, value);
+}
+
+void EmbeddedDatabase::setKeyValue(const std::string &key,
+                                   const std::string &value,
+                                   const std::string &bucket)
+{
+    m_impl->setKeyValue(key, value, bucket);
 }
 
 void EmbeddedDatabase::setKeyValue(const std::string &key,
@@ -318,6 +1469,93 @@ void EmbeddedDatabase::setKeyValue(const std::string &key,
     m_impl->setKeyValue(key, value, bucket);
 }
 
+// Set methods with time to live
+void EmbeddedDatabase::setKeyValue(const std::string &key, const std::string &value,
+                                   std::chrono::milliseconds ttl)
+{
+    m_impl->setKeyValue(key, value, ttl);
+}
+
+void EmbeddedDatabase::setKeyValue(const std::string &key,
+                                   const std::unordered_set<std::string> &value,
+                                   std::chrono::milliseconds ttl)
+{
+    m_impl->setKeyValue(key, value, ttl);
+}
+
+void EmbeddedDatabase::setKeyValue(const std::string &key, const std::string &value,
+                                   const std::string &bucket, std::chrono::milliseconds ttl)
+{
+    m_impl->setKeyValue(key, value, bucket, ttl);
+}
+
+void EmbeddedDatabase::setKeyValue(const std::string &key,
+                                   const std::unordered_set<std::string> &value,
+                                   const std::string &bucket, std::chrono::milliseconds ttl)
+{
+    m_impl->setKeyValue(key, value, bucket, ttl);
+}
+
+std::uint64_t EmbeddedDatabase::expiredKeys() const
+{
+    return m_impl->expiredKeys();
+}
+
+// Merge methods
+void EmbeddedDatabase::incrementKeyValue(const std::string &key, std::int64_t delta)
+{
+    m_impl->incrementKeyValue(key, delta);
+}
+
+void EmbeddedDatabase::decrementKeyValue(const std::string &key, std::int64_t delta)
+{
+    m_impl->decrementKeyValue(key, delta);
+}
+
+void EmbeddedDatabase::appendToKeyValue(const std::string &key, const std::string &suffix)
+{
+    m_impl->appendToKeyValue(key, suffix);
+}
+
+void EmbeddedDatabase::mergeKeyValueSet(const std::string &key,
+                                        const std::unordered_set<std::string> &members)
+{
+    m_impl->mergeKeyValueSet(key, members);
+}
+
+// Conditional and versioned methods
+bool EmbeddedDatabase::compareAndSet(const std::string &key, const std::string &expected,
+                                     const std::string &value)
+{
+    return m_impl->compareAndSet(key, expected, value);
+}
+
+bool EmbeddedDatabase::setIfAbsent(const std::string &key, const std::string &value)
+{
+    return m_impl->setIfAbsent(key, value);
+}
+
+std::string EmbeddedDatabase::getKeyValue(const std::string &key, std::uint64_t &version)
+{
+    return m_impl->getKeyValue(key, version);
+}
+
+bool EmbeddedDatabase::setKeyValueIfVersion(const std::string &key, const std::string &value,
+                                            std::uint64_t version)
+{
+    return m_impl->setKeyValueIfVersion(key, value, version);
+}
+
+// Delete methods
+void EmbeddedDatabase::deleteKey(const std::string &key)
+{
+    m_impl->deleteKey(key);
+}
+
+void EmbeddedDatabase::removeFromBucket(const std::string &key, const std::string &bucket)
+{
+    m_impl->removeFromBucket(key, bucket);
+}
 
 std::string EmbeddedDatabase::getKeyValue(const std::string &key)
 {
@@ -330,6 +1568,17 @@ EmbeddedDatabase::getKeyValueSet(const std::string &key)
     return m_impl->getKeyValueSet(key);
 }
 
+bool EmbeddedDatabase::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    return m_impl->tryGetKeyValue(key, value);
+}
+
+bool EmbeddedDatabase::tryGetKeyValueSet(const std::string &key,
+                                         std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    return m_impl->tryGetKeyValueSet(key, value);
+}
+
 // Query records methods
 std::unique_ptr<IQueryResult> EmbeddedDatabase::query(Query &q) const
 {
@@ -340,3 +1589,336 @@ std::unique_ptr<IQueryResult> EmbeddedDatabase::query(BucketQuery &q) const
 {
     return m_impl->query(q);
 }
+
+std::unique_ptr<IQueryResult> EmbeddedDatabase::query(RangeQuery &q) const
+{
+    return m_impl->query(q);
+}
+
+bool EmbeddedDatabase::tryQuery(BucketQuery &q, std::unique_ptr<IQueryResult> &result) const
+{
+    return m_impl->tryQuery(q, result);
+}
+
+std::unique_ptr<ISnapshot> EmbeddedDatabase::snapshot()
+{
+    return m_impl->snapshot();
+}
+
+// Transaction methods
+std::unique_ptr<ITransaction> EmbeddedDatabase::begin()
+{
+    return m_impl->begin();
+}
+
+bool EmbeddedDatabase::transact(std::function<void(ITransaction &txn)> body, int attempts)
+{
+    return m_impl->transact(body, attempts);
+}
+
+// Stats methods
+Stats EmbeddedDatabase::stats() const
+{
+    return m_impl->stats();
+}
+
+void EmbeddedDatabase::enableStats(bool enabled)
+{
+    m_impl->enableStats(enabled);
+}
+
+// Slow log methods
+void EmbeddedDatabase::setSlowThreshold(std::chrono::nanoseconds threshold, std::size_t capacity)
+{
+    m_impl->setSlowThreshold(threshold, capacity);
+}
+
+std::vector<SlowOperation> EmbeddedDatabase::slowOperations() const
+{
+    return m_impl->slowOperations();
+}
+
+// Memory methods
+MemoryUsage EmbeddedDatabase::memoryUsage() const
+{
+    return m_impl->memoryUsage();
+}
+
+std::map<std::string, MemoryUsage> EmbeddedDatabase::bucketMemoryUsage() const
+{
+    return m_impl->bucketMemoryUsage();
+}
+
+// Defaults for stores written against the set and get methods alone
+
+std::uint64_t KeyValueSnapshot::sequence() const
+{
+    return 0;
+}
+
+void KeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                  MergeOperator op)
+{
+    setKeyValue(key, applyMerge(op, getKeyValue(key), operand));
+}
+
+void KeyValueStore::mergeKeyValue(const std::string &key,
+                                  const std::unordered_set<std::string> &members)
+{
+    for (auto &member : members)
+        appendKeyValue(key, member);
+}
+
+bool KeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                          const std::string &value)
+{
+    if (getKeyValue(key) != expected)
+        return false;
+
+    setKeyValue(key, value);
+
+    return true;
+}
+
+void KeyValueStore::deleteKeyValue(const std::string &)
+{
+    throw std::runtime_error("this store can't delete keys");
+}
+
+void KeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    auto members = getKeyValueSet(key);
+    if (members->erase(value))
+        setKeyValue(key, *members);
+}
+
+// Nothing is known to be in memory, so the blocking methods answer
+bool KeyValueStore::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    value = getKeyValue(key);
+
+    return true;
+}
+
+bool KeyValueStore::tryGetKeyValueSet(const std::string &key,
+                                      std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    value = getKeyValueSet(key);
+
+    return true;
+}
+
+// Sorts every key the store loads, stores with an order of their own scan it instead
+void KeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                             std::function<bool(const std::string &key)> cb)
+{
+    std::set<std::string> keys;
+    loadKeysInto([&keys](std::string key, std::string) {
+        keys.insert(std::move(key));
+    });
+
+    if (!from.empty() && !to.empty() && to <= from)
+        return;
+
+    auto begin = from.empty() ? keys.begin() : keys.lower_bound(from);
+    auto end = to.empty() ? keys.end() : keys.lower_bound(to);
+
+    if (reverse) {
+        for (auto it = std::make_reverse_iterator(end); it != std::make_reverse_iterator(begin); it++)
+            if (!cb(*it))
+                return;
+        return;
+    }
+    for (auto it = begin; it != end; it++)
+        if (!cb(*it))
+            return;
+}
+
+std::unique_ptr<KeyValueSnapshot> KeyValueStore::snapshot()
+{
+    throw std::runtime_error("snapshots are not supported by this store");
+}
+
+MemoryUsage KeyValueStore::memoryUsage() const
+{
+    return MemoryUsage();
+}
+
+MemoryUsage KeyValueStore::memoryUsage(const std::string &) const
+{
+    return MemoryUsage();
+}
+
+std::uint64_t ISnapshot::sequence() const
+{
+    return 0;
+}
+
+// Defaults for databases written against the set, get and bucket query methods alone
+
+void IDatabase::setKeyValue(const std::string &, const std::string &, std::chrono::milliseconds)
+{
+    throw std::runtime_error("time to live is not supported by this database");
+}
+
+void IDatabase::setKeyValue(const std::string &, const std::unordered_set<std::string> &,
+                            std::chrono::milliseconds)
+{
+    throw std::runtime_error("time to live is not supported by this database");
+}
+
+void IDatabase::setKeyValue(const std::string &, const std::string &, const std::string &,
+                            std::chrono::milliseconds)
+{
+    throw std::runtime_error("time to live is not supported by this database");
+}
+
+void IDatabase::setKeyValue(const std::string &, const std::unordered_set<std::string> &,
+                            const std::string &, std::chrono::milliseconds)
+{
+    throw std::runtime_error("time to live is not supported by this database");
+}
+
+std::uint64_t IDatabase::expiredKeys() const
+{
+    return 0;
+}
+
+void IDatabase::incrementKeyValue(const std::string &key, std::int64_t delta)
+{
+    setKeyValue(key, applyMerge(MergeOperator::ADD, getKeyValue(key), std::to_string(delta)));
+}
+
+// Negated as unsigned, the smallest delta can't be negated as signed
+void IDatabase::decrementKeyValue(const std::string &key, std::int64_t delta)
+{
+    incrementKeyValue(key, static_cast<std::int64_t>(0 - static_cast<std::uint64_t>(delta)));
+}
+
+void IDatabase::appendToKeyValue(const std::string &key, const std::string &suffix)
+{
+    setKeyValue(key, getKeyValue(key) + suffix);
+}
+
+void IDatabase::mergeKeyValueSet(const std::string &key, const std::unordered_set<std::string> &members)
+{
+    auto value = getKeyValueSet(key);
+    value->insert(members.begin(), members.end());
+    setKeyValue(key, *value);
+}
+
+bool IDatabase::compareAndSet(const std::string &key, const std::string &expected,
+                              const std::string &value)
+{
+    if (getKeyValue(key) != expected)
+        return false;
+
+    setKeyValue(key, value);
+
+    return true;
+}
+
+bool IDatabase::setIfAbsent(const std::string &key, const std::string &value)
+{
+    return compareAndSet(key, std::string(), value);
+}
+
+std::string IDatabase::getKeyValue(const std::string &, std::uint64_t &)
+{
+    throw std::runtime_error("versioned reads are not supported by this database");
+}
+
+bool IDatabase::setKeyValueIfVersion(const std::string &, const std::string &, std::uint64_t)
+{
+    throw std::runtime_error("versioned writes are not supported by this database");
+}
+
+void IDatabase::deleteKey(const std::string &)
+{
+    throw std::runtime_error("this database can't delete keys");
+}
+
+void IDatabase::removeFromBucket(const std::string &, const std::string &)
+{
+    throw std::runtime_error("this database can't remove keys from buckets");
+}
+
+// Nothing is known to be in memory, so the blocking methods answer
+bool IDatabase::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    value = getKeyValue(key);
+
+    return true;
+}
+
+bool IDatabase::tryGetKeyValueSet(const std::string &key,
+                                  std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    value = getKeyValueSet(key);
+
+    return true;
+}
+
+std::unique_ptr<IQueryResult> IDatabase::query(RangeQuery &) const
+{
+    throw std::invalid_argument("range queries are not supported by this database");
+}
+
+bool IDatabase::tryQuery(BucketQuery &q, std::unique_ptr<IQueryResult> &result) const
+{
+    result = query(q);
+
+    return true;
+}
+
+std::unique_ptr<ISnapshot> IDatabase::snapshot()
+{
+    throw std::runtime_error("snapshots are not supported by this database");
+}
+
+std::unique_ptr<ITransaction> IDatabase::begin()
+{
+    throw std::runtime_error("transactions are not supported by this database");
+}
+
+bool IDatabase::transact(std::function<void(ITransaction &txn)> body, int attempts)
+{
+    for (int attempt = 0; attempt < attempts; attempt++) {
+        auto txn = begin();
+        body(*txn);
+        if (txn->commit())
+            return true;
+    }
+
+    return false;
+}
+
+Stats IDatabase::stats() const
+{
+    return Stats();
+}
+
+void IDatabase::enableStats(bool)
+{
+
+}
+
+void IDatabase::setSlowThreshold(std::chrono::nanoseconds, std::size_t)
+{
+
+}
+
+std::vector<SlowOperation> IDatabase::slowOperations() const
+{
+    return {};
+}
+
+MemoryUsage IDatabase::memoryUsage() const
+{
+    return MemoryUsage();
+}
+
+std::map<std::string, MemoryUsage> IDatabase::bucketMemoryUsage() const
+{
+    return {};
+}
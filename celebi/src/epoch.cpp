@@ -0,0 +1,193 @@
+#include "extensions/epoch.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace celebiext {
+
+namespace {
+
+// A thread which may read, its epoch is 0 while it is outside any read section
+struct Participant {
+    std::atomic<std::uint64_t> m_epoch{0};
+    std::atomic<bool> m_inUse{true};
+    unsigned m_nesting = 0;
+    Participant *m_next = nullptr;
+};
+
+struct Retired {
+    std::uint64_t m_epoch;
+    void *m_ptr;
+    void (*m_deleter)(void *);
+};
+
+// Retired memory is freed once the global epoch is two steps past it:
+// then every active reader has entered after the memory was unlinked
+class Domain {
+public:
+    ~Domain()
+    {
+        for (auto &r : m_retired)
+            r.m_deleter(r.m_ptr);
+
+        for (Participant *p = m_participants.load(); p; ) {
+            Participant *next = p->m_next;
+            delete p;
+            p = next;
+        }
+    }
+
+    Participant *acquire()
+    {
+        // reuse the slot of an exited thread first
+        for (Participant *p = m_participants.load(std::memory_order_acquire); p; p = p->m_next) {
+            bool free = false;
+            if (p->m_inUse.compare_exchange_strong(free, true))
+                return p;
+        }
+
+        auto *p = new Participant();
+        p->m_next = m_participants.load(std::memory_order_relaxed);
+        while (!m_participants.compare_exchange_weak(p->m_next, p, std::memory_order_release,
+                                                     std::memory_order_relaxed))
+            ;
+
+        return p;
+    }
+
+    void release(Participant *p)
+    {
+        p->m_epoch.store(0, std::memory_order_release);
+        p->m_inUse.store(false, std::memory_order_release);
+    }
+
+    void enter(Participant *p)
+    {
+        if (0 == p->m_nesting++) {
+            p->m_epoch.store(m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            // the announcement must be visible before any shared pointer is read
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    void leave(Participant *p)
+    {
+        if (0 == --p->m_nesting)
+            p->m_epoch.store(0, std::memory_order_release);
+    }
+
+    void retire(void *ptr, void (*deleter)(void *))
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool collectNow;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_retired.push_back({ m_epoch.load(std::memory_order_relaxed), ptr, deleter });
+            collectNow = 0 == m_retired.size() % collectEvery;
+        }
+
+        if (collectNow)
+            collect();
+    }
+
+    void collect()
+    {
+        tryAdvance();
+
+        std::vector<Retired> freeable;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            std::uint64_t epoch = m_epoch.load(std::memory_order_acquire);
+            auto keep = m_retired.begin();
+            for (auto it = m_retired.begin(); it != m_retired.end(); it++) {
+                if (it->m_epoch + 2 <= epoch)
+                    freeable.push_back(*it);
+                else
+                    *keep++ = *it;
+            }
+            m_retired.erase(keep, m_retired.end());
+        }
+
+        for (auto &r : freeable)
+            r.m_deleter(r.m_ptr);
+    }
+
+    std::size_t pending()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        return m_retired.size();
+    }
+
+private:
+    void tryAdvance()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::uint64_t epoch = m_epoch.load(std::memory_order_relaxed);
+
+        for (Participant *p = m_participants.load(std::memory_order_acquire); p; p = p->m_next) {
+            std::uint64_t e = p->m_epoch.load(std::memory_order_acquire);
+            if (0 != e && e != epoch)
+                return;
+        }
+
+        m_epoch.compare_exchange_strong(epoch, epoch + 1);
+    }
+
+    static constexpr std::size_t collectEvery = 64;
+
+    std::atomic<std::uint64_t> m_epoch{1};
+    std::atomic<Participant *> m_participants{nullptr};
+    std::mutex m_lock;
+    std::vector<Retired> m_retired;
+};
+
+Domain &domain()
+{
+    static Domain instance;
+    return instance;
+}
+
+// Registers the thread on first use and hands its slot back when the thread exits
+struct ThreadParticipant {
+    ThreadParticipant() : m_participant(domain().acquire()) {}
+    ~ThreadParticipant() { domain().release(m_participant); }
+
+    Participant *m_participant;
+};
+
+Participant *threadParticipant()
+{
+    thread_local ThreadParticipant participant;
+    return participant.m_participant;
+}
+
+}
+
+EpochGuard::EpochGuard()
+{
+    domain().enter(threadParticipant());
+}
+
+EpochGuard::~EpochGuard()
+{
+    domain().leave(threadParticipant());
+}
+
+void Epoch::retire(void *ptr, void (*deleter)(void *))
+{
+    domain().retire(ptr, deleter);
+}
+
+void Epoch::collect()
+{
+    domain().collect();
+}
+
+std::size_t Epoch::pending()
+{
+    return domain().pending();
+}
+
+}
@@ -1,8 +1,15 @@
 #include "extensions/extdatabase.h"
+#include "extensions/trace.h"
 
+#include <atomic>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <cstring>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <stdexcept>
 
 #include <iostream>
 
@@ -12,23 +19,55 @@ namespace fs = std::filesystem;
 
 class FileKeyValueStore::Impl {
 public:
-    explicit Impl(std::string fullpath);
-    const std::string getFilepathFromKey(const std::string &key, const ValueType type);
+    Impl(std::string fullpath, int bitsPerKey);
+    ~Impl();
+    const std::string getFilenameFromKey(const std::string &key, const ValueType type);
     const std::string getKeyFromFilename(const std::string &filename, const ValueType type);
 
+    // The filter holds file names, a miss is a file which surely doesn't exist
+    bool mayExist(const std::string &filename) const;
+    bool exists(const std::string &filename);
+    void growFilter();
+    void loadFilter();
+    void rebuildFilter();
+    void saveFilter() const;
+
     static const std::string fileExtension;
+    static const std::string filterFilename;
+    static const std::size_t minFilterKeys;
+    static const int countWidth;
     const std::string m_fullpath;
+    const int m_bitsPerKey;
+
+    // Writers hold the lock shared from adding a name until its file exists,
+    // so a rebuild listing the directory under the exclusive lock misses nothing
+    mutable std::shared_mutex m_filterLock;
+    std::unique_ptr<BloomFilter> m_filter;
+    std::size_t m_filterCapacity;
+    mutable std::atomic<std::uint64_t> m_negatives;
+    mutable std::atomic<std::uint64_t> m_falsePositives;
 };
 
 const std::string FileKeyValueStore::Impl::fileExtension = ".kv";
-
-FileKeyValueStore::Impl::Impl(const std::string fullpath)
-    : m_fullpath(fullpath)
+const std::string FileKeyValueStore::Impl::filterFilename = "filter.bloom";
+const std::size_t FileKeyValueStore::Impl::minFilterKeys = 1024;
+// Set files start with their member count padded to a fixed width,
+// so an append can rewrite the count in place however large it grows
+const int FileKeyValueStore::Impl::countWidth = 20;
+
+FileKeyValueStore::Impl::Impl(const std::string fullpath, int bitsPerKey)
+    : m_fullpath(fullpath), m_bitsPerKey(bitsPerKey), m_filter(), m_filterCapacity(0),
+      m_negatives(0), m_falsePositives(0)
 {
 
 }
 
-const std::string FileKeyValueStore::Impl::getFilepathFromKey(const std::string &key,
+FileKeyValueStore::Impl::~Impl()
+{
+    saveFilter();
+}
+
+const std::string FileKeyValueStore::Impl::getFilenameFromKey(const std::string &key,
                                                               const ValueType type)
 {
     std::string extension = fileExtension;
@@ -41,7 +80,7 @@ const std::string FileKeyValueStore::Impl::getFilepathFromKey(const std::string
         break;
     }
 
-    return m_fullpath + "/" + key + extension;
+    return key + extension;
 }
 
 const std::string FileKeyValueStore::Impl::getKeyFromFilename(const std::string &filename,
@@ -61,11 +100,108 @@ const std::string FileKeyValueStore::Impl::getKeyFromFilename(const std::string
     return filename.substr(0, filename.length() - extensionLength);
 }
 
-FileKeyValueStore::FileKeyValueStore(const std::string &fullpath)
-    : m_impl(std::make_unique<FileKeyValueStore::Impl>(fullpath))
+inline bool FileKeyValueStore::Impl::mayExist(const std::string &filename) const
+{
+    if (m_bitsPerKey <= 0)
+        return true;
+
+    std::shared_lock<std::shared_mutex> lock(m_filterLock);
+    if (m_filter->mayContain(filename))
+        return true;
+
+    m_negatives.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// Asks the filter and then the disk, so misses the filter let through are counted
+bool FileKeyValueStore::Impl::exists(const std::string &filename)
+{
+    if (!mayExist(filename))
+        return false;
+
+    bool exists = fs::exists(m_fullpath + "/" + filename);
+    if (!exists && m_bitsPerKey > 0)
+        m_falsePositives.fetch_add(1, std::memory_order_relaxed);
+
+    return exists;
+}
+
+// Rebuilds the filter once it holds more keys than it was sized for,
+// otherwise its false positives would grow with every key
+void FileKeyValueStore::Impl::growFilter()
+{
+    {
+        std::shared_lock<std::shared_mutex> lock(m_filterLock);
+        if (m_filter->keys() <= m_filterCapacity)
+            return;
+    }
+
+    std::unique_lock<std::shared_mutex> lock(m_filterLock);
+    if (m_filter->keys() > m_filterCapacity)
+        rebuildFilter();
+}
+
+// A saved filter is only trusted once, it is removed as soon as it is loaded
+// and saved again on a clean close, so a crash leaves a directory to list instead
+void FileKeyValueStore::Impl::loadFilter()
+{
+    if (m_bitsPerKey <= 0)
+        return;
+
+    const std::string path = m_fullpath + "/" + filterFilename;
+    std::ifstream is(path, std::ios::binary);
+    if (is.is_open()) {
+        std::string encoded((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        is.close();
+        fs::remove(path);
+
+        m_filter = std::make_unique<BloomFilter>(encoded);
+        m_filterCapacity = m_filter->bits() / m_bitsPerKey;
+        if (m_filter->probes() == BloomFilter(m_bitsPerKey, 1).probes() &&
+                m_filter->keys() <= m_filterCapacity)
+            return;
+    }
+
+    rebuildFilter();
+}
+
+void FileKeyValueStore::Impl::rebuildFilter()
+{
+    std::vector<std::string> filenames;
+    if (fs::exists(m_fullpath)) {
+        for (auto &p : fs::directory_iterator(m_fullpath))
+            if (p.is_regular_file() && p.path().extension() == fileExtension)
+                filenames.push_back(p.path().filename());
+    }
+
+    m_filterCapacity = std::max(filenames.size() * 2, minFilterKeys);
+    m_filter = std::make_unique<BloomFilter>(m_bitsPerKey, m_filterCapacity);
+    for (auto &filename : filenames)
+        m_filter->add(filename);
+}
+
+void FileKeyValueStore::Impl::saveFilter() const
+{
+    if (m_bitsPerKey <= 0 || !fs::exists(m_fullpath))
+        return;
+
+    const std::string path = m_fullpath + "/" + filterFilename;
+    {
+        std::ofstream os(path + ".tmp", std::ios::binary | std::ios::trunc);
+        os << m_filter->encode();
+        if (!os.flush())
+            return;
+    }
+    fs::rename(path + ".tmp", path);
+}
+
+FileKeyValueStore::FileKeyValueStore(const std::string &fullpath, int bitsPerKey)
+    : m_impl(std::make_unique<FileKeyValueStore::Impl>(fullpath, bitsPerKey))
 {
     if (!fs::exists(fullpath))
         fs::create_directories(fullpath);
+
+    m_impl->loadFilter();
 }
 
 FileKeyValueStore::~FileKeyValueStore()
@@ -98,68 +234,205 @@ void FileKeyValueStore::loadKeysInto(std::function<void(std::string key, std::st
 
 void FileKeyValueStore::clear()
 {
+    std::unique_lock<std::shared_mutex> lock(m_impl->m_filterLock);
     if (fs::exists(m_impl->m_fullpath))
         fs::remove_all(m_impl->m_fullpath);
+
+    if (m_impl->m_bitsPerKey > 0)
+        m_impl->rebuildFilter();
 }
 
 // Set or get methods
 void FileKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
 {
-    std::ofstream os(m_impl->getFilepathFromKey(key, ValueType::STRING),
-                     std::ios::out | std::ios::trunc);
+    CELEBI_TRACE_SPAN(span, "file.set", key, TraceSpan::bytesOf(value));
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING);
+    {
+        std::shared_lock<std::shared_mutex> lock(m_impl->m_filterLock, std::defer_lock);
+        if (m_impl->m_bitsPerKey > 0) {
+            lock.lock();
+            m_impl->m_filter->add(filename);
+        }
+
+        std::ofstream os(m_impl->m_fullpath + "/" + filename, std::ios::out | std::ios::trunc);
 
-    // write value to key file
-    os << value;
+        // write value to key file
+        os << value;
 
-    // RAII, os.close()
+        // RAII, os.close()
+    }
+    if (m_impl->m_bitsPerKey > 0)
+        m_impl->growFilter();
 }
 
 void FileKeyValueStore::setKeyValue(const std::string &key,
                                     const std::unordered_set<std::string> &value)
 {
-    std::fstream os(m_impl->getFilepathFromKey(key, ValueType::STRING_SET),
-                     std::ios::out | std::ios::trunc);
+    CELEBI_TRACE_SPAN(span, "file.set", key, TraceSpan::bytesOf(value));
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING_SET);
+    {
+        std::shared_lock<std::shared_mutex> lock(m_impl->m_filterLock, std::defer_lock);
+        if (m_impl->m_bitsPerKey > 0) {
+            lock.lock();
+            m_impl->m_filter->add(filename);
+        }
 
-    os << value.size() << std::endl;
+        std::fstream os(m_impl->m_fullpath + "/" + filename, std::ios::out | std::ios::trunc);
 
-    for (auto &v : value) {
-        os << v.length() << std::endl;
-        os << v.c_str() << std::endl;
-    }
+        os << std::setw(m_impl->countWidth) << value.size() << std::endl;
 
-    // RAII, os.close()
+        for (auto &v : value) {
+            os << v.length() << std::endl;
+            os << v.c_str() << std::endl;
+        }
+
+        // RAII, os.close()
+    }
+    if (m_impl->m_bitsPerKey > 0)
+        m_impl->growFilter();
 }
 
-// TODO: need to fix bug,
-// as the number of digits in the first line increate, the following line will be coverd
 void FileKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
 {
-    std::fstream stream(m_impl->getFilepathFromKey(key, ValueType::STRING_SET), std::ios::out | std::ios::in);
+    mergeKeyValue(key, std::unordered_set<std::string>{ value });
+}
+
+// Appending goes to the end of the file without reading it, adding needs the number
+void FileKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                      MergeOperator op)
+{
+    CELEBI_TRACE_SPAN(span, "file.merge", key, TraceSpan::bytesOf(operand));
+    if (MergeOperator::APPEND != op) {
+        setKeyValue(key, applyMerge(op, getKeyValue(key), operand));
+        return;
+    }
+
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING);
+    {
+        std::shared_lock<std::shared_mutex> lock(m_impl->m_filterLock, std::defer_lock);
+        if (m_impl->m_bitsPerKey > 0) {
+            lock.lock();
+            m_impl->m_filter->add(filename);
+        }
+
+        std::ofstream os(m_impl->m_fullpath + "/" + filename, std::ios::out | std::ios::app);
+        os << operand;
+    }
+    if (m_impl->m_bitsPerKey > 0)
+        m_impl->growFilter();
+}
+
+// Members go to the end of the file and only the count in front is rewritten,
+// a member merged twice is read back once
+void FileKeyValueStore::mergeKeyValue(const std::string &key,
+                                      const std::unordered_set<std::string> &members)
+{
+    if (members.empty())
+        return;
+
+    CELEBI_TRACE_SPAN(span, "file.merge", key, TraceSpan::bytesOf(members));
+
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING_SET);
+
+    // the first members create the file
+    if (!m_impl->mayExist(filename)) {
+        setKeyValue(key, members);
+        return;
+    }
+
+    std::fstream stream(m_impl->m_fullpath + "/" + filename, std::ios::out | std::ios::in);
+    if (!stream.is_open()) {
+        if (m_impl->m_bitsPerKey > 0)
+            m_impl->m_falsePositives.fetch_add(1, std::memory_order_relaxed);
+        setKeyValue(key, members);
+        return;
+    }
 
     // read size
     stream.seekg(0, std::ios::beg);
-    long entries;
-    stream >> entries;
+    std::string header;
+    std::getline(stream, header);
+
+    // files written before the count was padded are rewritten as a whole
+    if (header.length() != static_cast<std::size_t>(m_impl->countWidth)) {
+        stream.close();
+        auto values = getKeyValueSet(key);
+        values->insert(members.begin(), members.end());
+        setKeyValue(key, *values);
+        return;
+    }
 
-    entries++;
+    long entries = std::stol(header) + static_cast<long>(members.size());
     stream.seekp(0, std::ios::beg);
-    stream << entries << std::endl;
+    stream << std::setw(m_impl->countWidth) << entries << std::endl;
 
     stream.seekp(0, std::ios::end);
-    stream << value.length() << std::endl;
-    stream << value.c_str() << std::endl;
+    for (auto &member : members) {
+        stream << member.length() << std::endl;
+        stream << member.c_str() << std::endl;
+    }
+}
+
+// As atomic as the other writes of the store, callers sharing it serialize them
+bool FileKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                              const std::string &value)
+{
+    if (getKeyValue(key) != expected)
+        return false;
+
+    setKeyValue(key, value);
+
+    return true;
+}
+
+// A file holds the newest value only, so a delete takes the files away at once and leaves
+// no tombstone, the filter keeps their names until it is rebuilt
+void FileKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    CELEBI_TRACE_SPAN(span, "file.delete", key);
+    for (ValueType type : { ValueType::STRING, ValueType::STRING_SET }) {
+        const std::string filename = m_impl->getFilenameFromKey(key, type);
+        if (m_impl->mayExist(filename))
+            fs::remove(m_impl->m_fullpath + "/" + filename);
+    }
+}
+
+// Members are not kept in order, so the set is written again without the member
+void FileKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    auto values = getKeyValueSet(key);
+    if (!values->erase(value))
+        return;
+
+    if (values->empty())
+        fs::remove(m_impl->m_fullpath + "/" + m_impl->getFilenameFromKey(key, ValueType::STRING_SET));
+    else
+        setKeyValue(key, *values);
 }
 
 std::string FileKeyValueStore::getKeyValue(const std::string &key)
 {
-    std::ifstream is(m_impl->getFilepathFromKey(key, ValueType::STRING));
+    CELEBI_TRACE_SPAN(span, "file.get", key);
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING);
+    if (!m_impl->mayExist(filename))
+        return std::string();
+
+    CELEBI_TRACE_SPAN(read, "file.read", key);
+    std::ifstream is(m_impl->m_fullpath + "/" + filename);
     std::string value;
+    if (!is.is_open()) {
+        if (m_impl->m_bitsPerKey > 0)
+            m_impl->m_falsePositives.fetch_add(1, std::memory_order_relaxed);
+        return value;
+    }
 
     is.seekg(0, std::ios::end);
     value.reserve(is.tellg());
     is.seekg(0, std::ios::beg);
 
     value.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(value));
+    CELEBI_TRACE_BYTES(read, TraceSpan::bytesOf(value));
 
     return value;
 }
@@ -167,11 +440,13 @@ std::string FileKeyValueStore::getKeyValue(const std::string &key)
 std::unique_ptr<std::unordered_set<std::string>>
 FileKeyValueStore::getKeyValueSet(const std::string &key)
 {
-    std::string filepath = m_impl->getFilepathFromKey(key, ValueType::STRING_SET);
-    if (!fs::exists(filepath))
+    CELEBI_TRACE_SPAN(span, "file.get_set", key);
+    const std::string filename = m_impl->getFilenameFromKey(key, ValueType::STRING_SET);
+    if (!m_impl->exists(filename))
         return std::make_unique<std::unordered_set<std::string>>();
 
-    std::ifstream is(filepath);
+    CELEBI_TRACE_SPAN(read, "file.read", key);
+    std::ifstream is(m_impl->m_fullpath + "/" + filename);
     std::unordered_set<std::string> values;
     std::string value;
 
@@ -185,8 +460,111 @@ FileKeyValueStore::getKeyValueSet(const std::string &key)
         std::getline(is, value);
         values.insert(value);
     }
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(values));
+    CELEBI_TRACE_BYTES(read, TraceSpan::bytesOf(values));
 
     return std::make_unique<std::unordered_set<std::string>>(values);
 }
 
+// Every value lives on disk, so nothing can be answered without I/O
+bool FileKeyValueStore::tryGetKeyValue(const std::string &, std::string &)
+{
+    return false;
+}
+
+bool FileKeyValueStore::tryGetKeyValueSet(const std::string &,
+                                          std::unique_ptr<std::unordered_set<std::string>> &)
+{
+    return false;
+}
+
+// Keys only live in file names, so the directory is listed and sorted on every scan
+void FileKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                 std::function<bool(const std::string &key)> cb)
+{
+    const std::string stringExtension = "_string" + m_impl->fileExtension;
+    const std::string setExtension = "_string_set" + m_impl->fileExtension;
+    auto endsWith = [](const std::string &name, const std::string &suffix) {
+        return name.length() > suffix.length() &&
+                0 == name.compare(name.length() - suffix.length(), suffix.length(), suffix);
+    };
+
+    std::set<std::string> keys;
+    for (auto &p : fs::directory_iterator(m_impl->m_fullpath)) {
+        if (!p.is_regular_file())
+            continue;
+
+        std::string filename = p.path().filename();
+        std::string key;
+        if (endsWith(filename, setExtension))
+            key = m_impl->getKeyFromFilename(filename, ValueType::STRING_SET);
+        else if (endsWith(filename, stringExtension))
+            key = m_impl->getKeyFromFilename(filename, ValueType::STRING);
+        else
+            continue;
+
+        if ((from.empty() || key >= from) && (to.empty() || key < to))
+            keys.insert(key);
+    }
+
+    if (reverse) {
+        for (auto it = keys.rbegin(); it != keys.rend(); it++)
+            if (!cb(*it))
+                return;
+    } else {
+        for (auto &key : keys)
+            if (!cb(key))
+                return;
+    }
+}
+
+// A file holds the newest value only, cache the store in a MemoryKeyValueStore for snapshots
+std::unique_ptr<KeyValueSnapshot> FileKeyValueStore::snapshot()
+{
+    throw std::runtime_error("the file store keeps no old versions to take a snapshot of");
+}
+
+// Values stay on disk, the filter is all there is in memory
+MemoryUsage FileKeyValueStore::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.block(sizeof(Impl));
+    usage.string(m_impl->m_fullpath, &MemoryUsage::m_overhead);
+
+    std::shared_lock<std::shared_mutex> lock(m_impl->m_filterLock);
+    if (m_impl->m_filter) {
+        usage.block(sizeof(BloomFilter));
+        usage.block(m_impl->m_filter->bits() / 8);
+    }
+
+    return usage;
+}
+
+MemoryUsage FileKeyValueStore::memoryUsage(const std::string &) const
+{
+    return MemoryUsage();
+}
+
+FilterStats FileKeyValueStore::filterStats() const
+{
+    FilterStats stats;
+    std::shared_lock<std::shared_mutex> lock(m_impl->m_filterLock);
+    if (m_impl->m_bitsPerKey <= 0)
+        return stats;
+
+    stats.m_bitsPerKey = m_impl->m_bitsPerKey;
+    stats.m_keys = m_impl->m_filter->keys();
+    stats.m_bits = m_impl->m_filter->bits();
+    stats.m_expectedFalsePositiveRate = m_impl->m_filter->falsePositiveRate();
+    stats.m_negatives = m_impl->m_negatives.load(std::memory_order_relaxed);
+    stats.m_falsePositives = m_impl->m_falsePositives.load(std::memory_order_relaxed);
+
+    return stats;
+}
+
+std::string FileKeyValueStore::filePath(const std::string &key) const
+{
+    return m_impl->m_fullpath + "/" + m_impl->getFilenameFromKey(key, ValueType::STRING);
+}
+
 };
@@ -0,0 +1,102 @@
+#include "extensions/filelock.h"
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace celebiext {
+
+// One open file and flock per path and process, whatever the number of holders
+class FileLock::Impl {
+public:
+    Impl(const std::string &path, Type type);
+    ~Impl();
+
+    void lock(Type type);
+
+    static std::shared_ptr<Impl> acquire(const std::string &path, Type type);
+
+    const std::string m_path;
+    const pid_t m_pid;
+    int m_fd;
+    Type m_type;
+
+    static std::mutex registryLock;
+    static std::map<std::string, std::weak_ptr<Impl>> registry;
+};
+
+std::mutex FileLock::Impl::registryLock;
+std::map<std::string, std::weak_ptr<FileLock::Impl>> FileLock::Impl::registry;
+
+FileLock::Impl::Impl(const std::string &path, Type type)
+    : m_path(path), m_pid(::getpid()), m_fd(-1), m_type(type)
+{
+    m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::runtime_error("can't open lock file " + path + ": " + ::strerror(errno));
+
+    try {
+        lock(type);
+    } catch (...) {
+        ::close(m_fd);
+        throw;
+    }
+}
+
+FileLock::Impl::~Impl()
+{
+    // a forked child must not drop the parent's lock, it shares the open file
+    if (::getpid() == m_pid)
+        ::flock(m_fd, LOCK_UN);
+
+    ::close(m_fd);
+}
+
+void FileLock::Impl::lock(Type type)
+{
+    int operation = Type::EXCLUSIVE == type ? LOCK_EX : LOCK_SH;
+    if (::flock(m_fd, operation | LOCK_NB) < 0) {
+        if (EWOULDBLOCK == errno)
+            throw std::runtime_error("database is locked by another process: " + m_path);
+
+        throw std::runtime_error("can't lock " + m_path + ": " + ::strerror(errno));
+    }
+
+    m_type = type;
+}
+
+std::shared_ptr<FileLock::Impl> FileLock::Impl::acquire(const std::string &path, Type type)
+{
+    std::lock_guard<std::mutex> guard(registryLock);
+
+    auto held = registry[path].lock();
+    if (!held || held->m_pid != ::getpid()) {
+        held = std::make_shared<Impl>(path, type);
+        registry[path] = held;
+    } else if (Type::EXCLUSIVE == type && Type::SHARED == held->m_type) {
+        // the process keeps the strongest lock any of its holders asked for
+        held->lock(type);
+    }
+
+    return held;
+}
+
+FileLock::FileLock(const std::string &path, Type type)
+    : m_impl(Impl::acquire(path, type))
+{
+
+}
+
+FileLock::~FileLock()
+{
+    std::lock_guard<std::mutex> guard(Impl::registryLock);
+    m_impl.reset();
+}
+
+}
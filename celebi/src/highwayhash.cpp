@@ -3,31 +3,28 @@
 namespace celebiext {
 
 HighwayHash::HighwayHash()
-    : m_key{1, 2, 3, 4},
-      m_hh(new HighwayHashCatT<HH_TARGET>(m_key)),
-      m_result(new HHResult64())
+    : m_key{1, 2, 3, 4}
 {
 }
 
 HighwayHash::HighwayHash(std::uint64_t s1, std::uint64_t s2, std::uint64_t s3, std::uint64_t s4)
-    : m_key{s1, s2, s3, s4},
-      m_hh(new HighwayHashCatT<HH_TARGET>(m_key)),
-      m_result(new HHResult64())
+    : m_key{s1, s2, s3, s4}
 {
 }
 
 HighwayHash::~HighwayHash() {
-    delete m_hh;
-    delete m_result;
 }
 
 std::size_t
 HighwayHash::operator() (const std::string &s) const noexcept {
-    m_hh->Reset(m_key);
-    m_hh->Append(s.c_str(), s.length());
-    m_hh->Finalize(m_result);
+    // hash state lives on the stack, so concurrent calls never share it
+    HighwayHashCatT<HH_TARGET> hh(m_key);
+    HHResult64 result;
 
-    return *m_result;
+    hh.Append(s.c_str(), s.length());
+    hh.Finalize(&result);
+
+    return result;
 }
 
 }
@@ -0,0 +1,1259 @@
+#include "extensions/extdatabase.h"
+#include "extensions/skiplist.h"
+#include "extensions/sstable.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace celebiext {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const int numLevels = 7;
+const std::string manifestName = "MANIFEST";
+const std::string manifestMagic = "celebi-lsm";
+
+/**
+ * Writes land in a skiplist, one writer at a time changes it while readers walk it freely
+ */
+class MemTable {
+public:
+    explicit MemTable(std::uint64_t logNumber) : m_list(), m_bytes(0), m_logNumber(logNumber) {}
+
+    void add(const Entry &entry)
+    {
+        m_list.insert(entry);
+        m_bytes.fetch_add(entry.m_key.m_user.size() + entry.m_value.size() + entryOverhead,
+                          std::memory_order_relaxed);
+    }
+
+    std::size_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+    bool empty() const { return 0 == m_list.size(); }
+    std::uint64_t logNumber() const { return m_logNumber; }
+
+    // skiplist node, sequence number, kind and string headers
+    static constexpr std::size_t entryOverhead = 96;
+
+    SkipList<Entry, EntryCompare> m_list;
+
+private:
+    std::atomic<std::size_t> m_bytes;
+    const std::uint64_t m_logNumber;
+};
+
+class MemTableIterator : public EntryIterator {
+public:
+    explicit MemTableIterator(std::shared_ptr<const MemTable> mem)
+        : m_mem(std::move(mem)), m_it(&m_mem->m_list) {}
+
+    virtual bool valid() const override { return m_it.valid(); }
+    virtual const Entry &entry() const override { return *m_it; }
+    virtual void seekToFirst() override { m_it.seekToFirst(); }
+    virtual void seekToLast() override { m_it.seekToLast(); }
+    virtual void seek(const InternalKey &target) override { m_it.seek(Entry{target, std::string()}); }
+    virtual void seekBefore(const InternalKey &target) override { m_it.seekBefore(Entry{target, std::string()}); }
+    virtual void next() override { m_it.next(); }
+    virtual void prev() override { m_it.prev(); }
+
+private:
+    std::shared_ptr<const MemTable> m_mem;
+    SkipList<Entry, EntryCompare>::Iterator m_it;
+};
+
+// Memtable entries are counted as a flush counts them, with the same overhead each
+void entryUsage(const Entry &entry, MemoryUsage &usage)
+{
+    usage.m_overhead += MemTable::entryOverhead;
+    usage.string(entry.m_key.m_user, &MemoryUsage::m_keys);
+    usage.string(entry.m_value, 0 == columnOf(entry.m_key.m_kind) ? &MemoryUsage::m_values
+                                                                 : &MemoryUsage::m_members);
+}
+
+// A file's data, or a directory's entries, are on the device once this returns
+void syncPath(const std::string &path, bool directory)
+{
+    const int fd = ::open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+    const bool synced = fd >= 0 && 0 == (directory ? ::fsync(fd) : ::fdatasync(fd));
+    if (fd >= 0)
+        ::close(fd);
+    if (!synced)
+        throw std::runtime_error("cannot sync " + path);
+}
+
+/**
+ * Every write is in the log before it is in the memtable, so a memtable which was
+ * never flushed is replayed from its log on the next open
+ */
+class LogWriter {
+public:
+    LogWriter(const std::string &path, bool sync) : m_path(path), m_fd(-1), m_sync(sync)
+    {
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0)
+            throw std::runtime_error("cannot create log " + path + ": " + std::strerror(errno));
+    }
+
+    ~LogWriter()
+    {
+        ::close(m_fd);
+    }
+
+    // Entries written together go in one write
+    void append(const std::vector<Entry> &entries)
+    {
+        std::string record;
+        for (auto &entry : entries)
+            encodeEntry(entry, record);
+
+        std::size_t written = 0;
+        while (written < record.size()) {
+            ssize_t n = ::write(m_fd, record.data() + written, record.size() - written);
+            if (n < 0)
+                throw std::runtime_error("cannot write log " + m_path + ": " + std::strerror(errno));
+            written += static_cast<std::size_t>(n);
+        }
+
+        if (m_sync && 0 != ::fdatasync(m_fd))
+            throw std::runtime_error("cannot sync log " + m_path);
+    }
+
+private:
+    std::string m_path;
+    int m_fd;
+    bool m_sync;
+};
+
+/**
+ * Folds the entries of a set column newest first, members an entry removed stay out
+ * of whatever older entries hold
+ */
+struct SetMerge {
+    std::unordered_set<std::string> m_members;
+    std::unordered_set<std::string> m_removed;
+
+    // Returns false once the entry left nothing older to look at
+    bool add(const Entry &entry)
+    {
+        if (m_removed.empty() && EntryKind::SET_REMOVE != entry.m_key.m_kind) {
+            decodeSetInto(entry.m_value, m_members);
+            return !shadows(entry.m_key.m_kind);
+        }
+
+        std::unordered_set<std::string> members;
+        decodeSetInto(entry.m_value, members);
+        for (auto &member : members) {
+            if (EntryKind::SET_REMOVE == entry.m_key.m_kind) {
+                if (!m_members.count(member))
+                    m_removed.insert(member);
+            } else if (!m_removed.count(member)) {
+                m_members.insert(member);
+            }
+        }
+
+        return !shadows(entry.m_key.m_kind);
+    }
+};
+
+inline MergeOperator operatorOf(EntryKind kind)
+{
+    return EntryKind::STRING_ADD == kind ? MergeOperator::ADD : MergeOperator::APPEND;
+}
+
+/**
+ * Folds the entries of a string column newest first, merge operands wait for the value
+ * below them and are applied to it oldest first
+ */
+struct StringMerge {
+    std::vector<Entry> m_operands;      // newest first
+    std::optional<std::string> m_base;  // empty for a tombstone
+
+    // Returns false once the entry left nothing older to look at
+    bool add(const Entry &entry)
+    {
+        if (shadows(entry.m_key.m_kind)) {
+            m_base = entry.m_value;
+            return false;
+        }
+
+        m_operands.push_back(entry);
+        return true;
+    }
+
+    std::string value() const
+    {
+        std::string value = m_base.value_or(std::string());
+        for (auto it = m_operands.rbegin(); it != m_operands.rend(); it++)
+            value = applyMerge(operatorOf(it->m_key.m_kind), value, it->m_value);
+
+        return value;
+    }
+
+    // The operands newest first, a run of one operator folded into the newest of the run
+    std::vector<Entry> folded() const
+    {
+        std::vector<Entry> runs;
+        for (auto it = m_operands.rbegin(); it != m_operands.rend(); it++) {
+            if (runs.empty() || runs.back().m_key.m_kind != it->m_key.m_kind) {
+                runs.push_back(*it);
+                continue;
+            }
+            runs.back().m_value = applyMerge(operatorOf(it->m_key.m_kind), runs.back().m_value,
+                                             it->m_value);
+            runs.back().m_key.m_seq = it->m_key.m_seq;
+        }
+        std::reverse(runs.begin(), runs.end());
+
+        return runs;
+    }
+};
+
+// Level 0 tables are newest first and may overlap, deeper levels are sorted and disjoint
+struct Version {
+    std::array<std::vector<std::shared_ptr<Table>>, numLevels> m_levels;
+};
+
+bool overlaps(const Table &table, const std::string &smallest, const std::string &largest)
+{
+    return table.smallest().m_user <= largest && table.largest().m_user >= smallest;
+}
+
+std::uint64_t levelBytes(const std::vector<std::shared_ptr<Table>> &tables)
+{
+    std::uint64_t bytes = 0;
+    for (auto &table : tables)
+        bytes += table->fileSize();
+
+    return bytes;
+}
+
+}
+
+class LsmKeyValueStore::Impl {
+public:
+    Impl(const std::string &fullpath, const LsmOptions &options);
+    ~Impl();
+
+    // What a reader needs, taken at once so that a flush can't slip in between.
+    // Entries newer than the sequence are skipped, the memtables may still take writes.
+    struct View {
+        std::shared_ptr<MemTable> m_mem;
+        std::shared_ptr<MemTable> m_imm;
+        std::shared_ptr<const Version> m_version;
+        std::uint64_t m_seq = InternalKey::maxSeq;
+    };
+
+    class Snapshot;
+
+    struct Compaction {
+        int m_level;
+        std::vector<std::shared_ptr<Table>> m_inputs;   // from m_level
+        std::vector<std::shared_ptr<Table>> m_overlaps; // from the level below
+    };
+
+    View view() const;
+    template <typename F>
+    bool lookup(const View &view, const std::string &key, std::uint8_t column,
+                bool memoryOnly, F visit) const;
+    std::unique_ptr<EntryIterator> iterator(const View &view) const;
+    void scan(const View &view, const std::string &from, const std::string &to, bool reverse,
+              const std::function<bool(const std::string &key)> &cb) const;
+
+    // Every column written takes the same sequence number. Nothing is written if check
+    // returns false, it runs under the write lock, so no other write gets in between.
+    bool write(const std::string &key,
+               std::initializer_list<std::pair<EntryKind, std::string>> columns,
+               const std::function<bool()> &check = nullptr);
+    void makeRoomForWrite(std::unique_lock<std::mutex> &lock);
+    void openLog();
+    void recover();
+    void writeManifest(const Version &version) const;
+
+    std::string tablePath(std::uint64_t number) const;
+    std::string logPath(std::uint64_t number) const;
+
+    // Background work, the state lock is released while tables are written
+    void backgroundLoop();
+    void flushMemTable(std::unique_lock<std::mutex> &lock);
+    bool pickCompaction(Compaction &compaction) const;
+    void runCompaction(std::unique_lock<std::mutex> &lock, Compaction &compaction);
+    std::vector<std::shared_ptr<Table>> buildTables(EntryIterator &input, const Version &version,
+                                                    int olderFrom, std::uint64_t maxFileSize);
+    static bool olderDataExists(const Version &version, int fromLevel, const std::string &key);
+
+    const std::string m_path;
+    const LsmOptions m_options;
+
+    std::mutex m_writeLock;             // one writer at a time, it owns the log
+    mutable std::mutex m_lock;          // guards everything below
+    std::condition_variable m_cv;
+    std::shared_ptr<MemTable> m_mem;
+    std::shared_ptr<MemTable> m_imm;    // full memtable being flushed
+    std::shared_ptr<const Version> m_version;
+    std::unique_ptr<LogWriter> m_log;
+    std::atomic<std::uint64_t> m_nextFile;
+    std::atomic<std::uint64_t> m_lastSeq;
+    std::uint64_t m_flushedLog;         // logs up to this one are in tables
+    std::array<std::string, numLevels> m_compactPointer;
+    bool m_stop;
+    bool m_busy;
+    std::string m_error;                // background failure, writes report it
+    std::thread m_thread;
+    mutable std::atomic<std::uint64_t> m_negatives;
+    mutable std::atomic<std::uint64_t> m_falsePositives;
+};
+
+LsmKeyValueStore::Impl::Impl(const std::string &fullpath, const LsmOptions &options)
+    : m_path(fullpath), m_options(options), m_mem(), m_imm(),
+      m_version(std::make_shared<Version>()), m_log(), m_nextFile(1), m_lastSeq(0),
+      m_flushedLog(0), m_compactPointer(), m_stop(false), m_busy(false), m_error(), m_thread(),
+      m_negatives(0), m_falsePositives(0)
+{
+    recover();
+
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        openLog();
+    }
+
+    m_thread = std::thread(&Impl::backgroundLoop, this);
+}
+
+LsmKeyValueStore::Impl::~Impl()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+inline std::string LsmKeyValueStore::Impl::tablePath(std::uint64_t number) const
+{
+    return m_path + "/" + std::to_string(number) + ".sst";
+}
+
+inline std::string LsmKeyValueStore::Impl::logPath(std::uint64_t number) const
+{
+    return m_path + "/" + std::to_string(number) + ".log";
+}
+
+// The manifest lists the live tables, it is replaced by a rename so it is never torn.
+// Syncing, it is on the device with the renamed name and the tables it lists before
+// the caller removes the logs it replaces.
+void LsmKeyValueStore::Impl::writeManifest(const Version &version) const
+{
+    const std::string tmp = m_path + "/" + manifestName + ".tmp";
+    {
+        std::ofstream os(tmp, std::ios::trunc);
+        os << manifestMagic << std::endl
+           << "next " << m_nextFile.load() << std::endl
+           << "seq " << m_lastSeq.load() << std::endl
+           << "log " << m_flushedLog << std::endl;
+        for (int level = 0; level < numLevels; level++)
+            for (auto &table : version.m_levels[level])
+                os << "table " << level << " " << table->number() << std::endl;
+        if (!os.flush())
+            throw std::runtime_error("cannot write manifest in " + m_path);
+    }
+    if (m_options.sync)
+        syncPath(tmp, false);
+    fs::rename(tmp, m_path + "/" + manifestName);
+    if (m_options.sync)
+        syncPath(m_path, true);
+}
+
+// Tables come from the manifest, and logs of memtables which were never flushed
+// are replayed into level 0. Files no manifest names are leftovers of a crash.
+void LsmKeyValueStore::Impl::recover()
+{
+    fs::create_directories(m_path);
+
+    auto version = std::make_shared<Version>();
+    std::set<std::uint64_t> live;
+
+    std::ifstream is(m_path + "/" + manifestName);
+    std::string token;
+    if (is >> token) {
+        if (manifestMagic != token)
+            throw std::runtime_error("not an LSM store: " + m_path);
+
+        std::uint64_t value;
+        while (is >> token) {
+            if ("next" == token && is >> value) {
+                m_nextFile = std::max<std::uint64_t>(m_nextFile, value);
+            } else if ("seq" == token && is >> value) {
+                m_lastSeq = value;
+            } else if ("log" == token && is >> value) {
+                m_flushedLog = value;
+            } else if ("table" == token) {
+                int level;
+                if (!(is >> level >> value) || level < 0 || level >= numLevels)
+                    throw std::runtime_error("corrupt manifest in " + m_path);
+                version->m_levels[level].push_back(Table::open(tablePath(value), value));
+                live.insert(value);
+            } else {
+                throw std::runtime_error("corrupt manifest in " + m_path);
+            }
+        }
+    }
+
+    std::vector<std::uint64_t> logs;
+    for (auto &p : fs::directory_iterator(m_path)) {
+        if (!p.is_regular_file())
+            continue;
+
+        std::string extension = p.path().extension();
+        if (".log" != extension && ".sst" != extension)
+            continue;
+
+        std::uint64_t number = std::stoull(p.path().stem());
+        m_nextFile = std::max<std::uint64_t>(m_nextFile, number + 1);
+        // a log the manifest covers outlived a crash right after its flush,
+        // replaying it would apply its merges twice
+        if (".log" == extension && number <= m_flushedLog)
+            fs::remove(p.path());
+        else if (".log" == extension)
+            logs.push_back(number);
+        else if (!live.count(number))
+            fs::remove(p.path());
+    }
+    std::sort(logs.begin(), logs.end());
+
+    auto replayed = std::make_shared<MemTable>(0);
+    for (std::uint64_t number : logs) {
+        std::ifstream log(logPath(number), std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(log)), std::istreambuf_iterator<char>());
+
+        // a torn record at the end is a write which never returned
+        Entry entry;
+        for (std::size_t pos = 0; decodeEntry(data, pos, entry); ) {
+            m_lastSeq = std::max<std::uint64_t>(m_lastSeq, entry.m_key.m_seq);
+            replayed->add(entry);
+        }
+    }
+
+    if (!replayed->empty()) {
+        MemTableIterator it(replayed);
+        it.seekToFirst();
+        auto tables = buildTables(it, *version, 0, UINT64_MAX);
+        version->m_levels[0].insert(version->m_levels[0].begin(), tables.begin(), tables.end());
+    }
+
+    if (!logs.empty())
+        m_flushedLog = logs.back();
+    writeManifest(*version);
+    for (std::uint64_t number : logs)
+        fs::remove(logPath(number));
+
+    m_version = version;
+}
+
+// Starts a new memtable with its own log, the caller holds both locks
+void LsmKeyValueStore::Impl::openLog()
+{
+    std::uint64_t number = m_nextFile++;
+    fs::create_directories(m_path);
+
+    m_log = std::make_unique<LogWriter>(logPath(number), m_options.sync);
+    m_mem = std::make_shared<MemTable>(number);
+}
+
+LsmKeyValueStore::Impl::View LsmKeyValueStore::Impl::view() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    return View{m_mem, m_imm, m_version};
+}
+
+// Writers wait while the previous memtable is still being flushed,
+// or while level 0 has more tables than reads should have to look into
+void LsmKeyValueStore::Impl::makeRoomForWrite(std::unique_lock<std::mutex> &lock)
+{
+    for (;;) {
+        if (!m_error.empty())
+            throw std::runtime_error(m_error);
+
+        if (!m_log) {
+            openLog();
+        } else if (m_version->m_levels[0].size() >= static_cast<std::size_t>(m_options.level0StopWritesTrigger)) {
+            m_cv.wait(lock);
+        } else if (m_mem->bytes() < m_options.writeBufferSize) {
+            return;
+        } else if (m_imm) {
+            m_cv.wait(lock);
+        } else {
+            m_imm = m_mem;
+            openLog();
+            m_cv.notify_all();
+        }
+    }
+}
+
+bool LsmKeyValueStore::Impl::write(const std::string &key,
+                                   std::initializer_list<std::pair<EntryKind, std::string>> columns,
+                                   const std::function<bool()> &check)
+{
+    std::lock_guard<std::mutex> writeLock(m_writeLock);
+    if (check && !check())
+        return false;
+
+    std::shared_ptr<MemTable> mem;
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        makeRoomForWrite(lock);
+        mem = m_mem;
+    }
+
+    const std::uint64_t seq = m_lastSeq.load() + 1;
+    std::vector<Entry> entries;
+    for (auto &column : columns)
+        entries.push_back(Entry{InternalKey{key, seq, column.first}, column.second});
+
+    m_log->append(entries);
+    for (auto &entry : entries)
+        mem->add(entry);
+    m_lastSeq.store(seq);
+
+    return true;
+}
+
+// Visits the entries of one column of a key newest first, memtables first and then
+// level by level, until visit returns false. Returns true if visit stopped it.
+template <typename F>
+bool LsmKeyValueStore::Impl::lookup(const View &view, const std::string &key, std::uint8_t column,
+                                    bool memoryOnly, F visit) const
+{
+    const InternalKey target = InternalKey::first(key, column);
+    bool matched = false;
+    auto search = [&](EntryIterator &it) {
+        matched = false;
+        for (it.seek(target); it.valid(); it.next()) {
+            const Entry &entry = it.entry();
+            if (entry.m_key.m_user != key || columnOf(entry.m_key.m_kind) != column)
+                break;
+            matched = true;
+            if (entry.m_key.m_seq > view.m_seq)
+                continue;
+            if (!visit(entry))
+                return true;
+        }
+        return false;
+    };
+
+    for (auto &mem : { view.m_mem, view.m_imm }) {
+        if (!mem)
+            continue;
+        MemTableIterator it(mem);
+        if (search(it))
+            return true;
+    }
+
+    if (memoryOnly)
+        return false;
+
+    const std::string logicalKey = target.logicalKey();
+    auto searchTable = [&](const Table &table) {
+        if (!table.mayContain(logicalKey)) {
+            m_negatives.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (search(*table.iterator()))
+            return true;
+        if (!matched)
+            m_falsePositives.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    };
+
+    for (auto &table : view.m_version->m_levels[0]) {
+        if (overlaps(*table, key, key) && searchTable(*table))
+            return true;
+    }
+
+    for (int level = 1; level < numLevels; level++) {
+        auto &tables = view.m_version->m_levels[level];
+        auto it = std::lower_bound(tables.begin(), tables.end(), target,
+                                   [](const std::shared_ptr<Table> &table, const InternalKey &k) {
+            return compare(table->largest(), k) < 0;
+        });
+        if (it != tables.end() && (*it)->smallest().m_user <= key && searchTable(**it))
+            return true;
+    }
+
+    return false;
+}
+
+std::unique_ptr<EntryIterator> LsmKeyValueStore::Impl::iterator(const View &view) const
+{
+    std::vector<std::unique_ptr<EntryIterator>> children;
+    children.push_back(std::make_unique<MemTableIterator>(view.m_mem));
+    if (view.m_imm)
+        children.push_back(std::make_unique<MemTableIterator>(view.m_imm));
+    for (auto &table : view.m_version->m_levels[0])
+        children.push_back(table->iterator());
+    for (int level = 1; level < numLevels; level++) {
+        if (!view.m_version->m_levels[level].empty())
+            children.push_back(std::make_unique<ConcatenatingIterator>(view.m_version->m_levels[level]));
+    }
+
+    return std::make_unique<MergingIterator>(std::move(children));
+}
+
+// Keys whose entries are all newer than the view are not reported, nor keys whose
+// newest entry in every column is a tombstone
+void LsmKeyValueStore::Impl::scan(const View &view, const std::string &from, const std::string &to,
+                                  bool reverse,
+                                  const std::function<bool(const std::string &key)> &cb) const
+{
+    auto it = iterator(view);
+    std::string current;
+    bool any = false;
+    // newest entry kind of each column of the current key, a reverse scan meets it last
+    std::optional<EntryKind> newest[2];
+
+    auto report = [&]() {
+        bool live = false;
+        for (auto &kind : newest)
+            live = live || (kind && !isTombstone(*kind));
+
+        return !live || cb(current);
+    };
+
+    if (reverse) {
+        if (to.empty())
+            it->seekToLast();
+        else
+            it->seekBefore(InternalKey::first(to, 0));
+    } else {
+        if (from.empty())
+            it->seekToFirst();
+        else
+            it->seek(InternalKey::first(from, 0));
+    }
+
+    for (; it->valid(); reverse ? it->prev() : it->next()) {
+        const InternalKey &key = it->entry().m_key;
+        if (reverse ? !from.empty() && key.m_user < from : !to.empty() && key.m_user >= to)
+            break;
+        if (key.m_seq > view.m_seq)
+            continue;
+
+        if (!any || key.m_user != current) {
+            if (any && !report())
+                return;
+            any = true;
+            current = key.m_user;
+            newest[0].reset();
+            newest[1].reset();
+        }
+
+        auto &kind = newest[columnOf(key.m_kind)];
+        if (reverse || !kind)
+            kind = key.m_kind;
+    }
+
+    if (any)
+        report();
+}
+
+/**
+ * The Snapshot class reads through a view pinned at the last write it sees
+ */
+class LsmKeyValueStore::Impl::Snapshot : public KeyValueSnapshot {
+public:
+    explicit Snapshot(const Impl &impl) : m_impl(impl), m_view()
+    {
+        // every write up to the sequence is in the memtables or tables of a later view
+        const std::uint64_t seq = impl.m_lastSeq.load();
+        m_view = impl.view();
+        m_view.m_seq = seq;
+    }
+
+    virtual std::uint64_t sequence() const override { return m_view.m_seq; }
+
+    virtual std::string getKeyValue(const std::string &key) override
+    {
+        StringMerge merge;
+        m_impl.lookup(m_view, key, 0, false, [&merge](const Entry &entry) {
+            return merge.add(entry);
+        });
+
+        return merge.value();
+    }
+
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override
+    {
+        SetMerge merge;
+        m_impl.lookup(m_view, key, 1, false, [&merge](const Entry &entry) {
+            return merge.add(entry);
+        });
+
+        return std::make_unique<std::unordered_set<std::string>>(std::move(merge.m_members));
+    }
+
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override
+    {
+        m_impl.scan(m_view, from, to, reverse, cb);
+    }
+
+private:
+    const Impl &m_impl;
+    View m_view;
+};
+
+bool LsmKeyValueStore::Impl::olderDataExists(const Version &version, int fromLevel,
+                                             const std::string &key)
+{
+    for (int level = std::max(fromLevel, 0); level < numLevels; level++) {
+        auto &tables = version.m_levels[level];
+        if (0 == level) {
+            for (auto &table : tables)
+                if (overlaps(*table, key, key))
+                    return true;
+            continue;
+        }
+
+        auto it = std::lower_bound(tables.begin(), tables.end(), key,
+                                   [](const std::shared_ptr<Table> &table, const std::string &k) {
+            return table->largest().m_user < k;
+        });
+        if (it != tables.end() && (*it)->smallest().m_user <= key)
+            return true;
+    }
+
+    return false;
+}
+
+// Writes the input as tables of up to maxFileSize bytes, keeping the newest entry of
+// every column of every key. Set members merged on top of each other are folded into
+// one entry, which is a whole set once nothing older is left below it, and string
+// merges the same into a whole string. Tombstones and empty whole sets with nothing
+// older left below them are dropped.
+std::vector<std::shared_ptr<Table>>
+LsmKeyValueStore::Impl::buildTables(EntryIterator &input, const Version &version,
+                                    int olderFrom, std::uint64_t maxFileSize)
+{
+    std::vector<std::shared_ptr<Table>> tables;
+    std::unique_ptr<TableBuilder> builder;
+    std::uint64_t number = 0;
+
+    auto finishTable = [&]() {
+        builder->finish(m_options.sync);
+        builder.reset();
+        tables.push_back(Table::open(tablePath(number), number));
+    };
+
+    auto add = [&](const Entry &output) {
+        if (!builder) {
+            number = m_nextFile++;
+            builder = std::make_unique<TableBuilder>(tablePath(number), m_options.blockSize,
+                                                     m_options.bitsPerKey);
+        }
+        builder->add(output);
+        if (builder->fileSize() >= maxFileSize)
+            finishTable();
+    };
+
+    while (input.valid()) {
+        Entry output = input.entry();
+        const std::uint8_t column = columnOf(output.m_key.m_kind);
+        std::vector<Entry> below;   // at the same key and column, after the output
+        bool older = true;
+
+        if (0 != column) {
+            SetMerge merge;
+            bool whole = false;
+            for (; input.valid() && input.entry().m_key.m_user == output.m_key.m_user &&
+                   columnOf(input.entry().m_key.m_kind) == column; input.next()) {
+                if (!merge.add(input.entry())) {
+                    whole = true;
+                    break;
+                }
+            }
+            older = olderDataExists(version, olderFrom, output.m_key.m_user);
+            whole = whole || !older;
+
+            if (whole) {
+                output.m_key.m_kind = merge.m_members.empty() ? EntryKind::SET_DELETE : EntryKind::SET;
+            } else {
+                output.m_key.m_kind = EntryKind::SET_MERGE;
+                // the members taken out go just below the merged ones, at the same sequence
+                if (!merge.m_removed.empty())
+                    below.push_back(Entry{InternalKey{output.m_key.m_user, output.m_key.m_seq,
+                                                      EntryKind::SET_REMOVE}, encodeSet(merge.m_removed)});
+            }
+            output.m_value = encodeSet(merge.m_members);
+        } else if (!shadows(output.m_key.m_kind)) {
+            StringMerge merge;
+            bool whole = false;
+            for (; input.valid() && input.entry().m_key.m_user == output.m_key.m_user &&
+                   columnOf(input.entry().m_key.m_kind) == column; input.next()) {
+                if (!merge.add(input.entry())) {
+                    whole = true;
+                    break;
+                }
+            }
+
+            if (whole || !olderDataExists(version, olderFrom, output.m_key.m_user)) {
+                output.m_key.m_kind = EntryKind::STRING;
+                output.m_value = merge.value();
+            } else {
+                below = merge.folded();
+                output = below.front();
+                below.erase(below.begin());
+            }
+        } else if (EntryKind::STRING_DELETE == output.m_key.m_kind) {
+            older = olderDataExists(version, olderFrom, output.m_key.m_user);
+        }
+
+        // older entries of the column are shadowed
+        while (input.valid() && input.entry().m_key.m_user == output.m_key.m_user &&
+               columnOf(input.entry().m_key.m_kind) == column)
+            input.next();
+
+        if (older || !isTombstone(output.m_key.m_kind))
+            add(output);
+        for (auto &entry : below)
+            add(entry);
+    }
+
+    if (builder)
+        finishTable();
+
+    return tables;
+}
+
+void LsmKeyValueStore::Impl::backgroundLoop()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+
+    while (!m_stop) {
+        Compaction compaction;
+        if (!m_error.empty() || !(m_imm || pickCompaction(compaction))) {
+            m_busy = false;
+            m_cv.notify_all();
+            m_cv.wait(lock);
+            continue;
+        }
+
+        m_busy = true;
+        try {
+            if (m_imm)
+                flushMemTable(lock);
+            else
+                runCompaction(lock, compaction);
+        } catch (const std::exception &e) {
+            if (!lock.owns_lock())
+                lock.lock();
+            m_error = std::string("LSM background work failed: ") + e.what();
+        }
+        m_cv.notify_all();
+    }
+
+    m_busy = false;
+}
+
+void LsmKeyValueStore::Impl::flushMemTable(std::unique_lock<std::mutex> &lock)
+{
+    std::shared_ptr<MemTable> imm = m_imm;
+    std::shared_ptr<const Version> version = m_version;
+    lock.unlock();
+
+    MemTableIterator it(imm);
+    it.seekToFirst();
+    auto tables = buildTables(it, *version, 0, UINT64_MAX);
+
+    lock.lock();
+    auto next = std::make_shared<Version>(*m_version);
+    next->m_levels[0].insert(next->m_levels[0].begin(), tables.begin(), tables.end());
+    m_flushedLog = imm->logNumber();
+    writeManifest(*next);
+    m_version = next;
+    m_imm.reset();
+
+    std::error_code ec;
+    fs::remove(logPath(imm->logNumber()), ec);
+}
+
+// Level 0 goes down whole once it has enough tables, deeper levels one table at a
+// time once they are over their size, taking turns through the key range
+bool LsmKeyValueStore::Impl::pickCompaction(Compaction &compaction) const
+{
+    const Version &version = *m_version;
+
+    if (version.m_levels[0].size() >= static_cast<std::size_t>(m_options.level0CompactionTrigger)) {
+        compaction.m_level = 0;
+        compaction.m_inputs = version.m_levels[0];
+    } else {
+        std::uint64_t maxBytes = m_options.levelBaseBytes;
+        for (int level = 1; level < numLevels - 1; level++, maxBytes *= 10) {
+            auto &tables = version.m_levels[level];
+            if (levelBytes(tables) <= maxBytes)
+                continue;
+
+            auto it = std::find_if(tables.begin(), tables.end(), [&](const std::shared_ptr<Table> &table) {
+                return m_compactPointer[level].empty() || table->smallest().m_user > m_compactPointer[level];
+            });
+            compaction.m_level = level;
+            compaction.m_inputs = { it != tables.end() ? *it : tables.front() };
+            break;
+        }
+        if (compaction.m_inputs.empty())
+            return false;
+    }
+
+    std::string smallest = compaction.m_inputs.front()->smallest().m_user;
+    std::string largest = compaction.m_inputs.front()->largest().m_user;
+    for (auto &table : compaction.m_inputs) {
+        smallest = std::min(smallest, table->smallest().m_user);
+        largest = std::max(largest, table->largest().m_user);
+    }
+
+    compaction.m_overlaps.clear();
+    for (auto &table : version.m_levels[compaction.m_level + 1])
+        if (overlaps(*table, smallest, largest))
+            compaction.m_overlaps.push_back(table);
+
+    return true;
+}
+
+void LsmKeyValueStore::Impl::runCompaction(std::unique_lock<std::mutex> &lock, Compaction &compaction)
+{
+    const int level = compaction.m_level;
+    std::shared_ptr<const Version> version = m_version;
+    std::vector<std::shared_ptr<Table>> outputs;
+
+    // a table with nothing to merge with below just moves down
+    if (level > 0 && 1 == compaction.m_inputs.size() && compaction.m_overlaps.empty()) {
+        outputs = compaction.m_inputs;
+    } else {
+        lock.unlock();
+
+        std::vector<std::unique_ptr<EntryIterator>> children;
+        for (auto &table : compaction.m_inputs)
+            children.push_back(table->iterator());
+        children.push_back(std::make_unique<ConcatenatingIterator>(compaction.m_overlaps));
+
+        MergingIterator merged(std::move(children));
+        merged.seekToFirst();
+        outputs = buildTables(merged, *version, level + 2, m_options.targetFileSize);
+
+        lock.lock();
+    }
+
+    auto next = std::make_shared<Version>(*m_version);
+    auto removeFrom = [](std::vector<std::shared_ptr<Table>> &tables,
+                         const std::vector<std::shared_ptr<Table>> &removed) {
+        tables.erase(std::remove_if(tables.begin(), tables.end(), [&removed](const std::shared_ptr<Table> &table) {
+            return std::find(removed.begin(), removed.end(), table) != removed.end();
+        }), tables.end());
+    };
+    removeFrom(next->m_levels[level], compaction.m_inputs);
+    removeFrom(next->m_levels[level + 1], compaction.m_overlaps);
+
+    auto &below = next->m_levels[level + 1];
+    below.insert(below.end(), outputs.begin(), outputs.end());
+    std::sort(below.begin(), below.end(), [](const std::shared_ptr<Table> &a, const std::shared_ptr<Table> &b) {
+        return compare(a->smallest(), b->smallest()) < 0;
+    });
+
+    writeManifest(*next);
+    m_version = next;
+    for (auto &table : compaction.m_inputs)
+        m_compactPointer[level] = std::max(m_compactPointer[level], table->largest().m_user);
+    // a level emptied by moving its only table down starts over too
+    const auto &left = next->m_levels[level];
+    if (level > 0 && (left.empty() || m_compactPointer[level] >= left.back()->largest().m_user))
+        m_compactPointer[level].clear();
+
+    // files go once the manifest no longer names them and the last reader is done
+    if (outputs != compaction.m_inputs) {
+        for (auto &table : compaction.m_inputs)
+            table->markObsolete();
+        for (auto &table : compaction.m_overlaps)
+            table->markObsolete();
+    }
+}
+
+LsmKeyValueStore::LsmKeyValueStore(const std::string &fullpath, const LsmOptions &options)
+    : m_impl(std::make_unique<Impl>(fullpath, options))
+{
+
+}
+
+LsmKeyValueStore::~LsmKeyValueStore()
+{
+
+}
+
+// Management methods
+void LsmKeyValueStore::loadKeysInto(std::function<void(std::string key, std::string vlaue)> cb)
+{
+    auto it = m_impl->iterator(m_impl->view());
+
+    for (it->seekToFirst(); it->valid(); ) {
+        const InternalKey first = it->entry().m_key;
+        StringMerge merge;
+        bool folding = 0 == columnOf(first.m_kind);
+
+        // fold or skip the older entries of the column
+        do {
+            if (folding)
+                folding = merge.add(it->entry());
+            it->next();
+        } while (it->valid() && it->entry().m_key.m_user == first.m_user &&
+                 columnOf(it->entry().m_key.m_kind) == columnOf(first.m_kind));
+
+        if (0 == columnOf(first.m_kind) && EntryKind::STRING_DELETE != first.m_kind)
+            cb(first.m_user, merge.value());
+    }
+}
+
+void LsmKeyValueStore::clear()
+{
+    std::lock_guard<std::mutex> writeLock(m_impl->m_writeLock);
+    std::unique_lock<std::mutex> lock(m_impl->m_lock);
+    m_impl->m_cv.wait(lock, [this]() { return !m_impl->m_busy; });
+
+    for (auto &tables : m_impl->m_version->m_levels)
+        for (auto &table : tables)
+            table->markObsolete();
+
+    m_impl->m_version = std::make_shared<Version>();
+    m_impl->m_imm.reset();
+    m_impl->m_mem = std::make_shared<MemTable>(0);
+    m_impl->m_log.reset();
+    m_impl->m_error.clear();
+    m_impl->m_compactPointer = {};
+
+    // the next write starts over with a new log
+    if (fs::exists(m_impl->m_path))
+        fs::remove_all(m_impl->m_path);
+}
+
+// Set or get methods
+void LsmKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { { EntryKind::STRING, value } });
+}
+
+void LsmKeyValueStore::setKeyValue(const std::string &key,
+                                   const std::unordered_set<std::string> &value)
+{
+    m_impl->write(key, { { EntryKind::SET, encodeSet(value) } });
+}
+
+void LsmKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { { EntryKind::SET_MERGE, encodeSet({ value }) } });
+}
+
+// The value is compared under the write lock and the new one goes through the log
+bool LsmKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                             const std::string &value)
+{
+    return m_impl->write(key, { { EntryKind::STRING, value } }, [this, &key, &expected]() {
+        return getKeyValue(key) == expected;
+    });
+}
+
+// Merges are written without a read, reads and compactions fold them into what is older
+void LsmKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                     MergeOperator op)
+{
+    m_impl->write(key, { { MergeOperator::ADD == op ? EntryKind::STRING_ADD : EntryKind::STRING_APPEND,
+                           operand } });
+}
+
+void LsmKeyValueStore::mergeKeyValue(const std::string &key,
+                                     const std::unordered_set<std::string> &members)
+{
+    if (!members.empty())
+        m_impl->write(key, { { EntryKind::SET_MERGE, encodeSet(members) } });
+}
+
+// Deletes only write tombstones, the compactions reclaim what they shadow
+void LsmKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    m_impl->write(key, { { EntryKind::STRING_DELETE, std::string() },
+                         { EntryKind::SET_DELETE, encodeSet({}) } });
+}
+
+void LsmKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { { EntryKind::SET_REMOVE, encodeSet({ value }) } });
+}
+
+// Merges are folded on the way, the compactions fold them for good
+std::string LsmKeyValueStore::getKeyValue(const std::string &key)
+{
+    StringMerge merge;
+    m_impl->lookup(m_impl->view(), key, 0, false, [&merge](const Entry &entry) {
+        return merge.add(entry);
+    });
+
+    return merge.value();
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+LsmKeyValueStore::getKeyValueSet(const std::string &key)
+{
+    SetMerge merge;
+    m_impl->lookup(m_impl->view(), key, 1, false, [&merge](const Entry &entry) {
+        return merge.add(entry);
+    });
+
+    return std::make_unique<std::unordered_set<std::string>>(std::move(merge.m_members));
+}
+
+// Only the memtables are in memory, anything else may need a table read
+bool LsmKeyValueStore::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    StringMerge merge;
+    bool whole = m_impl->lookup(m_impl->view(), key, 0, true, [&merge](const Entry &entry) {
+        return merge.add(entry);
+    });
+    if (whole)
+        value = merge.value();
+
+    return whole;
+}
+
+bool LsmKeyValueStore::tryGetKeyValueSet(const std::string &key,
+                                         std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    SetMerge merge;
+    bool whole = m_impl->lookup(m_impl->view(), key, 1, true, [&merge](const Entry &entry) {
+        return merge.add(entry);
+    });
+    if (whole)
+        value = std::make_unique<std::unordered_set<std::string>>(std::move(merge.m_members));
+
+    return whole;
+}
+
+// Merges the memtables and every level, each key is reported once
+void LsmKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                std::function<bool(const std::string &key)> cb)
+{
+    m_impl->scan(m_impl->view(), from, to, reverse, cb);
+}
+
+// Nothing is copied, the view keeps the memtables and tables the snapshot sees alive
+// and compactions carry on writing new tables beside them
+std::unique_ptr<KeyValueSnapshot> LsmKeyValueStore::snapshot()
+{
+    return std::make_unique<Impl::Snapshot>(*m_impl);
+}
+
+MemoryUsage LsmKeyValueStore::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.block(sizeof(Impl));
+
+    const Impl::View view = m_impl->view();
+    for (auto &mem : { view.m_mem, view.m_imm }) {
+        if (!mem)
+            continue;
+        MemTableIterator it(mem);
+        for (it.seekToFirst(); it.valid(); it.next())
+            entryUsage(it.entry(), usage);
+    }
+    for (auto &tables : view.m_version->m_levels)
+        for (auto &table : tables)
+            table->memoryUsage(usage);
+
+    return usage;
+}
+
+// Tables keep no key apart, only the memtables do
+MemoryUsage LsmKeyValueStore::memoryUsage(const std::string &key) const
+{
+    MemoryUsage usage;
+
+    const Impl::View view = m_impl->view();
+    for (auto &mem : { view.m_mem, view.m_imm }) {
+        if (!mem)
+            continue;
+        MemTableIterator it(mem);
+        for (it.seek(InternalKey::first(key, 0)); it.valid() && it.entry().m_key.m_user == key; it.next())
+            entryUsage(it.entry(), usage);
+    }
+
+    return usage;
+}
+
+void LsmKeyValueStore::compact()
+{
+    std::unique_lock<std::mutex> writeLock(m_impl->m_writeLock);
+    std::unique_lock<std::mutex> lock(m_impl->m_lock);
+
+    m_impl->m_cv.wait(lock, [this]() { return !m_impl->m_imm || !m_impl->m_error.empty(); });
+    if (m_impl->m_log && !m_impl->m_mem->empty()) {
+        m_impl->m_imm = m_impl->m_mem;
+        m_impl->openLog();
+        m_impl->m_cv.notify_all();
+    }
+    writeLock.unlock();
+
+    m_impl->m_cv.wait(lock, [this]() {
+        Impl::Compaction compaction;
+        return !m_impl->m_error.empty() ||
+                (!m_impl->m_busy && !m_impl->m_imm && !m_impl->pickCompaction(compaction));
+    });
+    if (!m_impl->m_error.empty())
+        throw std::runtime_error(m_impl->m_error);
+}
+
+// Every table has its own filter, the rates are over all tables and lookups
+FilterStats LsmKeyValueStore::filterStats() const
+{
+    FilterStats stats;
+    stats.m_bitsPerKey = m_impl->m_options.bitsPerKey;
+    stats.m_negatives = m_impl->m_negatives.load(std::memory_order_relaxed);
+    stats.m_falsePositives = m_impl->m_falsePositives.load(std::memory_order_relaxed);
+
+    double expectedFalsePositives = 0.0;
+    auto version = m_impl->view().m_version;
+    for (auto &tables : version->m_levels) {
+        for (auto &table : tables) {
+            const BloomFilter &filter = table->filter();
+            stats.m_keys += filter.keys();
+            stats.m_bits += filter.bits();
+            expectedFalsePositives += filter.falsePositiveRate() * filter.keys();
+        }
+    }
+    if (stats.m_keys > 0)
+        stats.m_expectedFalsePositiveRate = expectedFalsePositives / stats.m_keys;
+
+    return stats;
+}
+
+std::vector<std::size_t> LsmKeyValueStore::tablesPerLevel() const
+{
+    std::lock_guard<std::mutex> lock(m_impl->m_lock);
+    std::vector<std::size_t> tables;
+    for (auto &level : m_impl->m_version->m_levels)
+        tables.push_back(level.size());
+
+    return tables;
+}
+
+}
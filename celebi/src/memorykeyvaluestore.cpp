@@ -1,42 +1,936 @@
 #include "extensions/extdatabase.h"
 #include "extensions/highwayhash.h"
+#include "extensions/epoch.h"
+#include "extensions/art.h"
+#include "extensions/trace.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <optional>
+#include <set>
+#include <shared_mutex>
+#include <unordered_set>
+#include <vector>
 
 
 namespace celebiext {
 
+const std::size_t MemoryKeyValueStore::defaultShards = 16;
+
+namespace {
+
+// Frees at once, for stores whose readers never outlive a writer's lock
+void reclaimNow(void *ptr, void (*deleter)(void *))
+{
+    deleter(ptr);
+}
+
+/**
+ * Hash table whose readers can run without locks: nodes and values are only ever
+ * published by release stores, and whatever a writer unlinks goes to the reclaim
+ * function instead of being freed. Writers must be serialized by the caller.
+ */
+template <typename V>
+class ConcurrentTable {
+public:
+    using Reclaim = void (*)(void *ptr, void (*deleter)(void *));
+
+    explicit ConcurrentTable(Reclaim reclaim);
+    ~ConcurrentTable();
+
+    // Read methods, the caller holds a read lock or an epoch guard
+    V *find(const std::string &key, std::size_t hash) const;
+    template <typename F> void forEach(F f) const;
+
+    // Write methods
+    void put(const std::string &key, std::size_t hash, V *value);
+    // Like put, but the value it replaced is handed back to the caller instead of reclaimed
+    V *exchange(const std::string &key, std::size_t hash, V *value);
+    V *emplace(const std::string &key, std::size_t hash, V *value);
+    // Returns false if the key is not in the table
+    bool erase(const std::string &key, std::size_t hash);
+    void clear();
+
+    // Memory methods, buckets and nodes with their keys, f counts each value
+    template <typename F> void memoryUsage(MemoryUsage &usage, F f) const;
+    template <typename F>
+    void memoryUsage(const std::string &key, std::size_t hash, MemoryUsage &usage, F f) const;
+
+private:
+    struct Node {
+        Node(const std::string &key, std::size_t hash, V *value, Node *next)
+            : m_key(key), m_hash(hash), m_value(value), m_next(next) {}
+
+        const std::string m_key;
+        const std::size_t m_hash;
+        std::atomic<V *> m_value;
+        std::atomic<Node *> m_next;
+    };
+
+    struct Buckets {
+        explicit Buckets(std::size_t size)
+            : m_size(size), m_heads(new std::atomic<Node *>[size])
+        {
+            for (std::size_t i = 0; i < size; i++)
+                m_heads[i].store(nullptr, std::memory_order_relaxed);
+        }
+
+        std::atomic<Node *> &head(std::size_t hash) { return m_heads[hash & (m_size - 1)]; }
+
+        const std::size_t m_size;   // power of two
+        std::unique_ptr<std::atomic<Node *>[]> m_heads;
+    };
+
+    Node *findNode(Buckets *buckets, const std::string &key, std::size_t hash) const;
+    void grow();
+
+    static void deleteValue(void *value) { delete static_cast<V *>(value); }
+    static void deleteNode(void *node) { delete static_cast<Node *>(node); }
+    static void deleteBuckets(void *buckets) { delete static_cast<Buckets *>(buckets); }
+
+    static constexpr std::size_t initialBuckets = 16;
+
+    Reclaim m_reclaim;
+    std::atomic<Buckets *> m_buckets;
+    std::size_t m_size;
+};
+
+template <typename V>
+ConcurrentTable<V>::ConcurrentTable(Reclaim reclaim)
+    : m_reclaim(reclaim), m_buckets(new Buckets(initialBuckets)), m_size(0)
+{
+
+}
+
+// No reader may be left when the table goes away, so everything is freed at once
+template <typename V>
+ConcurrentTable<V>::~ConcurrentTable()
+{
+    Buckets *buckets = m_buckets.load(std::memory_order_relaxed);
+    for (std::size_t i = 0; i < buckets->m_size; i++) {
+        for (Node *node = buckets->m_heads[i].load(std::memory_order_relaxed); node; ) {
+            Node *next = node->m_next.load(std::memory_order_relaxed);
+            delete node->m_value.load(std::memory_order_relaxed);
+            delete node;
+            node = next;
+        }
+    }
+
+    delete buckets;
+}
+
+template <typename V>
+typename ConcurrentTable<V>::Node *
+ConcurrentTable<V>::findNode(Buckets *buckets, const std::string &key, std::size_t hash) const
+{
+    for (Node *node = buckets->head(hash).load(std::memory_order_acquire); node;
+         node = node->m_next.load(std::memory_order_acquire)) {
+        if (node->m_hash == hash && node->m_key == key)
+            return node;
+    }
+
+    return nullptr;
+}
+
+template <typename V>
+V *ConcurrentTable<V>::find(const std::string &key, std::size_t hash) const
+{
+    Node *node = findNode(m_buckets.load(std::memory_order_acquire), key, hash);
+
+    return node ? node->m_value.load(std::memory_order_acquire) : nullptr;
+}
+
+template <typename V>
+template <typename F>
+void ConcurrentTable<V>::forEach(F f) const
+{
+    Buckets *buckets = m_buckets.load(std::memory_order_acquire);
+    for (std::size_t i = 0; i < buckets->m_size; i++) {
+        for (Node *node = buckets->m_heads[i].load(std::memory_order_acquire); node;
+             node = node->m_next.load(std::memory_order_acquire))
+            f(node->m_key, *node->m_value.load(std::memory_order_acquire));
+    }
+}
+
+template <typename V>
+void ConcurrentTable<V>::put(const std::string &key, std::size_t hash, V *value)
+{
+    if (V *old = exchange(key, hash, value))
+        m_reclaim(old, deleteValue);
+}
+
+template <typename V>
+V *ConcurrentTable<V>::exchange(const std::string &key, std::size_t hash, V *value)
+{
+    Buckets *buckets = m_buckets.load(std::memory_order_relaxed);
+    Node *node = findNode(buckets, key, hash);
+    if (node)
+        return node->m_value.exchange(value, std::memory_order_acq_rel);
+
+    std::atomic<Node *> &head = buckets->head(hash);
+    head.store(new Node(key, hash, value, head.load(std::memory_order_relaxed)),
+               std::memory_order_release);
+
+    if (++m_size > buckets->m_size)
+        grow();
+
+    return nullptr;
+}
+
+template <typename V>
+V *ConcurrentTable<V>::emplace(const std::string &key, std::size_t hash, V *value)
+{
+    Node *node = findNode(m_buckets.load(std::memory_order_relaxed), key, hash);
+    if (node) {
+        delete value;
+        return node->m_value.load(std::memory_order_relaxed);
+    }
+
+    put(key, hash, value);
+
+    return value;
+}
+
+// Readers on the unlinked node still see the rest of the chain through it
+template <typename V>
+bool ConcurrentTable<V>::erase(const std::string &key, std::size_t hash)
+{
+    std::atomic<Node *> *link = &m_buckets.load(std::memory_order_relaxed)->head(hash);
+    for (Node *node = link->load(std::memory_order_relaxed); node;
+         link = &node->m_next, node = link->load(std::memory_order_relaxed)) {
+        if (node->m_hash != hash || node->m_key != key)
+            continue;
+
+        link->store(node->m_next.load(std::memory_order_relaxed), std::memory_order_release);
+        m_reclaim(node->m_value.load(std::memory_order_relaxed), deleteValue);
+        m_reclaim(node, deleteNode);
+        m_size--;
+        return true;
+    }
+
+    return false;
+}
+
+// Readers may still walk the old chains, so nodes are copied into the new buckets
+// rather than relinked, the copies share the values with the old nodes
+template <typename V>
+void ConcurrentTable<V>::grow()
+{
+    Buckets *old = m_buckets.load(std::memory_order_relaxed);
+    auto *buckets = new Buckets(old->m_size * 2);
+
+    for (std::size_t i = 0; i < old->m_size; i++) {
+        for (Node *node = old->m_heads[i].load(std::memory_order_relaxed); node; ) {
+            std::atomic<Node *> &head = buckets->head(node->m_hash);
+            head.store(new Node(node->m_key, node->m_hash,
+                                node->m_value.load(std::memory_order_relaxed),
+                                head.load(std::memory_order_relaxed)),
+                       std::memory_order_relaxed);
+
+            Node *next = node->m_next.load(std::memory_order_relaxed);
+            m_reclaim(node, deleteNode);
+            node = next;
+        }
+    }
+
+    m_buckets.store(buckets, std::memory_order_release);
+    m_reclaim(old, deleteBuckets);
+}
+
+template <typename V>
+void ConcurrentTable<V>::clear()
+{
+    Buckets *old = m_buckets.load(std::memory_order_relaxed);
+    m_buckets.store(new Buckets(initialBuckets), std::memory_order_release);
+    m_size = 0;
+
+    for (std::size_t i = 0; i < old->m_size; i++) {
+        for (Node *node = old->m_heads[i].load(std::memory_order_relaxed); node; ) {
+            Node *next = node->m_next.load(std::memory_order_relaxed);
+            m_reclaim(node->m_value.load(std::memory_order_relaxed), deleteValue);
+            m_reclaim(node, deleteNode);
+            node = next;
+        }
+    }
+
+    m_reclaim(old, deleteBuckets);
+}
+
+template <typename V>
+template <typename F>
+void ConcurrentTable<V>::memoryUsage(MemoryUsage &usage, F f) const
+{
+    Buckets *buckets = m_buckets.load(std::memory_order_acquire);
+    usage.block(sizeof(Buckets));
+    usage.block(buckets->m_size * sizeof(std::atomic<Node *>));
+
+    for (std::size_t i = 0; i < buckets->m_size; i++) {
+        for (Node *node = buckets->m_heads[i].load(std::memory_order_acquire); node;
+             node = node->m_next.load(std::memory_order_acquire)) {
+            usage.block(sizeof(Node));
+            usage.string(node->m_key, &MemoryUsage::m_keys);
+            f(*node->m_value.load(std::memory_order_acquire));
+        }
+    }
+}
+
+template <typename V>
+template <typename F>
+void ConcurrentTable<V>::memoryUsage(const std::string &key, std::size_t hash,
+                                     MemoryUsage &usage, F f) const
+{
+    Node *node = findNode(m_buckets.load(std::memory_order_acquire), key, hash);
+    if (!node)
+        return;
+
+    usage.block(sizeof(Node));
+    usage.string(node->m_key, &MemoryUsage::m_keys);
+    f(*node->m_value.load(std::memory_order_acquire));
+}
+
+/**
+ * A value with the versions it replaced, newest first. Snapshots walk down to the newest
+ * version not after their sequence, writers cut off the versions no snapshot can reach.
+ * A deleted key keeps a tombstone on top of its versions while snapshots may see them.
+ */
+template <typename V>
+struct Versioned {
+    Versioned(V value, std::uint64_t seq, Versioned *older, bool deleted = false)
+        : m_value(std::move(value)), m_seq(seq), m_older(older), m_deleted(deleted) {}
+
+    // Older versions go too, one at a time rather than recursively
+    ~Versioned()
+    {
+        Versioned *older = m_older.load(std::memory_order_relaxed);
+        while (older) {
+            Versioned *next = older->m_older.exchange(nullptr, std::memory_order_relaxed);
+            delete older;
+            older = next;
+        }
+    }
+
+    // Newest version a snapshot at seq sees, nullptr if the key was written later
+    const Versioned *at(std::uint64_t seq) const
+    {
+        const Versioned *version = this;
+        while (version && version->m_seq > seq)
+            version = version->m_older.load(std::memory_order_acquire);
+
+        return version;
+    }
+
+    V m_value;
+    std::uint64_t m_seq;    // 0 for values loaded from the persistent store
+    std::atomic<Versioned *> m_older;
+    const bool m_deleted;   // m_value is empty
+};
+
+// Every version a snapshot may still need counts, not only the newest
+void versionsUsage(const Versioned<std::string> &value, MemoryUsage &usage)
+{
+    for (const Versioned<std::string> *version = &value; version;
+         version = version->m_older.load(std::memory_order_acquire)) {
+        usage.block(sizeof(*version));
+        usage.string(version->m_value, &MemoryUsage::m_values);
+    }
+}
+
+void versionsUsage(const Versioned<std::unordered_set<std::string>> &value, MemoryUsage &usage)
+{
+    for (const Versioned<std::unordered_set<std::string>> *version = &value; version;
+         version = version->m_older.load(std::memory_order_acquire)) {
+        usage.block(sizeof(*version));
+        usage.set(version->m_value, &MemoryUsage::m_members);
+    }
+}
+
+}
+
 class MemoryKeyValueStore::Impl {
 public:
-    Impl();
-    explicit Impl(std::unique_ptr<KeyValueStore> &persistentStore);
+    Impl(Concurrency concurrency, std::size_t shards);
+    Impl(std::unique_ptr<KeyValueStore> &persistentStore,
+         Concurrency concurrency, std::size_t shards);
+    ~Impl();
+
+    using ValueSet = std::unordered_set<std::string>;
+    using OrderedKeys = AdaptiveRadixTree;
+    using Reclaim = void (*)(void *ptr, void (*deleter)(void *));
+
+    static constexpr std::uint64_t noSnapshot = UINT64_MAX;
+
+    // A part of the keyspace, readers and writers of other shards never touch its lock
+    struct Shard {
+        explicit Shard(Reclaim reclaim)
+            : m_lock(), m_keyValueStore(reclaim), m_listStore(reclaim),
+              m_history(), m_oldVersions(0), m_erased(0) {}
+
+        std::shared_mutex m_lock;
+        ConcurrentTable<Versioned<std::string>> m_keyValueStore;
+        ConcurrentTable<Versioned<ValueSet>> m_listStore;
+        std::unordered_set<std::string> m_history;  // keys with versions older than the newest
+        std::size_t m_oldVersions;
+        std::uint64_t m_erased;     // bumped whenever a key leaves the tables or changes
+                                    // on disk only, a cache fill from before is stale
+    };
+
+    // Whatever a reader needs to hold while it looks at values in a shard
+    class ReadGuard {
+    public:
+        ReadGuard(Impl &impl, Shard &shard);
+
+    private:
+        std::shared_lock<std::shared_mutex> m_lock;
+        std::optional<EpochGuard> m_epoch;
+    };
+
+    class Snapshot;
+
+    std::size_t hashOf(const std::string &key);
+    Shard &shardFor(std::size_t hash);
+    std::shared_lock<std::shared_mutex> readLock(Shard &shard);
+    std::unique_lock<std::shared_mutex> writeLock(Shard &shard);
+    std::unique_lock<std::mutex> orderedLock();
+
+    // New keys go to the ordered index too, while their shard is still locked
+    void indexKey(const std::string &key);
+    // Deleted keys leave it, kept aside for snapshot scans if tombstones cover their versions
+    void unindexKey(const std::string &key, bool tombstoned);
+    void forgetKey(Shard &shard, const std::string &key, std::size_t hash);
+
+    // Values may only be changed in place while no reader can look at them without a lock,
+    // and no snapshot may still need the version being overwritten
+    template <typename V>
+    bool inPlace(const Versioned<V> *current) const;
+
+    template <typename V>
+    bool assign(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                const std::string &key, std::size_t hash, const V &value);
+    template <typename V>
+    void push(Shard &shard, ConcurrentTable<Versioned<V>> &table, const std::string &key,
+              std::size_t hash, Versioned<V> *current, V value, std::uint64_t seq,
+              bool deleted = false);
+    template <typename V>
+    bool remove(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                const std::string &key, std::size_t hash, std::uint64_t seq);
+    template <typename V>
+    bool prune(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+               const std::string &key, std::size_t hash);
+
+    bool loadCold(const std::string &key, std::string &value);
+    bool loadCold(const std::string &key, ValueSet &value);
+    // Writes a key which is not in memory to the persistent store only, if no snapshot
+    // needs its old value. Returns false if the key has to be brought into memory first.
+    template <typename F>
+    bool writeCold(Shard &shard, const std::string &key, F write);
+
+    // Snapshot methods
+    std::uint64_t pin();
+    void unpin(std::uint64_t seq);
+    template <typename V>
+    bool findAt(ConcurrentTable<Versioned<V>> &table, const std::string &key,
+                std::size_t hash, std::uint64_t seq, V &value);
+    std::string getAt(const std::string &key, std::uint64_t seq);
+    std::unique_ptr<ValueSet> getSetAt(const std::string &key, std::uint64_t seq);
+    bool visibleAt(const std::string &key, std::uint64_t seq, bool indexed);
+    std::vector<std::string> deletedIn(const std::string &from, const std::string &to, bool reverse);
 
-    std::unordered_map<std::string, std::string, HighwayHash>  m_keyValueStore;
-    std::unordered_map<std::string, std::unordered_set<std::string>, HighwayHash>  m_listStore;
+    Concurrency m_concurrency;
+    Reclaim m_reclaim;
+    std::vector<std::unique_ptr<Shard>> m_shards;
+    std::mutex m_orderedLock;                   // serializes writers of the ordered index
+    std::atomic<OrderedKeys *> m_orderedKeys;   // every key, scanned under an epoch guard
+    std::set<std::string> m_deletedKeys;        // deleted under tombstones, with the index
+    std::atomic<std::uint64_t> m_sequence;      // of the last write, taken under its shard lock
+    std::mutex m_snapshotLock;
+    std::multiset<std::uint64_t> m_snapshots;
+    std::atomic<std::uint64_t> m_oldestSnapshot;
+    HighwayHash m_hash;
     std::optional<std::unique_ptr<KeyValueStore>> m_persistentStore;
 };
 
-MemoryKeyValueStore::Impl::Impl()
-    : m_keyValueStore(), m_listStore(), m_persistentStore()
+/**
+ * The Snapshot class pins a sequence number, so writers keep the versions it sees
+ */
+class MemoryKeyValueStore::Impl::Snapshot : public KeyValueSnapshot {
+public:
+    explicit Snapshot(Impl &impl) : m_impl(impl), m_seq(impl.pin()) {}
+    virtual ~Snapshot() { m_impl.unpin(m_seq); }
+
+    virtual std::uint64_t sequence() const override { return m_seq; }
+
+    virtual std::string getKeyValue(const std::string &key) override
+    {
+        return m_impl.getAt(key, m_seq);
+    }
+
+    virtual std::unique_ptr<std::unordered_set<std::string>>
+                        getKeyValueSet(const std::string &key) override
+    {
+        return m_impl.getSetAt(key, m_seq);
+    }
+
+    // Keys written after the snapshot are in the ordered index too, they are skipped,
+    // keys deleted after it are not and are merged in from the deleted ones
+    virtual void scanKeys(const std::string &from, const std::string &to, bool reverse,
+                          std::function<bool(const std::string &key)> cb) override
+    {
+        std::vector<std::string> deleted = m_impl.deletedIn(from, to, reverse);
+        auto next = deleted.begin();
+        auto emit = [this, &cb](const std::string &key, bool indexed) {
+            return !m_impl.visibleAt(key, m_seq, indexed) || cb(key);
+        };
+
+        bool more = true;
+        {
+            EpochGuard guard;
+            m_impl.m_orderedKeys.load(std::memory_order_acquire)->scan(from, to, reverse,
+                                                                       [&](const std::string &key) {
+                for (; next != deleted.end() && (reverse ? *next >= key : *next <= key); next++)
+                    if (*next != key && !emit(*next, false))
+                        return more = false;
+                return more = emit(key, true);
+            });
+        }
+
+        for (; more && next != deleted.end(); next++)
+            more = emit(*next, false);
+    }
+
+private:
+    Impl &m_impl;
+    const std::uint64_t m_seq;
+};
+
+MemoryKeyValueStore::Impl::Impl(Concurrency concurrency, std::size_t shards)
+    : m_concurrency(concurrency), m_reclaim(reclaimNow), m_shards(), m_orderedLock(),
+      m_orderedKeys(new OrderedKeys(Concurrency::NONE != concurrency)), m_sequence(0),
+      m_snapshotLock(), m_snapshots(), m_oldestSnapshot(noSnapshot), m_hash(), m_persistentStore()
+{
+    if (Concurrency::NONE == concurrency || 0 == shards)
+        shards = 1;
+
+    if (Concurrency::LOCK_FREE_READ == concurrency)
+        m_reclaim = Epoch::retire;
+    for (std::size_t i = 0; i < shards; i++)
+        m_shards.push_back(std::make_unique<Shard>(m_reclaim));
+}
+
+MemoryKeyValueStore::Impl::Impl(std::unique_ptr<KeyValueStore> &persistentStore,
+                                Concurrency concurrency, std::size_t shards)
+    : Impl(concurrency, shards)
+{
+    m_persistentStore = std::unique_ptr<KeyValueStore>(persistentStore.release());
+
+    // keys still cold on disk must be found by scans too, they come in sorted already
+    OrderedKeys *orderedKeys = m_orderedKeys.load(std::memory_order_relaxed);
+    m_persistentStore->get()->scanKeys("", "", false, [orderedKeys](const std::string &key) {
+        orderedKeys->insert(key);
+        return true;
+    });
+}
+
+MemoryKeyValueStore::Impl::~Impl()
+{
+    delete m_orderedKeys.load(std::memory_order_relaxed);
+}
+
+MemoryKeyValueStore::Impl::ReadGuard::ReadGuard(Impl &impl, Shard &shard)
+    : m_lock(), m_epoch()
+{
+    if (Concurrency::LOCK_FREE_READ == impl.m_concurrency)
+        m_epoch.emplace();
+    else
+        m_lock = impl.readLock(shard);
+}
+
+inline std::size_t MemoryKeyValueStore::Impl::hashOf(const std::string &key)
+{
+    CELEBI_TRACE_SPAN(span, "memory.hash", key, key.size());
+
+    return m_hash(key);
+}
+
+// Tables pick buckets with the low bits of the hash, so shards use the high bits
+inline MemoryKeyValueStore::Impl::Shard &MemoryKeyValueStore::Impl::shardFor(std::size_t hash)
+{
+    if (1 == m_shards.size())
+        return *m_shards.front();
+
+    return *m_shards[(hash >> 32) % m_shards.size()];
+}
+
+inline std::shared_lock<std::shared_mutex> MemoryKeyValueStore::Impl::readLock(Shard &shard)
+{
+    if (Concurrency::NONE == m_concurrency)
+        return std::shared_lock<std::shared_mutex>(shard.m_lock, std::defer_lock);
+
+    return std::shared_lock<std::shared_mutex>(shard.m_lock);
+}
+
+inline std::unique_lock<std::shared_mutex> MemoryKeyValueStore::Impl::writeLock(Shard &shard)
+{
+    if (Concurrency::NONE == m_concurrency)
+        return std::unique_lock<std::shared_mutex>(shard.m_lock, std::defer_lock);
+
+    return std::unique_lock<std::shared_mutex>(shard.m_lock);
+}
+
+inline std::unique_lock<std::mutex> MemoryKeyValueStore::Impl::orderedLock()
+{
+    if (Concurrency::NONE == m_concurrency)
+        return std::unique_lock<std::mutex>(m_orderedLock, std::defer_lock);
+
+    return std::unique_lock<std::mutex>(m_orderedLock);
+}
+
+void MemoryKeyValueStore::Impl::indexKey(const std::string &key)
+{
+    auto lock = orderedLock();
+    m_orderedKeys.load(std::memory_order_relaxed)->insert(key);
+    if (!m_deletedKeys.empty())
+        m_deletedKeys.erase(key);
+}
+
+void MemoryKeyValueStore::Impl::unindexKey(const std::string &key, bool tombstoned)
+{
+    auto lock = orderedLock();
+    m_orderedKeys.load(std::memory_order_relaxed)->erase(key);
+    if (tombstoned)
+        m_deletedKeys.insert(key);
+}
+
+// Once neither table holds the key no snapshot can see it any more
+void MemoryKeyValueStore::Impl::forgetKey(Shard &shard, const std::string &key, std::size_t hash)
+{
+    if (shard.m_keyValueStore.find(key, hash) || shard.m_listStore.find(key, hash))
+        return;
+
+    auto lock = orderedLock();
+    m_deletedKeys.erase(key);
+}
+
+// Snapshots are pinned under every shard lock, so the shard lock held by a writer
+// is enough to see the oldest one
+template <typename V>
+inline bool MemoryKeyValueStore::Impl::inPlace(const Versioned<V> *current) const
+{
+    return Concurrency::LOCK_FREE_READ != m_concurrency && !current->m_deleted &&
+            !current->m_older.load(std::memory_order_relaxed) &&
+            noSnapshot == m_oldestSnapshot.load(std::memory_order_relaxed);
+}
+
+// Returns true if the key was not in the table before
+template <typename V>
+bool MemoryKeyValueStore::Impl::assign(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                                       const std::string &key, std::size_t hash, const V &value)
+{
+    std::uint64_t seq = m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    Versioned<V> *current = table.find(key, hash);
+    bool added = !current || current->m_deleted;
+
+    if (current && inPlace(current)) {
+        current->m_value = value;
+        current->m_seq = seq;
+        return false;
+    }
+
+    // a snapshot must still see what a cold key held on disk before this write
+    if (!current && noSnapshot != m_oldestSnapshot.load(std::memory_order_relaxed)) {
+        V cold;
+        if (loadCold(key, cold)) {
+            current = new Versioned<V>(std::move(cold), 0, nullptr);
+            table.put(key, hash, current);
+        }
+    }
+
+    push(shard, table, key, hash, current, value, seq);
+
+    return added;
+}
+
+// The replaced version stays linked below the new one until no snapshot needs it
+template <typename V>
+void MemoryKeyValueStore::Impl::push(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                                     const std::string &key, std::size_t hash,
+                                     Versioned<V> *current, V value, std::uint64_t seq,
+                                     bool deleted)
 {
+    table.exchange(key, hash, new Versioned<V>(std::move(value), seq, current, deleted));
+    if (!current)
+        return;
 
+    shard.m_oldVersions++;
+    if (prune(shard, table, key, hash))
+        shard.m_history.insert(key);
 }
 
-MemoryKeyValueStore::Impl::Impl(std::unique_ptr<KeyValueStore> &persistentStore)
-    : m_keyValueStore(), m_listStore(), m_persistentStore(persistentStore.release())
+// Every snapshot sees a version at least as new as the one the oldest snapshot sees,
+// so whatever is below that one is cut off. Returns true if old versions are left.
+template <typename V>
+bool MemoryKeyValueStore::Impl::prune(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                                      const std::string &key, std::size_t hash)
 {
+    Versioned<V> *head = table.find(key, hash);
+    if (!head)
+        return false;
 
+    const std::uint64_t oldest = m_oldestSnapshot.load(std::memory_order_relaxed);
+    Versioned<V> *keep = head;
+    while (keep->m_seq > oldest && keep->m_older.load(std::memory_order_relaxed))
+        keep = keep->m_older.load(std::memory_order_relaxed);
+
+    if (Versioned<V> *cut = keep->m_older.exchange(nullptr, std::memory_order_acq_rel)) {
+        for (Versioned<V> *version = cut; version;
+             version = version->m_older.load(std::memory_order_relaxed))
+            shard.m_oldVersions--;
+        m_reclaim(cut, [](void *version) { delete static_cast<Versioned<V> *>(version); });
+    }
+
+    // a tombstone nothing is left under is no different from no key at all
+    if (head->m_deleted && !head->m_older.load(std::memory_order_relaxed)) {
+        table.erase(key, hash);
+        shard.m_erased++;
+        forgetKey(shard, key, hash);
+        return false;
+    }
+
+    return nullptr != head->m_older.load(std::memory_order_relaxed);
+}
+
+// Returns true if a tombstone now covers the key, which is only needed while a snapshot
+// may see what it held, a cold key's value is brought in under it like for a write
+template <typename V>
+bool MemoryKeyValueStore::Impl::remove(Shard &shard, ConcurrentTable<Versioned<V>> &table,
+                                       const std::string &key, std::size_t hash,
+                                       std::uint64_t seq)
+{
+    Versioned<V> *current = table.find(key, hash);
+    if (noSnapshot == m_oldestSnapshot.load(std::memory_order_relaxed)) {
+        if (!current)
+            return false;
+
+        for (Versioned<V> *version = current->m_older.load(std::memory_order_relaxed); version;
+             version = version->m_older.load(std::memory_order_relaxed))
+            shard.m_oldVersions--;
+        table.erase(key, hash);
+        shard.m_erased++;
+        return false;
+    }
+
+    if (current && current->m_deleted)
+        return true;
+
+    if (!current) {
+        V cold;
+        if (!loadCold(key, cold))
+            return false;
+        current = new Versioned<V>(std::move(cold), 0, nullptr);
+        table.put(key, hash, current);
+    }
+
+    push(shard, table, key, hash, current, V(), seq, true);
+
+    return true;
+}
+
+bool MemoryKeyValueStore::Impl::loadCold(const std::string &key, std::string &value)
+{
+    if (!m_persistentStore)
+        return false;
+
+    value = m_persistentStore->get()->getKeyValue(key);
+
+    return !value.empty();
+}
+
+bool MemoryKeyValueStore::Impl::loadCold(const std::string &key, ValueSet &value)
+{
+    if (!m_persistentStore)
+        return false;
+
+    value = std::move(*m_persistentStore->get()->getKeyValueSet(key));
+
+    return !value.empty();
+}
+
+template <typename F>
+bool MemoryKeyValueStore::Impl::writeCold(Shard &shard, const std::string &key, F write)
+{
+    if (!m_persistentStore || noSnapshot != m_oldestSnapshot.load(std::memory_order_relaxed))
+        return false;
+
+    bool known;
+    {
+        EpochGuard guard;
+        known = m_orderedKeys.load(std::memory_order_acquire)->contains(key);
+    }
+    if (!known)
+        indexKey(key);
+
+    shard.m_erased++;
+    write(*m_persistentStore->get());
+
+    return true;
+}
+
+// With every shard locked no write is half done, so the snapshot sees whole writes only
+std::uint64_t MemoryKeyValueStore::Impl::pin()
+{
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    for (auto &shard : m_shards)
+        locks.push_back(writeLock(*shard));
+
+    std::lock_guard<std::mutex> lock(m_snapshotLock);
+    const std::uint64_t seq = m_sequence.load(std::memory_order_relaxed);
+    m_snapshots.insert(seq);
+    m_oldestSnapshot.store(*m_snapshots.begin(), std::memory_order_relaxed);
+
+    return seq;
+}
+
+// Versions only the oldest snapshot saw are freed when it goes, not on the next write
+// of their keys, which may never come
+void MemoryKeyValueStore::Impl::unpin(std::uint64_t seq)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_snapshotLock);
+        m_snapshots.erase(m_snapshots.find(seq));
+        const std::uint64_t oldest = m_snapshots.empty() ? noSnapshot : *m_snapshots.begin();
+        if (oldest == m_oldestSnapshot.exchange(oldest, std::memory_order_relaxed))
+            return;
+    }
+
+    for (auto &shard : m_shards) {
+        auto lock = writeLock(*shard);
+        for (auto it = shard->m_history.begin(); it != shard->m_history.end(); ) {
+            const std::size_t hash = m_hash(*it);
+            bool strings = prune(*shard, shard->m_keyValueStore, *it, hash);
+            bool sets = prune(*shard, shard->m_listStore, *it, hash);
+            it = strings || sets ? std::next(it) : shard->m_history.erase(it);
+        }
+    }
+}
+
+// Returns false if the key is not in memory at all
+template <typename V>
+bool MemoryKeyValueStore::Impl::findAt(ConcurrentTable<Versioned<V>> &table,
+                                       const std::string &key, std::size_t hash,
+                                       std::uint64_t seq, V &value)
+{
+    const Versioned<V> *current = table.find(key, hash);
+    if (!current)
+        return false;
+
+    if (const Versioned<V> *version = current->at(seq))
+        value = version->m_value;
+
+    return true;
+}
+
+// A key still cold on disk has not been written since the snapshot, or its old value
+// would have been brought into memory, so the persistent store has what the snapshot saw
+std::string MemoryKeyValueStore::Impl::getAt(const std::string &key, std::uint64_t seq)
+{
+    std::size_t hash = m_hash(key);
+    auto &shard = shardFor(hash);
+    std::string value;
+    {
+        ReadGuard guard(*this, shard);
+        if (findAt(shard.m_keyValueStore, key, hash, seq, value))
+            return value;
+    }
+
+    if (!m_persistentStore)
+        return value;
+
+    auto lock = readLock(shard);
+    if (findAt(shard.m_keyValueStore, key, hash, seq, value))
+        return value;
+
+    return m_persistentStore->get()->getKeyValue(key);
+}
+
+std::unique_ptr<MemoryKeyValueStore::Impl::ValueSet>
+MemoryKeyValueStore::Impl::getSetAt(const std::string &key, std::uint64_t seq)
+{
+    std::size_t hash = m_hash(key);
+    auto &shard = shardFor(hash);
+    auto value = std::make_unique<ValueSet>();
+    {
+        ReadGuard guard(*this, shard);
+        if (findAt(shard.m_listStore, key, hash, seq, *value))
+            return value;
+    }
+
+    if (!m_persistentStore)
+        return value;
+
+    auto lock = readLock(shard);
+    if (findAt(shard.m_listStore, key, hash, seq, *value))
+        return value;
+
+    return m_persistentStore->get()->getKeyValueSet(key);
+}
+
+// A key in neither table is cold on disk if it is in the ordered index,
+// and was deleted before the snapshot if it is only among the deleted keys
+bool MemoryKeyValueStore::Impl::visibleAt(const std::string &key, std::uint64_t seq, bool indexed)
+{
+    std::size_t hash = m_hash(key);
+    auto &shard = shardFor(hash);
+    ReadGuard guard(*this, shard);
+
+    const Versioned<std::string> *value = shard.m_keyValueStore.find(key, hash);
+    const Versioned<ValueSet> *members = shard.m_listStore.find(key, hash);
+    if (!value && !members)
+        return indexed;
+
+    value = value ? value->at(seq) : nullptr;
+    if (value && !value->m_deleted)
+        return true;
+
+    members = members ? members->at(seq) : nullptr;
+
+    return members && !members->m_value.empty();
+}
+
+std::vector<std::string>
+MemoryKeyValueStore::Impl::deletedIn(const std::string &from, const std::string &to, bool reverse)
+{
+    auto lock = orderedLock();
+    auto first = from.empty() ? m_deletedKeys.begin() : m_deletedKeys.lower_bound(from);
+    auto last = to.empty() ? m_deletedKeys.end() : m_deletedKeys.lower_bound(to);
+    std::vector<std::string> keys(first, last);
+    if (reverse)
+        std::reverse(keys.begin(), keys.end());
+
+    return keys;
 }
 
 MemoryKeyValueStore::MemoryKeyValueStore()
-    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>())
+    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>(Concurrency::NONE, 1))
 {
 
 }
 
 MemoryKeyValueStore::MemoryKeyValueStore(std::unique_ptr<KeyValueStore> &toCache)
-    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>(toCache))
+    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>(toCache, Concurrency::NONE, 1))
+{
+
+}
+
+MemoryKeyValueStore::MemoryKeyValueStore(Concurrency concurrency, std::size_t shards)
+    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>(concurrency, shards))
+{
+
+}
+
+MemoryKeyValueStore::MemoryKeyValueStore(std::unique_ptr<KeyValueStore> &toCache,
+                                         Concurrency concurrency, std::size_t shards)
+    : m_impl(std::make_unique<MemoryKeyValueStore::Impl>(toCache, concurrency, shards))
 {
 
 }
@@ -49,69 +943,491 @@ MemoryKeyValueStore::~MemoryKeyValueStore()
 // Management methods
 void MemoryKeyValueStore::loadKeysInto(std::function<void(std::string key, std::string vlaue)> cb)
 {
-    for (auto &it: m_impl->m_keyValueStore)
-        cb(it.first, it.second);
+    for (auto &shard : m_impl->m_shards) {
+        Impl::ReadGuard guard(*m_impl, *shard);
+        shard->m_keyValueStore.forEach([&cb](const std::string &key,
+                                             const Versioned<std::string> &value) {
+            cb(key, value.m_value);
+        });
+    }
 }
 
+// Versions are not kept across a clear, snapshots taken before see the cleared store
 void MemoryKeyValueStore::clear()
 {
-    m_impl->m_keyValueStore.clear();
+    for (auto &shard : m_impl->m_shards) {
+        auto lock = m_impl->writeLock(*shard);
+        shard->m_keyValueStore.clear();
+        shard->m_listStore.clear();
+        shard->m_history.clear();
+        shard->m_oldVersions = 0;
+        shard->m_erased++;
+    }
+
+    // scans may still walk the old list, it is freed once they are all gone
+    {
+        auto lock = m_impl->orderedLock();
+        m_impl->m_deletedKeys.clear();
+        Impl::OrderedKeys *old = m_impl->m_orderedKeys.exchange(
+                    new Impl::OrderedKeys(Concurrency::NONE != m_impl->m_concurrency),
+                                                                std::memory_order_acq_rel);
+        Epoch::retire(old);
+    }
 
     if (m_impl->m_persistentStore)
         m_impl->m_persistentStore->get()->clear();
 }
 
-// Set or get methods
+// Set or get methods, writes hold the shard lock across the persistent store too,
+// so memory and disk agree on the order of writes to the same key
 void MemoryKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
 {
-    m_impl->m_keyValueStore[key] = value;
+    CELEBI_TRACE_SPAN(span, "memory.set", key, TraceSpan::bytesOf(value));
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    if (m_impl->assign(shard, shard.m_keyValueStore, key, hash, value))
+        m_impl->indexKey(key);
 
     // also write persistent store, if persistent store is exist
-    if (m_impl->m_persistentStore)
+    if (m_impl->m_persistentStore) {
+        CELEBI_TRACE_SPAN(persist, "memory.persist", key, TraceSpan::bytesOf(value));
         m_impl->m_persistentStore->get()->setKeyValue(key, value);
+    }
 }
 
 void MemoryKeyValueStore::setKeyValue(const std::string &key,
                  const std::unordered_set<std::string> &value)
 {
-    m_impl->m_listStore[key] = value;
+    CELEBI_TRACE_SPAN(span, "memory.set", key, TraceSpan::bytesOf(value));
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
 
-    if (m_impl->m_persistentStore)
+    if (m_impl->assign(shard, shard.m_listStore, key, hash, value))
+        m_impl->indexKey(key);
+
+    if (m_impl->m_persistentStore) {
+        CELEBI_TRACE_SPAN(persist, "memory.persist", key, TraceSpan::bytesOf(value));
         m_impl->m_persistentStore->get()->setKeyValue(key, value);
+    }
 }
 
 void MemoryKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
 {
-     m_impl->m_listStore[key].insert(value);
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    Versioned<Impl::ValueSet> *current = shard.m_listStore.find(key, hash);
+    if (!current) {
+        // bring the rest of the set into memory first, not to shadow it with one member
+        Impl::ValueSet cold;
+        m_impl->loadCold(key, cold);
+        current = new Versioned<Impl::ValueSet>(std::move(cold), 0, nullptr);
+        shard.m_listStore.put(key, hash, current);
+        m_impl->indexKey(key);
+    } else if (current->m_deleted) {
+        m_impl->indexKey(key);
+    }
+
+    // members already in the set are not written again
+    if (current->m_value.find(value) != current->m_value.end())
+        return;
+
+    std::uint64_t seq = m_impl->m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (m_impl->inPlace(current)) {
+        current->m_value.insert(value);
+        current->m_seq = seq;
+    } else {
+        Impl::ValueSet copy(current->m_value);
+        copy.insert(value);
+        m_impl->push(shard, shard.m_listStore, key, hash, current, std::move(copy), seq);
+    }
 
     if (m_impl->m_persistentStore)
         m_impl->m_persistentStore->get()->appendKeyValue(key, value);
 }
 
+// A key which is not in memory is merged on disk alone, persistent stores may fold
+// the merge lazily and the cache learns the result the next time it reads the key
+void MemoryKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                        MergeOperator op)
+{
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    Versioned<std::string> *current = shard.m_keyValueStore.find(key, hash);
+    if (!current) {
+        if (m_impl->writeCold(shard, key, [&key, &operand, op](KeyValueStore &store) {
+            store.mergeKeyValue(key, operand, op);
+        }))
+            return;
+
+        // a snapshot must still see what the key held on disk
+        std::string cold;
+        if (m_impl->loadCold(key, cold)) {
+            current = new Versioned<std::string>(std::move(cold), 0, nullptr);
+            shard.m_keyValueStore.put(key, hash, current);
+        }
+    }
+
+    const bool added = !current || current->m_deleted;
+    std::string merged = applyMerge(op, added ? std::string() : current->m_value, operand);
+    std::uint64_t seq = m_impl->m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (current && m_impl->inPlace(current)) {
+        current->m_value = std::move(merged);
+        current->m_seq = seq;
+    } else {
+        m_impl->push(shard, shard.m_keyValueStore, key, hash, current, std::move(merged), seq);
+    }
+    if (added)
+        m_impl->indexKey(key);
+
+    if (m_impl->m_persistentStore)
+        m_impl->m_persistentStore->get()->mergeKeyValue(key, operand, op);
+}
+
+void MemoryKeyValueStore::mergeKeyValue(const std::string &key,
+                                        const std::unordered_set<std::string> &members)
+{
+    if (members.empty())
+        return;
+
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    Versioned<Impl::ValueSet> *current = shard.m_listStore.find(key, hash);
+    if (!current) {
+        if (m_impl->writeCold(shard, key, [&key, &members](KeyValueStore &store) {
+            store.mergeKeyValue(key, members);
+        }))
+            return;
+
+        Impl::ValueSet cold;
+        m_impl->loadCold(key, cold);
+        current = new Versioned<Impl::ValueSet>(std::move(cold), 0, nullptr);
+        shard.m_listStore.put(key, hash, current);
+        m_impl->indexKey(key);
+    } else if (current->m_deleted) {
+        m_impl->indexKey(key);
+    }
+
+    Impl::ValueSet added;
+    for (auto &member : members)
+        if (current->m_value.find(member) == current->m_value.end())
+            added.insert(member);
+    if (added.empty())
+        return;
+
+    std::uint64_t seq = m_impl->m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (m_impl->inPlace(current)) {
+        current->m_value.insert(added.begin(), added.end());
+        current->m_seq = seq;
+    } else {
+        Impl::ValueSet copy(current->m_value);
+        copy.insert(added.begin(), added.end());
+        m_impl->push(shard, shard.m_listStore, key, hash, current, std::move(copy), seq);
+    }
+
+    if (m_impl->m_persistentStore)
+        m_impl->m_persistentStore->get()->mergeKeyValue(key, added);
+}
+
+// The shard lock makes the compare and the write one step, a cold value is read under it
+bool MemoryKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                                const std::string &value)
+{
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    std::string current;
+    if (const Versioned<std::string> *cached = shard.m_keyValueStore.find(key, hash))
+        current = cached->m_value;
+    else
+        m_impl->loadCold(key, current);
+    if (current != expected)
+        return false;
+
+    if (m_impl->assign(shard, shard.m_keyValueStore, key, hash, value))
+        m_impl->indexKey(key);
+
+    if (m_impl->m_persistentStore)
+        m_impl->m_persistentStore->get()->setKeyValue(key, value);
+
+    return true;
+}
+
+// A deleted key leaves memory and the ordered index at once, unless a snapshot
+// may still see it, then a tombstone covers its versions until no snapshot does
+void MemoryKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    std::uint64_t seq = m_impl->m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    bool strings = m_impl->remove(shard, shard.m_keyValueStore, key, hash, seq);
+    bool sets = m_impl->remove(shard, shard.m_listStore, key, hash, seq);
+    m_impl->unindexKey(key, strings || sets);
+
+    if (m_impl->m_persistentStore)
+        m_impl->m_persistentStore->get()->deleteKeyValue(key);
+}
+
+void MemoryKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    auto lock = m_impl->writeLock(shard);
+
+    Versioned<Impl::ValueSet> *current = shard.m_listStore.find(key, hash);
+    if (!current && Impl::noSnapshot == m_impl->m_oldestSnapshot.load(std::memory_order_relaxed)) {
+        // a set which is not in memory needs no loading to lose a member
+        if (m_impl->m_persistentStore) {
+            shard.m_erased++;
+            m_impl->m_persistentStore->get()->removeKeyValue(key, value);
+        }
+        return;
+    }
+
+    if (!current) {
+        Impl::ValueSet cold;
+        if (!m_impl->loadCold(key, cold))
+            return;
+        current = new Versioned<Impl::ValueSet>(std::move(cold), 0, nullptr);
+        shard.m_listStore.put(key, hash, current);
+    }
+
+    if (current->m_value.find(value) == current->m_value.end())
+        return;
+
+    std::uint64_t seq = m_impl->m_sequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (m_impl->inPlace(current)) {
+        current->m_value.erase(value);
+        current->m_seq = seq;
+    } else {
+        Impl::ValueSet copy(current->m_value);
+        copy.erase(value);
+        m_impl->push(shard, shard.m_listStore, key, hash, current, std::move(copy), seq);
+    }
+
+    if (m_impl->m_persistentStore)
+        m_impl->m_persistentStore->get()->removeKeyValue(key, value);
+}
+
 std::string MemoryKeyValueStore::getKeyValue(const std::string &key)
 {
-    const auto &it = m_impl->m_keyValueStore.find(key);
-    if (it != m_impl->m_keyValueStore.end())
-        return it->second;
+    CELEBI_TRACE_SPAN(span, "memory.get", key);
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    {
+        CELEBI_TRACE_SPAN(lookup, "memory.lookup", key);
+        Impl::ReadGuard guard(*m_impl, shard);
+        if (const Versioned<std::string> *value = shard.m_keyValueStore.find(key, hash)) {
+            CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(value->m_value));
+            return value->m_value;
+        }
+    }
+
+    if (!m_impl->m_persistentStore)
+        return "";
 
-    return "";
+    // try underlying store, writers are kept out so the value is not torn
+    std::string value;
+    std::uint64_t erased;
+    {
+        CELEBI_TRACE_SPAN(fallback, "memory.fallback", key);
+        auto lock = m_impl->readLock(shard);
+        if (const Versioned<std::string> *cached = shard.m_keyValueStore.find(key, hash))
+            return cached->m_value;
+
+        erased = shard.m_erased;
+        value = m_impl->m_persistentStore->get()->getKeyValue(key);
+    }
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(value));
+
+    // keep the value in memory for next time, unless a writer got in first
+    // or a delete took it away meanwhile
+    if (!value.empty()) {
+        CELEBI_TRACE_SPAN(fill, "memory.fill", key, TraceSpan::bytesOf(value));
+        auto lock = m_impl->writeLock(shard);
+        if (erased == shard.m_erased)
+            shard.m_keyValueStore.emplace(key, hash, new Versioned<std::string>(value, 0, nullptr));
+    }
+
+    return value;
 }
 
 
 std::unique_ptr<std::unordered_set<std::string>>
 MemoryKeyValueStore::getKeyValueSet(const std::string &key)
 {
-    const auto &it = m_impl->m_listStore.find(key);
-    if (it == m_impl->m_listStore.end()) {
-        // try underlying store first
-        if (m_impl->m_persistentStore) {
-            return m_impl->m_persistentStore->get()->getKeyValueSet(key);
+    CELEBI_TRACE_SPAN(span, "memory.get_set", key);
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    {
+        CELEBI_TRACE_SPAN(lookup, "memory.lookup", key);
+        Impl::ReadGuard guard(*m_impl, shard);
+        if (const Versioned<Impl::ValueSet> *value = shard.m_listStore.find(key, hash)) {
+            CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(value->m_value));
+            return std::make_unique<Impl::ValueSet>(value->m_value);
+        }
+    }
+
+    // try underlying store first
+    if (!m_impl->m_persistentStore)
+        return std::make_unique<Impl::ValueSet>();
+
+    std::unique_ptr<Impl::ValueSet> value;
+    std::uint64_t erased;
+    {
+        CELEBI_TRACE_SPAN(fallback, "memory.fallback", key);
+        auto lock = m_impl->readLock(shard);
+        if (const Versioned<Impl::ValueSet> *cached = shard.m_listStore.find(key, hash))
+            return std::make_unique<Impl::ValueSet>(cached->m_value);
+
+        erased = shard.m_erased;
+        value = m_impl->m_persistentStore->get()->getKeyValueSet(key);
+    }
+    CELEBI_TRACE_BYTES(span, TraceSpan::bytesOf(*value));
+
+    if (!value->empty()) {
+        CELEBI_TRACE_SPAN(fill, "memory.fill", key, TraceSpan::bytesOf(*value));
+        auto lock = m_impl->writeLock(shard);
+        if (erased == shard.m_erased)
+            shard.m_listStore.emplace(key, hash, new Versioned<Impl::ValueSet>(*value, 0, nullptr));
+    }
+
+    return value;
+}
+
+bool MemoryKeyValueStore::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    CELEBI_TRACE_SPAN(span, "memory.try_get", key);
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    Impl::ReadGuard guard(*m_impl, shard);
+
+    if (const Versioned<std::string> *current = shard.m_keyValueStore.find(key, hash)) {
+        value = current->m_value;
+        return true;
+    }
+
+    // a miss is only final when there is no underlying store to look into
+    if (m_impl->m_persistentStore)
+        return false;
+
+    value.clear();
+
+    return true;
+}
+
+bool MemoryKeyValueStore::tryGetKeyValueSet(const std::string &key,
+                                            std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    std::size_t hash = m_impl->hashOf(key);
+    auto &shard = m_impl->shardFor(hash);
+    Impl::ReadGuard guard(*m_impl, shard);
+
+    if (const Versioned<Impl::ValueSet> *current = shard.m_listStore.find(key, hash)) {
+        value = std::make_unique<Impl::ValueSet>(current->m_value);
+        return true;
+    }
+
+    if (m_impl->m_persistentStore)
+        return false;
+
+    value = std::make_unique<Impl::ValueSet>();
+
+    return true;
+}
+
+// Scans walk the ordered index without any lock, so writers are never held up
+void MemoryKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                   std::function<bool(const std::string &key)> cb)
+{
+    EpochGuard guard;
+    m_impl->m_orderedKeys.load(std::memory_order_acquire)->scan(from, to, reverse, cb);
+}
+
+// Taking a snapshot copies nothing, it only keeps writers from freeing what it sees
+std::unique_ptr<KeyValueSnapshot> MemoryKeyValueStore::snapshot()
+{
+    return std::make_unique<Impl::Snapshot>(*m_impl);
+}
+
+std::size_t MemoryKeyValueStore::oldVersions() const
+{
+    std::size_t versions = 0;
+    for (auto &shard : m_impl->m_shards) {
+        auto lock = m_impl->readLock(*shard);
+        versions += shard->m_oldVersions;
+    }
+
+    return versions;
+}
+
+// Shards are walked one at a time, so writes to other shards may land in between
+MemoryUsage MemoryKeyValueStore::memoryUsage() const
+{
+    MemoryUsage usage;
+    usage.block(sizeof(Impl));
+    usage.block(m_impl->m_shards.capacity() * sizeof(std::unique_ptr<Impl::Shard>));
+
+    auto versions = [&usage](const auto &value) { versionsUsage(value, usage); };
+    for (auto &shard : m_impl->m_shards) {
+        auto lock = m_impl->readLock(*shard);
+        usage.block(sizeof(Impl::Shard));
+        shard->m_keyValueStore.memoryUsage(usage, versions);
+        shard->m_listStore.memoryUsage(usage, versions);
+        usage.set(shard->m_history, &MemoryUsage::m_overhead);
+    }
+
+    {
+        auto lock = m_impl->orderedLock();
+        usage.m_overhead += m_impl->m_orderedKeys.load(std::memory_order_acquire)->memoryUsage();
+        // a tree node is its colour and three links before the value
+        for (auto &key : m_impl->m_deletedKeys) {
+            usage.block(4 * sizeof(void *) + sizeof(std::string));
+            usage.string(key, &MemoryUsage::m_overhead);
         }
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_impl->m_snapshotLock);
+        for (std::size_t i = 0; i < m_impl->m_snapshots.size(); i++)
+            usage.block(4 * sizeof(void *) + sizeof(std::uint64_t));
+    }
 
-        return std::make_unique<std::unordered_set<std::string>>();
-     }
+    if (m_impl->m_persistentStore)
+        usage += (*m_impl->m_persistentStore)->memoryUsage();
+
+    return usage;
+}
+
+// The key's node and versions in either table, the ordered index shares its bytes
+// with other keys and is left out
+MemoryUsage MemoryKeyValueStore::memoryUsage(const std::string &key) const
+{
+    MemoryUsage usage;
+    const std::size_t hash = m_impl->hashOf(key);
+    Impl::Shard &shard = m_impl->shardFor(hash);
+
+    auto versions = [&usage](const auto &value) { versionsUsage(value, usage); };
+    {
+        auto lock = m_impl->readLock(shard);
+        shard.m_keyValueStore.memoryUsage(key, hash, usage, versions);
+        shard.m_listStore.memoryUsage(key, hash, usage, versions);
+    }
+
+    if (m_impl->m_persistentStore)
+        usage += (*m_impl->m_persistentStore)->memoryUsage(key);
 
-     return std::make_unique<std::unordered_set<std::string>>(it->second);
+    return usage;
 }
 
 }
@@ -0,0 +1,34 @@
+#include "extensions/extdatabase.h"
+
+#include <charconv>
+
+namespace celebiext {
+
+namespace {
+
+std::int64_t toInteger(const std::string &value)
+{
+    std::int64_t number = 0;
+    const char *end = value.data() + value.size();
+    auto result = std::from_chars(value.data(), end, number);
+    if (std::errc() != result.ec || result.ptr != end)
+        return 0;
+
+    return number;
+}
+
+}
+
+// Counters wrap around instead of failing, a merge can't be refused once it is written
+std::string applyMerge(MergeOperator op, const std::string &value, const std::string &operand)
+{
+    if (MergeOperator::APPEND == op)
+        return value + operand;
+
+    const std::uint64_t sum = static_cast<std::uint64_t>(toInteger(value)) +
+                              static_cast<std::uint64_t>(toInteger(operand));
+
+    return std::to_string(static_cast<std::int64_t>(sum));
+}
+
+}
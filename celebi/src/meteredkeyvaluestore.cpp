@@ -0,0 +1,208 @@
+#include "extensions/extdatabase.h"
+#include "extensions/metrics.h"
+
+#include <optional>
+
+namespace celebiext {
+
+class MeteredKeyValueStore::Impl {
+public:
+    Impl(std::unique_ptr<KeyValueStore> &store, Metrics &metrics, const std::string &layer);
+    ~Impl();
+
+    std::optional<std::size_t> collectFilterStats();
+
+    std::unique_ptr<KeyValueStore> m_store;
+    Metrics &m_metrics;
+    std::string m_layer;
+    LatencyRecorder &m_get;
+    LatencyRecorder &m_tryGet;
+    LatencyRecorder &m_set;
+    LatencyRecorder &m_merge;
+    LatencyRecorder &m_conditional;
+    LatencyRecorder &m_delete;
+    LatencyRecorder &m_scan;
+    std::atomic<std::uint64_t> &m_tryGetMisses;
+    std::optional<std::size_t> m_collector;
+};
+
+MeteredKeyValueStore::Impl::Impl(std::unique_ptr<KeyValueStore> &store, Metrics &metrics,
+                                 const std::string &layer)
+    : m_store(store.release()), m_metrics(metrics), m_layer(layer),
+      m_get(metrics.latency(layer, "get")),
+      m_tryGet(metrics.latency(layer, "try_get")),
+      m_set(metrics.latency(layer, "set")),
+      m_merge(metrics.latency(layer, "merge")),
+      m_conditional(metrics.latency(layer, "conditional")),
+      m_delete(metrics.latency(layer, "delete")),
+      m_scan(metrics.latency(layer, "scan")),
+      m_tryGetMisses(metrics.counter(layer, "try_get_misses")),
+      m_collector(collectFilterStats())
+{
+
+}
+
+MeteredKeyValueStore::Impl::~Impl()
+{
+    if (m_collector)
+        m_metrics.uncollect(*m_collector);
+}
+
+// Stores with bloom filters count what the filters saved, read whenever stats are taken
+std::optional<std::size_t> MeteredKeyValueStore::Impl::collectFilterStats()
+{
+    std::function<FilterStats()> filterStats;
+    if (auto *fileStore = dynamic_cast<FileKeyValueStore *>(m_store.get()))
+        filterStats = [fileStore]() { return fileStore->filterStats(); };
+    else if (auto *lsmStore = dynamic_cast<LsmKeyValueStore *>(m_store.get()))
+        filterStats = [lsmStore]() { return lsmStore->filterStats(); };
+    else
+        return std::nullopt;
+
+    return m_metrics.collect([layer = m_layer, filterStats](Stats &stats) {
+        FilterStats filters = filterStats();
+        stats.m_counters[{ layer, "filter_negatives" }] = filters.m_negatives;
+        stats.m_counters[{ layer, "filter_false_positives" }] = filters.m_falsePositives;
+    });
+}
+
+MeteredKeyValueStore::MeteredKeyValueStore(std::unique_ptr<KeyValueStore> &toMeter,
+                                           Metrics &metrics, const std::string &layer)
+    : m_impl(std::make_unique<Impl>(toMeter, metrics, layer))
+{
+
+}
+
+MeteredKeyValueStore::~MeteredKeyValueStore()
+{
+
+}
+
+void MeteredKeyValueStore::loadKeysInto(std::function<void(std::string key, std::string value)> callback)
+{
+    m_impl->m_store->loadKeysInto(callback);
+}
+
+void MeteredKeyValueStore::clear()
+{
+    m_impl->m_store->clear();
+}
+
+void MeteredKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
+{
+    ScopedLatency timer(m_impl->m_set);
+    m_impl->m_store->setKeyValue(key, value);
+}
+
+void MeteredKeyValueStore::setKeyValue(const std::string &key,
+                                       const std::unordered_set<std::string> &value)
+{
+    ScopedLatency timer(m_impl->m_set);
+    m_impl->m_store->setKeyValue(key, value);
+}
+
+void MeteredKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
+{
+    ScopedLatency timer(m_impl->m_merge);
+    m_impl->m_store->appendKeyValue(key, value);
+}
+
+void MeteredKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                         MergeOperator op)
+{
+    ScopedLatency timer(m_impl->m_merge);
+    m_impl->m_store->mergeKeyValue(key, operand, op);
+}
+
+void MeteredKeyValueStore::mergeKeyValue(const std::string &key,
+                                         const std::unordered_set<std::string> &members)
+{
+    ScopedLatency timer(m_impl->m_merge);
+    m_impl->m_store->mergeKeyValue(key, members);
+}
+
+bool MeteredKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                                 const std::string &value)
+{
+    ScopedLatency timer(m_impl->m_conditional);
+
+    return m_impl->m_store->compareAndSetKeyValue(key, expected, value);
+}
+
+void MeteredKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    ScopedLatency timer(m_impl->m_delete);
+    m_impl->m_store->deleteKeyValue(key);
+}
+
+void MeteredKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    ScopedLatency timer(m_impl->m_delete);
+    m_impl->m_store->removeKeyValue(key, value);
+}
+
+std::string MeteredKeyValueStore::getKeyValue(const std::string &key)
+{
+    ScopedLatency timer(m_impl->m_get);
+
+    return m_impl->m_store->getKeyValue(key);
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+MeteredKeyValueStore::getKeyValueSet(const std::string &key)
+{
+    ScopedLatency timer(m_impl->m_get);
+
+    return m_impl->m_store->getKeyValueSet(key);
+}
+
+bool MeteredKeyValueStore::tryGetKeyValue(const std::string &key, std::string &value)
+{
+    ScopedLatency timer(m_impl->m_tryGet);
+    if (m_impl->m_store->tryGetKeyValue(key, value))
+        return true;
+
+    m_impl->m_tryGetMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool MeteredKeyValueStore::tryGetKeyValueSet(const std::string &key,
+                                             std::unique_ptr<std::unordered_set<std::string>> &value)
+{
+    ScopedLatency timer(m_impl->m_tryGet);
+    if (m_impl->m_store->tryGetKeyValueSet(key, value))
+        return true;
+
+    m_impl->m_tryGetMisses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+// The scan is timed with its callbacks, which are the caller's time as much as the store's
+void MeteredKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                    std::function<bool(const std::string &key)> cb)
+{
+    ScopedLatency timer(m_impl->m_scan);
+    m_impl->m_store->scanKeys(from, to, reverse, cb);
+}
+
+std::unique_ptr<KeyValueSnapshot> MeteredKeyValueStore::snapshot()
+{
+    return m_impl->m_store->snapshot();
+}
+
+MemoryUsage MeteredKeyValueStore::memoryUsage() const
+{
+    return m_impl->m_store->memoryUsage();
+}
+
+MemoryUsage MeteredKeyValueStore::memoryUsage(const std::string &key) const
+{
+    return m_impl->m_store->memoryUsage(key);
+}
+
+KeyValueStore &MeteredKeyValueStore::metered()
+{
+    return *m_impl->m_store;
+}
+
+}
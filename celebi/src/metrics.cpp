@@ -0,0 +1,210 @@
+#include "extensions/metrics.h"
+
+#include <algorithm>
+
+using namespace celebiext;
+
+LatencyRecorder::LatencyRecorder(const std::atomic<bool> &enabled, const Stats::Series &series)
+    : m_enabled(enabled), m_series(series), m_stripes()
+{
+
+}
+
+// Threads take stripes in turn as they first record, so a few threads never share one
+std::size_t LatencyRecorder::stripeOfThread()
+{
+    static std::atomic<std::size_t> threads{0};
+    thread_local const std::size_t stripe = threads.fetch_add(1, std::memory_order_relaxed) % stripes;
+
+    return stripe;
+}
+
+// Stripes are read while threads record, so the counts may be a few records apart
+Histogram LatencyRecorder::histogram() const
+{
+    Histogram histogram;
+    for (const Stripe &stripe : m_stripes) {
+        for (std::size_t bucket = 0; bucket < Histogram::buckets; bucket++) {
+            const std::uint64_t count = stripe.m_counts[bucket].load(std::memory_order_relaxed);
+            histogram.m_counts[bucket] += count;
+            histogram.m_count += count;
+        }
+        histogram.m_sum += stripe.m_sum.load(std::memory_order_relaxed);
+    }
+
+    return histogram;
+}
+
+Metrics::Metrics()
+    : m_enabled(false), m_nextCollector(0)
+{
+
+}
+
+LatencyRecorder &Metrics::latency(const std::string &layer, const std::string &operation)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto recorder = m_latencies.try_emplace({ layer, operation }).first;
+    if (!recorder->second)
+        recorder->second = std::make_unique<LatencyRecorder>(m_enabled, recorder->first);
+
+    return *recorder->second;
+}
+
+std::atomic<std::uint64_t> &Metrics::counter(const std::string &layer, const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    auto &counter = m_counters[{ layer, name }];
+    if (!counter)
+        counter = std::make_unique<std::atomic<std::uint64_t>>(0);
+
+    return *counter;
+}
+
+std::size_t Metrics::collect(std::function<void(Stats &stats)> collector)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_collectors.emplace(m_nextCollector, std::move(collector));
+
+    return m_nextCollector++;
+}
+
+void Metrics::uncollect(std::size_t collector)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_collectors.erase(collector);
+}
+
+void Metrics::enable(bool enabled)
+{
+    m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+// Recorders nothing went through yet are left out
+Stats Metrics::stats() const
+{
+    Stats stats;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (auto &recorder : m_latencies) {
+        Histogram histogram = recorder.second->histogram();
+        if (0 != histogram.m_count)
+            stats.m_latencies.emplace(recorder.first, histogram);
+    }
+    for (auto &counter : m_counters)
+        stats.m_counters.emplace(counter.first, counter.second->load(std::memory_order_relaxed));
+    for (auto &collector : m_collectors)
+        collector.second(stats);
+
+    return stats;
+}
+
+// More layers than there is room for are left out, a database has a handful
+void LayerTimes::add(const std::string &layer, std::uint64_t nanos)
+{
+    for (std::size_t i = 0; i < m_count; i++) {
+        if (*m_layers[i] == layer) {
+            m_nanos[i] += nanos;
+            return;
+        }
+    }
+
+    if (m_count == maxLayers)
+        return;
+
+    m_layers[m_count] = &layer;
+    m_nanos[m_count++] = nanos;
+}
+
+SlowLog::SlowLog()
+    : m_threshold(0), m_capacity(0)
+{
+
+}
+
+void SlowLog::configure(std::chrono::nanoseconds threshold, std::size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_capacity = capacity;
+    while (m_operations.size() > m_capacity)
+        m_operations.pop_front();
+    m_threshold.store(std::max<std::int64_t>(threshold.count(), 0), std::memory_order_relaxed);
+}
+
+void SlowLog::record(SlowOperation operation)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (0 == m_capacity)
+        return;
+
+    if (m_operations.size() == m_capacity)
+        m_operations.pop_front();
+    m_operations.push_back(std::move(operation));
+}
+
+std::vector<SlowOperation> SlowLog::operations() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+
+    return std::vector<SlowOperation>(m_operations.begin(), m_operations.end());
+}
+
+TimedCall::TimedCall(LatencyRecorder &recorder, SlowLog &slowLog, const std::string &key,
+                     const std::string *bucket)
+    : m_recorder(recorder),
+      m_slowLog(slowLog.enabled() && !LayerTimes::current() ? &slowLog : nullptr),
+      m_key(key), m_bucket(bucket), m_valueSize(0),
+      m_timed(m_slowLog || recorder.enabled())
+{
+    if (!m_timed)
+        return;
+
+    if (m_slowLog)
+        LayerTimes::current() = &m_layers;
+    m_start = std::chrono::steady_clock::now();
+}
+
+TimedCall::~TimedCall()
+{
+    if (!m_timed)
+        return;
+
+    const std::uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+    if (m_recorder.enabled())
+        m_recorder.record(nanos);
+    if (!m_slowLog)
+        return;
+
+    LayerTimes::current() = nullptr;
+    if (nanos < m_slowLog->threshold())
+        return;
+
+    SlowOperation operation;
+    operation.m_operation = m_recorder.series().second;
+    operation.m_key = m_key.substr(0, SlowOperation::maxKeySize);
+    operation.m_keySize = m_key.size();
+    operation.m_valueSize = m_valueSize;
+    if (m_bucket)
+        operation.m_bucket = *m_bucket;
+    operation.m_duration = std::chrono::nanoseconds(nanos);
+    operation.m_time = std::chrono::system_clock::now();
+    for (std::size_t i = 0; i < m_layers.m_count; i++)
+        operation.m_layers.emplace(*m_layers.m_layers[i], std::chrono::nanoseconds(m_layers.m_nanos[i]));
+
+    try {
+        m_slowLog->record(std::move(operation));
+    } catch (const std::exception &) {
+        // the call itself went fine, losing its log entry is no reason to fail it
+    }
+}
+
+void TimedCall::value(const std::unordered_set<std::string> &value)
+{
+    if (!m_slowLog)
+        return;
+
+    m_valueSize = 0;
+    for (auto &member : value)
+        m_valueSize += member.size();
+}
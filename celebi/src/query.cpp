@@ -1,6 +1,7 @@
 #include "query.h"
 #include "extensions/extquery.h"
 
+#include <algorithm>
 #include <string>
 
 using namespace celebi;
@@ -36,20 +37,138 @@ const std::string BucketQuery::bucket() const
     return m_impl->m_bucket;
 }
 
+class RangeQuery::Impl {
+public:
+    Impl(const std::string &from, const std::string &to, bool reverse, std::size_t limit);
+    ~Impl() = default;
+
+    std::string m_from;
+    std::string m_to;
+    bool m_reverse;
+    std::size_t m_limit;
+};
+
+RangeQuery::Impl::Impl(const std::string &from, const std::string &to,
+                       bool reverse, std::size_t limit)
+    : m_from(from), m_to(to), m_reverse(reverse), m_limit(limit)
+{
+
+}
+
+RangeQuery::RangeQuery(const std::string &from, const std::string &to,
+                       bool reverse, std::size_t limit)
+    : m_impl(std::make_unique<Impl>(from, to, reverse, limit))
+{
+
+}
+
+RangeQuery::~RangeQuery()
+{
+
+}
+
+const std::string RangeQuery::from() const
+{
+    return m_impl->m_from;
+}
+
+const std::string RangeQuery::to() const
+{
+    return m_impl->m_to;
+}
+
+bool RangeQuery::reverse() const
+{
+    return m_impl->m_reverse;
+}
+
+std::size_t RangeQuery::limit() const
+{
+    return m_impl->m_limit;
+}
+
+// The least key greater than every key with the prefix: drop trailing 0xff bytes
+// and bump the last one left, nothing is left when the prefix is all 0xff
+static std::string prefixSuccessor(std::string prefix)
+{
+    while (!prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xff)
+        prefix.pop_back();
+
+    if (!prefix.empty())
+        prefix.back() = static_cast<char>(static_cast<unsigned char>(prefix.back()) + 1);
+
+    return prefix;
+}
+
+PrefixQuery::PrefixQuery(const std::string &prefix, bool reverse, std::size_t limit)
+    : RangeQuery(prefix, prefixSuccessor(prefix), reverse, limit), m_prefix(prefix)
+{
+
+}
+
+PrefixQuery::~PrefixQuery()
+{
+
+}
+
+const std::string PrefixQuery::prefix() const
+{
+    return m_prefix;
+}
+
 DefaultQueryResult::DefaultQueryResult()
-    : m_recordKeys()
+    : m_recordKeys(), m_orderedRecordKeys()
 {
 
 }
 
 DefaultQueryResult::DefaultQueryResult(std::unique_ptr<std::unordered_set<std::string>> recordKeys)
-    : m_recordKeys(std::move(recordKeys))
+    : m_recordKeys(std::move(recordKeys)), m_orderedRecordKeys()
 {
 
 }
 
+DefaultQueryResult::DefaultQueryResult(std::unique_ptr<std::vector<std::string>> orderedRecordKeys)
+    : m_recordKeys(), m_orderedRecordKeys(std::move(orderedRecordKeys))
+{
+
+}
+
+// Results are handed out once, in whichever shape the caller asks for
 const std::unique_ptr<std::unordered_set<std::string>>
 DefaultQueryResult::recordKeys()
 {
+    if (!m_recordKeys && m_orderedRecordKeys) {
+        m_recordKeys = std::make_unique<std::unordered_set<std::string>>(
+                    m_orderedRecordKeys->begin(), m_orderedRecordKeys->end());
+        m_orderedRecordKeys.reset();
+    }
+
     return std::move(m_recordKeys);
 }
+
+const std::unique_ptr<std::vector<std::string>>
+DefaultQueryResult::orderedRecordKeys()
+{
+    if (!m_orderedRecordKeys && m_recordKeys) {
+        m_orderedRecordKeys = std::make_unique<std::vector<std::string>>(
+                    m_recordKeys->begin(), m_recordKeys->end());
+        std::sort(m_orderedRecordKeys->begin(), m_orderedRecordKeys->end());
+        m_recordKeys.reset();
+    }
+
+    return std::move(m_orderedRecordKeys);
+}
+
+// Sorted from the unordered keys, for results written before ordered ones existed
+const std::unique_ptr<std::vector<std::string>> IQueryResult::orderedRecordKeys()
+{
+    auto keys = recordKeys();
+    if (!keys)
+        return nullptr;
+
+    auto ordered = std::make_unique<std::vector<std::string>>(keys->begin(), keys->end());
+    std::sort(ordered->begin(), ordered->end());
+
+    return ordered;
+}
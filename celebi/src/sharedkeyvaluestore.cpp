@@ -0,0 +1,548 @@
+#include "extensions/extdatabase.h"
+#include "extensions/highwayhash.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace celebiext {
+
+namespace {
+
+/*
+ * The keydir is a file mapped into every process sharing the store. It is an open
+ * addressing table from key hash to version. Versions work as a seqlock: the writer
+ * makes a version odd before it touches the value and even again once it is done,
+ * readers retry until they read a value with the same even version on both sides.
+ */
+struct KeydirHeader {
+    std::uint64_t m_magic;
+    std::uint64_t m_capacity;                   // number of slots, power of two
+    std::atomic<std::uint64_t> m_count;
+    std::atomic<std::uint64_t> m_commits;
+    std::atomic<std::uint32_t> m_retired;       // a bigger keydir replaced this one
+};
+
+struct KeydirSlot {
+    std::atomic<std::uint64_t> m_hash;          // 0 for an empty slot
+    std::atomic<std::uint64_t> m_version;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+              "keydir atomics must be address-free to be shared between processes");
+
+const std::uint64_t keydirMagic = 0x726964794b626c63;  // "clbKydir"
+const std::uint64_t initialCapacity = 1 << 12;
+
+std::size_t keydirSize(std::uint64_t capacity)
+{
+    return sizeof(KeydirHeader) + capacity * sizeof(KeydirSlot);
+}
+
+/**
+ * @brief The CommitGuard class makes the versions of a commit even again when it
+ *        ends, also when storing the value throws
+ */
+class CommitGuard {
+public:
+    CommitGuard(KeydirHeader *header, std::vector<KeydirSlot *> &slots)
+        : m_header(header), m_slots(slots)
+    {
+        for (KeydirSlot *slot : m_slots)
+            slot->m_version.fetch_add(1, std::memory_order_seq_cst);
+    }
+
+    ~CommitGuard()
+    {
+        for (KeydirSlot *slot : m_slots)
+            slot->m_version.fetch_add(1, std::memory_order_release);
+        m_header->m_commits.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    KeydirHeader *m_header;
+    std::vector<KeydirSlot *> &m_slots;
+};
+
+/**
+ * @brief The FileDescriptor class closes a file unless it is released first, so a
+ *        throw between opening and keeping the file leaks nothing
+ */
+class FileDescriptor {
+public:
+    explicit FileDescriptor(int fd) : m_fd(fd) {}
+    ~FileDescriptor()
+    {
+        if (m_fd >= 0)
+            ::close(m_fd);
+    }
+
+    FileDescriptor(const FileDescriptor &) = delete;
+    FileDescriptor &operator=(const FileDescriptor &) = delete;
+
+    int get() const { return m_fd; }
+
+    int release()
+    {
+        int fd = m_fd;
+        m_fd = -1;
+        return fd;
+    }
+
+private:
+    int m_fd;
+};
+
+}
+
+class SharedKeyValueStore::Impl {
+public:
+    Impl(std::unique_ptr<KeyValueStore> &store, const std::string &keydirPath, bool writer);
+    ~Impl();
+
+    void map();
+    void unmap();
+    void grow();
+
+    std::uint64_t hashOf(const std::string &key, ValueType type) const;
+    KeydirSlot *find(std::uint64_t hash) const;
+    KeydirSlot *claim(std::uint64_t hash);
+
+    template <typename T>
+    T read(const std::string &key, ValueType type, std::function<T()> load);
+    void write(const std::string &key, std::initializer_list<ValueType> types,
+               std::function<void()> store);
+    void checkWriter() const;
+
+    std::unique_ptr<KeyValueStore> m_store;
+    const std::string m_path;
+    const bool m_writer;
+    int m_fd;
+    void *m_map;
+    std::size_t m_mapSize;
+    KeydirHeader *m_header;
+    KeydirSlot *m_slots;
+
+    HighwayHash m_hash;
+    std::mutex m_writeLock;         // threads of the writer process take turns
+    std::shared_mutex m_mapLock;    // keeps the mapping alive while a thread uses it
+};
+
+SharedKeyValueStore::Impl::Impl(std::unique_ptr<KeyValueStore> &store,
+                                const std::string &keydirPath, bool writer)
+    : m_store(store.release()), m_path(keydirPath), m_writer(writer), m_fd(-1),
+      m_map(nullptr), m_mapSize(0), m_header(nullptr), m_slots(nullptr), m_hash()
+{
+    map();
+}
+
+SharedKeyValueStore::Impl::~Impl()
+{
+    unmap();
+}
+
+// Opens the current keydir file, whoever comes first creates it. Nothing is kept
+// unless all of it works, closing the file also drops its lock.
+void SharedKeyValueStore::Impl::map()
+{
+    FileDescriptor fd(::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644));
+    if (fd.get() < 0)
+        throw std::runtime_error("can't open keydir " + m_path + ": " + ::strerror(errno));
+    if (::flock(fd.get(), LOCK_EX) < 0)
+        throw std::runtime_error("can't lock keydir " + m_path + ": " + ::strerror(errno));
+
+    struct stat st;
+    if (::fstat(fd.get(), &st) < 0)
+        throw std::runtime_error("can't stat keydir " + m_path + ": " + ::strerror(errno));
+    if (0 == st.st_size) {
+        if (::ftruncate(fd.get(), keydirSize(initialCapacity)) < 0)
+            throw std::runtime_error("can't size keydir " + m_path + ": " + ::strerror(errno));
+
+        KeydirHeader header;
+        header.m_magic = keydirMagic;
+        header.m_capacity = initialCapacity;
+        if (::pwrite(fd.get(), &header, offsetof(KeydirHeader, m_count), 0) < 0)
+            throw std::runtime_error("can't write keydir " + m_path + ": " + ::strerror(errno));
+        st.st_size = keydirSize(initialCapacity);
+    }
+    ::flock(fd.get(), LOCK_UN);
+
+    // readers map it read-only, nothing but the writer may change it
+    void *map = ::mmap(nullptr, st.st_size, m_writer ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, fd.get(), 0);
+    if (MAP_FAILED == map)
+        throw std::runtime_error("can't map keydir " + m_path + ": " + ::strerror(errno));
+
+    auto *header = static_cast<KeydirHeader *>(map);
+    if (keydirMagic != header->m_magic || keydirSize(header->m_capacity) > static_cast<std::size_t>(st.st_size)) {
+        ::munmap(map, st.st_size);
+        throw std::runtime_error("corrupted keydir " + m_path);
+    }
+
+    m_fd = fd.release();
+    m_map = map;
+    m_mapSize = st.st_size;
+    m_header = header;
+    m_slots = reinterpret_cast<KeydirSlot *>(static_cast<char *>(m_map) + sizeof(KeydirHeader));
+
+    // an odd version left by a writer which died mid commit would stall readers for
+    // good, the writer holds the writer lock so no commit of another one is running
+    if (m_writer) {
+        for (std::uint64_t i = 0; i < m_header->m_capacity; i++) {
+            if (m_slots[i].m_version.load(std::memory_order_relaxed) & 1)
+                m_slots[i].m_version.fetch_add(1, std::memory_order_release);
+        }
+    }
+}
+
+void SharedKeyValueStore::Impl::unmap()
+{
+    if (m_map && MAP_FAILED != m_map)
+        ::munmap(m_map, m_mapSize);
+    if (m_fd >= 0)
+        ::close(m_fd);
+
+    m_map = nullptr;
+    m_fd = -1;
+}
+
+inline std::uint64_t SharedKeyValueStore::Impl::hashOf(const std::string &key, ValueType type) const
+{
+    // a string and a set may live under the same key, they get different slots
+    std::uint64_t hash = m_hash(static_cast<char>(type) + key);
+
+    return 0 == hash ? 1 : hash;
+}
+
+KeydirSlot *SharedKeyValueStore::Impl::find(std::uint64_t hash) const
+{
+    std::uint64_t mask = m_header->m_capacity - 1;
+    for (std::uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        std::uint64_t slotHash = m_slots[i].m_hash.load(std::memory_order_acquire);
+        if (slotHash == hash)
+            return &m_slots[i];
+        if (0 == slotHash)
+            return nullptr;
+    }
+}
+
+// Only the writer claims slots, the version is set before the hash publishes the slot
+KeydirSlot *SharedKeyValueStore::Impl::claim(std::uint64_t hash)
+{
+    if (KeydirSlot *slot = find(hash))
+        return slot;
+
+    if (2 * (m_header->m_count.load(std::memory_order_relaxed) + 1) > m_header->m_capacity)
+        grow();
+
+    std::uint64_t mask = m_header->m_capacity - 1;
+    std::uint64_t i = hash & mask;
+    while (0 != m_slots[i].m_hash.load(std::memory_order_relaxed))
+        i = (i + 1) & mask;
+
+    m_slots[i].m_version.store(0, std::memory_order_relaxed);
+    m_slots[i].m_hash.store(hash, std::memory_order_release);
+    m_header->m_count.fetch_add(1, std::memory_order_relaxed);
+
+    return &m_slots[i];
+}
+
+// A full keydir is replaced by one twice as big. Readers still on the old one
+// notice the retired flag and map the new file before trusting any version.
+void SharedKeyValueStore::Impl::grow()
+{
+    std::uint64_t capacity = m_header->m_capacity * 2;
+    std::string tmpPath = m_path + ".tmp";
+
+    // a keydir which isn't complete never stays behind
+    auto failed = [&tmpPath](const std::string &what) {
+        std::string error = ::strerror(errno);
+        ::unlink(tmpPath.c_str());
+        return std::runtime_error(what + ": " + error);
+    };
+
+    FileDescriptor fd(::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+    if (fd.get() < 0)
+        throw std::runtime_error("can't grow keydir " + m_path + ": " + ::strerror(errno));
+    if (::ftruncate(fd.get(), keydirSize(capacity)) < 0)
+        throw failed("can't grow keydir " + m_path);
+
+    void *grown = ::mmap(nullptr, keydirSize(capacity), PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (MAP_FAILED == grown)
+        throw failed("can't map keydir " + tmpPath);
+
+    auto *header = static_cast<KeydirHeader *>(grown);
+    auto *slots = reinterpret_cast<KeydirSlot *>(static_cast<char *>(grown) + sizeof(KeydirHeader));
+    header->m_magic = keydirMagic;
+    header->m_capacity = capacity;
+    header->m_count.store(m_header->m_count.load());
+    header->m_commits.store(m_header->m_commits.load());
+    header->m_retired.store(0);
+
+    for (std::uint64_t i = 0; i < m_header->m_capacity; i++) {
+        std::uint64_t hash = m_slots[i].m_hash.load(std::memory_order_relaxed);
+        if (0 == hash)
+            continue;
+
+        std::uint64_t j = hash & (capacity - 1);
+        while (0 != slots[j].m_hash.load(std::memory_order_relaxed))
+            j = (j + 1) & (capacity - 1);
+        slots[j].m_version.store(m_slots[i].m_version.load(std::memory_order_relaxed));
+        slots[j].m_hash.store(hash);
+    }
+    ::munmap(grown, keydirSize(capacity));
+
+    if (::rename(tmpPath.c_str(), m_path.c_str()) < 0)
+        throw failed("can't replace keydir " + m_path);
+
+    m_header->m_retired.store(1, std::memory_order_seq_cst);
+
+    std::unique_lock<std::shared_mutex> lock(m_mapLock);
+    unmap();
+    map();
+}
+
+template <typename T>
+T SharedKeyValueStore::Impl::read(const std::string &key, ValueType type, std::function<T()> load)
+{
+    std::uint64_t hash = hashOf(key, type);
+
+    for (;;) {
+        std::shared_lock<std::shared_mutex> lock(m_mapLock);
+
+        if (m_header->m_retired.load(std::memory_order_acquire)) {
+            lock.unlock();
+            std::unique_lock<std::shared_mutex> remapLock(m_mapLock);
+            if (m_header->m_retired.load(std::memory_order_acquire)) {
+                unmap();
+                map();
+            }
+            continue;
+        }
+
+        KeydirSlot *slot = find(hash);
+        std::uint64_t version = slot ? slot->m_version.load(std::memory_order_acquire) : 0;
+        if (version & 1) {
+            // a commit is in progress
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+
+        T value = load();
+
+        // the value counts if no commit started meanwhile, and for keys the
+        // keydir had not seen, if the writer has not claimed them meanwhile
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (m_header->m_retired.load(std::memory_order_acquire))
+            continue;
+
+        if (!slot) {
+            if (!find(hash))
+                return value;
+        } else if (slot->m_version.load(std::memory_order_acquire) == version) {
+            return value;
+        }
+    }
+}
+
+// A delete takes the string and the set of a key at once, so readers of either see it whole
+void SharedKeyValueStore::Impl::write(const std::string &key, std::initializer_list<ValueType> types,
+                                      std::function<void()> store)
+{
+    checkWriter();
+
+    std::lock_guard<std::mutex> guard(m_writeLock);
+    std::vector<std::uint64_t> hashes;
+    for (ValueType type : types)
+        hashes.push_back(hashOf(key, type));
+    // claiming may grow the keydir, which moves the slots claimed before
+    for (std::uint64_t hash : hashes)
+        claim(hash);
+
+    std::shared_lock<std::shared_mutex> lock(m_mapLock);
+    std::vector<KeydirSlot *> slots;
+    for (std::uint64_t hash : hashes)
+        slots.push_back(find(hash));
+
+    CommitGuard commit(m_header, slots);
+    store();
+}
+
+inline void SharedKeyValueStore::Impl::checkWriter() const
+{
+    if (!m_writer)
+        throw std::runtime_error("database is opened read-only by this process");
+}
+
+SharedKeyValueStore::SharedKeyValueStore(std::unique_ptr<KeyValueStore> &toShare,
+                                         const std::string &keydirPath, bool writer)
+    : m_impl(std::make_unique<SharedKeyValueStore::Impl>(toShare, keydirPath, writer))
+{
+
+}
+
+SharedKeyValueStore::~SharedKeyValueStore()
+{
+
+}
+
+// Management methods
+void SharedKeyValueStore::loadKeysInto(std::function<void(std::string key, std::string vlaue)> cb)
+{
+    m_impl->m_store->loadKeysInto(cb);
+}
+
+void SharedKeyValueStore::clear()
+{
+    m_impl->checkWriter();
+
+    std::lock_guard<std::mutex> guard(m_impl->m_writeLock);
+    m_impl->m_store->clear();
+}
+
+// Set or get methods
+void SharedKeyValueStore::setKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { ValueType::STRING }, [this, &key, &value]() {
+        m_impl->m_store->setKeyValue(key, value);
+    });
+}
+
+void SharedKeyValueStore::setKeyValue(const std::string &key,
+                                      const std::unordered_set<std::string> &value)
+{
+    m_impl->write(key, { ValueType::STRING_SET }, [this, &key, &value]() {
+        m_impl->m_store->setKeyValue(key, value);
+    });
+}
+
+void SharedKeyValueStore::appendKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { ValueType::STRING_SET }, [this, &key, &value]() {
+        m_impl->m_store->appendKeyValue(key, value);
+    });
+}
+
+void SharedKeyValueStore::mergeKeyValue(const std::string &key, const std::string &operand,
+                                        MergeOperator op)
+{
+    m_impl->write(key, { ValueType::STRING }, [this, &key, &operand, op]() {
+        m_impl->m_store->mergeKeyValue(key, operand, op);
+    });
+}
+
+void SharedKeyValueStore::mergeKeyValue(const std::string &key,
+                                        const std::unordered_set<std::string> &members)
+{
+    m_impl->write(key, { ValueType::STRING_SET }, [this, &key, &members]() {
+        m_impl->m_store->mergeKeyValue(key, members);
+    });
+}
+
+bool SharedKeyValueStore::compareAndSetKeyValue(const std::string &key, const std::string &expected,
+                                                const std::string &value)
+{
+    bool set = false;
+    m_impl->write(key, { ValueType::STRING }, [this, &key, &expected, &value, &set]() {
+        set = m_impl->m_store->compareAndSetKeyValue(key, expected, value);
+    });
+
+    return set;
+}
+
+void SharedKeyValueStore::deleteKeyValue(const std::string &key)
+{
+    m_impl->write(key, { ValueType::STRING, ValueType::STRING_SET }, [this, &key]() {
+        m_impl->m_store->deleteKeyValue(key);
+    });
+}
+
+void SharedKeyValueStore::removeKeyValue(const std::string &key, const std::string &value)
+{
+    m_impl->write(key, { ValueType::STRING_SET }, [this, &key, &value]() {
+        m_impl->m_store->removeKeyValue(key, value);
+    });
+}
+
+std::string SharedKeyValueStore::getKeyValue(const std::string &key)
+{
+    return m_impl->read<std::string>(key, ValueType::STRING, [this, &key]() {
+        return m_impl->m_store->getKeyValue(key);
+    });
+}
+
+std::unique_ptr<std::unordered_set<std::string>>
+SharedKeyValueStore::getKeyValueSet(const std::string &key)
+{
+    using ValueSet = std::unique_ptr<std::unordered_set<std::string>>;
+
+    return m_impl->read<ValueSet>(key, ValueType::STRING_SET, [this, &key]() {
+        return m_impl->m_store->getKeyValueSet(key);
+    });
+}
+
+// Values are read from the shared store every time, so there is nothing in memory
+bool SharedKeyValueStore::tryGetKeyValue(const std::string &, std::string &)
+{
+    return false;
+}
+
+bool SharedKeyValueStore::tryGetKeyValueSet(const std::string &,
+                                            std::unique_ptr<std::unordered_set<std::string>> &)
+{
+    return false;
+}
+
+// The keydir is a hash table, key order only exists in the shared store itself
+void SharedKeyValueStore::scanKeys(const std::string &from, const std::string &to, bool reverse,
+                                   std::function<bool(const std::string &key)> cb)
+{
+    m_impl->m_store->scanKeys(from, to, reverse, cb);
+}
+
+// The writer in another process does not know which versions a reader's snapshot needs
+std::unique_ptr<KeyValueSnapshot> SharedKeyValueStore::snapshot()
+{
+    throw std::runtime_error("snapshots are not supported for stores shared between processes");
+}
+
+// The keydir is shared memory every process maps, on top of what the store below holds
+MemoryUsage SharedKeyValueStore::memoryUsage() const
+{
+    MemoryUsage usage = m_impl->m_store->memoryUsage();
+    usage.block(sizeof(Impl));
+    usage.string(m_impl->m_path, &MemoryUsage::m_overhead);
+
+    std::shared_lock<std::shared_mutex> lock(m_impl->m_mapLock);
+    usage.m_mapped += m_impl->m_mapSize;
+
+    return usage;
+}
+
+MemoryUsage SharedKeyValueStore::memoryUsage(const std::string &key) const
+{
+    MemoryUsage usage = m_impl->m_store->memoryUsage(key);
+
+    std::shared_lock<std::shared_mutex> lock(m_impl->m_mapLock);
+    for (ValueType type : { ValueType::STRING, ValueType::STRING_SET }) {
+        if (m_impl->find(m_impl->hashOf(key, type)))
+            usage.m_mapped += sizeof(KeydirSlot);
+    }
+
+    return usage;
+}
+
+}
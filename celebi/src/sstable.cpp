@@ -0,0 +1,767 @@
+#include "extensions/sstable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace celebiext {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+const std::uint64_t tableMagic = 0x63656c6562697373ull;   // "celebiss"
+const std::size_t footerSize = 6 * sizeof(std::uint64_t);
+
+void putFixed32(std::string &out, std::uint32_t value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+void putFixed64(std::string &out, std::uint64_t value)
+{
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+std::uint32_t getFixed32(const char *data)
+{
+    std::uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+std::uint64_t getFixed64(const char *data)
+{
+    std::uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+void putLengthPrefixed(std::string &out, const std::string &value)
+{
+    putFixed32(out, static_cast<std::uint32_t>(value.size()));
+    out += value;
+}
+
+// Reads a length-prefixed string at pos, throws if it runs past the end
+std::string getLengthPrefixed(const std::string &in, std::size_t &pos)
+{
+    if (pos + sizeof(std::uint32_t) > in.size())
+        throw std::runtime_error("corrupt table block");
+    std::uint32_t length = getFixed32(in.data() + pos);
+    pos += sizeof(std::uint32_t);
+    if (pos + length > in.size())
+        throw std::runtime_error("corrupt table block");
+    std::string value = in.substr(pos, length);
+    pos += length;
+
+    return value;
+}
+
+void writeAll(int fd, const std::string &data, const std::string &path)
+{
+    std::size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0)
+            throw std::runtime_error("cannot write table " + path + ": " + std::strerror(errno));
+        written += static_cast<std::size_t>(n);
+    }
+}
+
+std::string readAt(int fd, std::uint64_t offset, std::uint64_t size, const std::string &path)
+{
+    std::string data(size, '\0');
+    std::size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, &data[done], size - done, static_cast<off_t>(offset + done));
+        if (n <= 0)
+            throw std::runtime_error("cannot read table " + path);
+        done += static_cast<std::size_t>(n);
+    }
+
+    return data;
+}
+
+}
+
+InternalKey InternalKey::first(const std::string &user, std::uint8_t column)
+{
+    return InternalKey{user, maxSeq, 0 == column ? EntryKind::STRING : EntryKind::SET};
+}
+
+std::string InternalKey::logicalKey() const
+{
+    return m_user + static_cast<char>(columnOf(m_kind));
+}
+
+// [user key][8 bytes seq][1 byte kind]
+void InternalKey::encodeTo(std::string &out) const
+{
+    out += m_user;
+    putFixed64(out, m_seq);
+    out += static_cast<char>(m_kind);
+}
+
+InternalKey InternalKey::decode(const char *data, std::size_t size)
+{
+    if (size < sizeof(std::uint64_t) + 1)
+        throw std::runtime_error("corrupt internal key");
+
+    std::size_t userSize = size - sizeof(std::uint64_t) - 1;
+
+    return InternalKey{std::string(data, userSize), getFixed64(data + userSize),
+                       static_cast<EntryKind>(data[size - 1])};
+}
+
+int compare(const InternalKey &a, const InternalKey &b)
+{
+    int c = a.m_user.compare(b.m_user);
+    if (0 != c)
+        return c < 0 ? -1 : 1;
+    if (columnOf(a.m_kind) != columnOf(b.m_kind))
+        return columnOf(a.m_kind) < columnOf(b.m_kind) ? -1 : 1;
+    if (a.m_seq != b.m_seq)
+        return a.m_seq > b.m_seq ? -1 : 1;
+    if (a.m_kind != b.m_kind)
+        return a.m_kind < b.m_kind ? -1 : 1;
+
+    return 0;
+}
+
+void encodeEntry(const Entry &entry, std::string &out)
+{
+    std::string key;
+    entry.m_key.encodeTo(key);
+    putLengthPrefixed(out, key);
+    putLengthPrefixed(out, entry.m_value);
+}
+
+bool decodeEntry(const std::string &in, std::size_t &pos, Entry &entry)
+{
+    try {
+        std::size_t next = pos;
+        std::string key = getLengthPrefixed(in, next);
+        std::string value = getLengthPrefixed(in, next);
+        entry.m_key = InternalKey::decode(key.data(), key.size());
+        entry.m_value = std::move(value);
+        pos = next;
+    } catch (const std::runtime_error &) {
+        return false;
+    }
+
+    return true;
+}
+
+// [4 bytes count]([4 bytes length][member])...
+std::string encodeSet(const std::unordered_set<std::string> &set)
+{
+    std::string encoded;
+    putFixed32(encoded, static_cast<std::uint32_t>(set.size()));
+    for (auto &member : set)
+        putLengthPrefixed(encoded, member);
+
+    return encoded;
+}
+
+void decodeSetInto(const std::string &encoded, std::unordered_set<std::string> &set)
+{
+    if (encoded.size() < sizeof(std::uint32_t))
+        return;
+
+    std::uint32_t count = getFixed32(encoded.data());
+    std::size_t pos = sizeof(std::uint32_t);
+    for (std::uint32_t i = 0; i < count; i++)
+        set.insert(getLengthPrefixed(encoded, pos));
+}
+
+/*
+ ************************************************************
+ * Table building
+ ************************************************************
+ */
+
+class TableBuilder::Impl {
+public:
+    Impl(const std::string &path, std::size_t blockSize, int bitsPerKey);
+
+    void flushBlock();
+
+    std::string m_path;
+    int m_fd;
+    std::size_t m_blockSize;
+    int m_bitsPerKey;
+    std::uint64_t m_offset;
+    std::size_t m_entries;
+    std::string m_block;
+    std::string m_lastKey;   // encoded
+    std::string m_index;
+    std::vector<std::string> m_logicalKeys;
+};
+
+TableBuilder::Impl::Impl(const std::string &path, std::size_t blockSize, int bitsPerKey)
+    : m_path(path), m_fd(-1), m_blockSize(blockSize), m_bitsPerKey(bitsPerKey),
+      m_offset(0), m_entries(0)
+{
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+        throw std::runtime_error("cannot create table " + path + ": " + std::strerror(errno));
+}
+
+// Index entries are [last key of the block][8 bytes offset][8 bytes size]
+void TableBuilder::Impl::flushBlock()
+{
+    if (m_block.empty())
+        return;
+
+    writeAll(m_fd, m_block, m_path);
+
+    putLengthPrefixed(m_index, m_lastKey);
+    putFixed64(m_index, m_offset);
+    putFixed64(m_index, m_block.size());
+
+    m_offset += m_block.size();
+    m_block.clear();
+}
+
+TableBuilder::TableBuilder(const std::string &path, std::size_t blockSize, int bitsPerKey)
+    : m_impl(std::make_unique<Impl>(path, blockSize, bitsPerKey))
+{
+
+}
+
+TableBuilder::~TableBuilder()
+{
+    if (m_impl->m_fd >= 0)
+        ::close(m_impl->m_fd);
+}
+
+void TableBuilder::add(const Entry &entry)
+{
+    m_impl->m_lastKey.clear();
+    entry.m_key.encodeTo(m_impl->m_lastKey);
+
+    encodeEntry(entry, m_impl->m_block);
+    m_impl->m_entries++;
+
+    // versions of a key come together, the filter needs it once
+    std::string logicalKey = entry.m_key.logicalKey();
+    if (m_impl->m_logicalKeys.empty() || m_impl->m_logicalKeys.back() != logicalKey)
+        m_impl->m_logicalKeys.push_back(std::move(logicalKey));
+
+    if (m_impl->m_block.size() >= m_impl->m_blockSize)
+        m_impl->flushBlock();
+}
+
+// Footer is [index offset][index size][filter offset][filter size][entries][magic]
+void TableBuilder::finish(bool sync)
+{
+    m_impl->flushBlock();
+
+    BloomFilter filter(m_impl->m_bitsPerKey, m_impl->m_logicalKeys.size());
+    for (auto &key : m_impl->m_logicalKeys)
+        filter.add(key);
+    std::string encodedFilter = filter.encode();
+
+    std::string tail = m_impl->m_index + encodedFilter;
+    putFixed64(tail, m_impl->m_offset);
+    putFixed64(tail, m_impl->m_index.size());
+    putFixed64(tail, m_impl->m_offset + m_impl->m_index.size());
+    putFixed64(tail, encodedFilter.size());
+    putFixed64(tail, m_impl->m_entries);
+    putFixed64(tail, tableMagic);
+    writeAll(m_impl->m_fd, tail, m_impl->m_path);
+    m_impl->m_offset += tail.size();
+
+    if (sync && 0 != ::fdatasync(m_impl->m_fd))
+        throw std::runtime_error("cannot sync table " + m_impl->m_path);
+
+    ::close(m_impl->m_fd);
+    m_impl->m_fd = -1;
+}
+
+std::uint64_t TableBuilder::fileSize() const
+{
+    return m_impl->m_offset + m_impl->m_block.size();
+}
+
+std::size_t TableBuilder::entries() const
+{
+    return m_impl->m_entries;
+}
+
+/*
+ ************************************************************
+ * Table reading
+ ************************************************************
+ */
+
+class Table::Impl {
+public:
+    struct IndexEntry {
+        InternalKey m_last;
+        std::uint64_t m_offset;
+        std::uint64_t m_size;
+    };
+
+    Impl() : m_fd(-1), m_filter(), m_obsolete(false) {}
+
+    using Block = std::vector<Entry>;
+    std::shared_ptr<Block> readBlock(std::size_t index) const;
+    // index of the first block whose last key is not less than target
+    std::size_t findBlock(const InternalKey &target) const;
+
+    std::string m_path;
+    std::uint64_t m_number;
+    int m_fd;
+    std::uint64_t m_fileSize;
+    std::size_t m_entries;
+    std::vector<IndexEntry> m_index;
+    std::unique_ptr<BloomFilter> m_filter;
+    InternalKey m_smallest;
+    std::atomic<bool> m_obsolete;
+};
+
+std::shared_ptr<Table::Impl::Block> Table::Impl::readBlock(std::size_t index) const
+{
+    std::string data = readAt(m_fd, m_index[index].m_offset, m_index[index].m_size, m_path);
+    auto block = std::make_shared<Block>();
+
+    for (std::size_t pos = 0; pos < data.size(); ) {
+        block->emplace_back();
+        if (!decodeEntry(data, pos, block->back()))
+            throw std::runtime_error("corrupt table " + m_path);
+    }
+
+    return block;
+}
+
+std::size_t Table::Impl::findBlock(const InternalKey &target) const
+{
+    auto it = std::lower_bound(m_index.begin(), m_index.end(), target,
+                               [](const IndexEntry &entry, const InternalKey &key) {
+        return compare(entry.m_last, key) < 0;
+    });
+
+    return static_cast<std::size_t>(it - m_index.begin());
+}
+
+namespace {
+
+class TableIterator : public EntryIterator {
+public:
+    explicit TableIterator(std::shared_ptr<const Table> table, const Table::Impl *impl)
+        : m_table(std::move(table)), m_impl(impl), m_blockIndex(npos), m_block(), m_pos(0) {}
+
+    virtual bool valid() const override { return npos != m_blockIndex; }
+    virtual const Entry &entry() const override { return (*m_block)[m_pos]; }
+
+    virtual void seekToFirst() override
+    {
+        if (!load(0))
+            return;
+        m_pos = 0;
+        skipEmptyForward();
+    }
+
+    virtual void seekToLast() override
+    {
+        if (!load(m_impl->m_index.size() - 1))
+            return;
+        m_pos = m_block->size() - 1;
+        skipEmptyBackward();
+    }
+
+    virtual void seek(const InternalKey &target) override
+    {
+        if (!load(m_impl->findBlock(target)))
+            return;
+        m_pos = lowerBound(target);
+        skipEmptyForward();
+    }
+
+    virtual void seekBefore(const InternalKey &target) override
+    {
+        std::size_t index = std::min(m_impl->findBlock(target), m_impl->m_index.size() - 1);
+        if (!load(index))
+            return;
+        // one before the lower bound, which may be in the block before
+        m_pos = lowerBound(target) - 1;
+        skipEmptyBackward();
+    }
+
+    virtual void next() override
+    {
+        m_pos++;
+        skipEmptyForward();
+    }
+
+    virtual void prev() override
+    {
+        m_pos--;
+        skipEmptyBackward();
+    }
+
+private:
+    static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    bool load(std::size_t index)
+    {
+        if (index >= m_impl->m_index.size()) {
+            m_blockIndex = npos;
+            return false;
+        }
+        m_blockIndex = index;
+        m_block = m_impl->readBlock(index);
+
+        return true;
+    }
+
+    std::size_t lowerBound(const InternalKey &target) const
+    {
+        auto it = std::lower_bound(m_block->begin(), m_block->end(), target,
+                                   [](const Entry &entry, const InternalKey &key) {
+            return compare(entry.m_key, key) < 0;
+        });
+
+        return static_cast<std::size_t>(it - m_block->begin());
+    }
+
+    void skipEmptyForward()
+    {
+        while (valid() && m_pos >= m_block->size()) {
+            if (!load(m_blockIndex + 1))
+                return;
+            m_pos = 0;
+        }
+    }
+
+    // m_pos wraps around below 0, which also lands past the end
+    void skipEmptyBackward()
+    {
+        while (valid() && m_pos >= m_block->size()) {
+            if (0 == m_blockIndex || !load(m_blockIndex - 1)) {
+                m_blockIndex = npos;
+                return;
+            }
+            m_pos = m_block->size() - 1;
+        }
+    }
+
+    std::shared_ptr<const Table> m_table;
+    const Table::Impl *m_impl;
+    std::size_t m_blockIndex;
+    std::shared_ptr<Table::Impl::Block> m_block;
+    std::size_t m_pos;
+};
+
+}
+
+Table::Table()
+    : m_impl(std::make_unique<Impl>())
+{
+
+}
+
+Table::~Table()
+{
+    if (m_impl->m_fd >= 0)
+        ::close(m_impl->m_fd);
+
+    if (m_impl->m_obsolete.load()) {
+        std::error_code ec;
+        fs::remove(m_impl->m_path, ec);
+    }
+}
+
+std::shared_ptr<Table> Table::open(const std::string &path, std::uint64_t number)
+{
+    std::shared_ptr<Table> table(new Table());
+    Impl &impl = *table->m_impl;
+    impl.m_path = path;
+    impl.m_number = number;
+
+    impl.m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (impl.m_fd < 0)
+        throw std::runtime_error("cannot open table " + path + ": " + std::strerror(errno));
+
+    off_t size = ::lseek(impl.m_fd, 0, SEEK_END);
+    if (size < static_cast<off_t>(footerSize))
+        throw std::runtime_error("corrupt table " + path);
+    impl.m_fileSize = static_cast<std::uint64_t>(size);
+
+    std::string footer = readAt(impl.m_fd, impl.m_fileSize - footerSize, footerSize, path);
+    if (tableMagic != getFixed64(footer.data() + 5 * sizeof(std::uint64_t)))
+        throw std::runtime_error("corrupt table " + path);
+
+    std::uint64_t indexOffset = getFixed64(footer.data());
+    std::uint64_t indexSize = getFixed64(footer.data() + sizeof(std::uint64_t));
+    std::uint64_t filterOffset = getFixed64(footer.data() + 2 * sizeof(std::uint64_t));
+    std::uint64_t filterSize = getFixed64(footer.data() + 3 * sizeof(std::uint64_t));
+    impl.m_entries = getFixed64(footer.data() + 4 * sizeof(std::uint64_t));
+
+    std::string index = readAt(impl.m_fd, indexOffset, indexSize, path);
+    for (std::size_t pos = 0; pos < index.size(); ) {
+        std::string last = getLengthPrefixed(index, pos);
+        if (pos + 2 * sizeof(std::uint64_t) > index.size())
+            throw std::runtime_error("corrupt table " + path);
+        impl.m_index.push_back(Impl::IndexEntry{InternalKey::decode(last.data(), last.size()),
+                                                getFixed64(index.data() + pos),
+                                                getFixed64(index.data() + pos + sizeof(std::uint64_t))});
+        pos += 2 * sizeof(std::uint64_t);
+    }
+    if (impl.m_index.empty())
+        throw std::runtime_error("empty table " + path);
+
+    impl.m_filter = std::make_unique<BloomFilter>(readAt(impl.m_fd, filterOffset, filterSize, path));
+    impl.m_smallest = impl.readBlock(0)->front().m_key;
+
+    return table;
+}
+
+std::uint64_t Table::number() const
+{
+    return m_impl->m_number;
+}
+
+std::uint64_t Table::fileSize() const
+{
+    return m_impl->m_fileSize;
+}
+
+std::size_t Table::entries() const
+{
+    return m_impl->m_entries;
+}
+
+const InternalKey &Table::smallest() const
+{
+    return m_impl->m_smallest;
+}
+
+const InternalKey &Table::largest() const
+{
+    return m_impl->m_index.back().m_last;
+}
+
+bool Table::mayContain(const std::string &logicalKey) const
+{
+    return m_impl->m_filter->mayContain(logicalKey);
+}
+
+const BloomFilter &Table::filter() const
+{
+    return *m_impl->m_filter;
+}
+
+// Index keys are what the table looks blocks up by, they count as overhead
+void Table::memoryUsage(MemoryUsage &usage) const
+{
+    usage.block(sizeof(Table));
+    usage.block(sizeof(Impl));
+    usage.string(m_impl->m_path, &MemoryUsage::m_overhead);
+    usage.string(m_impl->m_smallest.m_user, &MemoryUsage::m_overhead);
+    usage.block(m_impl->m_index.capacity() * sizeof(Impl::IndexEntry));
+    for (auto &entry : m_impl->m_index)
+        usage.string(entry.m_last.m_user, &MemoryUsage::m_overhead);
+
+    usage.block(sizeof(BloomFilter));
+    usage.block(m_impl->m_filter->bits() / 8);
+}
+
+std::unique_ptr<EntryIterator> Table::iterator() const
+{
+    return std::make_unique<TableIterator>(shared_from_this(), m_impl.get());
+}
+
+void Table::markObsolete()
+{
+    m_impl->m_obsolete.store(true);
+}
+
+/*
+ ************************************************************
+ * Iterators over many sources
+ ************************************************************
+ */
+
+MergingIterator::MergingIterator(std::vector<std::unique_ptr<EntryIterator>> children)
+    : m_children(std::move(children)), m_current(nullptr)
+{
+
+}
+
+bool MergingIterator::valid() const
+{
+    return nullptr != m_current;
+}
+
+const Entry &MergingIterator::entry() const
+{
+    return m_current->entry();
+}
+
+void MergingIterator::seekToFirst()
+{
+    for (auto &child : m_children)
+        child->seekToFirst();
+    pickSmallest();
+}
+
+void MergingIterator::seekToLast()
+{
+    for (auto &child : m_children)
+        child->seekToLast();
+    pickLargest();
+}
+
+void MergingIterator::seek(const InternalKey &target)
+{
+    for (auto &child : m_children)
+        child->seek(target);
+    pickSmallest();
+}
+
+void MergingIterator::seekBefore(const InternalKey &target)
+{
+    for (auto &child : m_children)
+        child->seekBefore(target);
+    pickLargest();
+}
+
+void MergingIterator::next()
+{
+    m_current->next();
+    pickSmallest();
+}
+
+void MergingIterator::prev()
+{
+    m_current->prev();
+    pickLargest();
+}
+
+// Children are few, a memtable or two and a table per level, so a scan beats a heap
+void MergingIterator::pickSmallest()
+{
+    m_current = nullptr;
+    for (auto &child : m_children) {
+        if (child->valid() && (!m_current || compare(child->entry().m_key, m_current->entry().m_key) < 0))
+            m_current = child.get();
+    }
+}
+
+void MergingIterator::pickLargest()
+{
+    m_current = nullptr;
+    for (auto &child : m_children) {
+        if (child->valid() && (!m_current || compare(child->entry().m_key, m_current->entry().m_key) > 0))
+            m_current = child.get();
+    }
+}
+
+ConcatenatingIterator::ConcatenatingIterator(std::vector<std::shared_ptr<Table>> tables)
+    : m_tables(std::move(tables)), m_index(0), m_current()
+{
+
+}
+
+bool ConcatenatingIterator::valid() const
+{
+    return m_current && m_current->valid();
+}
+
+const Entry &ConcatenatingIterator::entry() const
+{
+    return m_current->entry();
+}
+
+void ConcatenatingIterator::openTable(std::size_t index)
+{
+    m_index = index;
+    m_current = index < m_tables.size() ? m_tables[index]->iterator() : nullptr;
+}
+
+void ConcatenatingIterator::seekToFirst()
+{
+    openTable(0);
+    if (m_current)
+        m_current->seekToFirst();
+    skipForward();
+}
+
+void ConcatenatingIterator::seekToLast()
+{
+    openTable(m_tables.empty() ? 0 : m_tables.size() - 1);
+    if (m_current)
+        m_current->seekToLast();
+    skipBackward();
+}
+
+void ConcatenatingIterator::seek(const InternalKey &target)
+{
+    auto it = std::lower_bound(m_tables.begin(), m_tables.end(), target,
+                               [](const std::shared_ptr<Table> &table, const InternalKey &key) {
+        return compare(table->largest(), key) < 0;
+    });
+    openTable(static_cast<std::size_t>(it - m_tables.begin()));
+    if (m_current)
+        m_current->seek(target);
+    skipForward();
+}
+
+void ConcatenatingIterator::seekBefore(const InternalKey &target)
+{
+    // the last table starting before target
+    auto it = std::lower_bound(m_tables.begin(), m_tables.end(), target,
+                               [](const std::shared_ptr<Table> &table, const InternalKey &key) {
+        return compare(table->smallest(), key) < 0;
+    });
+    if (it == m_tables.begin()) {
+        m_current.reset();
+        return;
+    }
+    openTable(static_cast<std::size_t>(it - m_tables.begin()) - 1);
+    m_current->seekBefore(target);
+    skipBackward();
+}
+
+void ConcatenatingIterator::next()
+{
+    m_current->next();
+    skipForward();
+}
+
+void ConcatenatingIterator::prev()
+{
+    m_current->prev();
+    skipBackward();
+}
+
+void ConcatenatingIterator::skipForward()
+{
+    while (m_current && !m_current->valid()) {
+        openTable(m_index + 1);
+        if (m_current)
+            m_current->seekToFirst();
+    }
+}
+
+void ConcatenatingIterator::skipBackward()
+{
+    while (m_current && !m_current->valid()) {
+        if (0 == m_index) {
+            m_current.reset();
+            return;
+        }
+        openTable(m_index - 1);
+        m_current->seekToLast();
+    }
+}
+
+}
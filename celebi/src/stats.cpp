@@ -0,0 +1,218 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace celebi;
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// The le bounds of every exported histogram in nanoseconds, the same ones each scrape
+const std::array<std::uint64_t, 22> prometheusBounds = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000, 250000000, 500000000,
+    1000000000, 2500000000, 5000000000, 10000000000,
+};
+
+}
+
+// Values below two sub-bucket counts are their own bucket, above that a value goes by
+// its highest bit and the subBucketBits bits after it
+std::size_t Histogram::bucketOf(std::uint64_t nanos)
+{
+    if (nanos < 2 * subBuckets)
+        return nanos;
+
+    if (nanos >> (maxExponent + 1))
+        return buckets - 1;
+
+    const unsigned exponent = 63 - __builtin_clzll(nanos);
+    const std::uint64_t sub = (nanos >> (exponent - subBucketBits)) & (subBuckets - 1);
+
+    return 2 * subBuckets + (exponent - subBucketBits - 1) * subBuckets + sub;
+}
+
+std::uint64_t Histogram::upperBound(std::size_t bucket)
+{
+    if (bucket < 2 * subBuckets)
+        return bucket;
+
+    const unsigned exponent = (bucket - 2 * subBuckets) / subBuckets + subBucketBits + 1;
+    const std::uint64_t sub = (bucket - 2 * subBuckets) % subBuckets;
+    const unsigned shift = exponent - subBucketBits;
+
+    return ((subBuckets + sub) << shift) + (std::uint64_t(1) << shift) - 1;
+}
+
+std::uint64_t Histogram::percentile(double q) const
+{
+    if (0 == m_count)
+        return 0;
+
+    const std::uint64_t rank = std::max<std::uint64_t>(
+                1, static_cast<std::uint64_t>(std::ceil(std::clamp(q, 0.0, 1.0) * m_count)));
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < buckets; bucket++) {
+        seen += m_counts[bucket];
+        if (seen >= rank)
+            return upperBound(bucket);
+    }
+
+    return max();
+}
+
+std::uint64_t Histogram::max() const
+{
+    for (std::size_t bucket = buckets; bucket > 0; bucket--)
+        if (0 != m_counts[bucket - 1])
+            return upperBound(bucket - 1);
+
+    return 0;
+}
+
+double Histogram::mean() const
+{
+    return 0 == m_count ? 0.0 : static_cast<double>(m_sum) / m_count;
+}
+
+void Histogram::merge(const Histogram &other)
+{
+    for (std::size_t bucket = 0; bucket < buckets; bucket++)
+        m_counts[bucket] += other.m_counts[bucket];
+    m_count += other.m_count;
+    m_sum += other.m_sum;
+}
+
+const Histogram &Stats::latency(const std::string &layer, const std::string &operation) const
+{
+    static const Histogram empty;
+    auto found = m_latencies.find({ layer, operation });
+
+    return found == m_latencies.end() ? empty : found->second;
+}
+
+std::uint64_t Stats::counter(const std::string &layer, const std::string &name) const
+{
+    auto found = m_counters.find({ layer, name });
+
+    return found == m_counters.end() ? 0 : found->second;
+}
+
+// One histogram family labelled by layer and operation, buckets are cumulative and every
+// scrape writes the same bounds, so the set of series never changes between scrapes
+std::string Stats::prometheus() const
+{
+    std::ostringstream out;
+    out.precision(9);
+
+    out << "# HELP celebi_latency_seconds Latency of celebi operations by layer.\n"
+        << "# TYPE celebi_latency_seconds histogram\n";
+    for (auto &series : m_latencies) {
+        const std::string labels = "layer=\"" + series.first.first +
+                                   "\",operation=\"" + series.first.second + "\"";
+        const Histogram &histogram = series.second;
+
+        // a bucket counts toward a bound once all of it is at or below the bound
+        std::uint64_t cumulative = 0;
+        std::size_t bucket = 0;
+        for (std::uint64_t bound : prometheusBounds) {
+            for (; bucket < Histogram::buckets && Histogram::upperBound(bucket) <= bound; bucket++)
+                cumulative += histogram.m_counts[bucket];
+            out << "celebi_latency_seconds_bucket{" << labels << ",le=\""
+                << bound / 1e9 << "\"} " << cumulative << "\n";
+        }
+        out << "celebi_latency_seconds_bucket{" << labels << ",le=\"+Inf\"} "
+            << histogram.m_count << "\n"
+            << "celebi_latency_seconds_sum{" << labels << "} " << histogram.m_sum / 1e9 << "\n"
+            << "celebi_latency_seconds_count{" << labels << "} " << histogram.m_count << "\n";
+    }
+
+    // counters are one family per name, labelled by layer
+    std::map<std::string, std::map<std::string, std::uint64_t>> families;
+    for (auto &counter : m_counters)
+        families[counter.first.second][counter.first.first] = counter.second;
+    for (auto &family : families) {
+        out << "# TYPE celebi_" << family.first << "_total counter\n";
+        for (auto &layer : family.second)
+            out << "celebi_" << family.first << "_total{layer=\"" << layer.first << "\"} "
+                << layer.second << "\n";
+    }
+
+    return out.str();
+}
+
+void Stats::writePrometheus(const std::string &path) const
+{
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        out << prometheus();
+        if (!out.flush())
+            throw std::runtime_error("could not write stats to " + temporary);
+    }
+
+    fs::rename(temporary, path);
+}
+
+std::size_t MemoryUsage::total() const
+{
+    return m_keys + m_values + m_members + m_postings + m_overhead + m_mapped + m_slack;
+}
+
+MemoryUsage &MemoryUsage::operator+=(const MemoryUsage &other)
+{
+    m_keys += other.m_keys;
+    m_values += other.m_values;
+    m_members += other.m_members;
+    m_postings += other.m_postings;
+    m_overhead += other.m_overhead;
+    m_mapped += other.m_mapped;
+    m_slack += other.m_slack;
+
+    return *this;
+}
+
+// A chunk is the request and its size word rounded up to 16 bytes, 32 at least
+std::size_t MemoryUsage::allocated(std::size_t bytes)
+{
+    if (0 == bytes)
+        return 0;
+
+    return std::max<std::size_t>(32, (bytes + sizeof(std::size_t) + 15) & ~std::size_t(15));
+}
+
+void MemoryUsage::block(std::size_t bytes)
+{
+    m_overhead += bytes;
+    m_slack += allocated(bytes) - bytes;
+}
+
+// Short strings live in their object, longer ones in a block of their capacity
+void MemoryUsage::string(const std::string &value, std::size_t MemoryUsage::*field)
+{
+    static const std::size_t inlineCapacity = std::string().capacity();
+
+    this->*field += value.size();
+    if (value.capacity() > inlineCapacity)
+        m_slack += allocated(value.capacity() + 1) - value.size();
+}
+
+// A node links to the next, holds its member and caches its hash, a set of one
+// bucket keeps the bucket in its object
+void MemoryUsage::set(const std::unordered_set<std::string> &value, std::size_t MemoryUsage::*field)
+{
+    if (value.bucket_count() > 1)
+        block(value.bucket_count() * sizeof(void *));
+
+    for (auto &member : value) {
+        block(sizeof(void *) + sizeof(std::string) + sizeof(std::size_t));
+        string(member, field);
+    }
+}
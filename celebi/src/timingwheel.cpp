@@ -0,0 +1,97 @@
+#include "extensions/timingwheel.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace celebiext {
+
+namespace {
+
+constexpr unsigned slotBits = 8;
+
+}
+
+TimingWheel::TimingWheel(std::uint64_t now, std::uint64_t tickMs)
+    : m_tickMs(std::max<std::uint64_t>(tickMs, 1)), m_tick(now / m_tickMs), m_size(0), m_wheels()
+{
+
+}
+
+void TimingWheel::schedule(const std::string &key, std::uint64_t deadline)
+{
+    // the current tick is done, so even a key due already waits for the next one
+    place({ key, deadline }, m_tick + 1);
+    m_size++;
+}
+
+// A timer goes to the lowest level whose slots still reach its tick, the top level
+// keeps what is too far away and puts it back there on every turn until it is near
+void TimingWheel::place(Timer timer, std::uint64_t earliest)
+{
+    std::uint64_t expires = std::max((timer.m_deadline + m_tickMs - 1) / m_tickMs, earliest);
+
+    for (std::size_t level = 0; level < levels; level++) {
+        const unsigned shift = slotBits * level;
+        if ((expires >> shift) - (m_tick >> shift) < slots) {
+            m_wheels[level][(expires >> shift) % slots].push_back(std::move(timer));
+            return;
+        }
+    }
+
+    const unsigned shift = slotBits * (levels - 1);
+    m_wheels[levels - 1][((m_tick >> shift) + slots - 1) % slots].push_back(std::move(timer));
+}
+
+void TimingWheel::advance(std::uint64_t now, const std::function<void(const std::string &, std::uint64_t)> &fire)
+{
+    const std::uint64_t target = now / m_tickMs;
+
+    while (m_tick < target) {
+        if (0 == m_size) {
+            m_tick = target;
+            break;
+        }
+        m_tick++;
+
+        // higher levels first, what they hand down may land in a slot cascaded next
+        for (std::size_t level = levels - 1; level > 0; level--) {
+            const unsigned shift = slotBits * level;
+            if (0 != (m_tick & ((std::uint64_t(1) << shift) - 1)))
+                continue;
+
+            std::vector<Timer> timers;
+            timers.swap(m_wheels[level][(m_tick >> shift) % slots]);
+            for (Timer &timer : timers)
+                place(std::move(timer), m_tick);
+        }
+
+        std::vector<Timer> due;
+        due.swap(m_wheels[0][m_tick % slots]);
+        m_size -= due.size();
+        for (const Timer &timer : due)
+            fire(timer.m_key, timer.m_deadline);
+    }
+}
+
+std::size_t TimingWheel::size() const
+{
+    return m_size;
+}
+
+std::uint64_t TimingWheel::tickMs() const
+{
+    return m_tickMs;
+}
+
+void TimingWheel::memoryUsage(celebi::MemoryUsage &usage) const
+{
+    for (auto &wheel : m_wheels) {
+        for (auto &slot : wheel) {
+            usage.block(slot.capacity() * sizeof(Timer));
+            for (auto &timer : slot)
+                usage.string(timer.m_key, &celebi::MemoryUsage::m_overhead);
+        }
+    }
+}
+
+}
@@ -0,0 +1,231 @@
+#include "extensions/trace.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+namespace celebiext {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// A slot is a seqlock, odd while its thread writes it. Every field is atomic so a
+// reader racing the writer reads a torn slot at worst, which the sequence gives away.
+struct Slot {
+    std::atomic<std::uint64_t> m_sequence{0};
+    std::atomic<const char *> m_name{nullptr};
+    std::atomic<std::uint64_t> m_start{0};
+    std::atomic<std::uint64_t> m_duration{0};
+    std::atomic<std::uint64_t> m_keyHash{0};
+    std::atomic<std::uint64_t> m_bytes{0};
+};
+
+struct Ring {
+    explicit Ring(std::uint32_t thread) : m_thread(thread) {}
+
+    const std::uint32_t m_thread;
+    std::atomic<bool> m_inUse{true};
+    std::atomic<std::uint64_t> m_head{0};
+    std::array<Slot, Tracer::ringSize> m_slots;
+};
+
+// Rings stay when their thread exits, so its spans can still be dumped,
+// and the next new thread takes the ring over
+class Domain {
+public:
+    Ring *acquire()
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto &ring : m_rings) {
+            bool free = false;
+            if (ring->m_inUse.compare_exchange_strong(free, true))
+                return ring.get();
+        }
+
+        m_rings.push_back(std::make_unique<Ring>(static_cast<std::uint32_t>(m_rings.size() + 1)));
+        return m_rings.back().get();
+    }
+
+    void release(Ring *ring)
+    {
+        ring->m_inUse.store(false, std::memory_order_release);
+    }
+
+    template <typename F>
+    void forEachRing(F f)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (auto &ring : m_rings)
+            f(*ring);
+    }
+
+    std::atomic<bool> m_enabled{false};
+    std::atomic<std::uint64_t> m_since{0};
+
+private:
+    std::mutex m_lock;
+    std::vector<std::unique_ptr<Ring>> m_rings;
+};
+
+Domain &domain()
+{
+    static Domain instance;
+    return instance;
+}
+
+struct ThreadRing {
+    ThreadRing() : m_ring(domain().acquire()) {}
+    ~ThreadRing() { domain().release(m_ring); }
+
+    Ring *m_ring;
+};
+
+Ring *threadRing()
+{
+    thread_local ThreadRing ring;
+    return ring.m_ring;
+}
+
+}
+
+void Tracer::enable(bool enabled)
+{
+    domain().m_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool Tracer::enabled()
+{
+    return domain().m_enabled.load(std::memory_order_relaxed);
+}
+
+void Tracer::record(const char *name, std::uint64_t start, std::uint64_t end,
+                    std::uint64_t keyHash, std::uint64_t bytes)
+{
+    Ring *ring = threadRing();
+    const std::uint64_t head = ring->m_head.load(std::memory_order_relaxed);
+    Slot &slot = ring->m_slots[head % ringSize];
+
+    const std::uint64_t sequence = slot.m_sequence.load(std::memory_order_relaxed);
+    slot.m_sequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.m_name.store(name, std::memory_order_relaxed);
+    slot.m_start.store(start, std::memory_order_relaxed);
+    slot.m_duration.store(end - start, std::memory_order_relaxed);
+    slot.m_keyHash.store(keyHash, std::memory_order_relaxed);
+    slot.m_bytes.store(bytes, std::memory_order_relaxed);
+
+    slot.m_sequence.store(sequence + 2, std::memory_order_release);
+    ring->m_head.store(head + 1, std::memory_order_release);
+}
+
+std::uint64_t Tracer::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+std::vector<TraceEvent> Tracer::events()
+{
+    std::vector<TraceEvent> events;
+    const std::uint64_t since = domain().m_since.load(std::memory_order_relaxed);
+
+    domain().forEachRing([&events, since](Ring &ring) {
+        for (Slot &slot : ring.m_slots) {
+            const std::uint64_t sequence = slot.m_sequence.load(std::memory_order_acquire);
+            if (0 == sequence || sequence % 2)
+                continue;
+
+            TraceEvent event{ slot.m_name.load(std::memory_order_relaxed),
+                              slot.m_start.load(std::memory_order_relaxed),
+                              slot.m_duration.load(std::memory_order_relaxed),
+                              slot.m_keyHash.load(std::memory_order_relaxed),
+                              slot.m_bytes.load(std::memory_order_relaxed),
+                              ring.m_thread };
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.m_sequence.load(std::memory_order_relaxed) != sequence || event.m_start < since)
+                continue;
+
+            events.push_back(event);
+        }
+    });
+
+    std::sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b) {
+        return a.m_start < b.m_start;
+    });
+
+    return events;
+}
+
+void Tracer::clear()
+{
+    domain().m_since.store(now(), std::memory_order_relaxed);
+}
+
+// Complete events, one per span, in microseconds as the format wants them. Key hashes
+// are strings, JSON readers would round a 64-bit number.
+std::string Tracer::chromeTrace()
+{
+    std::ostringstream out;
+    out << "{\"traceEvents\":[";
+
+    const pid_t pid = ::getpid();
+    bool first = true;
+    for (const TraceEvent &event : events()) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.m_name
+            << "\",\"cat\":\"celebi\",\"ph\":\"X\",\"ts\":" << event.m_start / 1000
+            << "." << std::setfill('0') << std::setw(3) << event.m_start % 1000
+            << ",\"dur\":" << event.m_duration / 1000
+            << "." << std::setw(3) << event.m_duration % 1000 << std::setfill(' ')
+            << ",\"pid\":" << pid << ",\"tid\":" << event.m_thread
+            << ",\"args\":{\"key_hash\":\"0x" << std::hex << event.m_keyHash << std::dec
+            << "\",\"bytes\":" << event.m_bytes << "}}";
+        first = false;
+    }
+    out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+    return out.str();
+}
+
+void Tracer::writeChromeTrace(const std::string &path)
+{
+    const std::string temporary = path + ".tmp";
+    {
+        std::ofstream out(temporary, std::ios::trunc);
+        out << chromeTrace();
+        if (!out.flush())
+            throw std::runtime_error("could not write trace to " + temporary);
+    }
+
+    fs::rename(temporary, path);
+}
+
+TraceSpan::TraceSpan(const char *name, const std::string &key, std::uint64_t bytes)
+    : m_name(name), m_start(0), m_keyHash(0), m_bytes(bytes)
+{
+    if (!Tracer::enabled())
+        return;
+
+    m_keyHash = std::hash<std::string>()(key);
+    m_start = Tracer::now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (on())
+        Tracer::record(m_name, m_start, Tracer::now(), m_keyHash, m_bytes);
+}
+
+}